@@ -45,6 +45,16 @@ static void do_TCP_server_delay(TCP_Server *tcp_s, Mono_Time *mono_time, int del
 }
 static uint16_t ports[NUM_PORTS] = {13215, 33445, 25643};
 
+/* Whether the tests run the server on io_uring, see test_io_uring. */
+static bool use_io_uring;
+
+static void set_io_engine(TCP_Server *tcp_s)
+{
+    if (use_io_uring && !tcp_server_use_io_uring(tcp_s)) {
+        printf("io_uring is not available, running on epoll\n");
+    }
+}
+
 START_TEST(test_basic)
 {
     Mono_Time *mono_time = mono_time_new();
@@ -284,6 +294,7 @@ START_TEST(test_some)
     TCP_Server *tcp_s = new_TCP_server(logger, USE_IPV6, NUM_PORTS, ports, self_secret_key, nullptr);
     ck_assert_msg(tcp_s != nullptr, "Failed to create TCP relay server");
     ck_assert_msg(tcp_server_listen_count(tcp_s) == NUM_PORTS, "Failed to bind to all ports.");
+    set_io_engine(tcp_s);
 
     struct sec_TCP_con *con1 = new_TCP_con(tcp_s, mono_time);
     struct sec_TCP_con *con2 = new_TCP_con(tcp_s, mono_time);
@@ -370,6 +381,18 @@ START_TEST(test_some)
     ck_assert_msg(data[0] == TCP_PACKET_PONG, "wrong packet id %u", data[0]);
     ck_assert_msg(memcmp(ping_packet + 1, data + 1, sizeof(uint64_t)) == 0, "wrong packet data");
 
+    // Connection 2 did the handshake but never sent a packet.
+    TCP_Server_Stats stats;
+    tcp_server_get_stats(tcp_s, &stats);
+    ck_assert_msg(stats.incoming == 0 && stats.unconfirmed == 1 && stats.confirmed == 2,
+                  "wrong connection counts: %u incoming, %u unconfirmed, %u confirmed", stats.incoming, stats.unconfirmed,
+                  stats.confirmed);
+    ck_assert_msg(stats.queued == 0 && stats.queued_bytes == 0, "%u connections have data queued", stats.queued);
+
+    // With nothing queued, the server only needs to run for the next second's pings.
+    ck_assert_msg(tcp_server_run_deadline(tcp_s, mono_time) == mono_time_next_second(mono_time),
+                  "server wants to run before the next second");
+
     // Kill off the connections
     kill_TCP_server(tcp_s);
     kill_TCP_con(con1);
@@ -381,6 +404,157 @@ START_TEST(test_some)
 }
 END_TEST
 
+// Read a routing response and return the connection id it hands out for public_key.
+static uint8_t read_routing_response(struct sec_TCP_con *con, const uint8_t *public_key)
+{
+    uint8_t data[2048];
+    int len = read_packet_sec_TCP(con, data, 2 + 1 + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == 1 + 1 + CRYPTO_PUBLIC_KEY_SIZE, "Wrong response packet length of %d.", len);
+    ck_assert_msg(data[0] == TCP_PACKET_ROUTING_RESPONSE, "Wrong response packet id of %d.", data[0]);
+    ck_assert_msg(public_key_cmp(data + 2, public_key) == 0, "Key in response packet wrong.");
+    return data[1];
+}
+
+// Test that connection ids are handed out lowest first, reused once freed and
+// that routes still link up when the routing table had to grow.
+START_TEST(test_routing_table)
+{
+    Mono_Time *mono_time = mono_time_new();
+    Logger *logger = logger_new();
+
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(logger, USE_IPV6, NUM_PORTS, ports, self_secret_key, nullptr);
+    ck_assert_msg(tcp_s != nullptr, "Failed to create TCP relay server");
+    set_io_engine(tcp_s);
+
+    struct sec_TCP_con *con1 = new_TCP_con(tcp_s, mono_time);
+    struct sec_TCP_con *con2 = new_TCP_con(tcp_s, mono_time);
+
+    uint8_t keys[10][CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t requ_p[1 + CRYPTO_PUBLIC_KEY_SIZE];
+    requ_p[0] = TCP_PACKET_ROUTING_REQUEST;
+
+    for (uint32_t i = 0; i < 10; ++i) {
+        random_bytes(keys[i], CRYPTO_PUBLIC_KEY_SIZE);
+        memcpy(requ_p + 1, keys[i], CRYPTO_PUBLIC_KEY_SIZE);
+        write_packet_TCP_secure_connection(con1, requ_p, sizeof(requ_p));
+        do_TCP_server_delay(tcp_s, mono_time, 10);
+        const uint8_t id = read_routing_response(con1, keys[i]);
+        ck_assert_msg(id == NUM_RESERVED_PORTS + i, "key %u got connection id %u", i, id);
+    }
+
+    // Asking again for a key gets the same id.
+    memcpy(requ_p + 1, keys[3], CRYPTO_PUBLIC_KEY_SIZE);
+    write_packet_TCP_secure_connection(con1, requ_p, sizeof(requ_p));
+    do_TCP_server_delay(tcp_s, mono_time, 10);
+    ck_assert(read_routing_response(con1, keys[3]) == NUM_RESERVED_PORTS + 3);
+
+    // Dropping a route frees its id for the next one.
+    uint8_t disconnect_p[2] = {TCP_PACKET_DISCONNECT_NOTIFICATION, NUM_RESERVED_PORTS + 3};
+    write_packet_TCP_secure_connection(con1, disconnect_p, sizeof(disconnect_p));
+    memcpy(requ_p + 1, con2->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    write_packet_TCP_secure_connection(con1, requ_p, sizeof(requ_p));
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+    ck_assert(read_routing_response(con1, con2->public_key) == NUM_RESERVED_PORTS + 3);
+
+    memcpy(requ_p + 1, con1->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    write_packet_TCP_secure_connection(con2, requ_p, sizeof(requ_p));
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+    ck_assert(read_routing_response(con2, con1->public_key) == NUM_RESERVED_PORTS);
+
+    uint8_t data[2048];
+    int len = read_packet_sec_TCP(con1, data, 2 + 2 + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == 2 && data[0] == TCP_PACKET_CONNECTION_NOTIFICATION && data[1] == NUM_RESERVED_PORTS + 3,
+                  "wrong connection notification %d %u %u", len, data[0], data[1]);
+    len = read_packet_sec_TCP(con2, data, 2 + 2 + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == 2 && data[0] == TCP_PACKET_CONNECTION_NOTIFICATION && data[1] == NUM_RESERVED_PORTS,
+                  "wrong connection notification %d %u %u", len, data[0], data[1]);
+
+    uint8_t test_packet[100] = {NUM_RESERVED_PORTS, 1, 2, 3};
+    write_packet_TCP_secure_connection(con2, test_packet, sizeof(test_packet));
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+    len = read_packet_sec_TCP(con1, data, 2 + sizeof(test_packet) + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == sizeof(test_packet), "wrong len %d", len);
+    ck_assert_msg(data[0] == NUM_RESERVED_PORTS + 3 && memcmp(data + 1, test_packet + 1, sizeof(test_packet) - 1) == 0,
+                  "packet is wrong");
+
+    kill_TCP_server(tcp_s);
+    kill_TCP_con(con1);
+    kill_TCP_con(con2);
+
+    logger_kill(logger);
+    mono_time_free(mono_time);
+}
+END_TEST
+
+static uint64_t ping_test_clock(Mono_Time *mono_time, void *user_data)
+{
+    return *(const uint64_t *)user_data;
+}
+
+// Test that the server pings idle connections and kills those that don't answer.
+START_TEST(test_ping_timeout)
+{
+    uint64_t now = 1000000;
+    Mono_Time *mono_time = mono_time_new();
+    mono_time_set_current_time_callback(mono_time, ping_test_clock, &now);
+    Logger *logger = logger_new();
+
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(logger, USE_IPV6, NUM_PORTS, ports, self_secret_key, nullptr);
+    ck_assert_msg(tcp_s != nullptr, "Failed to create TCP relay server");
+
+    struct sec_TCP_con *con = new_TCP_con(tcp_s, mono_time);
+
+    // The first packet confirms the connection.
+    uint8_t ping_packet[1 + sizeof(uint64_t)] = {TCP_PACKET_PING, 1, 2, 3};
+    write_packet_TCP_secure_connection(con, ping_packet, sizeof(ping_packet));
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+
+    uint8_t data[2048];
+    int len = read_packet_sec_TCP(con, data, 2 + sizeof(ping_packet) + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == sizeof(ping_packet) && data[0] == TCP_PACKET_PONG, "no pong");
+
+    // Nothing happens before TCP_PING_FREQUENCY has passed.
+    now += (TCP_PING_FREQUENCY - 1) * 1000;
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+    ck_assert_msg(net_socket_data_recv_buffer(con->sock) == 0, "server pinged too early");
+
+    now += 1000;
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+    len = read_packet_sec_TCP(con, data, 2 + sizeof(ping_packet) + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == sizeof(ping_packet) && data[0] == TCP_PACKET_PING, "server didn't ping");
+
+    // Answering keeps the connection alive past TCP_PING_TIMEOUT.
+    data[0] = TCP_PACKET_PONG;
+    write_packet_TCP_secure_connection(con, data, sizeof(ping_packet));
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+    now += TCP_PING_TIMEOUT * 1000;
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+    ck_assert_msg(net_socket_data_recv_buffer(con->sock) == 0, "unexpected packet");
+
+    // The next ping goes unanswered.
+    now += (TCP_PING_FREQUENCY - TCP_PING_TIMEOUT) * 1000;
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+    len = read_packet_sec_TCP(con, data, 2 + sizeof(ping_packet) + CRYPTO_MAC_SIZE);
+    ck_assert_msg(len == sizeof(ping_packet) && data[0] == TCP_PACKET_PING, "server didn't ping again");
+
+    now += TCP_PING_TIMEOUT * 1000;
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+    ck_assert_msg(net_recv(con->sock, data, sizeof(data)) == 0, "connection wasn't killed");
+
+    kill_TCP_server(tcp_s);
+    kill_TCP_con(con);
+
+    logger_kill(logger);
+    mono_time_free(mono_time);
+}
+END_TEST
+
 static int response_callback_good;
 static uint8_t response_callback_connection_id;
 static uint8_t response_callback_public_key[CRYPTO_PUBLIC_KEY_SIZE];
@@ -462,7 +636,11 @@ static int oob_data_callback(void *object, const uint8_t *public_key, const uint
     return 1;
 }
 
-START_TEST(test_client)
+/* Run two clients through a relay with num_threads worker threads, or none if
+ * it is 0. The server hands accepted connections to the threads in turn, so
+ * with two threads the clients end up on different ones.
+ */
+static void run_test_client(uint32_t num_threads)
 {
     Mono_Time *mono_time = mono_time_new();
     Logger *logger = logger_new();
@@ -472,8 +650,13 @@ START_TEST(test_client)
     crypto_new_keypair(self_public_key, self_secret_key);
     TCP_Server *tcp_s = new_TCP_server(logger, USE_IPV6, NUM_PORTS, ports, self_secret_key, nullptr);
     ck_assert_msg(tcp_s != nullptr, "Failed to create a TCP relay server.");
+    set_io_engine(tcp_s);
     ck_assert_msg(tcp_server_listen_count(tcp_s) == NUM_PORTS, "Failed to bind the relay server to all ports.");
 
+    if (num_threads != 0) {
+        ck_assert_msg(tcp_server_start_threads(tcp_s, mono_time, num_threads) == 0, "Failed to start worker threads.");
+    }
+
     uint8_t f_public_key[CRYPTO_PUBLIC_KEY_SIZE];
     uint8_t f_secret_key[CRYPTO_SECRET_KEY_SIZE];
     crypto_new_keypair(f_public_key, f_secret_key);
@@ -488,9 +671,12 @@ START_TEST(test_client)
     c_sleep(50);
 
     // The connection status should be unconfirmed here because we have finished
-    // sending our data and are awaiting a response.
-    ck_assert_msg(tcp_con_status(conn) == TCP_CLIENT_UNCONFIRMED, "Wrong connection status. Expected: %d, is: %d.",
-                  TCP_CLIENT_UNCONFIRMED, tcp_con_status(conn));
+    // sending our data and are awaiting a response. Worker threads may have
+    // responded already.
+    if (num_threads == 0) {
+        ck_assert_msg(tcp_con_status(conn) == TCP_CLIENT_UNCONFIRMED, "Wrong connection status. Expected: %d, is: %d.",
+                      TCP_CLIENT_UNCONFIRMED, tcp_con_status(conn));
+    }
 
     do_TCP_server_delay(tcp_s, mono_time, 50); // Now let the server handle requests...
 
@@ -588,8 +774,35 @@ START_TEST(test_client)
     logger_kill(logger);
     mono_time_free(mono_time);
 }
+
+START_TEST(test_client)
+{
+    run_test_client(0);
+}
 END_TEST
 
+#ifdef TCP_SERVER_USE_EPOLL
+START_TEST(test_client_threaded)
+{
+    run_test_client(2);
+}
+END_TEST
+#endif
+
+#ifdef TCP_SERVER_USE_IO_URING
+// The tests that run the server, with it on io_uring.
+START_TEST(test_io_uring)
+{
+    use_io_uring = true;
+    test_some();
+    test_routing_table();
+    test_client();
+    test_client_threaded();
+    use_io_uring = false;
+}
+END_TEST
+#endif
+
 // Test how the client handles servers that don't respond.
 START_TEST(test_client_invalid)
 {
@@ -858,7 +1071,15 @@ static Suite *TCP_suite(void)
 
     DEFTESTCASE_SLOW(basic, 5);
     DEFTESTCASE_SLOW(some, 10);
+    DEFTESTCASE_SLOW(routing_table, 10);
+    DEFTESTCASE_SLOW(ping_timeout, 10);
     DEFTESTCASE_SLOW(client, 10);
+#ifdef TCP_SERVER_USE_EPOLL
+    DEFTESTCASE_SLOW(client_threaded, 10);
+#endif
+#ifdef TCP_SERVER_USE_IO_URING
+    DEFTESTCASE_SLOW(io_uring, 30);
+#endif
     DEFTESTCASE_SLOW(client_invalid, 15);
     DEFTESTCASE_SLOW(tcp_connection, 20);
     DEFTESTCASE_SLOW(tcp_connection2, 20);
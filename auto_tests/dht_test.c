@@ -406,6 +406,308 @@ static void test_addto_lists_ipv6(void)
     test_addto_lists(ip);
 }
 
+/* A DHT with its own logger, clock and loopback socket, for tests that only
+ * need one instance. */
+typedef struct Single_DHT {
+    Logger *log;
+    Mono_Time *mono_time;
+    Networking_Core *net;
+    DHT *dht;
+} Single_DHT;
+
+static void new_single_dht(Single_DHT *single, uint16_t port)
+{
+    single->log = logger_new();
+    single->mono_time = mono_time_new();
+    ck_assert_msg(single->mono_time != nullptr, "Failed to create Mono_Time");
+
+    single->net = new_networking(single->log, get_loopback(), port);
+    ck_assert_msg(single->net != nullptr, "Failed to create Networking_Core");
+
+    single->dht = new_dht(single->log, single->mono_time, single->net, true);
+    ck_assert_msg(single->dht != nullptr, "Failed to create DHT");
+}
+
+static void kill_single_dht(Single_DHT *single)
+{
+    kill_dht(single->dht);
+    kill_networking(single->net);
+    mono_time_free(single->mono_time);
+    logger_kill(single->log);
+}
+
+#define FRIEND_LIST_TEST_NODES 200
+
+static void check_friend_client_list_order(const DHT_Friend *dht_friend)
+{
+    for (uint32_t i = 1; i < MAX_FRIEND_CLIENTS; ++i) {
+        ck_assert_msg(id_closest(dht_friend->public_key, dht_friend->client_list[i - 1].public_key,
+                                 dht_friend->client_list[i].public_key) != 1,
+                      "Friend client list is not ordered by distance, farthest first");
+    }
+}
+
+static void test_friend_client_list_order(void)
+{
+    Single_DHT single;
+    new_single_dht(&single, 36571);
+    DHT *dht = single.dht;
+    const Mono_Time *mono_time = single.mono_time;
+
+    uint8_t friend_pk[CRYPTO_PUBLIC_KEY_SIZE];
+    random_bytes(friend_pk, sizeof(friend_pk));
+    uint16_t lock_count;
+    ck_assert(dht_addfriend(dht, friend_pk, nullptr, nullptr, 0, &lock_count) == 0);
+    const DHT_Friend *dht_friend = &dht->friends_list[index_of_friend_pk(dht, friend_pk)];
+
+    uint8_t keys[FRIEND_LIST_TEST_NODES][CRYPTO_PUBLIC_KEY_SIZE];
+    IP_Port ip_port;
+    ip_port.ip = get_loopback();
+
+    for (uint32_t i = 0; i < FRIEND_LIST_TEST_NODES; ++i) {
+        random_bytes(keys[i], CRYPTO_PUBLIC_KEY_SIZE);
+        ip_port.port = net_htons(20000 + i);
+        addto_lists(dht, ip_port, keys[i]);
+        check_friend_client_list_order(dht_friend);
+    }
+
+    // The clock didn't move, so no node timed out and the list holds the
+    // closest nodes to the friend that were added.
+    for (uint32_t i = 0; i < FRIEND_LIST_TEST_NODES; ++i) {
+        uint32_t closer = 0;
+
+        for (uint32_t j = 0; j < FRIEND_LIST_TEST_NODES; ++j) {
+            closer += id_closest(friend_pk, keys[j], keys[i]) == 1;
+        }
+
+        const bool in_list = client_in_list((Client_data *)dht_friend->client_list, MAX_FRIEND_CLIENTS, keys[i]) >= 0;
+        ck_assert_msg(in_list == (closer < MAX_FRIEND_CLIENTS), "Friend client list doesn't hold the closest nodes");
+    }
+
+    // A new key on the address of a node in the list replaces the key of that
+    // node, which has to move to its new place. The address is cleared then,
+    // so each round picks one that is still set.
+    for (uint32_t i = 0; i < MAX_FRIEND_CLIENTS / 2; ++i) {
+        uint32_t index = 0;
+
+        while (client_timed_out(&dht_friend->client_list[index], mono_time_get(mono_time))) {
+            ++index;
+        }
+
+        const Client_data *client = &dht_friend->client_list[index];
+        ip_port = assoc_timeout(mono_time, &client->assoc6) ? client->assoc4.ip_port : client->assoc6.ip_port;
+
+        uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+        random_bytes(public_key, sizeof(public_key));
+        addto_lists(dht, ip_port, public_key);
+        ck_assert(client_in_list((Client_data *)dht_friend->client_list, MAX_FRIEND_CLIENTS, public_key) >= 0);
+        check_friend_client_list_order(dht_friend);
+    }
+
+    kill_single_dht(&single);
+}
+
+static uint64_t maintenance_test_clock(Mono_Time *mono_time, void *user_data)
+{
+    return *(uint64_t *)user_data;
+}
+
+static void maintenance_test_tick(DHT *dht, uint64_t *clock, uint32_t seconds)
+{
+    *clock += seconds * 1000;
+    mono_time_update(dht->mono_time);
+    do_dht(dht);
+}
+
+static void test_maintenance_timers(void)
+{
+    Single_DHT single;
+    new_single_dht(&single, 36572);
+    DHT *dht = single.dht;
+    Mono_Time *mono_time = single.mono_time;
+
+    // The fake clock carries on from the real one the timers started at.
+    uint64_t clock = current_time_monotonic(mono_time);
+    mono_time_set_current_time_callback(mono_time, maintenance_test_clock, &clock);
+    mono_time_update(mono_time);
+
+    // Nothing is scheduled for the empty close list.
+    for (uint32_t i = 0; i <= DHT_TIMER_CLOSE; ++i) {
+        ck_assert(!timer_wheel_is_set(&dht->timers, i));
+    }
+
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    random_bytes(public_key, sizeof(public_key));
+    IP_Port ip_port;
+    ip_port.ip = get_loopback();
+    ip_port.port = net_htons(36573);
+    addto_lists(dht, ip_port, public_key);
+
+    const uint32_t bucket = close_bucket_index(dht->self_public_key, public_key);
+    const uint32_t index = index_of_client_pk(dht->close_clientlist, LCLIENT_LIST, public_key);
+    ck_assert(index / LCLIENT_NODES == bucket);
+    const IPPTsPng *assoc = net_family_is_ipv6(ip_port.ip.family)
+                            ? &dht->close_clientlist[index].assoc6
+                            : &dht->close_clientlist[index].assoc4;
+
+    // Only the bucket of the new node and the close list have work to do.
+    for (uint32_t i = 0; i < DHT_TIMER_CLOSE; ++i) {
+        ck_assert(timer_wheel_is_set(&dht->timers, i) == (i == bucket));
+    }
+
+    ck_assert(timer_wheel_is_set(&dht->timers, DHT_TIMER_CLOSE));
+
+    // The new node gets pinged right away, then every PING_INTERVAL seconds.
+    maintenance_test_tick(dht, &clock, 1);
+    const uint64_t pinged = mono_time_get(mono_time);
+    ck_assert(assoc->last_pinged == pinged);
+    ck_assert(timer_wheel_deadline(&dht->timers, bucket) == pinged + PING_INTERVAL);
+
+    maintenance_test_tick(dht, &clock, PING_INTERVAL - 1);
+    ck_assert(assoc->last_pinged == pinged);
+
+    maintenance_test_tick(dht, &clock, 1);
+    ck_assert(assoc->last_pinged == pinged + PING_INTERVAL);
+
+    // When every node timed out we must be mute, so they all get reset to bad
+    // instead of killed and the buckets get scheduled to ping them again.
+    const uint64_t timestamp = assoc->timestamp;
+
+    while (mono_time_get(mono_time) < timestamp + KILL_NODE_TIMEOUT) {
+        maintenance_test_tick(dht, &clock, PING_INTERVAL);
+    }
+
+    ck_assert(assoc->timestamp == mono_time_get(mono_time) - BAD_NODE_TIMEOUT);
+    ck_assert(timer_wheel_is_set(&dht->timers, bucket));
+
+    kill_single_dht(&single);
+}
+
+#define FRIENDS_INDEX_TEST_FRIENDS 1000
+
+static void check_friends_index(const DHT *dht)
+{
+    for (uint32_t i = 0; i < dht->num_friends; ++i) {
+        ck_assert_msg(index_of_friend_pk(dht, dht->friends_list[i].public_key) == i,
+                      "friend %u is indexed at the wrong slot", i);
+    }
+
+    ck_assert(dht->friends_index.n == dht->num_friends);
+}
+
+static void test_friends_index(void)
+{
+    Single_DHT single;
+    new_single_dht(&single, 36574);
+    DHT *dht = single.dht;
+
+    uint8_t keys[FRIENDS_INDEX_TEST_FRIENDS][CRYPTO_PUBLIC_KEY_SIZE];
+
+    for (uint32_t i = 0; i < FRIENDS_INDEX_TEST_FRIENDS; ++i) {
+        random_bytes(keys[i], sizeof(keys[i]));
+        ck_assert(dht_addfriend(dht, keys[i], nullptr, nullptr, 0, nullptr) == 0);
+    }
+
+    check_friends_index(dht);
+
+    // A second lock on a friend doesn't add another slot.
+    uint16_t lock_count;
+    ck_assert(dht_addfriend(dht, keys[0], nullptr, nullptr, 0, &lock_count) == 0);
+    ck_assert(lock_count == 2);
+    check_friends_index(dht);
+    ck_assert(dht_delfriend(dht, keys[0], lock_count) == 0);
+    ck_assert(index_of_friend_pk(dht, keys[0]) != UINT32_MAX);
+
+    // Removing a friend moves the last one into its slot.
+    for (uint32_t i = 0; i < FRIENDS_INDEX_TEST_FRIENDS; i += 2) {
+        ck_assert(dht_delfriend(dht, keys[i], 0) == 0);
+        check_friends_index(dht);
+    }
+
+    for (uint32_t i = 0; i < FRIENDS_INDEX_TEST_FRIENDS; ++i) {
+        ck_assert((index_of_friend_pk(dht, keys[i]) == UINT32_MAX) == (i % 2 == 0));
+    }
+
+    check_friends_index(dht);
+
+    kill_single_dht(&single);
+}
+
+#define RTT_TEST_NODES 16
+
+static void test_rtt(void)
+{
+    Single_DHT single;
+    new_single_dht(&single, 36575);
+    DHT *dht = single.dht;
+
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    random_bytes(public_key, sizeof(public_key));
+    IP_Port ip_port;
+    ip_port.ip = get_loopback();
+    ip_port.port = net_htons(36576);
+
+    // Nodes we only heard about have no round trip time.
+    addto_lists(dht, ip_port, public_key);
+    ck_assert(dht_node_rtt(dht, public_key, &ip_port) == 0);
+
+    addto_lists_rtt(dht, ip_port, public_key, 100);
+    ck_assert(dht_node_rtt(dht, public_key, &ip_port) == 100);
+    addto_lists_rtt(dht, ip_port, public_key, 200);
+    ck_assert(dht_node_rtt(dht, public_key, &ip_port) == (100 * 7 + 200) / 8);
+    addto_lists(dht, ip_port, public_key);
+    ck_assert(dht_node_rtt(dht, public_key, &ip_port) == (100 * 7 + 200) / 8);
+
+    DHT_Rtt_Stats stats;
+    dht_get_rtt_stats(dht, &stats);
+    ck_assert(stats.good == 1 && stats.measured == 1);
+    ck_assert(stats.min_rtt == 112 && stats.mean_rtt == 112 && stats.max_rtt == 112);
+
+    // The time was measured on the old address.
+    IP_Port moved = ip_port;
+    moved.port = net_htons(36577);
+    ck_assert(dht_node_rtt(dht, public_key, &moved) == 0);
+    addto_lists(dht, moved, public_key);
+    ck_assert(dht_node_rtt(dht, public_key, &moved) == 0);
+    ck_assert(dht_node_rtt(dht, public_key, &ip_port) == 0);
+
+    // The fastest nodes are advertised, the ones never measured last. Every
+    // node goes into a bucket of its own so none gets dropped.
+    uint8_t keys[RTT_TEST_NODES][CRYPTO_PUBLIC_KEY_SIZE];
+
+    for (uint32_t i = 0; i < RTT_TEST_NODES; ++i) {
+        memcpy(keys[i], dht->self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        keys[i][i / 8] ^= 0x80 >> (i % 8);
+        ip_port.port = net_htons(36600 + i);
+
+        if (i % 4 == 0) {
+            addto_lists(dht, ip_port, keys[i]);
+        } else {
+            addto_lists_rtt(dht, ip_port, keys[i], 1000 - i);
+        }
+    }
+
+    dht_get_rtt_stats(dht, &stats);
+    ck_assert(stats.good == RTT_TEST_NODES + 1);
+    ck_assert(stats.measured == RTT_TEST_NODES - RTT_TEST_NODES / 4);
+    ck_assert(stats.min_rtt == 1000 - (RTT_TEST_NODES - 1) && stats.max_rtt == 1000 - 1);
+
+    const uint32_t fastest[] = {15, 14, 13, 11};
+    Node_format nodes[4];
+    ck_assert(closelist_nodes(dht, nodes, 4) == 4);
+
+    for (uint32_t i = 0; i < 4; ++i) {
+        ck_assert(id_equal(nodes[i].public_key, keys[fastest[i]]));
+    }
+
+    Node_format all_nodes[RTT_TEST_NODES + 1];
+    ck_assert(closelist_nodes(dht, all_nodes, RTT_TEST_NODES + 1) == RTT_TEST_NODES + 1);
+    ck_assert(dht_node_rtt(dht, all_nodes[stats.measured - 1].public_key, &all_nodes[stats.measured - 1].ip_port) == 999);
+    ck_assert(dht_node_rtt(dht, all_nodes[stats.measured].public_key, &all_nodes[stats.measured].ip_port) == 0);
+
+    kill_single_dht(&single);
+}
+
 #define DHT_DEFAULT_PORT (TOX_PORT_DEFAULT + 1000)
 
 static void print_pk(uint8_t *public_key)
@@ -689,6 +991,13 @@ loop_top:
         c_sleep(20);
     }
 
+    // All of them answered requests, so each one has timed some others.
+    for (i = 0; i < NUM_DHT; ++i) {
+        DHT_Rtt_Stats stats;
+        dht_get_rtt_stats(dhts[i], &stats);
+        ck_assert_msg(stats.measured > 0, "DHT %u has no round trip times", i);
+    }
+
     for (i = 0; i < NUM_DHT; ++i) {
         Networking_Core *n = dhts[i]->net;
         kill_dht(dhts[i]);
@@ -807,15 +1116,77 @@ static void test_dht_node_packing(void)
     free(data);
 }
 
+static void check_shared_key(Shared_Keys *shared_keys, const uint8_t *secret_key, const uint8_t *public_key)
+{
+    uint8_t expected[CRYPTO_SHARED_KEY_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    encrypt_precompute(public_key, secret_key, expected);
+    get_shared_key(shared_keys, shared_key, secret_key, public_key);
+    ck_assert_msg(memcmp(shared_key, expected, CRYPTO_SHARED_KEY_SIZE) == 0, "wrong shared key");
+}
+
+static void test_shared_keys(void)
+{
+    Shared_Keys *shared_keys = shared_keys_new(5);
+    ck_assert(shared_keys != nullptr);
+    ck_assert_msg(shared_keys_capacity(shared_keys) == 2 * MAX_KEYS_PER_SLOT, "capacity %u",
+                  shared_keys_capacity(shared_keys));
+    shared_keys_free(shared_keys);
+
+    /* A single slot, so every key competes for the same entries. */
+    shared_keys = shared_keys_new(MAX_KEYS_PER_SLOT);
+    ck_assert(shared_keys != nullptr);
+
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, self_secret_key);
+
+    uint8_t public_keys[MAX_KEYS_PER_SLOT + 1][CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+
+    for (uint32_t i = 0; i <= MAX_KEYS_PER_SLOT; ++i) {
+        crypto_new_keypair(public_keys[i], secret_key);
+    }
+
+    for (uint32_t i = 0; i < MAX_KEYS_PER_SLOT; ++i) {
+        check_shared_key(shared_keys, self_secret_key, public_keys[i]);
+    }
+
+    Shared_Keys_Stats stats;
+    shared_keys_get_stats(shared_keys, &stats);
+    ck_assert(stats.hits == 0 && stats.misses == MAX_KEYS_PER_SLOT && stats.evictions == 0);
+
+    /* Key 0 becomes the most recently used, so key 1 is evicted next. */
+    check_shared_key(shared_keys, self_secret_key, public_keys[0]);
+    check_shared_key(shared_keys, self_secret_key, public_keys[MAX_KEYS_PER_SLOT]);
+    check_shared_key(shared_keys, self_secret_key, public_keys[0]);
+
+    shared_keys_get_stats(shared_keys, &stats);
+    ck_assert_msg(stats.hits == 2 && stats.misses == MAX_KEYS_PER_SLOT + 1 && stats.evictions == 1,
+                  "hits %u misses %u evictions %u", (unsigned)stats.hits, (unsigned)stats.misses,
+                  (unsigned)stats.evictions);
+
+    check_shared_key(shared_keys, self_secret_key, public_keys[1]);
+    shared_keys_get_stats(shared_keys, &stats);
+    ck_assert(stats.hits == 2 && stats.evictions == 2);
+
+    shared_keys_free(shared_keys);
+}
+
 int main(void)
 {
     setvbuf(stdout, nullptr, _IONBF, 0);
 
     test_dht_create_packet();
     test_dht_node_packing();
+    test_shared_keys();
 
     test_list();
     test_DHT_test();
+    test_friend_client_list_order();
+    test_maintenance_timers();
+    test_friends_index();
+    test_rtt();
 
     if (enable_broken_tests) {
         test_addto_lists_ipv4();
@@ -264,6 +264,19 @@ static void file_transfer_test(void)
 
     printf("100MiB file sent in %lu seconds\n", (unsigned long)(time(nullptr) - f_time));
 
+    Tox_Err_Friend_Get_Transport_Stats stats_err;
+    const uint64_t packets_sent = tox_friend_get_transport_packets_sent(tox2, 0, &stats_err);
+    ck_assert_msg(stats_err == TOX_ERR_FRIEND_GET_TRANSPORT_STATS_OK, "tox_friend_get_transport_packets_sent failed");
+    ck_assert_msg(packets_sent >= file_size / TOX_MAX_CUSTOM_PACKET_SIZE, "only %lu packets sent",
+                  (unsigned long)packets_sent);
+    const uint64_t rtt_min = tox_friend_get_transport_rtt_min(tox2, 0, nullptr);
+    const uint64_t rtt_last = tox_friend_get_transport_rtt_last(tox2, 0, nullptr);
+    ck_assert_msg(rtt_last != 0 && rtt_min <= rtt_last, "bad rtt %lu %lu", (unsigned long)rtt_min,
+                  (unsigned long)rtt_last);
+    ck_assert_msg(tox_friend_get_transport_send_rate(tox2, 0, nullptr) > 0, "no send rate");
+    ck_assert_msg(tox_friend_get_transport_packets_sent(tox2, 1, &stats_err) == 0, "stats for an unknown friend");
+    ck_assert_msg(stats_err == TOX_ERR_FRIEND_GET_TRANSPORT_STATS_FRIEND_NOT_FOUND, "wrong error");
+
     printf("Starting file streaming transfer test.\n");
 
     file_sending_done = 0;
@@ -165,6 +165,100 @@ START_TEST(test_ip_equal)
 }
 END_TEST
 
+#define BATCH_TEST_PACKETS 200
+#define BATCH_TEST_PACKET_ID 0x42
+
+typedef struct Batch_Test_State {
+    uint32_t received;
+    bool in_order;
+} Batch_Test_State;
+
+static uint16_t batch_test_packet_length(uint32_t i)
+{
+    // Runs of equal sizes (GSO candidates) mixed with odd sizes.
+    return (i % 10 < 7) ? 1000 : 100 + i;
+}
+
+static int handle_batch_test_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len, void *userdata)
+{
+    Batch_Test_State *state = (Batch_Test_State *)object;
+    uint32_t seq;
+    net_unpack_u32(data + 1, &seq);
+
+    if (seq != state->received || len != batch_test_packet_length(seq)) {
+        state->in_order = false;
+    }
+
+    ++state->received;
+    return 0;
+}
+
+START_TEST(test_send_batching)
+{
+    Logger *log = logger_new();
+    IP ip;
+    ip_init(&ip, false);
+    ip.ip.v4 = get_ip4_loopback();
+
+    Networking_Core *sender = new_networking(log, ip, TOX_PORTRANGE_FROM);
+    Networking_Core *receiver = new_networking(log, ip, TOX_PORTRANGE_FROM);
+    ck_assert_msg(sender != nullptr && receiver != nullptr, "failed to create networking");
+
+    Batch_Test_State state = {0, true};
+    networking_registerhandler(receiver, BATCH_TEST_PACKET_ID, &handle_batch_test_packet, &state);
+    networking_set_send_batching(sender, true);
+
+    IP_Port target;
+    target.ip = ip;
+    target.port = net_port(receiver);
+
+    uint8_t packet[MAX_UDP_PACKET_SIZE] = {BATCH_TEST_PACKET_ID};
+
+    for (uint32_t i = 0; i < BATCH_TEST_PACKETS; ++i) {
+        const uint16_t length = batch_test_packet_length(i);
+        net_pack_u32(packet + 1, i);
+        ck_assert_msg(sendpacket(sender, target, packet, length) == length, "sendpacket failed");
+    }
+
+    ck_assert_msg(networking_flush(sender) == 0, "networking_flush failed");
+
+    for (uint32_t tries = 0; tries < 100 && state.received < BATCH_TEST_PACKETS; ++tries) {
+        networking_poll(receiver, nullptr);
+        c_sleep(10);
+    }
+
+    ck_assert_msg(state.received == BATCH_TEST_PACKETS, "received %u of %u packets", state.received, BATCH_TEST_PACKETS);
+    ck_assert_msg(state.in_order, "packets were reordered or resized");
+
+    uint64_t bytes = 0;
+
+    for (uint32_t i = 0; i < BATCH_TEST_PACKETS; ++i) {
+        bytes += batch_test_packet_length(i);
+    }
+
+    const Net_Stats *sent = networking_get_stats(sender);
+    const Net_Stats *received = networking_get_stats(receiver);
+    ck_assert_msg(sent->packets_sent[BATCH_TEST_PACKET_ID] == BATCH_TEST_PACKETS
+                  && sent->bytes_sent[BATCH_TEST_PACKET_ID] == bytes, "wrong sent packet count or size");
+    ck_assert_msg(received->packets_recv[BATCH_TEST_PACKET_ID] == BATCH_TEST_PACKETS
+                  && received->bytes_recv[BATCH_TEST_PACKET_ID] == bytes, "wrong received packet count or size");
+
+    /* Port 0 is rejected by the kernel when the queue is flushed. Only the
+     * flush reports it, and the dropped packet isn't counted as sent. */
+    IP_Port invalid = target;
+    invalid.port = 0;
+    ck_assert_msg(sendpacket(sender, invalid, packet, 100) == 100, "packet to port 0 was not queued");
+    ck_assert_msg(networking_flush(sender) == -1, "failed send not reported by networking_flush");
+    ck_assert_msg(sent->packets_sent[BATCH_TEST_PACKET_ID] == BATCH_TEST_PACKETS, "dropped packet counted as sent");
+    ck_assert_msg(sendpacket(sender, target, packet, 100) == 100, "earlier failure reported by sendpacket");
+    ck_assert_msg(networking_flush(sender) == 0, "networking_flush failed");
+
+    kill_networking(sender);
+    kill_networking(receiver);
+    logger_kill(log);
+}
+END_TEST
+
 static Suite *network_suite(void)
 {
     Suite *s = suite_create("Network");
@@ -173,6 +267,7 @@ static Suite *network_suite(void)
 
     DEFTESTCASE(addr_resolv_localhost);
     DEFTESTCASE(ip_equal);
+    DEFTESTCASE(send_batching);
 
     return s;
 }
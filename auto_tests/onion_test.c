@@ -250,8 +250,7 @@ static void test_basic(void)
 
     random_bytes(sb_data, sizeof(sb_data));
     memcpy(&s, sb_data, sizeof(uint64_t));
-    memcpy(onion_announce_entry_public_key(onion2_a, 1), dht_get_self_public_key(onion2->dht), CRYPTO_PUBLIC_KEY_SIZE);
-    onion_announce_entry_set_time(onion2_a, 1, mono_time_get(mono_time2));
+    ck_assert_msg(onion_announce_add_entry(onion2_a, dht_get_self_public_key(onion2->dht)), "failed to add entry");
     networking_registerhandler(onion1->net, NET_PACKET_ONION_DATA_RESPONSE, &handle_test_4, onion1);
     send_announce_request(onion1->net, &path, nodes[3],
                           dht_get_self_public_key(onion1->dht),
@@ -264,9 +263,9 @@ static void test_basic(void)
         do_onion(onion1);
         do_onion(onion2);
         c_sleep(50);
-    } while (memcmp(onion_announce_entry_public_key(onion2_a, ONION_ANNOUNCE_MAX_ENTRIES - 2),
-                    dht_get_self_public_key(onion1->dht),
-                    CRYPTO_PUBLIC_KEY_SIZE) != 0);
+    } while (onion_announce_entry_public_key(onion2_a, 1) == nullptr
+             || memcmp(onion_announce_entry_public_key(onion2_a, 1), dht_get_self_public_key(onion1->dht),
+                       CRYPTO_PUBLIC_KEY_SIZE) != 0);
 
     c_sleep(1000);
     Logger *log3 = logger_new();
@@ -593,11 +592,107 @@ static void test_announce(void)
     }
 }
 
+#define STORE_TEST_CAPACITY 500
+#define STORE_TEST_KEYS (4 * STORE_TEST_CAPACITY)
+
+static uint64_t store_test_clock(Mono_Time *mono_time, void *user_data)
+{
+    return *(uint64_t *)user_data;
+}
+
+static bool store_test_stored(const Onion_Announce *onion_a, const uint8_t *public_key)
+{
+    for (uint32_t i = 0; onion_announce_entry_public_key(onion_a, i) != nullptr; ++i) {
+        if (memcmp(onion_announce_entry_public_key(onion_a, i), public_key, CRYPTO_PUBLIC_KEY_SIZE) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void test_announce_store(void)
+{
+    Logger *log = logger_new();
+    Mono_Time *mono_time = mono_time_new();
+    uint64_t clock = current_time_monotonic(mono_time);
+    mono_time_set_current_time_callback(mono_time, store_test_clock, &clock);
+    mono_time_update(mono_time);
+
+    Networking_Core *net = new_networking(log, get_loopback(), 36570);
+    DHT *dht = new_dht(log, mono_time, net, true);
+    Onion_Announce *onion_a = new_onion_announce(mono_time, dht);
+    ck_assert_msg(onion_a != nullptr, "Onion_Announce failed initializing.");
+    ck_assert(!onion_announce_set_capacity(onion_a, 0));
+    ck_assert(onion_announce_set_capacity(onion_a, STORE_TEST_CAPACITY));
+
+    const uint8_t *self_public_key = dht_get_self_public_key(dht);
+    uint8_t(*keys)[CRYPTO_PUBLIC_KEY_SIZE] = (uint8_t(*)[CRYPTO_PUBLIC_KEY_SIZE])malloc(STORE_TEST_KEYS *
+            CRYPTO_PUBLIC_KEY_SIZE);
+    ck_assert(keys != nullptr);
+
+    for (uint32_t i = 0; i < STORE_TEST_KEYS; ++i) {
+        random_bytes(keys[i], CRYPTO_PUBLIC_KEY_SIZE);
+        onion_announce_add_entry(onion_a, keys[i]);
+    }
+
+    // The closest keys are kept, in order of distance.
+    ck_assert_msg(onion_announce_num_entries(onion_a) == STORE_TEST_CAPACITY, "%u entries stored",
+                  onion_announce_num_entries(onion_a));
+    ck_assert(onion_announce_entry_public_key(onion_a, STORE_TEST_CAPACITY) == nullptr);
+
+    for (uint32_t i = 0; i + 1 < STORE_TEST_CAPACITY; ++i) {
+        ck_assert_msg(id_closest(self_public_key, onion_announce_entry_public_key(onion_a, i),
+                                 onion_announce_entry_public_key(onion_a, i + 1)) == 1, "entry %u out of order", i);
+    }
+
+    const uint8_t *farthest = onion_announce_entry_public_key(onion_a, STORE_TEST_CAPACITY - 1);
+
+    for (uint32_t i = 0; i < STORE_TEST_KEYS; ++i) {
+        ck_assert_msg(store_test_stored(onion_a, keys[i]) || id_closest(self_public_key, farthest, keys[i]) == 1,
+                      "key %u was evicted for a farther one", i);
+    }
+
+    // Announcing again refreshes the entry instead of adding one.
+    ck_assert(onion_announce_add_entry(onion_a, onion_announce_entry_public_key(onion_a, 0)));
+    ck_assert(onion_announce_num_entries(onion_a) == STORE_TEST_CAPACITY);
+
+    // Shrinking keeps the closest keys.
+    uint8_t closest[CRYPTO_PUBLIC_KEY_SIZE];
+    memcpy(closest, onion_announce_entry_public_key(onion_a, 0), CRYPTO_PUBLIC_KEY_SIZE);
+    ck_assert(onion_announce_set_capacity(onion_a, STORE_TEST_CAPACITY / 10));
+    ck_assert(onion_announce_num_entries(onion_a) == STORE_TEST_CAPACITY / 10);
+    ck_assert(memcmp(onion_announce_entry_public_key(onion_a, 0), closest, CRYPTO_PUBLIC_KEY_SIZE) == 0);
+
+    // Timed out entries are replaced by new ones, however far.
+    clock += (ONION_ANNOUNCE_TIMEOUT + 1) * 1000;
+    mono_time_update(mono_time);
+    ck_assert(onion_announce_num_entries(onion_a) == 0);
+
+    uint8_t farthest_key[CRYPTO_PUBLIC_KEY_SIZE];
+
+    for (uint32_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
+        farthest_key[i] = ~self_public_key[i];
+    }
+
+    ck_assert(onion_announce_add_entry(onion_a, farthest_key));
+    ck_assert(onion_announce_num_entries(onion_a) == 1);
+    ck_assert(memcmp(onion_announce_entry_public_key(onion_a, 0), farthest_key, CRYPTO_PUBLIC_KEY_SIZE) == 0);
+
+    free(keys);
+    kill_onion_announce(onion_a);
+    kill_dht(dht);
+    kill_networking(net);
+    mono_time_free(mono_time);
+    logger_kill(log);
+}
+
 int main(void)
 {
     setvbuf(stdout, nullptr, _IONBF, 0);
 
     test_basic();
+    test_announce_store();
     test_announce();
 
     return 0;
@@ -127,6 +127,22 @@ static void test_one(void)
     tox_self_get_public_key(tox2, pk);
     ck_assert_msg(memcmp(pk, address, TOX_PUBLIC_KEY_SIZE) == 0, "Wrong public key.");
 
+    tox_iterate(tox2, nullptr);
+    const size_t num_fds = tox_wait_get_fds_size(tox2);
+    ck_assert_msg(num_fds >= 1, "No UDP socket to wait on.");
+    int32_t *fds = (int32_t *)malloc(num_fds * sizeof(int32_t));
+    ck_assert(fds != nullptr);
+    memset(fds, 0xff, num_fds * sizeof(int32_t));
+    tox_wait_get_fds(tox2, fds);
+
+    for (size_t i = 0; i < num_fds; ++i) {
+        ck_assert_msg(fds[i] >= 0, "Invalid fd %d at index %u.", fds[i], (unsigned)i);
+    }
+
+    free(fds);
+    const uint64_t now = tox_wait_current_time(tox2);
+    ck_assert_msg(tox_wait_deadline(tox2) <= now + 1000, "Deadline more than one second away.");
+
     tox_options_free(options);
     tox_kill(tox1);
     tox_kill(tox2);
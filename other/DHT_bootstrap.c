@@ -154,6 +154,8 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    networking_set_send_batching(dht_get_net(dht), true);
+
     perror("Initialization");
 
     manage_keys(dht);
@@ -229,6 +231,7 @@ int main(int argc, char *argv[])
         do_TCP_server(tcp_s, mono_time);
 #endif
         networking_poll(dht_get_net(dht), nullptr);
+        networking_flush(dht_get_net(dht));
 
         c_sleep(1);
     }
@@ -128,7 +128,10 @@ static void parse_tcp_relay_ports_config(config_t *cfg, uint16_t **tcp_relay_por
 
 int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port,
                        int *enable_ipv6, int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay,
-                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd)
+                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *tcp_relay_threads,
+                       int *tcp_relay_use_io_uring, int *tcp_relay_send_queue_limit, int *enable_motd,
+                       char **motd, int *onion_announce_capacity, int *dht_shared_keys_capacity, char **metrics_file_path,
+                       int *metrics_interval)
 {
     config_t cfg;
 
@@ -139,8 +142,15 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
     const char *NAME_ENABLE_IPV4_FALLBACK = "enable_ipv4_fallback";
     const char *NAME_ENABLE_LAN_DISCOVERY = "enable_lan_discovery";
     const char *NAME_ENABLE_TCP_RELAY     = "enable_tcp_relay";
+    const char *NAME_TCP_RELAY_THREADS    = "tcp_relay_threads";
+    const char *NAME_TCP_RELAY_USE_IO_URING = "tcp_relay_use_io_uring";
+    const char *NAME_TCP_RELAY_SEND_QUEUE_LIMIT = "tcp_relay_send_queue_limit";
     const char *NAME_ENABLE_MOTD          = "enable_motd";
     const char *NAME_MOTD                 = "motd";
+    const char *NAME_ONION_ANNOUNCE_CAPACITY = "onion_announce_capacity";
+    const char *NAME_DHT_SHARED_KEYS_CAPACITY = "dht_shared_keys_capacity";
+    const char *NAME_METRICS_FILE_PATH    = "metrics_file_path";
+    const char *NAME_METRICS_INTERVAL     = "metrics_interval";
 
     config_init(&cfg);
 
@@ -219,6 +229,35 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         *tcp_relay_port_count = 0;
     }
 
+    // Get TCP relay threads option
+    if (config_lookup_int(&cfg, NAME_TCP_RELAY_THREADS, tcp_relay_threads) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_TCP_RELAY_THREADS);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_TCP_RELAY_THREADS, DEFAULT_TCP_RELAY_THREADS);
+        *tcp_relay_threads = DEFAULT_TCP_RELAY_THREADS;
+    }
+
+    // Get TCP relay io_uring option
+    if (config_lookup_bool(&cfg, NAME_TCP_RELAY_USE_IO_URING, tcp_relay_use_io_uring) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_TCP_RELAY_USE_IO_URING);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %s\n", NAME_TCP_RELAY_USE_IO_URING,
+                  DEFAULT_TCP_RELAY_USE_IO_URING ? "true" : "false");
+        *tcp_relay_use_io_uring = DEFAULT_TCP_RELAY_USE_IO_URING;
+    }
+
+    // Get TCP relay send queue limit
+    if (config_lookup_int(&cfg, NAME_TCP_RELAY_SEND_QUEUE_LIMIT, tcp_relay_send_queue_limit) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_TCP_RELAY_SEND_QUEUE_LIMIT);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_TCP_RELAY_SEND_QUEUE_LIMIT,
+                  DEFAULT_TCP_RELAY_SEND_QUEUE_LIMIT);
+        *tcp_relay_send_queue_limit = DEFAULT_TCP_RELAY_SEND_QUEUE_LIMIT;
+    } else if (*tcp_relay_send_queue_limit < 0) {
+        log_write(LOG_LEVEL_WARNING, "Invalid '%s': %d, should not be negative.\n", NAME_TCP_RELAY_SEND_QUEUE_LIMIT,
+                  *tcp_relay_send_queue_limit);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_TCP_RELAY_SEND_QUEUE_LIMIT,
+                  DEFAULT_TCP_RELAY_SEND_QUEUE_LIMIT);
+        *tcp_relay_send_queue_limit = DEFAULT_TCP_RELAY_SEND_QUEUE_LIMIT;
+    }
+
     // Get MOTD option
     if (config_lookup_bool(&cfg, NAME_ENABLE_MOTD, enable_motd) == CONFIG_FALSE) {
         log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_ENABLE_MOTD);
@@ -244,6 +283,45 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         (*motd)[motd_length - 1] = '\0';
     }
 
+    // Get onion announce capacity
+    if (config_lookup_int(&cfg, NAME_ONION_ANNOUNCE_CAPACITY, onion_announce_capacity) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_ONION_ANNOUNCE_CAPACITY);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_ONION_ANNOUNCE_CAPACITY,
+                  DEFAULT_ONION_ANNOUNCE_CAPACITY);
+        *onion_announce_capacity = DEFAULT_ONION_ANNOUNCE_CAPACITY;
+    }
+
+    // Get DHT shared keys capacity
+    if (config_lookup_int(&cfg, NAME_DHT_SHARED_KEYS_CAPACITY, dht_shared_keys_capacity) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_DHT_SHARED_KEYS_CAPACITY);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_DHT_SHARED_KEYS_CAPACITY,
+                  DEFAULT_DHT_SHARED_KEYS_CAPACITY);
+        *dht_shared_keys_capacity = DEFAULT_DHT_SHARED_KEYS_CAPACITY;
+    }
+
+    // Get metrics file location
+    const char *tmp_metrics_file;
+
+    if (config_lookup_string(&cfg, NAME_METRICS_FILE_PATH, &tmp_metrics_file) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_METRICS_FILE_PATH);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %s\n", NAME_METRICS_FILE_PATH, DEFAULT_METRICS_FILE_PATH);
+        tmp_metrics_file = DEFAULT_METRICS_FILE_PATH;
+    }
+
+    *metrics_file_path = (char *)malloc(strlen(tmp_metrics_file) + 1);
+    strcpy(*metrics_file_path, tmp_metrics_file);
+
+    // Get metrics interval
+    if (config_lookup_int(&cfg, NAME_METRICS_INTERVAL, metrics_interval) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_METRICS_INTERVAL);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_METRICS_INTERVAL, DEFAULT_METRICS_INTERVAL);
+        *metrics_interval = DEFAULT_METRICS_INTERVAL;
+    } else if (*metrics_interval < 1) {
+        log_write(LOG_LEVEL_WARNING, "Invalid '%s': %d, should be at least 1.\n", NAME_METRICS_INTERVAL, *metrics_interval);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_METRICS_INTERVAL, DEFAULT_METRICS_INTERVAL);
+        *metrics_interval = DEFAULT_METRICS_INTERVAL;
+    }
+
     config_destroy(&cfg);
 
     log_write(LOG_LEVEL_INFO, "Successfully read:\n");
@@ -268,6 +346,11 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
                 log_write(LOG_LEVEL_INFO, "Port #%d: %u\n", i, (*tcp_relay_ports)[i]);
             }
         }
+
+        log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_TCP_RELAY_THREADS, *tcp_relay_threads);
+        log_write(LOG_LEVEL_INFO, "'%s': %s\n", NAME_TCP_RELAY_USE_IO_URING,
+                  *tcp_relay_use_io_uring ? "true" : "false");
+        log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_TCP_RELAY_SEND_QUEUE_LIMIT, *tcp_relay_send_queue_limit);
     }
 
     log_write(LOG_LEVEL_INFO, "'%s': %s\n", NAME_ENABLE_MOTD,          *enable_motd          ? "true" : "false");
@@ -276,6 +359,11 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         log_write(LOG_LEVEL_INFO, "'%s': %s\n", NAME_MOTD, *motd);
     }
 
+    log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_ONION_ANNOUNCE_CAPACITY, *onion_announce_capacity);
+    log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_DHT_SHARED_KEYS_CAPACITY, *dht_shared_keys_capacity);
+    log_write(LOG_LEVEL_INFO, "'%s': %s\n", NAME_METRICS_FILE_PATH,    *metrics_file_path);
+    log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_METRICS_INTERVAL,     *metrics_interval);
+
     return 1;
 }
 
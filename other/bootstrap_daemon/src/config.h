@@ -15,7 +15,7 @@
 /**
  * Gets general config options from the config file.
  *
- * Important: You are responsible for freeing `pid_file_path` and `keys_file_path`
+ * Important: You are responsible for freeing `pid_file_path`, `keys_file_path` and `metrics_file_path`
  *            also, iff `tcp_relay_ports_count` > 0, then you are responsible for freeing `tcp_relay_ports`
  *            and also `motd` iff `enable_motd` is set.
  *
@@ -24,7 +24,10 @@
  */
 int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port,
                        int *enable_ipv6, int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay,
-                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd);
+                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *tcp_relay_threads,
+                       int *tcp_relay_use_io_uring, int *tcp_relay_send_queue_limit, int *enable_motd,
+                       char **motd, int *onion_announce_capacity, int *dht_shared_keys_capacity, char **metrics_file_path,
+                       int *metrics_interval);
 
 /**
  * Bootstraps off nodes listed in the config file.
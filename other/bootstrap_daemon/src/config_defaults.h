@@ -21,7 +21,14 @@
 #define DEFAULT_ENABLE_TCP_RELAY      1 // 1 - true, 0 - false
 #define DEFAULT_TCP_RELAY_PORTS       443, 3389, 33445 // comma-separated list of ports. make sure to adjust DEFAULT_TCP_RELAY_PORTS_COUNT accordingly
 #define DEFAULT_TCP_RELAY_PORTS_COUNT 3
+#define DEFAULT_TCP_RELAY_THREADS     1 // 0 - run the TCP relay on the main thread
+#define DEFAULT_TCP_RELAY_USE_IO_URING 0 // 1 - true, 0 - false
+#define DEFAULT_TCP_RELAY_SEND_QUEUE_LIMIT 0 // bytes, 0 - the TCP server's default
 #define DEFAULT_ENABLE_MOTD           1 // 1 - true, 0 - false
 #define DEFAULT_MOTD                  DAEMON_NAME
+#define DEFAULT_ONION_ANNOUNCE_CAPACITY 160 // number of announced nodes stored
+#define DEFAULT_DHT_SHARED_KEYS_CAPACITY 1024 // number of shared keys cached for each direction
+#define DEFAULT_METRICS_FILE_PATH     "" // empty - don't export metrics
+#define DEFAULT_METRICS_INTERVAL      10 // seconds
 
 #endif // C_TOXCORE_OTHER_BOOTSTRAP_DAEMON_SRC_CONFIG_DEFAULTS_H
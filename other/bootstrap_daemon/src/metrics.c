@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/*
+ * Tox DHT bootstrap daemon.
+ * Export of runtime statistics for monitoring.
+ */
+#include "metrics.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define METRIC_PREFIX "tox_bootstrapd_"
+
+static void write_header(FILE *file, const char *name, const char *type, const char *help)
+{
+    fprintf(file, "# HELP " METRIC_PREFIX "%s %s\n", name, help);
+    fprintf(file, "# TYPE " METRIC_PREFIX "%s %s\n", name, type);
+}
+
+static void write_value(FILE *file, const char *name, const char *labels, uint64_t value)
+{
+    fprintf(file, METRIC_PREFIX "%s%s %" PRIu64 "\n", name, labels, value);
+}
+
+static void write_gauge(FILE *file, const char *name, const char *help, uint64_t value)
+{
+    write_header(file, name, "gauge", help);
+    write_value(file, name, "", value);
+}
+
+// Writes one counter per packet id, skipping the ids that were never seen.
+static void write_packet_counter(FILE *file, const char *name, const char *help, const uint64_t *counts)
+{
+    write_header(file, name, "counter", help);
+
+    for (unsigned int i = 0; i < 256; ++i) {
+        if (counts[i] == 0) {
+            continue;
+        }
+
+        char labels[32];
+        snprintf(labels, sizeof(labels), "{packet_id=\"0x%02x\"}", i);
+        write_value(file, name, labels, counts[i]);
+    }
+}
+
+static void write_shared_keys_stats(FILE *file, const DHT *dht)
+{
+    Shared_Keys_Stats recv;
+    Shared_Keys_Stats sent;
+    dht_get_shared_keys_stats(dht, &recv, &sent);
+
+    write_header(file, "dht_shared_key_cache_hits_total", "counter", "Lookups found in the DHT shared key cache.");
+    write_value(file, "dht_shared_key_cache_hits_total", "{cache=\"recv\"}", recv.hits);
+    write_value(file, "dht_shared_key_cache_hits_total", "{cache=\"sent\"}", sent.hits);
+
+    write_header(file, "dht_shared_key_cache_misses_total", "counter", "Lookups that had to compute a shared key.");
+    write_value(file, "dht_shared_key_cache_misses_total", "{cache=\"recv\"}", recv.misses);
+    write_value(file, "dht_shared_key_cache_misses_total", "{cache=\"sent\"}", sent.misses);
+
+    write_header(file, "dht_shared_key_cache_evictions_total", "counter",
+                 "Misses that replaced a key stored in the DHT shared key cache.");
+    write_value(file, "dht_shared_key_cache_evictions_total", "{cache=\"recv\"}", recv.evictions);
+    write_value(file, "dht_shared_key_cache_evictions_total", "{cache=\"sent\"}", sent.evictions);
+}
+
+static void write_rtt_stats(FILE *file, const DHT *dht)
+{
+    DHT_Rtt_Stats stats;
+    dht_get_rtt_stats(dht, &stats);
+
+    write_gauge(file, "dht_close_nodes_measured", "Good DHT close list addresses with a measured round trip time.",
+                stats.measured);
+
+    write_header(file, "dht_rtt_milliseconds", "gauge",
+                 "Smoothed round trip times of the measured DHT close list addresses.");
+    write_value(file, "dht_rtt_milliseconds", "{stat=\"min\"}", stats.min_rtt);
+    write_value(file, "dht_rtt_milliseconds", "{stat=\"mean\"}", stats.mean_rtt);
+    write_value(file, "dht_rtt_milliseconds", "{stat=\"max\"}", stats.max_rtt);
+}
+
+static void write_tcp_server_stats(FILE *file, TCP_Server *tcp_server)
+{
+    TCP_Server_Stats stats;
+    tcp_server_get_stats(tcp_server, &stats);
+
+    write_header(file, "tcp_connections", "gauge", "TCP relay connections by state.");
+    write_value(file, "tcp_connections", "{state=\"incoming\"}", stats.incoming);
+    write_value(file, "tcp_connections", "{state=\"unconfirmed\"}", stats.unconfirmed);
+    write_value(file, "tcp_connections", "{state=\"confirmed\"}", stats.confirmed);
+
+    write_gauge(file, "tcp_send_queue_connections", "Confirmed TCP relay connections with data queued for sending.",
+                stats.queued);
+    write_gauge(file, "tcp_send_queue_bytes", "Bytes queued for sending on all TCP relay connections.",
+                stats.queued_bytes);
+    write_gauge(file, "tcp_send_queue_max_bytes", "Most bytes queued for sending on one TCP relay connection.",
+                stats.max_queued_bytes);
+}
+
+int write_metrics(const char *file_path, uint64_t uptime, const DHT *dht, const Onion_Announce *onion_a,
+                  TCP_Server *tcp_server)
+{
+    const char suffix[] = ".tmp";
+    const size_t tmp_path_size = strlen(file_path) + sizeof(suffix);
+    char *tmp_path = (char *)malloc(tmp_path_size);
+
+    if (tmp_path == nullptr) {
+        return 0;
+    }
+
+    snprintf(tmp_path, tmp_path_size, "%s%s", file_path, suffix);
+
+    FILE *file = fopen(tmp_path, "w");
+
+    if (file == nullptr) {
+        free(tmp_path);
+        return 0;
+    }
+
+    write_gauge(file, "uptime_seconds", "Seconds since the daemon started.", uptime);
+
+    const Net_Stats *net_stats = networking_get_stats(dht_get_net(dht));
+    write_packet_counter(file, "udp_packets_received_total", "UDP packets received, by packet id.",
+                         net_stats->packets_recv);
+    write_packet_counter(file, "udp_bytes_received_total", "Bytes of UDP packets received, by packet id.",
+                         net_stats->bytes_recv);
+    write_packet_counter(file, "udp_packets_sent_total", "UDP packets sent, by packet id.", net_stats->packets_sent);
+    write_packet_counter(file, "udp_bytes_sent_total", "Bytes of UDP packets sent, by packet id.",
+                         net_stats->bytes_sent);
+
+    write_gauge(file, "dht_close_nodes", "Nodes in the DHT close list that did not time out.",
+                dht_get_num_close_nodes(dht));
+    write_rtt_stats(file, dht);
+    write_shared_keys_stats(file, dht);
+
+    write_gauge(file, "onion_announce_entries", "Entries stored for onion announce requests.",
+                onion_announce_num_entries(onion_a));
+
+    if (tcp_server != nullptr) {
+        write_tcp_server_stats(file, tcp_server);
+    }
+
+    const bool written = !ferror(file);
+
+    if (fclose(file) != 0 || !written || rename(tmp_path, file_path) != 0) {
+        remove(tmp_path);
+        free(tmp_path);
+        return 0;
+    }
+
+    free(tmp_path);
+    return 1;
+}
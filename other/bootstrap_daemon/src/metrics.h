@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/*
+ * Tox DHT bootstrap daemon.
+ * Export of runtime statistics for monitoring.
+ */
+#ifndef C_TOXCORE_OTHER_BOOTSTRAP_DAEMON_SRC_METRICS_H
+#define C_TOXCORE_OTHER_BOOTSTRAP_DAEMON_SRC_METRICS_H
+
+#include <stdint.h>
+
+#include "../../../toxcore/DHT.h"
+#include "../../../toxcore/TCP_server.h"
+#include "../../../toxcore/onion_announce.h"
+
+/**
+ * Writes the statistics of the daemon to a file in the Prometheus text
+ * exposition format, e.g. for the textfile collector of node_exporter.
+ *
+ * The statistics are written to `file_path` with ".tmp" appended first, which
+ * is then renamed to `file_path`, so readers never see a partially written file.
+ *
+ * @param uptime Seconds since the daemon started.
+ * @param tcp_server NULL if the TCP relay is disabled.
+ * @return 1 on success,
+ *         0 on failure, leaving the previous file in place.
+ */
+int write_metrics(const char *file_path, uint64_t uptime, const DHT *dht, const Onion_Announce *onion_a,
+                  TCP_Server *tcp_server);
+
+#endif // C_TOXCORE_OTHER_BOOTSTRAP_DAEMON_SRC_METRICS_H
@@ -14,6 +14,7 @@
 // system provided
 #include <sys/resource.h>
 #include <sys/stat.h>
+#include <poll.h>
 #include <signal.h> // system header, rather than C, because we need it for POSIX sigaction(2)
 #include <unistd.h>
 
@@ -40,10 +41,9 @@
 #include "config.h"
 #include "global.h"
 #include "log.h"
+#include "metrics.h"
 
 
-#define SLEEP_MILLISECONDS(MS) usleep(1000*MS)
-
 // Uses the already existing key or creates one if it didn't exist
 //
 // returns 1 on success
@@ -203,6 +203,43 @@ static void toxcore_logger_callback(void *context, Logger_Level level, const cha
     log_write(log_level, "%s:%d(%s) %s\n", file, line, func, message);
 }
 
+// Waits until the UDP socket or the TCP server has something to handle, or
+// until the DHT or the TCP server has to run again, whichever comes first.
+// Returns early when a signal is caught.
+
+static void wait_for_events(Networking_Core *net, TCP_Server *tcp_server, Mono_Time *mono_time)
+{
+    // The DHT, LAN discovery and metrics all run on whole seconds.
+    uint64_t deadline = mono_time_next_second(mono_time);
+
+    struct pollfd fds[2];
+    nfds_t num_fds = 0;
+
+    fds[num_fds].fd = net_sock(net).socket;
+    fds[num_fds].events = POLLIN;
+    ++num_fds;
+
+    if (tcp_server != nullptr) {
+        const Socket tcp_sock = tcp_server_event_socket(tcp_server);
+
+        if (sock_valid(tcp_sock)) {
+            fds[num_fds].fd = tcp_sock.socket;
+            fds[num_fds].events = POLLIN;
+            ++num_fds;
+        }
+
+        deadline = min_u64(deadline, tcp_server_run_deadline(tcp_server, mono_time));
+    }
+
+    const uint64_t now = current_time_monotonic(mono_time);
+
+    if (deadline <= now) {
+        return;
+    }
+
+    poll(fds, num_fds, (int)(deadline - now));
+}
+
 static volatile sig_atomic_t caught_signal = 0;
 
 static void handle_signal(int signum)
@@ -237,11 +274,20 @@ int main(int argc, char *argv[])
     int enable_tcp_relay;
     uint16_t *tcp_relay_ports = nullptr;
     int tcp_relay_port_count;
+    int tcp_relay_threads;
+    int tcp_relay_use_io_uring;
+    int tcp_relay_send_queue_limit;
     int enable_motd;
     char *motd = nullptr;
+    int onion_announce_capacity;
+    int dht_shared_keys_capacity;
+    char *metrics_file_path = nullptr;
+    int metrics_interval;
 
     if (get_general_config(cfg_file_path, &pid_file_path, &keys_file_path, &port, &enable_ipv6, &enable_ipv4_fallback,
-                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd)) {
+                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &tcp_relay_threads,
+                           &tcp_relay_use_io_uring, &tcp_relay_send_queue_limit, &enable_motd, &motd,
+                           &onion_announce_capacity, &dht_shared_keys_capacity, &metrics_file_path, &metrics_interval)) {
         log_write(LOG_LEVEL_INFO, "General config read successfully\n");
     } else {
         log_write(LOG_LEVEL_ERROR, "Couldn't read config file: %s. Exiting.\n", cfg_file_path);
@@ -255,6 +301,7 @@ int main(int argc, char *argv[])
         free(tcp_relay_ports);
         free(keys_file_path);
         free(pid_file_path);
+        free(metrics_file_path);
         return 1;
     }
 
@@ -288,6 +335,7 @@ int main(int argc, char *argv[])
                 free(motd);
                 free(tcp_relay_ports);
                 free(keys_file_path);
+                free(metrics_file_path);
                 return 1;
             }
         } else {
@@ -296,6 +344,7 @@ int main(int argc, char *argv[])
             free(motd);
             free(tcp_relay_ports);
             free(keys_file_path);
+            free(metrics_file_path);
             return 1;
         }
     }
@@ -309,11 +358,16 @@ int main(int argc, char *argv[])
         free(motd);
         free(tcp_relay_ports);
         free(keys_file_path);
+        free(metrics_file_path);
         return 1;
     }
 
     mono_time_update(mono_time);
 
+    // Responses are queued while handling packets and sent in batches at the
+    // end of each main loop iteration.
+    networking_set_send_batching(net, true);
+
     DHT *const dht = new_dht(logger, mono_time, net, true);
 
     if (dht == nullptr) {
@@ -324,6 +378,20 @@ int main(int argc, char *argv[])
         free(motd);
         free(tcp_relay_ports);
         free(keys_file_path);
+        free(metrics_file_path);
+        return 1;
+    }
+
+    if (dht_shared_keys_capacity < 1 || !dht_set_shared_keys_capacity(dht, dht_shared_keys_capacity)) {
+        log_write(LOG_LEVEL_ERROR, "Couldn't cache %d DHT shared keys. Exiting.\n", dht_shared_keys_capacity);
+        kill_dht(dht);
+        mono_time_free(mono_time);
+        kill_networking(net);
+        logger_kill(logger);
+        free(motd);
+        free(tcp_relay_ports);
+        free(keys_file_path);
+        free(metrics_file_path);
         return 1;
     }
 
@@ -338,6 +406,7 @@ int main(int argc, char *argv[])
         free(motd);
         free(tcp_relay_ports);
         free(keys_file_path);
+        free(metrics_file_path);
         return 1;
     }
 
@@ -353,6 +422,22 @@ int main(int argc, char *argv[])
         free(motd);
         free(tcp_relay_ports);
         free(keys_file_path);
+        free(metrics_file_path);
+        return 1;
+    }
+
+    if (onion_announce_capacity < 1 || !onion_announce_set_capacity(onion_a, onion_announce_capacity)) {
+        log_write(LOG_LEVEL_ERROR, "Couldn't store %d onion announcements. Exiting.\n", onion_announce_capacity);
+        kill_onion_announce(onion_a);
+        kill_onion(onion);
+        kill_dht(dht);
+        mono_time_free(mono_time);
+        kill_networking(net);
+        logger_kill(logger);
+        free(motd);
+        free(tcp_relay_ports);
+        free(keys_file_path);
+        free(metrics_file_path);
         return 1;
     }
 
@@ -371,6 +456,7 @@ int main(int argc, char *argv[])
             free(motd);
             free(tcp_relay_ports);
             free(keys_file_path);
+            free(metrics_file_path);
             return 1;
         }
     }
@@ -388,6 +474,7 @@ int main(int argc, char *argv[])
         logger_kill(logger);
         free(tcp_relay_ports);
         free(keys_file_path);
+        free(metrics_file_path);
         return 1;
     }
 
@@ -403,6 +490,21 @@ int main(int argc, char *argv[])
             kill_networking(net);
             logger_kill(logger);
             free(tcp_relay_ports);
+            free(metrics_file_path);
+            return 1;
+        }
+
+        if (tcp_relay_threads < 0 || tcp_relay_threads > TCP_SERVER_MAX_THREADS) {
+            log_write(LOG_LEVEL_ERROR, "Invalid number of TCP relay threads: %d, should be in [0, %d]. Exiting.\n",
+                      tcp_relay_threads, TCP_SERVER_MAX_THREADS);
+            kill_onion_announce(onion_a);
+            kill_onion(onion);
+            kill_dht(dht);
+            mono_time_free(mono_time);
+            kill_networking(net);
+            logger_kill(logger);
+            free(tcp_relay_ports);
+            free(metrics_file_path);
             return 1;
         }
 
@@ -437,6 +539,30 @@ int main(int argc, char *argv[])
                           "Continuing using the current limit (%ju).\n",
                           (uintmax_t)limit.rlim_cur, (uintmax_t)rlim_min, (uintmax_t)rlim_suggested, (uintmax_t)limit.rlim_cur);
             }
+
+            if (tcp_relay_send_queue_limit != 0) {
+                // The server raises limits below TCP_SEND_QUEUE_MIN_LIMIT to it.
+                tcp_server_set_send_queue_limit(tcp_server, (uint32_t)tcp_relay_send_queue_limit);
+            }
+
+            if (tcp_relay_use_io_uring) {
+                if (tcp_server_use_io_uring(tcp_server)) {
+                    log_write(LOG_LEVEL_INFO, "Running the TCP server on io_uring.\n");
+                } else {
+                    log_write(LOG_LEVEL_WARNING, "Couldn't use io_uring. Continuing with the TCP server on epoll.\n");
+                }
+            }
+
+            // The relay runs on its own threads, so that its traffic doesn't delay the DHT and the other way round.
+            // Onion requests it receives are passed to this thread, which owns the onion.
+            if (tcp_relay_threads > 0) {
+                if (tcp_server_start_threads(tcp_server, mono_time, tcp_relay_threads) == 0) {
+                    log_write(LOG_LEVEL_INFO, "Started %d TCP server threads.\n", tcp_relay_threads);
+                } else {
+                    log_write(LOG_LEVEL_WARNING,
+                              "Couldn't start TCP server threads. Continuing with the TCP server on the main thread.\n");
+                }
+            }
         } else {
             log_write(LOG_LEVEL_ERROR, "Couldn't initialize Tox TCP server. Exiting.\n");
             kill_onion_announce(onion_a);
@@ -445,6 +571,7 @@ int main(int argc, char *argv[])
             mono_time_free(mono_time);
             kill_networking(net);
             logger_kill(logger);
+            free(metrics_file_path);
             return 1;
         }
     }
@@ -460,6 +587,7 @@ int main(int argc, char *argv[])
         mono_time_free(mono_time);
         kill_networking(net);
         logger_kill(logger);
+        free(metrics_file_path);
         return 1;
     }
 
@@ -470,6 +598,10 @@ int main(int argc, char *argv[])
 
     int waiting_for_dht_connection = 1;
 
+    const bool enable_metrics = metrics_file_path[0] != '\0';
+    const uint64_t start_time = mono_time_get(mono_time);
+    uint64_t last_metrics = 0;
+
     if (enable_lan_discovery) {
         lan_discovery_init(dht);
         log_write(LOG_LEVEL_INFO, "Initialized LAN discovery successfully.\n");
@@ -508,13 +640,22 @@ int main(int argc, char *argv[])
         }
 
         networking_poll(dht_get_net(dht), nullptr);
+        networking_flush(dht_get_net(dht));
 
         if (waiting_for_dht_connection && dht_isconnected(dht)) {
             log_write(LOG_LEVEL_INFO, "Connected to another bootstrap node successfully.\n");
             waiting_for_dht_connection = 0;
         }
 
-        SLEEP_MILLISECONDS(30);
+        if (enable_metrics && mono_time_is_timeout(mono_time, last_metrics, metrics_interval)) {
+            if (!write_metrics(metrics_file_path, mono_time_get(mono_time) - start_time, dht, onion_a, tcp_server)) {
+                log_write(LOG_LEVEL_WARNING, "Couldn't write metrics to %s.\n", metrics_file_path);
+            }
+
+            last_metrics = mono_time_get(mono_time);
+        }
+
+        wait_for_events(net, tcp_server, mono_time);
     }
 
     switch (caught_signal) {
@@ -541,6 +682,7 @@ int main(int argc, char *argv[])
     mono_time_free(mono_time);
     kill_networking(net);
     logger_kill(logger);
+    free(metrics_file_path);
 
     return 0;
 }
@@ -68,7 +68,8 @@ static void print_assoc(const IPPTsPng *assoc, uint8_t ours)
     char ip_str[IP_NTOA_LEN];
     printf("\nIP: %s Port: %u", ip_ntoa(&ipp->ip, ip_str, sizeof(ip_str)), net_ntohs(ipp->port));
     printf("\nTimestamp: %llu", (long long unsigned int) assoc->timestamp);
-    printf("\nLast pinged: %llu\n", (long long unsigned int) assoc->last_pinged);
+    printf("\nLast pinged: %llu", (long long unsigned int) assoc->last_pinged);
+    printf("\nRound trip time: %u ms\n", assoc->rtt);
 
     ipp = &assoc->ret_ip_port;
 
@@ -0,0 +1,319 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/* net_crypto congestion control benchmark
+ * Runs a bulk transfer between two net_crypto instances through a relay on
+ * loopback that emulates a bottleneck link with a drop-tail buffer, one-way
+ * propagation delay and random loss. For each congestion controller and link
+ * it reports the goodput and the queueing delay packets saw at the
+ * bottleneck.
+ *
+ * Usage: ./congestion_bench [seconds per run]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/logger.h"
+#include "../toxcore/mono_time.h"
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/network.h"
+#include "misc_tools.h"
+
+#define BENCH_PORT_FROM 40000
+#define BENCH_PORT_TO 49999
+
+/* Maximum number of packets in flight on one emulated link. */
+#define LINK_MAX_PACKETS 8192
+
+typedef struct Link_Params {
+    const char *name;
+    uint32_t rate; /* bottleneck rate in bytes per second */
+    uint32_t delay; /* one-way propagation delay in ms */
+    uint32_t buffer; /* bottleneck buffer size in ms at the bottleneck rate */
+    double loss; /* probability of a packet being dropped at random */
+} Link_Params;
+
+static const Link_Params link_params[] = {
+    {"fat",     8 * 1024 * 1024,  10, 100, 0.0},
+    {"wan",     2 * 1024 * 1024,  40, 200, 0.005},
+    {"mobile",       512 * 1024, 100, 500, 0.03},
+};
+
+typedef struct Link_Packet {
+    uint64_t deliver_time;
+    uint16_t length;
+    uint8_t data[MAX_UDP_PACKET_SIZE];
+} Link_Packet;
+
+/* One direction of the emulated path. */
+typedef struct Link {
+    const Link_Params *params;
+    Mono_Time *mono_time;
+    Networking_Core *out; /* the relay socket packets leave through */
+    IP_Port dest;
+
+    Link_Packet *packets;
+    uint32_t start;
+    uint32_t count;
+    double busy_until; /* time in ms at which the bottleneck is done with the queued packets */
+
+    uint64_t queue_delay_sum;
+    uint64_t queue_delay_max;
+    uint32_t forwarded;
+    uint32_t random_drops;
+    uint32_t tail_drops;
+} Link;
+
+typedef struct Node {
+    Networking_Core *net;
+    DHT *dht;
+    Net_Crypto *net_crypto;
+    int conn_id;
+    bool online;
+    uint64_t bytes_received;
+} Node;
+
+static int link_receive(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    Link *link = (Link *)object;
+    const double now = current_time_monotonic(link->mono_time);
+
+    if (link->params->loss > 0 && random_u32() < link->params->loss * UINT32_MAX) {
+        ++link->random_drops;
+        return 0;
+    }
+
+    const double queue_delay = link->busy_until > now ? link->busy_until - now : 0;
+
+    if (queue_delay > link->params->buffer || link->count == LINK_MAX_PACKETS) {
+        ++link->tail_drops;
+        return 0;
+    }
+
+    link->busy_until = (link->busy_until > now ? link->busy_until : now) + length * 1000.0 / link->params->rate;
+
+    Link_Packet *lp = &link->packets[(link->start + link->count) % LINK_MAX_PACKETS];
+    lp->deliver_time = (uint64_t)link->busy_until + link->params->delay;
+    lp->length = length;
+    memcpy(lp->data, packet, length);
+    ++link->count;
+
+    link->queue_delay_sum += (uint64_t)queue_delay;
+
+    if (link->queue_delay_max < queue_delay) {
+        link->queue_delay_max = queue_delay;
+    }
+
+    return 0;
+}
+
+static bool link_init(Link *link, const Link_Params *params, Mono_Time *mono_time, Networking_Core *in,
+                      Networking_Core *out, IP_Port dest)
+{
+    memset(link, 0, sizeof(Link));
+    link->params = params;
+    link->mono_time = mono_time;
+    link->out = out;
+    link->dest = dest;
+    link->packets = (Link_Packet *)malloc(LINK_MAX_PACKETS * sizeof(Link_Packet));
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        networking_registerhandler(in, i, &link_receive, link);
+    }
+
+    return link->packets != nullptr;
+}
+
+static void link_run(Link *link)
+{
+    const uint64_t now = current_time_monotonic(link->mono_time);
+
+    while (link->count > 0 && link->packets[link->start].deliver_time <= now) {
+        const Link_Packet *lp = &link->packets[link->start];
+        sendpacket(link->out, link->dest, lp->data, lp->length);
+        link->start = (link->start + 1) % LINK_MAX_PACKETS;
+        --link->count;
+        ++link->forwarded;
+    }
+}
+
+static Networking_Core *new_loopback_networking(const Logger *log)
+{
+    IP ip;
+    ip_init(&ip, false);
+    ip.ip.v4 = get_ip4_loopback();
+    return new_networking_ex(log, ip, BENCH_PORT_FROM, BENCH_PORT_TO, nullptr);
+}
+
+static IP_Port loopback_ip_port(const Networking_Core *net)
+{
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, false);
+    ip_port.ip.ip.v4 = get_ip4_loopback();
+    ip_port.port = net_port(net);
+    return ip_port;
+}
+
+static bool node_init(Node *node, const Logger *log, Mono_Time *mono_time, Congestion_Control_Type type)
+{
+    memset(node, 0, sizeof(Node));
+    node->net = new_loopback_networking(log);
+    node->dht = new_dht(log, mono_time, node->net, false);
+    TCP_Proxy_Info proxy_info;
+    memset(&proxy_info, 0, sizeof(proxy_info));
+    proxy_info.proxy_type = TCP_PROXY_NONE;
+    node->net_crypto = new_net_crypto(log, mono_time, node->dht, &proxy_info);
+    node->conn_id = -1;
+    return node->net_crypto != nullptr && net_crypto_set_congestion_control(node->net_crypto, type) == 0;
+}
+
+static void node_kill(Node *node)
+{
+    kill_net_crypto(node->net_crypto);
+    kill_dht(node->dht);
+    kill_networking(node->net);
+}
+
+static void node_iterate(Node *node)
+{
+    networking_poll(node->net, nullptr);
+    do_net_crypto(node->net_crypto, nullptr);
+}
+
+static int connection_status(void *object, int id, uint8_t status, void *userdata)
+{
+    ((Node *)object)->online = status != 0;
+    return 0;
+}
+
+static int connection_data(void *object, int id, const uint8_t *data, uint16_t length, void *userdata)
+{
+    ((Node *)object)->bytes_received += length;
+    return 0;
+}
+
+static int accept_connection(void *object, New_Connection *n_c)
+{
+    Node *node = (Node *)object;
+    node->conn_id = accept_crypto_connection(node->net_crypto, n_c);
+
+    if (node->conn_id == -1) {
+        return -1;
+    }
+
+    connection_status_handler(node->net_crypto, node->conn_id, &connection_status, node, 0);
+    connection_data_handler(node->net_crypto, node->conn_id, &connection_data, node, 0);
+    return 0;
+}
+
+static void run(const Logger *log, Mono_Time *mono_time, Congestion_Control_Type type, const char *type_name,
+                const Link_Params *params, uint32_t seconds)
+{
+    Node sender;
+    Node receiver;
+    Networking_Core *relay_sender = new_loopback_networking(log);
+    Networking_Core *relay_receiver = new_loopback_networking(log);
+
+    if (!node_init(&sender, log, mono_time, type) || !node_init(&receiver, log, mono_time, type)
+            || relay_sender == nullptr || relay_receiver == nullptr) {
+        printf("failed to create nodes\n");
+        exit(1);
+    }
+
+    /* The sender talks to relay_sender, the receiver to relay_receiver. */
+    Link forward;
+    Link backward;
+
+    if (!link_init(&forward, params, mono_time, relay_sender, relay_receiver, loopback_ip_port(receiver.net))
+            || !link_init(&backward, params, mono_time, relay_receiver, relay_sender, loopback_ip_port(sender.net))) {
+        printf("out of memory\n");
+        exit(1);
+    }
+
+    new_connection_handler(receiver.net_crypto, &accept_connection, &receiver);
+
+    sender.conn_id = new_crypto_connection(sender.net_crypto, nc_get_self_public_key(receiver.net_crypto),
+                                           dht_get_self_public_key(receiver.dht));
+    set_direct_ip_port(sender.net_crypto, sender.conn_id, loopback_ip_port(relay_sender), false);
+    connection_status_handler(sender.net_crypto, sender.conn_id, &connection_status, &sender, 0);
+
+    uint8_t packet[MAX_CRYPTO_DATA_SIZE] = {PACKET_ID_RANGE_LOSSLESS_CUSTOM_START};
+    uint64_t start = 0;
+    const uint64_t created = current_time_monotonic(mono_time);
+
+    while (true) {
+        mono_time_update(mono_time);
+        const uint64_t now = current_time_monotonic(mono_time);
+
+        if (start == 0 && sender.online && receiver.online) {
+            start = now;
+            receiver.bytes_received = 0;
+            forward.queue_delay_sum = 0;
+            forward.queue_delay_max = 0;
+            forward.forwarded = 0;
+            forward.random_drops = 0;
+            forward.tail_drops = 0;
+        }
+
+        if (start != 0 ? now - start >= seconds * 1000 : now - created >= 10000) {
+            break;
+        }
+
+        if (sender.online) {
+            while (crypto_num_free_sendqueue_slots(sender.net_crypto, sender.conn_id) > 0
+                    && write_cryptpacket(sender.net_crypto, sender.conn_id, packet, sizeof(packet), true) != -1) {
+                continue;
+            }
+        }
+
+        node_iterate(&sender);
+        networking_poll(relay_sender, nullptr);
+        networking_poll(relay_receiver, nullptr);
+        link_run(&forward);
+        link_run(&backward);
+        node_iterate(&receiver);
+
+        c_sleep(1);
+    }
+
+    const uint64_t elapsed = start != 0 ? current_time_monotonic(mono_time) - start : 0;
+    const uint32_t queued = forward.forwarded + forward.count;
+
+    if (elapsed == 0) {
+        printf("%-6s %-7s connection failed\n", type_name, params->name);
+    } else {
+        const double goodput = receiver.bytes_received * 1000.0 / elapsed;
+        printf("%-6s %-7s %8.0f KiB/s %5.1f%% of link, queueing delay %4llu ms avg %4llu ms max, "
+               "%u tail drops\n",
+               type_name, params->name, goodput / 1024, goodput * 100.0 / params->rate,
+               (unsigned long long)(queued ? forward.queue_delay_sum / queued : 0),
+               (unsigned long long)forward.queue_delay_max, forward.tail_drops);
+    }
+
+    node_kill(&sender);
+    node_kill(&receiver);
+    kill_networking(relay_sender);
+    kill_networking(relay_receiver);
+    free(forward.packets);
+    free(backward.packets);
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t seconds = argc > 1 ? (uint32_t)atoi(argv[1]) : 10;
+
+    Logger *log = logger_new();
+    Mono_Time *mono_time = mono_time_new();
+
+    for (size_t i = 0; i < sizeof(link_params) / sizeof(link_params[0]); ++i) {
+        run(log, mono_time, CONGESTION_CONTROL_QUEUE, "queue", &link_params[i], seconds);
+        run(log, mono_time, CONGESTION_CONTROL_DELAY, "delay", &link_params[i], seconds);
+    }
+
+    mono_time_free(mono_time);
+    logger_kill(log);
+    return 0;
+}
@@ -0,0 +1,191 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/* DHT benchmark
+ * Fills every bucket of the close list and measures how many get_close_nodes
+ * lookups (the work done for each incoming getnodes request) per second the
+ * DHT can answer, and how fast lists of close list keys are sorted by distance
+ * with the key_math functions compared to byte by byte comparisons.
+ *
+ * Usage: ./dht_bench [lookups]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/key_math.h"
+#include "../toxcore/logger.h"
+#include "../toxcore/mono_time.h"
+#include "../toxcore/network.h"
+
+/* Make a key that shares exactly `bits` leading bits with `base`. */
+static void key_with_prefix(uint8_t *key, const uint8_t *base, unsigned int bits)
+{
+    random_bytes(key, CRYPTO_PUBLIC_KEY_SIZE);
+
+    const unsigned int byte = bits / 8;
+    const uint8_t mask = 0x80 >> (bits % 8);
+
+    memcpy(key, base, byte);
+    key[byte] = (base[byte] & ~(mask | (mask - 1))) | ((base[byte] ^ mask) & mask) | (key[byte] & (mask - 1));
+}
+
+static uint32_t fill_close_list(DHT *dht)
+{
+    const uint8_t *self_pk = dht_get_self_public_key(dht);
+    uint32_t added = 0;
+
+    for (unsigned int bits = 0; bits < LCLIENT_LENGTH; ++bits) {
+        for (unsigned int i = 0; i < LCLIENT_NODES; ++i) {
+            uint8_t pk[CRYPTO_PUBLIC_KEY_SIZE];
+            key_with_prefix(pk, self_pk, bits);
+
+            IP_Port ip_port;
+            ip_init(&ip_port.ip, false);
+            ip_port.ip.ip.v4.uint32 = random_u32();
+            ip_port.port = net_htons(33445);
+
+            if (node_addable_to_close_list(dht, pk, ip_port)) {
+                addto_lists(dht, ip_port, pk);
+                ++added;
+            }
+        }
+    }
+
+    return added;
+}
+
+static void bench_get_close_nodes(DHT *dht, Mono_Time *mono_time, uint32_t lookups)
+{
+    uint8_t(*targets)[CRYPTO_PUBLIC_KEY_SIZE] = (uint8_t(*)[CRYPTO_PUBLIC_KEY_SIZE])malloc(
+                lookups * CRYPTO_PUBLIC_KEY_SIZE);
+
+    if (targets == nullptr) {
+        printf("out of memory\n");
+        exit(1);
+    }
+
+    random_bytes(targets[0], lookups * CRYPTO_PUBLIC_KEY_SIZE);
+
+    uint64_t found = 0;
+    const uint64_t start = current_time_monotonic(mono_time);
+
+    for (uint32_t i = 0; i < lookups; ++i) {
+        Node_format nodes[MAX_SENT_NODES];
+        found += get_close_nodes(dht, targets[i], nodes, net_family_unspec, true, 1);
+    }
+
+    const uint64_t elapsed = current_time_monotonic(mono_time) - start;
+
+    printf("get_close_nodes: %u lookups in %llu ms (%.0f lookups/s, %.2f nodes/lookup)\n",
+           lookups, (unsigned long long)elapsed, elapsed ? lookups * 1000.0 / elapsed : 0.0,
+           lookups ? (double)found / lookups : 0.0);
+
+    free(targets);
+}
+
+/* The XOR distance comparison as it was done before key_math. */
+static int byte_wise_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
+{
+    for (size_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
+        const uint8_t distance1 = pk[i] ^ pk1[i];
+        const uint8_t distance2 = pk[i] ^ pk2[i];
+
+        if (distance1 < distance2) {
+            return 1;
+        }
+
+        if (distance1 > distance2) {
+            return 2;
+        }
+    }
+
+    return 0;
+}
+
+static const uint8_t *sort_base_key;
+
+static int cmp_key_math(const void *a, const void *b)
+{
+    const int close = key_closest(sort_base_key, (const uint8_t *)a, (const uint8_t *)b);
+    return close == 1 ? -1 : close == 2 ? 1 : 0;
+}
+
+static int cmp_byte_wise(const void *a, const void *b)
+{
+    const int close = byte_wise_closest(sort_base_key, (const uint8_t *)a, (const uint8_t *)b);
+    return close == 1 ? -1 : close == 2 ? 1 : 0;
+}
+
+static uint64_t time_sorts(Mono_Time *mono_time, uint8_t *keys, const uint8_t *unsorted, uint32_t sorts,
+                           int (*cmp)(const void *, const void *))
+{
+    const uint64_t start = current_time_monotonic(mono_time);
+
+    for (uint32_t i = 0; i < sorts; ++i) {
+        memcpy(keys, unsorted, LCLIENT_LIST * CRYPTO_PUBLIC_KEY_SIZE);
+        qsort(keys, LCLIENT_LIST, CRYPTO_PUBLIC_KEY_SIZE, cmp);
+    }
+
+    return current_time_monotonic(mono_time) - start;
+}
+
+/* Sort keys like those in a full close list by their distance to our key, the
+ * same work sort_client_list does for every close list bucket.
+ */
+static void bench_sort(const DHT *dht, Mono_Time *mono_time, uint32_t sorts)
+{
+    static uint8_t unsorted[LCLIENT_LIST][CRYPTO_PUBLIC_KEY_SIZE];
+    static uint8_t keys[LCLIENT_LIST][CRYPTO_PUBLIC_KEY_SIZE];
+
+    sort_base_key = dht_get_self_public_key(dht);
+
+    for (unsigned int i = 0; i < LCLIENT_LIST; ++i) {
+        key_with_prefix(unsorted[i], sort_base_key, i / LCLIENT_NODES);
+    }
+
+    const uint64_t byte_wise = time_sorts(mono_time, keys[0], unsorted[0], sorts, cmp_byte_wise);
+    const uint64_t key_math = time_sorts(mono_time, keys[0], unsorted[0], sorts, cmp_key_math);
+
+    printf("sort %u keys by distance: byte-wise %.0f sorts/s, key_math (%s) %.0f sorts/s\n",
+           LCLIENT_LIST, byte_wise ? sorts * 1000.0 / byte_wise : 0.0, key_math_implementation(),
+           key_math ? sorts * 1000.0 / key_math : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t lookups = argc > 1 ? (uint32_t)atoi(argv[1]) : 100000;
+
+    Logger *log = logger_new();
+    Mono_Time *mono_time = mono_time_new();
+
+    IP ip;
+    ip_init(&ip, false);
+    ip.ip.v4 = get_ip4_loopback();
+    Networking_Core *net = new_networking(log, ip, TOX_PORTRANGE_FROM);
+
+    if (net == nullptr) {
+        printf("failed to create networking\n");
+        return 1;
+    }
+
+    DHT *dht = new_dht(log, mono_time, net, true);
+
+    if (dht == nullptr) {
+        printf("failed to create DHT\n");
+        return 1;
+    }
+
+    printf("close list: %u of %u slots filled\n", fill_close_list(dht), LCLIENT_LIST);
+    bench_get_close_nodes(dht, mono_time, lookups);
+    bench_sort(dht, mono_time, lookups / 100 + 1);
+
+    kill_dht(dht);
+    kill_networking(net);
+    mono_time_free(mono_time);
+    logger_kill(log);
+    return 0;
+}
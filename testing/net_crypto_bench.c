@@ -0,0 +1,186 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/* net_crypto memory benchmark
+ * Connects N peers to one hub over loopback and reports how much heap each
+ * crypto connection uses while idle, and how much more each one uses once it
+ * has unacknowledged lossless packets queued.
+ *
+ * Usage: ./net_crypto_bench [connections] [packets per connection]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define HAVE_MALLINFO2
+#endif
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/logger.h"
+#include "../toxcore/mono_time.h"
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/network.h"
+#include "misc_tools.h"
+
+#define BENCH_PORT_FROM 40000
+#define BENCH_PORT_TO 49999
+
+typedef struct Node {
+    Networking_Core *net;
+    DHT *dht;
+    Net_Crypto *net_crypto;
+    int conn_id;
+} Node;
+
+static size_t heap_in_use(void)
+{
+#ifdef HAVE_MALLINFO2
+    const struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+static bool node_init(Node *node, const Logger *log, Mono_Time *mono_time)
+{
+    IP ip;
+    ip_init(&ip, false);
+    ip.ip.v4 = get_ip4_loopback();
+
+    node->net = new_networking_ex(log, ip, BENCH_PORT_FROM, BENCH_PORT_TO, nullptr);
+    node->dht = new_dht(log, mono_time, node->net, false);
+    TCP_Proxy_Info proxy_info;
+    memset(&proxy_info, 0, sizeof(proxy_info));
+    proxy_info.proxy_type = TCP_PROXY_NONE;
+    node->net_crypto = new_net_crypto(log, mono_time, node->dht, &proxy_info);
+    node->conn_id = -1;
+    return node->net_crypto != nullptr;
+}
+
+static void node_kill(Node *node)
+{
+    kill_net_crypto(node->net_crypto);
+    kill_dht(node->dht);
+    kill_networking(node->net);
+}
+
+static void node_iterate(Node *node)
+{
+    networking_poll(node->net, nullptr);
+    do_net_crypto(node->net_crypto, nullptr);
+}
+
+static int accept_connection(void *object, New_Connection *n_c)
+{
+    return accept_crypto_connection((Net_Crypto *)object, n_c) == -1 ? -1 : 0;
+}
+
+static int connection_status(void *object, int id, uint8_t status, void *userdata)
+{
+    uint32_t *online = (uint32_t *)object;
+
+    if (status) {
+        ++*online;
+    }
+
+    return 0;
+}
+
+static void print_usage(const char *what, size_t before, size_t after, uint32_t num)
+{
+    printf("%-6s %8zu KiB total, %8zu bytes per connection\n", what, (after - before) / 1024,
+           num ? (after - before) / num : 0);
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t num_peers = argc > 1 ? (uint32_t)atoi(argv[1]) : 100;
+    const uint32_t num_packets = argc > 2 ? (uint32_t)atoi(argv[2]) : 64;
+
+#ifndef HAVE_MALLINFO2
+    printf("heap statistics are not available on this platform\n");
+#endif
+
+    Logger *log = logger_new();
+    Mono_Time *mono_time = mono_time_new();
+
+    Node hub;
+    Node *peers = (Node *)calloc(num_peers, sizeof(Node));
+
+    if (peers == nullptr || !node_init(&hub, log, mono_time)) {
+        printf("failed to create hub\n");
+        return 1;
+    }
+
+    new_connection_handler(hub.net_crypto, &accept_connection, hub.net_crypto);
+
+    for (uint32_t i = 0; i < num_peers; ++i) {
+        if (!node_init(&peers[i], log, mono_time)) {
+            printf("failed to create peer %u\n", i);
+            return 1;
+        }
+    }
+
+    const size_t heap_base = heap_in_use();
+
+    IP_Port hub_ip_port;
+    ip_init(&hub_ip_port.ip, false);
+    hub_ip_port.ip.ip.v4 = get_ip4_loopback();
+    hub_ip_port.port = net_port(hub.net);
+
+    uint32_t online = 0;
+
+    for (uint32_t i = 0; i < num_peers; ++i) {
+        Node *peer = &peers[i];
+        peer->conn_id = new_crypto_connection(peer->net_crypto, nc_get_self_public_key(hub.net_crypto),
+                                              dht_get_self_public_key(hub.dht));
+        set_direct_ip_port(peer->net_crypto, peer->conn_id, hub_ip_port, false);
+        connection_status_handler(peer->net_crypto, peer->conn_id, &connection_status, &online, 0);
+    }
+
+    const uint64_t start = current_time_monotonic(mono_time);
+
+    while (online < num_peers && current_time_monotonic(mono_time) - start < 30000) {
+        mono_time_update(mono_time);
+        node_iterate(&hub);
+
+        for (uint32_t i = 0; i < num_peers; ++i) {
+            node_iterate(&peers[i]);
+        }
+
+        c_sleep(1);
+    }
+
+    printf("%u of %u connections established in %llu ms\n", online, num_peers,
+           (unsigned long long)(current_time_monotonic(mono_time) - start));
+
+    /* Both ends of each connection live in this process. */
+    const uint32_t num_conns = online * 2;
+    const size_t heap_idle = heap_in_use();
+    print_usage("idle", heap_base, heap_idle, num_conns);
+
+    uint8_t packet[MAX_CRYPTO_DATA_SIZE] = {PACKET_ID_RANGE_LOSSLESS_CUSTOM_START};
+
+    /* The hub isn't polled, so none of these get acknowledged. */
+    for (uint32_t i = 0; i < num_peers; ++i) {
+        for (uint32_t j = 0; j < num_packets; ++j) {
+            write_cryptpacket(peers[i].net_crypto, peers[i].conn_id, packet, sizeof(packet), false);
+        }
+    }
+
+    print_usage("queued", heap_idle, heap_in_use(), online);
+
+    for (uint32_t i = 0; i < num_peers; ++i) {
+        node_kill(&peers[i]);
+    }
+
+    node_kill(&hub);
+    free(peers);
+    mono_time_free(mono_time);
+    logger_kill(log);
+    return 0;
+}
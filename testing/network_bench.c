@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/* Networking benchmark
+ * Measures how many UDP packets per second sendpacket/networking_flush can send
+ * and networking_poll can receive and dispatch on the loopback interface, with
+ * and without batching.
+ *
+ * Usage: ./network_bench [rounds]
+ */
+#ifndef _POSIX_C_SOURCE
+// For clock_gettime().
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../toxcore/logger.h"
+#include "../toxcore/network.h"
+
+/* Packets sent per round; must fit into the socket receive buffer. */
+#define PACKETS_PER_ROUND 1000
+#define PACKET_SIZE 128
+#define PACKET_ID 0x42
+
+static int handle_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len, void *userdata)
+{
+    uint64_t *received = (uint64_t *)object;
+    ++*received;
+    return 0;
+}
+
+/* A round takes well under a millisecond, so mono_time is too coarse. */
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run_bench(const Logger *log, bool batching, uint32_t rounds)
+{
+    IP ip;
+    ip_init(&ip, false);
+    ip.ip.v4 = get_ip4_loopback();
+
+    Networking_Core *server = new_networking(log, ip, TOX_PORTRANGE_FROM);
+    Networking_Core *client = new_networking(log, ip, TOX_PORTRANGE_FROM);
+
+    if (server == nullptr || client == nullptr) {
+        printf("failed to create networking\n");
+        exit(1);
+    }
+
+    uint64_t received = 0;
+    networking_registerhandler(server, PACKET_ID, &handle_packet, &received);
+    networking_set_recv_batching(server, batching);
+    networking_set_send_batching(client, batching);
+
+    IP_Port target;
+    target.ip = ip;
+    target.port = net_port(server);
+
+    uint8_t packet[PACKET_SIZE] = {PACKET_ID};
+    double send_time = 0;
+    double poll_time = 0;
+
+    for (uint32_t r = 0; r < rounds; ++r) {
+        double start = now_seconds();
+
+        for (uint32_t i = 0; i < PACKETS_PER_ROUND; ++i) {
+            sendpacket(client, target, packet, sizeof(packet));
+        }
+
+        networking_flush(client);
+        send_time += now_seconds() - start;
+
+        start = now_seconds();
+        networking_poll(server, nullptr);
+        poll_time += now_seconds() - start;
+    }
+
+    const uint64_t sent = (uint64_t)rounds * PACKETS_PER_ROUND;
+    printf("%-8s sent %llu packets in %.1f ms (%.0f packets/s)\n", batching ? "mmsg" : "single",
+           (unsigned long long)sent, send_time * 1000, send_time > 0 ? sent / send_time : 0.0);
+    printf("%-8s received %llu packets in %.1f ms (%.0f packets/s)\n", batching ? "mmsg" : "single",
+           (unsigned long long)received, poll_time * 1000, poll_time > 0 ? received / poll_time : 0.0);
+
+    kill_networking(client);
+    kill_networking(server);
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t rounds = argc > 1 ? (uint32_t)atoi(argv[1]) : 1000;
+
+    Logger *log = logger_new();
+
+    run_bench(log, false, rounds);
+    run_bench(log, true, rounds);
+
+    logger_kill(log);
+    return 0;
+}
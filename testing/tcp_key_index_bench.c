@@ -0,0 +1,202 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/* TCP relay server key index benchmark
+ * Runs the lookups a TCP relay server does on the public keys of its accepted
+ * connections against the sorted BS_List it used to keep them in and the
+ * Hash_List it keeps them in now, with as many keys as connected clients:
+ * -connect: a client is confirmed and its key added
+ * -routing: a routing request looks up a key, connected half the time
+ * -oob: an out of band packet looks up the connected recipient
+ * -churn: a client disconnects and another one takes its connection
+ *
+ * Usage: ./tcp_key_index_bench [clients]...
+ */
+#ifndef _POSIX_C_SOURCE
+// For clock_gettime().
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../toxcore/ccompat.h"
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/hash_list.h"
+#include "../toxcore/list.h"
+
+/* Number of lookups timed for routing and oob. */
+#define BENCH_OPERATIONS 1000000
+
+/* Largest number of clients replaced for churn. */
+#define BENCH_CHURN 10000
+
+#define BENCH_MAX_CLIENTS 10000000
+
+typedef struct Key_Index {
+    const char *name;
+    bool (*init)(void *list);
+    void (*free)(void *list);
+    int (*find)(const void *list, const uint8_t *key);
+    bool (*add)(void *list, const uint8_t *key, int id);
+    bool (*remove)(void *list, const uint8_t *key, int id);
+} Key_Index;
+
+static bool bs_init(void *list)
+{
+    return bs_list_init((BS_List *)list, CRYPTO_PUBLIC_KEY_SIZE, 8);
+}
+
+static void bs_free(void *list)
+{
+    bs_list_free((BS_List *)list);
+}
+
+static int bs_find(const void *list, const uint8_t *key)
+{
+    return bs_list_find((const BS_List *)list, key);
+}
+
+static bool bs_add(void *list, const uint8_t *key, int id)
+{
+    return bs_list_add((BS_List *)list, key, id);
+}
+
+static bool bs_remove(void *list, const uint8_t *key, int id)
+{
+    return bs_list_remove((BS_List *)list, key, id);
+}
+
+static bool hash_init(void *list)
+{
+    return hash_list_init((Hash_List *)list, CRYPTO_PUBLIC_KEY_SIZE, 8);
+}
+
+static void hash_free(void *list)
+{
+    hash_list_free((Hash_List *)list);
+}
+
+static int hash_find(const void *list, const uint8_t *key)
+{
+    return hash_list_find((const Hash_List *)list, key);
+}
+
+static bool hash_add(void *list, const uint8_t *key, int id)
+{
+    return hash_list_add((Hash_List *)list, key, id);
+}
+
+static bool hash_remove(void *list, const uint8_t *key, int id)
+{
+    return hash_list_remove((Hash_List *)list, key, id);
+}
+
+static const Key_Index key_indices[] = {
+    {"BS_List", bs_init, bs_free, bs_find, bs_add, bs_remove},
+    {"Hash_List", hash_init, hash_free, hash_find, hash_add, hash_remove},
+};
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_rate(const char *what, uint32_t operations, double seconds)
+{
+    printf(" %s %9.0f/s", what, operations / seconds);
+}
+
+/* keys holds 2 * num_clients keys: the connected clients' and as many that
+ * aren't connected (yet).
+ */
+static void run(const Key_Index *index, uint8_t *keys, uint32_t num_clients)
+{
+    union {
+        BS_List bs_list;
+        Hash_List hash_list;
+    } list;
+
+    if (!index->init(&list)) {
+        printf("out of memory\n");
+        exit(1);
+    }
+
+    printf("%7u %-9s", num_clients, index->name);
+
+    double start = now_seconds();
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        index->add(&list, keys + (size_t)i * CRYPTO_PUBLIC_KEY_SIZE, i);
+    }
+
+    print_rate("connect", num_clients, now_seconds() - start);
+
+    /* Checksum so the lookups can't be optimised out. */
+    int64_t found = 0;
+    start = now_seconds();
+
+    for (uint32_t i = 0; i < BENCH_OPERATIONS; ++i) {
+        found += index->find(&list, keys + (size_t)((uint64_t)i * 7919 % (2 * num_clients)) * CRYPTO_PUBLIC_KEY_SIZE);
+    }
+
+    print_rate("routing", BENCH_OPERATIONS, now_seconds() - start);
+    start = now_seconds();
+
+    for (uint32_t i = 0; i < BENCH_OPERATIONS; ++i) {
+        found += index->find(&list, keys + (size_t)((uint64_t)i * 7919 % num_clients) * CRYPTO_PUBLIC_KEY_SIZE);
+    }
+
+    print_rate("oob", BENCH_OPERATIONS, now_seconds() - start);
+    start = now_seconds();
+
+    const uint32_t num_churn = num_clients < BENCH_CHURN ? num_clients : BENCH_CHURN;
+
+    /* Client i leaves and client num_clients + i takes its connection. */
+    for (uint32_t i = 0; i < num_churn; ++i) {
+        index->remove(&list, keys + (size_t)i * CRYPTO_PUBLIC_KEY_SIZE, i);
+        index->add(&list, keys + ((size_t)num_clients + i) * CRYPTO_PUBLIC_KEY_SIZE, i);
+    }
+
+    print_rate("churn", num_churn, now_seconds() - start);
+    printf(" (%lld)\n", (long long)found);
+
+    index->free(&list);
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t default_clients[] = {10000, 100000};
+    const int num_runs = argc > 1 ? argc - 1 : 2;
+
+    for (int r = 0; r < num_runs; ++r) {
+        const uint32_t num_clients = argc > 1 ? (uint32_t)atoi(argv[r + 1]) : default_clients[r];
+
+        if (num_clients == 0 || num_clients > BENCH_MAX_CLIENTS) {
+            printf("invalid number of clients\n");
+            return 1;
+        }
+
+        uint8_t *keys = (uint8_t *)malloc((size_t)2 * num_clients * CRYPTO_PUBLIC_KEY_SIZE);
+
+        if (keys == nullptr) {
+            printf("out of memory\n");
+            return 1;
+        }
+
+        random_bytes(keys, (size_t)2 * num_clients * CRYPTO_PUBLIC_KEY_SIZE);
+
+        for (uint32_t i = 0; i < sizeof(key_indices) / sizeof(key_indices[0]); ++i) {
+            run(&key_indices[i], keys, num_clients);
+        }
+
+        free(keys);
+    }
+
+    return 0;
+}
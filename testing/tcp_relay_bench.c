@@ -0,0 +1,383 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/* TCP relay server load benchmark
+ * Connects pairs of clients through a TCP relay server on loopback and has
+ * every client send to its partner as fast as the server takes the data. The
+ * clients run on as many threads as the server, so the numbers show how the
+ * relayed throughput scales with the server's worker threads. "main" is the
+ * server running on the thread calling do_TCP_server, for which the system CPU
+ * time and context switches of that thread per MiB relayed are shown too.
+ * Every run is done with the server on epoll and, where available, io_uring.
+ * "load" is "main" with the clients sending a fixed load, which shows what the
+ * same traffic costs on each engine.
+ *
+ * Usage: ./tcp_relay_bench [seconds per run] [client pairs]
+ */
+#ifdef __linux__
+// For RUSAGE_THREAD.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "../toxcore/TCP_client.h"
+#include "../toxcore/TCP_server.h"
+#include "../toxcore/logger.h"
+#include "../toxcore/mono_time.h"
+#include "misc_tools.h"
+
+#define BENCH_PORT 34567
+#define BENCH_DATA_SIZE 1024
+
+/* Packets a client sends at most before it reads again. On io_uring the kernel
+ * takes the data off the socket as soon as it arrives, so the socket doesn't
+ * fill up to stop the sender. */
+#define BENCH_SEND_BURST 16
+
+/* Packets per second all clients together send in the fixed load runs. */
+#define BENCH_FIXED_RATE 2048
+
+/* How long to wait for all clients to connect and find their partner. */
+#define BENCH_SETUP_TIMEOUT 10000
+
+typedef struct Bench_Client {
+    TCP_Client_Connection *con;
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    int con_id; /* connection to the partner, -1 until the server answered */
+    bool online;
+    uint64_t bytes_received;
+} Bench_Client;
+
+typedef struct Client_Thread {
+    const Logger *log;
+    Mono_Time *mono_time;
+    Bench_Client *clients;
+    uint32_t num_clients;
+    pthread_mutex_t *lock;
+    const bool *stop;
+    uint32_t rate; /* packets per second of all its clients, 0 for unlimited */
+    pthread_t thread;
+} Client_Thread;
+
+static int routing_response(void *object, uint8_t connection_id, const uint8_t *public_key)
+{
+    ((Bench_Client *)object)->con_id = connection_id;
+    return 0;
+}
+
+static int routing_status(void *object, uint32_t number, uint8_t connection_id, uint8_t status)
+{
+    ((Bench_Client *)object)->online = status == 2;
+    return 0;
+}
+
+static int routing_data(void *object, uint32_t number, uint8_t connection_id, const uint8_t *data, uint16_t length,
+                        void *userdata)
+{
+    ((Bench_Client *)object)->bytes_received += length;
+    return 0;
+}
+
+static bool thread_stopped(const Client_Thread *t)
+{
+    pthread_mutex_lock(t->lock);
+    const bool stop = *t->stop;
+    pthread_mutex_unlock(t->lock);
+    return stop;
+}
+
+static void *client_thread(void *arg)
+{
+    Client_Thread *t = (Client_Thread *)arg;
+    const uint8_t data[BENCH_DATA_SIZE] = {0};
+    const uint64_t start = current_time_monotonic(t->mono_time);
+    uint64_t sent = 0;
+
+    while (!thread_stopped(t)) {
+        const uint64_t allowed = t->rate == 0 ? UINT64_MAX
+                                 : (current_time_monotonic(t->mono_time) - start) * t->rate / 1000;
+
+        for (uint32_t i = 0; i < t->num_clients; ++i) {
+            Bench_Client *client = &t->clients[i];
+
+            for (uint32_t j = 0; j < BENCH_SEND_BURST && sent < allowed; ++j) {
+                if (send_data(client->con, client->con_id, data, sizeof(data)) != 1) {
+                    break;
+                }
+
+                ++sent;
+            }
+
+            do_TCP_connection(t->log, t->mono_time, client->con, nullptr);
+        }
+
+        if (t->rate != 0) {
+            c_sleep(1);
+        }
+    }
+
+    return nullptr;
+}
+
+static void server_iterate(TCP_Server *server, Mono_Time *mono_time)
+{
+    mono_time_update(mono_time);
+    do_TCP_server(server, mono_time);
+}
+
+static bool clients_ready(const Logger *log, Mono_Time *mono_time, Bench_Client *clients, uint32_t num_clients)
+{
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        do_TCP_connection(log, mono_time, clients[i].con, nullptr);
+    }
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        if (!clients[i].online) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* System CPU time in us and context switches of the calling thread. */
+static void thread_usage(uint64_t *system_us, uint64_t *switches)
+{
+    struct rusage usage;
+#ifdef RUSAGE_THREAD
+    getrusage(RUSAGE_THREAD, &usage);
+#else
+    getrusage(RUSAGE_SELF, &usage);
+#endif
+    *system_us = (uint64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+    *switches = (uint64_t)usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+/* rate is the packets per second the clients send together, 0 for as fast as
+ * they can.
+ *
+ * return false if the server can't run with io_uring.
+ */
+static bool run(const Logger *log, Mono_Time *mono_time, bool io_uring, uint32_t num_threads, uint32_t num_pairs,
+                uint32_t rate, uint32_t seconds)
+{
+    uint8_t server_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t server_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(server_public_key, server_secret_key);
+
+    const uint16_t port = BENCH_PORT + num_threads;
+    TCP_Server *server = new_TCP_server(log, false, 1, &port, server_secret_key, nullptr);
+
+    if (server == nullptr) {
+        printf("failed to create the server\n");
+        exit(1);
+    }
+
+    if (io_uring && !tcp_server_use_io_uring(server)) {
+        kill_TCP_server(server);
+        return false;
+    }
+
+    if (num_threads != 0 && tcp_server_start_threads(server, mono_time, num_threads) != 0) {
+        printf("failed to start the server threads\n");
+        exit(1);
+    }
+
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, false);
+    ip_port.ip.ip.v4 = get_ip4_loopback();
+    ip_port.port = net_htons(port);
+
+    const uint32_t num_clients = num_pairs * 2;
+    Bench_Client *clients = (Bench_Client *)calloc(num_clients, sizeof(Bench_Client));
+
+    if (clients == nullptr) {
+        printf("out of memory\n");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        Bench_Client *client = &clients[i];
+        crypto_new_keypair(client->public_key, client->secret_key);
+        client->con_id = -1;
+        client->con = new_TCP_connection(mono_time, ip_port, server_public_key, client->public_key, client->secret_key,
+                                          nullptr);
+
+        if (client->con == nullptr) {
+            printf("failed to create a client\n");
+            exit(1);
+        }
+
+        routing_response_handler(client->con, &routing_response, client);
+        routing_status_handler(client->con, &routing_status, client);
+        routing_data_handler(client->con, &routing_data, client);
+    }
+
+    /* Client i talks to client i + num_pairs. The server hands the
+     * connections it accepts to its threads in turn, so most pairs span two
+     * threads. */
+    bool requested = false;
+    const uint64_t setup_start = current_time_monotonic(mono_time);
+
+    while (!clients_ready(log, mono_time, clients, num_clients)) {
+        if (current_time_monotonic(mono_time) - setup_start > BENCH_SETUP_TIMEOUT) {
+            printf("clients failed to connect\n");
+            exit(1);
+        }
+
+        if (!requested) {
+            requested = true;
+
+            for (uint32_t i = 0; i < num_clients; ++i) {
+                if (tcp_con_status(clients[i].con) != TCP_CLIENT_CONFIRMED) {
+                    requested = false;
+                }
+            }
+
+            for (uint32_t i = 0; requested && i < num_clients; ++i) {
+                send_routing_request(clients[i].con, clients[(i + num_pairs) % num_clients].public_key);
+            }
+        }
+
+        server_iterate(server, mono_time);
+        c_sleep(1);
+    }
+
+    const uint32_t num_client_threads = num_threads ? num_threads : 1;
+    Client_Thread threads[TCP_SERVER_MAX_THREADS];
+    pthread_mutex_t lock;
+    bool stop = false;
+    pthread_mutex_init(&lock, nullptr);
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        clients[i].bytes_received = 0;
+    }
+
+    for (uint32_t i = 0; i < num_client_threads; ++i) {
+        Client_Thread *t = &threads[i];
+        t->log = log;
+        t->mono_time = mono_time;
+        t->clients = &clients[num_clients * i / num_client_threads];
+        t->num_clients = num_clients * (i + 1) / num_client_threads - num_clients * i / num_client_threads;
+        t->lock = &lock;
+        t->stop = &stop;
+        t->rate = rate / num_client_threads;
+
+        if (pthread_create(&t->thread, nullptr, &client_thread, t) != 0) {
+            printf("failed to create a client thread\n");
+            exit(1);
+        }
+    }
+
+    uint64_t start_system_us;
+    uint64_t start_switches;
+    thread_usage(&start_system_us, &start_switches);
+    const uint64_t start = current_time_monotonic(mono_time);
+
+    while (current_time_monotonic(mono_time) - start < seconds * 1000) {
+        server_iterate(server, mono_time);
+
+        if (num_threads != 0) {
+            c_sleep(1);
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    stop = true;
+    pthread_mutex_unlock(&lock);
+
+    for (uint32_t i = 0; i < num_client_threads; ++i) {
+        pthread_join(threads[i].thread, nullptr);
+    }
+
+    const uint64_t elapsed = current_time_monotonic(mono_time) - start;
+    uint64_t system_us;
+    uint64_t switches;
+    thread_usage(&system_us, &switches);
+    system_us -= start_system_us;
+    switches -= start_switches;
+    uint64_t bytes = 0;
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        bytes += clients[i].bytes_received;
+    }
+
+    printf("%-8s ", io_uring ? "io_uring" : "epoll");
+
+    if (rate != 0) {
+        printf("load ");
+    } else if (num_threads == 0) {
+        printf("main ");
+    } else {
+        printf("%4u ", num_threads);
+    }
+
+    const double mib = bytes / (1024.0 * 1024.0);
+    printf("%9.1f MiB/s %9.0f packets/s relayed", mib * 1000.0 / elapsed, bytes * 1000.0 / elapsed / BENCH_DATA_SIZE);
+
+    if (num_threads == 0 && mib > 0) {
+        printf(", server: %7.0f us system CPU %7.1f context switches per MiB", system_us / mib, switches / mib);
+    }
+
+    printf("\n");
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        kill_TCP_connection(clients[i].con);
+    }
+
+    free(clients);
+    pthread_mutex_destroy(&lock);
+    kill_TCP_server(server);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t seconds = argc > 1 ? (uint32_t)atoi(argv[1]) : 5;
+    const uint32_t num_pairs = argc > 2 ? (uint32_t)atoi(argv[2]) : 32;
+
+    if (num_pairs == 0 || num_pairs * 2 > MAX_INCOMING_CONNECTIONS) {
+        printf("client pairs must be between 1 and %d\n", MAX_INCOMING_CONNECTIONS / 2);
+        return 1;
+    }
+
+    Logger *log = logger_new();
+    Mono_Time *mono_time = mono_time_new();
+
+    printf("engine   threads  throughput\n");
+
+    bool have_io_uring = true;
+
+    for (int io_uring = 0; io_uring <= 1; ++io_uring) {
+        if (!run(log, mono_time, io_uring, 0, num_pairs, 0, seconds)) {
+            printf("io_uring  not available\n");
+            have_io_uring = false;
+            break;
+        }
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+        for (uint32_t num_threads = 1; num_threads <= 8; num_threads *= 2) {
+            run(log, mono_time, io_uring, num_threads, num_pairs, 0, seconds);
+        }
+
+#endif
+    }
+
+    for (int io_uring = 0; io_uring <= have_io_uring; ++io_uring) {
+        run(log, mono_time, io_uring, 0, num_pairs, BENCH_FIXED_RATE, seconds);
+    }
+
+    mono_time_free(mono_time);
+    logger_kill(log);
+    return 0;
+}
@@ -13,11 +13,14 @@
 #include "DHT.h"
 
 #include "LAN_discovery.h"
+#include "hash_list.h"
+#include "key_math.h"
 #include "logger.h"
 #include "mono_time.h"
 #include "network.h"
 #include "ping.h"
 #include "state.h"
+#include "timer_wheel.h"
 #include "util.h"
 
 #include <assert.h>
@@ -46,6 +49,11 @@
 /* Number of get node requests to send to quickly find close nodes. */
 #define MAX_BOOTSTRAP_TIMES 5
 
+/* Ids of the maintenance timers: one per close list bucket, one for the close
+ * list as a whole, and one per friend. */
+#define DHT_TIMER_CLOSE LCLIENT_LENGTH
+#define DHT_TIMER_FRIEND(friend_num) (LCLIENT_LENGTH + 1 + (friend_num))
+
 typedef struct DHT_Friend_Callback {
     dht_ip_cb *ip_callback;
     void *data;
@@ -93,13 +101,15 @@ struct DHT {
 
     DHT_Friend    *friends_list;
     uint16_t       num_friends;
+    /* Maps friend public keys to their index in friends_list. */
+    Hash_List      friends_index;
 
     Node_format   *loaded_nodes_list;
     uint32_t       loaded_num_nodes;
     unsigned int   loaded_nodes_index;
 
-    Shared_Keys shared_keys_recv;
-    Shared_Keys shared_keys_sent;
+    Shared_Keys *shared_keys_recv;
+    Shared_Keys *shared_keys_sent;
 
     struct Ping   *ping;
     Ping_Array    *dht_ping_array;
@@ -110,6 +120,11 @@ struct DHT {
 
     Node_format to_bootstrap[MAX_CLOSE_TO_BOOTSTRAP_NODES];
     unsigned int num_to_bootstrap;
+
+    /* Maintenance timers in seconds, on the clock of mono_time_get. Each
+     * fires when the part of the DHT it's for next has something to do, so
+     * do_dht doesn't have to look at every node every second. */
+    Timer_Wheel timers;
 };
 
 const uint8_t *dht_friend_public_key(const DHT_Friend *dht_friend)
@@ -178,6 +193,41 @@ static bool assoc_timeout(const Mono_Time *mono_time, const IPPTsPng *assoc)
     return mono_time_is_timeout(mono_time, assoc->timestamp, BAD_NODE_TIMEOUT);
 }
 
+/* Add a round trip time of rtt milliseconds to the smoothed one of assoc. Like
+ * TCP's, each new time weighs 1/8.
+ */
+static void assoc_add_rtt(IPPTsPng *assoc, uint32_t rtt)
+{
+    // 0 means not measured, but a node on our host can answer within 1 ms.
+    rtt = max_u32(rtt, 1);
+
+    if (assoc->rtt == 0) {
+        assoc->rtt = rtt;
+    } else {
+        assoc->rtt = (uint32_t)(((uint64_t)assoc->rtt * 7 + rtt) / 8);
+    }
+}
+
+/* Return the round trip time to order addresses by, the fastest first and the
+ * ones that were never measured last.
+ */
+static uint32_t assoc_rtt_rank(const IPPTsPng *assoc)
+{
+    return assoc->rtt == 0 ? UINT32_MAX : assoc->rtt;
+}
+
+/* Return the faster of two good addresses of a node, or nullptr if the round
+ * trip time of either wasn't measured yet.
+ */
+static const IPPTsPng *faster_assoc(const IPPTsPng *assoc4, const IPPTsPng *assoc6)
+{
+    if (assoc4->rtt == 0 || assoc6->rtt == 0) {
+        return nullptr;
+    }
+
+    return assoc4->rtt <= assoc6->rtt ? assoc4 : assoc6;
+}
+
 /* Compares pk1 and pk2 with pk.
  *
  *  return 0 if both are same distance.
@@ -186,46 +236,105 @@ static bool assoc_timeout(const Mono_Time *mono_time, const IPPTsPng *assoc)
  */
 int id_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
 {
-    for (size_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
-        const uint8_t distance1 = pk[i] ^ pk1[i];
-        const uint8_t distance2 = pk[i] ^ pk2[i];
+    return key_closest(pk, pk1, pk2);
+}
 
-        if (distance1 < distance2) {
-            return 1;
-        }
+/* Return index of first unequal bit number.
+ */
+static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
+{
+    return key_common_prefix(pk1, pk2);
+}
 
-        if (distance1 > distance2) {
-            return 2;
-        }
+/* Return the index of the close list bucket that public_key belongs in.
+ *
+ * Bucket i holds the nodes whose keys share exactly i leading bits with our
+ * own key, except for the last one which holds everything sharing at least
+ * LCLIENT_LENGTH - 1 bits.
+ */
+static unsigned int close_bucket_index(const uint8_t *self_public_key, const uint8_t *public_key)
+{
+    const unsigned int index = bit_by_bit_cmp(public_key, self_public_key);
+
+    if (index >= LCLIENT_LENGTH) {
+        return LCLIENT_LENGTH - 1;
     }
 
-    return 0;
+    return index;
 }
 
-/* Return index of first unequal bit number.
- */
-static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
+typedef struct Shared_Key {
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    /* Value of the cache's use counter when this key was last requested, 0 if unused. */
+    uint64_t last_used;
+} Shared_Key;
+
+struct Shared_Keys {
+    Shared_Key *keys;
+    uint32_t num_slots;
+    /* Random per-cache hash key, so remote peers can't pick keys that collide. */
+    uint64_t hash_key;
+    uint64_t use_counter;
+    Shared_Keys_Stats stats;
+};
+
+/* Largest supported number of slots; keeps the allocation size within uint32_t. */
+#define MAX_SHARED_KEYS_SLOTS (1 << 20)
+
+Shared_Keys *shared_keys_new(uint32_t capacity)
 {
-    unsigned int i;
-    unsigned int j = 0;
+    Shared_Keys *shared_keys = (Shared_Keys *)calloc(1, sizeof(Shared_Keys));
 
-    for (i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
-        if (pk1[i] == pk2[i]) {
-            continue;
-        }
+    if (shared_keys == nullptr) {
+        return nullptr;
+    }
 
-        for (j = 0; j < 8; ++j) {
-            const uint8_t mask = 1 << (7 - j);
+    uint32_t num_slots = 1;
 
-            if ((pk1[i] & mask) != (pk2[i] & mask)) {
-                break;
-            }
-        }
+    while (num_slots < MAX_SHARED_KEYS_SLOTS && num_slots * MAX_KEYS_PER_SLOT < capacity) {
+        num_slots *= 2;
+    }
+
+    shared_keys->keys = (Shared_Key *)calloc(num_slots * MAX_KEYS_PER_SLOT, sizeof(Shared_Key));
+
+    if (shared_keys->keys == nullptr) {
+        free(shared_keys);
+        return nullptr;
+    }
+
+    shared_keys->num_slots = num_slots;
+    shared_keys->hash_key = random_u64();
+    return shared_keys;
+}
 
-        break;
+void shared_keys_free(Shared_Keys *shared_keys)
+{
+    if (shared_keys == nullptr) {
+        return;
     }
 
-    return i * 8 + j;
+    crypto_memzero(shared_keys->keys, shared_keys->num_slots * MAX_KEYS_PER_SLOT * sizeof(Shared_Key));
+    free(shared_keys->keys);
+    free(shared_keys);
+}
+
+uint32_t shared_keys_capacity(const Shared_Keys *shared_keys)
+{
+    return shared_keys->num_slots * MAX_KEYS_PER_SLOT;
+}
+
+void shared_keys_get_stats(const Shared_Keys *shared_keys, Shared_Keys_Stats *stats)
+{
+    *stats = shared_keys->stats;
+}
+
+/* Return the first entry of the slot public_key hashes to. */
+static Shared_Key *shared_keys_slot(const Shared_Keys *shared_keys, const uint8_t *public_key)
+{
+    const uint64_t hash = hash_bytes(shared_keys->hash_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    const uint32_t slot = (uint32_t)(hash >> 32) & (shared_keys->num_slots - 1);
+    return &shared_keys->keys[slot * MAX_KEYS_PER_SLOT];
 }
 
 /* Shared key generations are costly, it is therefore smart to store commonly used
@@ -234,49 +343,40 @@ static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
  * If shared key is already in shared_keys, copy it to shared_key.
  * else generate it into shared_key and copy it to shared_keys
  */
-void get_shared_key(const Mono_Time *mono_time, Shared_Keys *shared_keys, uint8_t *shared_key,
-                    const uint8_t *secret_key, const uint8_t *public_key)
+void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key,
+                    const uint8_t *public_key)
 {
-    uint32_t num = -1;
-    uint32_t curr = 0;
+    Shared_Key *const slot = shared_keys_slot(shared_keys, public_key);
+    Shared_Key *victim = &slot[0];
+
+    ++shared_keys->use_counter;
 
     for (uint32_t i = 0; i < MAX_KEYS_PER_SLOT; ++i) {
-        const int index = public_key[30] * MAX_KEYS_PER_SLOT + i;
-        Shared_Key *const key = &shared_keys->keys[index];
-
-        if (key->stored) {
-            if (id_equal(public_key, key->public_key)) {
-                memcpy(shared_key, key->shared_key, CRYPTO_SHARED_KEY_SIZE);
-                ++key->times_requested;
-                key->time_last_requested = mono_time_get(mono_time);
-                return;
-            }
+        Shared_Key *const key = &slot[i];
 
-            if (num != 0) {
-                if (mono_time_is_timeout(mono_time, key->time_last_requested, KEYS_TIMEOUT)) {
-                    num = 0;
-                    curr = index;
-                } else if (num > key->times_requested) {
-                    num = key->times_requested;
-                    curr = index;
-                }
-            }
-        } else if (num != 0) {
-            num = 0;
-            curr = index;
+        if (key->last_used != 0 && id_equal(public_key, key->public_key)) {
+            memcpy(shared_key, key->shared_key, CRYPTO_SHARED_KEY_SIZE);
+            key->last_used = shared_keys->use_counter;
+            ++shared_keys->stats.hits;
+            return;
+        }
+
+        if (key->last_used < victim->last_used) {
+            victim = key;
         }
     }
 
-    encrypt_precompute(public_key, secret_key, shared_key);
+    ++shared_keys->stats.misses;
 
-    if (num != UINT32_MAX) {
-        Shared_Key *const key = &shared_keys->keys[curr];
-        key->stored = true;
-        key->times_requested = 1;
-        memcpy(key->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
-        memcpy(key->shared_key, shared_key, CRYPTO_SHARED_KEY_SIZE);
-        key->time_last_requested = mono_time_get(mono_time);
+    if (victim->last_used != 0) {
+        ++shared_keys->stats.evictions;
     }
+
+    encrypt_precompute(public_key, secret_key, shared_key);
+
+    memcpy(victim->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(victim->shared_key, shared_key, CRYPTO_SHARED_KEY_SIZE);
+    victim->last_used = shared_keys->use_counter;
 }
 
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
@@ -284,7 +384,7 @@ void get_shared_key(const Mono_Time *mono_time, Shared_Keys *shared_keys, uint8_
  */
 void dht_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *public_key)
 {
-    get_shared_key(dht->mono_time, &dht->shared_keys_recv, shared_key, dht->self_secret_key, public_key);
+    get_shared_key(dht->shared_keys_recv, shared_key, dht->self_secret_key, public_key);
 }
 
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
@@ -292,7 +392,36 @@ void dht_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *publi
  */
 void dht_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *public_key)
 {
-    get_shared_key(dht->mono_time, &dht->shared_keys_sent, shared_key, dht->self_secret_key, public_key);
+    get_shared_key(dht->shared_keys_sent, shared_key, dht->self_secret_key, public_key);
+}
+
+bool dht_set_shared_keys_capacity(DHT *dht, uint32_t capacity)
+{
+    Shared_Keys *const recv = shared_keys_new(capacity);
+    Shared_Keys *const sent = shared_keys_new(capacity);
+
+    if (recv == nullptr || sent == nullptr) {
+        shared_keys_free(recv);
+        shared_keys_free(sent);
+        return false;
+    }
+
+    shared_keys_free(dht->shared_keys_recv);
+    shared_keys_free(dht->shared_keys_sent);
+    dht->shared_keys_recv = recv;
+    dht->shared_keys_sent = sent;
+    return true;
+}
+
+void dht_get_shared_keys_stats(const DHT *dht, Shared_Keys_Stats *recv, Shared_Keys_Stats *sent)
+{
+    if (recv != nullptr) {
+        shared_keys_get_stats(dht->shared_keys_recv, recv);
+    }
+
+    if (sent != nullptr) {
+        shared_keys_get_stats(dht->shared_keys_sent, sent);
+    }
 }
 
 #define CRYPTO_SIZE 1 + CRYPTO_PUBLIC_KEY_SIZE * 2 + CRYPTO_NONCE_SIZE
@@ -636,9 +765,10 @@ static uint32_t index_of_client_pk(const Client_data *array, uint32_t size, cons
     INDEX_OF_PK(array, size, pk);
 }
 
-static uint32_t index_of_friend_pk(const DHT_Friend *array, uint32_t size, const uint8_t *pk)
+static uint32_t index_of_friend_pk(const DHT *dht, const uint8_t *pk)
 {
-    INDEX_OF_PK(array, size, pk);
+    const int index = hash_list_find(&dht->friends_index, pk);
+    return index == -1 ? UINT32_MAX : (uint32_t)index;
 }
 
 static uint32_t index_of_node_pk(const Node_format *array, uint32_t size, const uint8_t *pk)
@@ -694,19 +824,70 @@ static void update_client(const Logger *log, const Mono_Time *mono_time, int ind
         return;
     }
 
+    if (!ipport_equal(&assoc->ip_port, &ip_port)) {
+        // The round trip time was measured on the old address.
+        assoc->rtt = 0;
+    }
+
     assoc->ip_port = ip_port;
     assoc->timestamp = mono_time_get(mono_time);
 }
 
+/* The client lists of friends are kept ordered by the distance of the nodes to
+ * the friend, the farthest first, so the node to replace with a new one is
+ * found without sorting the list.
+ *
+ * Move the node at index, whose public key changed, to its place in the
+ * ordered list. Only the nodes between its old and new place are moved.
+ *
+ * return the new index of the node.
+ */
+static uint32_t client_list_reorder(Client_data *list, uint32_t length, uint32_t index, const uint8_t *comp_public_key)
+{
+    // Binary search for the number of other nodes farther from
+    // comp_public_key, which is the new place of the node.
+    uint32_t low = 0;
+    uint32_t high = length - 1;
+
+    while (low < high) {
+        const uint32_t mid = low + (high - low) / 2;
+        const uint32_t other = mid < index ? mid : mid + 1;
+
+        if (id_closest(comp_public_key, list[index].public_key, list[other].public_key) == 1) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (low == index) {
+        return index;
+    }
+
+    const Client_data client = list[index];
+
+    if (low < index) {
+        memmove(&list[low + 1], &list[low], (index - low) * sizeof(Client_data));
+    } else {
+        memmove(&list[index], &list[index + 1], (low - index) * sizeof(Client_data));
+    }
+
+    list[low] = client;
+    return low;
+}
+
 /* Check if client with public_key is already in list of length length.
  * If it is then set its corresponding timestamp to current time.
  * If the id is already in the list with a different ip_port, update it.
+ * If the list is ordered by distance to comp_public_key, a client whose
+ * public_key gets replaced is moved to its new place. Pass NULL otherwise.
  * TODO(irungentoo): Maybe optimize this.
  *
- *  return True(1) or False(0)
+ *  return index of the client in the list.
+ *  return UINT32_MAX if it's not in the list.
  */
-static int client_or_ip_port_in_list(const Logger *log, const Mono_Time *mono_time, Client_data *list, uint16_t length,
-                                     const uint8_t *public_key, IP_Port ip_port)
+static uint32_t client_or_ip_port_in_list(const Logger *log, const Mono_Time *mono_time, Client_data *list, uint16_t length,
+                                     const uint8_t *public_key, IP_Port ip_port, const uint8_t *comp_public_key)
 {
     const uint64_t temp_time = mono_time_get(mono_time);
     uint32_t index = index_of_client_pk(list, length, public_key);
@@ -714,7 +895,7 @@ static int client_or_ip_port_in_list(const Logger *log, const Mono_Time *mono_ti
     /* if public_key is in list, find it and maybe overwrite ip_port */
     if (index != UINT32_MAX) {
         update_client(log, mono_time, index, &list[index], ip_port);
-        return 1;
+        return index;
     }
 
     /* public_key not in list yet: see if we can find an identical ip_port, in
@@ -725,7 +906,7 @@ static int client_or_ip_port_in_list(const Logger *log, const Mono_Time *mono_ti
     index = index_of_client_ip_port(list, length, &ip_port);
 
     if (index == UINT32_MAX) {
-        return 0;
+        return UINT32_MAX;
     }
 
     IPPTsPng *assoc;
@@ -747,7 +928,12 @@ static int client_or_ip_port_in_list(const Logger *log, const Mono_Time *mono_ti
 
     /* kill the other address, if it was set */
     memset(assoc, 0, sizeof(IPPTsPng));
-    return 1;
+
+    if (comp_public_key != nullptr) {
+        return client_list_reorder(list, length, index, comp_public_key);
+    }
+
+    return index;
 }
 
 bool add_to_list(Node_format *nodes_list, uint32_t length, const uint8_t *pk, IP_Port ip_port,
@@ -812,6 +998,9 @@ static void get_close_nodes_inner(const Mono_Time *mono_time, const uint8_t *pub
             ipptp = &client->assoc4;
         } else if (net_family_is_ipv6(sa_family)) {
             ipptp = &client->assoc6;
+        } else if (client->assoc4.rtt != 0 && client->assoc6.rtt != 0
+                   && !assoc_timeout(mono_time, &client->assoc4) && !assoc_timeout(mono_time, &client->assoc6)) {
+            ipptp = faster_assoc(&client->assoc4, &client->assoc6);
         } else if (client->assoc4.timestamp >= client->assoc6.timestamp) {
             ipptp = &client->assoc4;
         } else {
@@ -834,8 +1023,17 @@ static void get_close_nodes_inner(const Mono_Time *mono_time, const uint8_t *pub
         }
 
         if (num_nodes < MAX_SENT_NODES) {
-            memcpy(nodes_list[num_nodes].public_key, client->public_key, CRYPTO_PUBLIC_KEY_SIZE);
-            nodes_list[num_nodes].ip_port = ipptp->ip_port;
+            /* Keep the list sorted by distance so add_to_list() below always
+             * evicts the farthest node. */
+            uint32_t j = num_nodes;
+
+            while (j > 0 && id_closest(public_key, nodes_list[j - 1].public_key, client->public_key) == 2) {
+                nodes_list[j] = nodes_list[j - 1];
+                --j;
+            }
+
+            memcpy(nodes_list[j].public_key, client->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            nodes_list[j].ip_port = ipptp->ip_port;
             ++num_nodes;
         } else {
             add_to_list(nodes_list, MAX_SENT_NODES, client->public_key, ipptp->ip_port, public_key);
@@ -845,6 +1043,39 @@ static void get_close_nodes_inner(const Mono_Time *mono_time, const uint8_t *pub
     *num_nodes_ptr = num_nodes;
 }
 
+/* Add the nodes from the close list that are closest to public_key to nodes_list.
+ *
+ * Only the buckets that can still contain a closer node are visited. If
+ * public_key falls into bucket t, the nodes in bucket t share at least t + 1
+ * leading bits with it, the nodes in all buckets after t share exactly t bits,
+ * and the nodes in bucket i < t share exactly i bits. Visiting the buckets in
+ * that order means each group is strictly farther away than the previous one,
+ * so we can stop as soon as nodes_list is full.
+ */
+static void get_close_nodes_close_list(const DHT *dht, const uint8_t *public_key, Node_format *nodes_list,
+                                       Family sa_family, uint32_t *num_nodes_ptr, bool is_LAN)
+{
+    const unsigned int target = close_bucket_index(dht->self_public_key, public_key);
+
+    get_close_nodes_inner(dht->mono_time, public_key, nodes_list, sa_family,
+                          dht->close_clientlist + target * LCLIENT_NODES, LCLIENT_NODES,
+                          num_nodes_ptr, is_LAN, 0);
+
+    if (*num_nodes_ptr >= MAX_SENT_NODES) {
+        return;
+    }
+
+    get_close_nodes_inner(dht->mono_time, public_key, nodes_list, sa_family,
+                          dht->close_clientlist + (target + 1) * LCLIENT_NODES,
+                          (LCLIENT_LENGTH - target - 1) * LCLIENT_NODES, num_nodes_ptr, is_LAN, 0);
+
+    for (unsigned int i = target; i > 0 && *num_nodes_ptr < MAX_SENT_NODES; --i) {
+        get_close_nodes_inner(dht->mono_time, public_key, nodes_list, sa_family,
+                              dht->close_clientlist + (i - 1) * LCLIENT_NODES, LCLIENT_NODES,
+                              num_nodes_ptr, is_LAN, 0);
+    }
+}
+
 /* Find MAX_SENT_NODES nodes closest to the public_key for the send nodes request:
  * put them in the nodes_list and return how many were found.
  *
@@ -857,8 +1088,7 @@ static int get_somewhat_close_nodes(const DHT *dht, const uint8_t *public_key, N
                                     Family sa_family, bool is_LAN, uint8_t want_good)
 {
     uint32_t num_nodes = 0;
-    get_close_nodes_inner(dht->mono_time, public_key, nodes_list, sa_family,
-                          dht->close_clientlist, LCLIENT_LIST, &num_nodes, is_LAN, 0);
+    get_close_nodes_close_list(dht, public_key, nodes_list, sa_family, &num_nodes, is_LAN);
 
     /* TODO(irungentoo): uncomment this when hardening is added to close friend clients */
 #if 0
@@ -887,97 +1117,57 @@ int get_close_nodes(const DHT *dht, const uint8_t *public_key, Node_format *node
     return get_somewhat_close_nodes(dht, public_key, nodes_list, sa_family, is_LAN, want_good);
 }
 
-typedef struct DHT_Cmp_data {
-    const Mono_Time *mono_time;
-    const uint8_t *base_public_key;
-    Client_data entry;
-} DHT_Cmp_data;
-
 static bool incorrect_hardening(const IPPTsPng *assoc)
 {
     return hardening_correct(&assoc->hardening) != HARDENING_ALL_OK;
 }
 
-static int cmp_dht_entry(const void *a, const void *b)
+static bool client_timed_out(const Client_data *client, uint64_t now)
 {
-    DHT_Cmp_data cmp1;
-    DHT_Cmp_data cmp2;
-    memcpy(&cmp1, a, sizeof(DHT_Cmp_data));
-    memcpy(&cmp2, b, sizeof(DHT_Cmp_data));
-    const Client_data entry1 = cmp1.entry;
-    const Client_data entry2 = cmp2.entry;
-    const uint8_t *cmp_public_key = cmp1.base_public_key;
-
-    bool t1 = assoc_timeout(cmp1.mono_time, &entry1.assoc4) && assoc_timeout(cmp1.mono_time, &entry1.assoc6);
-    bool t2 = assoc_timeout(cmp2.mono_time, &entry2.assoc4) && assoc_timeout(cmp2.mono_time, &entry2.assoc6);
-
-    if (t1 && t2) {
-        return 0;
-    }
-
-    if (t1) {
-        return -1;
-    }
-
-    if (t2) {
-        return 1;
-    }
-
-    t1 = incorrect_hardening(&entry1.assoc4) && incorrect_hardening(&entry1.assoc6);
-    t2 = incorrect_hardening(&entry2.assoc4) && incorrect_hardening(&entry2.assoc6);
-
-    if (t1 && !t2) {
-        return -1;
-    }
-
-    if (!t1 && t2) {
-        return 1;
-    }
-
-    const int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
+    return client->assoc4.timestamp + BAD_NODE_TIMEOUT <= now && client->assoc6.timestamp + BAD_NODE_TIMEOUT <= now;
+}
 
-    if (close == 1) {
-        return 1;
-    }
+/* Return the index of the first node in the list that timed out, or UINT32_MAX
+ * if none did.
+ */
+static uint32_t index_of_timed_out_client(const Client_data *list, uint32_t length, const Mono_Time *mono_time)
+{
+    // Read the clock once rather than for every node.
+    const uint64_t now = mono_time_get(mono_time);
 
-    if (close == 2) {
-        return -1;
+    for (uint32_t i = 0; i < length; ++i) {
+        if (client_timed_out(&list[i], now)) {
+            return i;
+        }
     }
 
-    return 0;
+    return UINT32_MAX;
 }
 
-/* Is it ok to store node with public_key in client.
- *
- * return 0 if node can't be stored.
- * return 1 if it can.
+/* Return true if a node with public_key can be stored in the ordered list,
+ * because it is closer to comp_public_key than the farthest node or a node in
+ * the list timed out.
  */
-static unsigned int store_node_ok(const Client_data *client, const Mono_Time *mono_time, const uint8_t *public_key,
-                                  const uint8_t *comp_public_key)
+static bool client_list_store_ok(const Client_data *list, uint32_t length, const Mono_Time *mono_time,
+                                 const uint8_t *public_key, const uint8_t *comp_public_key)
 {
-    return (assoc_timeout(mono_time, &client->assoc4)
-            && assoc_timeout(mono_time, &client->assoc6))
-           || id_closest(comp_public_key, client->public_key, public_key) == 2;
+    return id_closest(comp_public_key, list[0].public_key, public_key) == 2
+           || index_of_timed_out_client(list, length, mono_time) != UINT32_MAX;
 }
 
-static void sort_client_list(Client_data *list, const Mono_Time *mono_time, unsigned int length,
-                             const uint8_t *comp_public_key)
+/* Return the index of the node in the ordered list, none of which timed out,
+ * to replace with a closer one: the farthest with incorrect hardening, or else
+ * the farthest.
+ */
+static uint32_t client_to_replace(const Client_data *list, uint32_t length)
 {
-    // Pass comp_public_key to qsort with each Client_data entry, so the
-    // comparison function can use it as the base of comparison.
-    VLA(DHT_Cmp_data, cmp_list, length);
-
     for (uint32_t i = 0; i < length; ++i) {
-        cmp_list[i].mono_time = mono_time;
-        cmp_list[i].base_public_key = comp_public_key;
-        cmp_list[i].entry = list[i];
+        if (incorrect_hardening(&list[i].assoc4) && incorrect_hardening(&list[i].assoc6)) {
+            return i;
+        }
     }
 
-    qsort(cmp_list, length, sizeof(DHT_Cmp_data), cmp_dht_entry);
-
-    for (uint32_t i = 0; i < length; ++i) {
-        list[i] = cmp_list[i].entry;
-    }
+    return 0;
 }
 
 static void update_client_with_reset(const Mono_Time *mono_time, Client_data *client, const IP_Port *ip_port)
@@ -999,11 +1189,64 @@ static void update_client_with_reset(const Mono_Time *mono_time, Client_data *cl
     ip_reset(&ipptp_write->ret_ip_port.ip);
     ipptp_write->ret_ip_port.port = 0;
     ipptp_write->ret_timestamp = 0;
+    ipptp_write->rtt = 0;
 
     /* zero out other address */
     memset(ipptp_clear, 0, sizeof(*ipptp_clear));
 }
 
+/* Return the time at which a random good node of a list should be asked for
+ * nodes next: right away until that was done MAX_BOOTSTRAP_TIMES times, then
+ * every GET_NODE_INTERVAL seconds.
+ */
+static uint64_t getnodes_time(uint64_t lastgetnode, uint32_t bootstrap_times)
+{
+    return bootstrap_times < MAX_BOOTSTRAP_TIMES ? 0 : lastgetnode + GET_NODE_INTERVAL;
+}
+
+/* Make the maintenance timer id fire at deadline, unless it fires earlier
+ * already. Deadlines that passed fire on the next call to do_dht.
+ */
+static void dht_schedule(DHT *dht, uint32_t id, uint64_t deadline)
+{
+    if (timer_wheel_deadline(&dht->timers, id) > deadline) {
+        timer_wheel_set(&dht->timers, id, deadline);
+    }
+}
+
+/* Return the time at which the node has to be pinged next, if it doesn't time
+ * out before then.
+ */
+static uint64_t client_ping_time(const Client_data *client)
+{
+    return min_u64(client->assoc4.last_pinged, client->assoc6.last_pinged) + PING_INTERVAL;
+}
+
+/* Schedule the maintenance of the close list for the node at index, which was
+ * added or heard from.
+ */
+static void dht_schedule_close_client(DHT *dht, uint32_t index)
+{
+    dht_schedule(dht, index / LCLIENT_NODES, client_ping_time(&dht->close_clientlist[index]));
+    dht_schedule(dht, DHT_TIMER_CLOSE, getnodes_time(dht->close_lastgetnodes, dht->close_bootstrap_times));
+}
+
+/* Schedule the maintenance of a friend for the node with public_key in its
+ * client list, which was added or heard from.
+ */
+static void dht_schedule_friend_client(DHT *dht, uint32_t friend_num, const uint8_t *public_key)
+{
+    const DHT_Friend *const dht_friend = &dht->friends_list[friend_num];
+    const uint32_t index = index_of_client_pk(dht_friend->client_list, MAX_FRIEND_CLIENTS, public_key);
+    uint64_t deadline = getnodes_time(dht_friend->lastgetnode, dht_friend->bootstrap_times);
+
+    if (index != UINT32_MAX) {
+        deadline = min_u64(deadline, client_ping_time(&dht_friend->client_list[index]));
+    }
+
+    dht_schedule(dht, DHT_TIMER_FRIEND(friend_num), deadline);
+}
+
 /* Replace a first bad (or empty) node with this one
  *  or replace a possibly bad node (tests failed or not done yet)
  *  that is further than any other in the list
@@ -1028,17 +1271,21 @@ static bool replace_all(const Mono_Time *mono_time,
         return false;
     }
 
-    if (!store_node_ok(&list[1], mono_time, public_key, comp_public_key) &&
-            !store_node_ok(&list[0], mono_time, public_key, comp_public_key)) {
-        return false;
-    }
+    uint32_t index = index_of_timed_out_client(list, length, mono_time);
 
-    sort_client_list(list, mono_time, length, comp_public_key);
+    if (index == UINT32_MAX) {
+        if (id_closest(comp_public_key, list[0].public_key, public_key) != 2) {
+            return false;
+        }
 
-    Client_data *const client = &list[0];
+        index = client_to_replace(list, length);
+    }
+
+    Client_data *const client = &list[index];
     id_copy(client->public_key, public_key);
 
     update_client_with_reset(mono_time, client, &ip_port);
+    client_list_reorder(list, length, index, comp_public_key);
     return true;
 }
 
@@ -1051,15 +1298,9 @@ static bool replace_all(const Mono_Time *mono_time,
  */
 static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, bool simulate)
 {
-    unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
-
-    if (index >= LCLIENT_LENGTH) {
-        index = LCLIENT_LENGTH - 1;
-    }
+    const unsigned int index = close_bucket_index(dht->self_public_key, public_key);
 
     for (uint32_t i = 0; i < LCLIENT_NODES; ++i) {
-        /* TODO(iphydf): write bounds checking test to catch the case that
-         * index is left as >= LCLIENT_LENGTH */
         Client_data *const client = &dht->close_clientlist[(index * LCLIENT_NODES) + i];
 
         if (!assoc_timeout(dht->mono_time, &client->assoc4) ||
@@ -1073,6 +1314,7 @@ static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, bo
 
         id_copy(client->public_key, public_key);
         update_client_with_reset(dht->mono_time, client, &ip_port);
+        dht_schedule_close_client(dht, index * LCLIENT_NODES + i);
         return 0;
     }
 
@@ -1104,11 +1346,7 @@ static bool is_pk_in_client_list(const Client_data *list, unsigned int client_li
 
 static bool is_pk_in_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip_port)
 {
-    unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
-
-    if (index >= LCLIENT_LENGTH) {
-        index = LCLIENT_LENGTH - 1;
-    }
+    const unsigned int index = close_bucket_index(dht->self_public_key, public_key);
 
     return is_pk_in_client_list(dht->close_clientlist + index * LCLIENT_NODES, LCLIENT_NODES, dht->mono_time, public_key,
                                 ip_port);
@@ -1134,6 +1372,8 @@ static bool ping_node_from_getnodes_ok(DHT *dht, const uint8_t *public_key, IP_P
         const bool in_close_list = is_pk_in_close_list(dht, public_key, ip_port);
 
         if (ret && index == UINT32_MAX && !in_close_list) {
+            dht_schedule(dht, DHT_TIMER_CLOSE, 0);
+
             if (*num < MAX_CLOSE_TO_BOOTSTRAP_NODES) {
                 memcpy(dht->to_bootstrap[*num].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
                 dht->to_bootstrap[*num].ip_port = ip_port;
@@ -1148,15 +1388,8 @@ static bool ping_node_from_getnodes_ok(DHT *dht, const uint8_t *public_key, IP_P
     for (uint32_t i = 0; i < dht->num_friends; ++i) {
         DHT_Friend *dht_friend = &dht->friends_list[i];
 
-        bool store_ok = false;
-
-        if (store_node_ok(&dht_friend->client_list[1], dht->mono_time, public_key, dht_friend->public_key)) {
-            store_ok = true;
-        }
-
-        if (store_node_ok(&dht_friend->client_list[0], dht->mono_time, public_key, dht_friend->public_key)) {
-            store_ok = true;
-        }
+        const bool store_ok = client_list_store_ok(dht_friend->client_list, MAX_FRIEND_CLIENTS, dht->mono_time,
+                              public_key, dht_friend->public_key);
 
         unsigned int *const friend_num = &dht_friend->num_to_bootstrap;
         const uint32_t index = index_of_node_pk(dht_friend->to_bootstrap, *friend_num, public_key);
@@ -1164,6 +1397,8 @@ static bool ping_node_from_getnodes_ok(DHT *dht, const uint8_t *public_key, IP_P
                                 ip_port);
 
         if (store_ok && index == UINT32_MAX && !pk_in_list) {
+            dht_schedule(dht, DHT_TIMER_FRIEND(i), 0);
+
             if (*friend_num < MAX_SENT_NODES) {
                 Node_format *const format = &dht_friend->to_bootstrap[*friend_num];
                 memcpy(format->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
@@ -1180,12 +1415,35 @@ static bool ping_node_from_getnodes_ok(DHT *dht, const uint8_t *public_key, IP_P
     return ret;
 }
 
+/* Round trip time passed to add_to_lists for nodes that didn't answer a request. */
+#define DHT_NO_RTT UINT32_MAX
+
+/* Add rtt to the round trip time of the node with public_key in list, if it's
+ * still at ip_port.
+ */
+static void client_list_add_rtt(Client_data *list, uint32_t length, const uint8_t *public_key,
+                                const IP_Port *ip_port, uint32_t rtt)
+{
+    const uint32_t index = index_of_client_pk(list, length, public_key);
+
+    if (index == UINT32_MAX) {
+        return;
+    }
+
+    IPPTsPng *const assoc = net_family_is_ipv4(ip_port->ip.family) ? &list[index].assoc4 : &list[index].assoc6;
+
+    if (ipport_equal(&assoc->ip_port, ip_port)) {
+        assoc_add_rtt(assoc, rtt);
+    }
+}
+
 /* Attempt to add client with ip_port and public_key to the friends client list
- * and close_clientlist.
+ * and close_clientlist, and add rtt to its round trip time in each list it is in
+ * unless it's DHT_NO_RTT.
  *
  *  returns 1+ if the item is used in any list, 0 else
  */
-uint32_t addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
+static uint32_t add_to_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key, uint32_t rtt)
 {
     uint32_t used = 0;
 
@@ -1198,28 +1456,42 @@ uint32_t addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
     /* NOTE: Current behavior if there are two clients with the same id is
      * to replace the first ip by the second.
      */
-    const bool in_close_list = client_or_ip_port_in_list(dht->log, dht->mono_time, dht->close_clientlist, LCLIENT_LIST,
-                               public_key, ip_port);
+    const uint32_t close_index = client_or_ip_port_in_list(dht->log, dht->mono_time, dht->close_clientlist,
+                                 LCLIENT_LIST, public_key, ip_port, nullptr);
+
+    if (close_index != UINT32_MAX) {
+        dht_schedule_close_client(dht, close_index);
+    }
 
     /* add_to_close should be called only if !in_list (don't extract to variable) */
-    if (in_close_list || add_to_close(dht, public_key, ip_port, 0)) {
+    if (close_index != UINT32_MAX || add_to_close(dht, public_key, ip_port, 0)) {
         ++used;
     }
 
+    if (rtt != DHT_NO_RTT) {
+        const unsigned int bucket = close_bucket_index(dht->self_public_key, public_key);
+        client_list_add_rtt(dht->close_clientlist + bucket * LCLIENT_NODES, LCLIENT_NODES, public_key, &ip_port, rtt);
+    }
+
+    const uint32_t friend_num = index_of_friend_pk(dht, public_key);
     DHT_Friend *friend_foundip = nullptr;
 
     for (uint32_t i = 0; i < dht->num_friends; ++i) {
         const bool in_list = client_or_ip_port_in_list(dht->log, dht->mono_time, dht->friends_list[i].client_list,
-                             MAX_FRIEND_CLIENTS, public_key, ip_port);
+                             MAX_FRIEND_CLIENTS, public_key, ip_port, dht->friends_list[i].public_key) != UINT32_MAX;
 
         /* replace_all should be called only if !in_list (don't extract to variable) */
         if (in_list
                 || replace_all(dht->mono_time, dht->friends_list[i].client_list, MAX_FRIEND_CLIENTS, public_key, ip_port,
                                dht->friends_list[i].public_key)) {
-            DHT_Friend *dht_friend = &dht->friends_list[i];
+            dht_schedule_friend_client(dht, i, public_key);
 
-            if (id_equal(public_key, dht_friend->public_key)) {
-                friend_foundip = dht_friend;
+            if (rtt != DHT_NO_RTT) {
+                client_list_add_rtt(dht->friends_list[i].client_list, MAX_FRIEND_CLIENTS, public_key, &ip_port, rtt);
+            }
+
+            if (i == friend_num) {
+                friend_foundip = &dht->friends_list[i];
             }
 
             ++used;
@@ -1240,6 +1512,28 @@ uint32_t addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
     return used;
 }
 
+uint32_t addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
+{
+    return add_to_lists(dht, ip_port, public_key, DHT_NO_RTT);
+}
+
+uint32_t addto_lists_rtt(DHT *dht, IP_Port ip_port, const uint8_t *public_key, uint32_t rtt)
+{
+    return add_to_lists(dht, ip_port, public_key, min_u32(rtt, DHT_NO_RTT - 1));
+}
+
+uint64_t dht_request_time(DHT *dht)
+{
+    return current_time_monotonic(dht->mono_time);
+}
+
+uint32_t addto_lists_answered(DHT *dht, IP_Port ip_port, const uint8_t *public_key, uint64_t sent_time)
+{
+    // The ping arrays time out requests after seconds, so this fits.
+    const uint32_t rtt = (uint32_t)(dht_request_time(dht) - sent_time);
+    return addto_lists_rtt(dht, ip_port, public_key, rtt);
+}
+
 static bool update_client_data(const Mono_Time *mono_time, Client_data *array, size_t size, IP_Port ip_port,
                                const uint8_t *pk)
 {
@@ -1282,14 +1576,17 @@ static void returnedip_ports(DHT *dht, IP_Port ip_port, const uint8_t *public_ke
         return;
     }
 
-    for (uint32_t i = 0; i < dht->num_friends; ++i) {
-        if (id_equal(public_key, dht->friends_list[i].public_key)) {
-            Client_data *const client_list = dht->friends_list[i].client_list;
+    const uint32_t friend_num = index_of_friend_pk(dht, public_key);
 
-            if (update_client_data(dht->mono_time, client_list, MAX_FRIEND_CLIENTS, ip_port, nodepublic_key)) {
-                return;
-            }
-        }
+    if (friend_num == UINT32_MAX) {
+        return;
+    }
+
+    Client_data *const client_list = dht->friends_list[friend_num].client_list;
+
+    if (update_client_data(dht->mono_time, client_list, MAX_FRIEND_CLIENTS, ip_port, nodepublic_key)) {
+        // Enough nodes may see the friend now to start hole punching.
+        dht_schedule(dht, DHT_TIMER_FRIEND(friend_num), 0);
     }
 }
 
@@ -1303,20 +1600,25 @@ static int getnodes(DHT *dht, IP_Port ip_port, const uint8_t *public_key, const
         return -1;
     }
 
-    uint8_t plain_message[sizeof(Node_format) * 2] = {0};
+    /* The receiver, the node to send the response to if any, and the time in
+     * milliseconds the request was sent at. */
+    uint8_t plain_message[sizeof(Node_format) * 2 + sizeof(uint64_t)] = {0};
 
     Node_format receiver;
     memcpy(receiver.public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
     receiver.ip_port = ip_port;
     memcpy(plain_message, &receiver, sizeof(receiver));
 
+    const uint64_t sent_time = dht_request_time(dht);
     uint64_t ping_id = 0;
 
     if (sendback_node != nullptr) {
         memcpy(plain_message + sizeof(receiver), sendback_node, sizeof(Node_format));
+        memcpy(plain_message + sizeof(Node_format) * 2, &sent_time, sizeof(sent_time));
         ping_id = ping_array_add(dht->dht_harden_ping_array, dht->mono_time, plain_message, sizeof(plain_message));
     } else {
-        ping_id = ping_array_add(dht->dht_ping_array, dht->mono_time, plain_message, sizeof(receiver));
+        memcpy(plain_message + sizeof(receiver), &sent_time, sizeof(sent_time));
+        ping_id = ping_array_add(dht->dht_ping_array, dht->mono_time, plain_message, sizeof(receiver) + sizeof(sent_time));
     }
 
     if (ping_id == 0) {
@@ -1426,17 +1728,22 @@ static int handle_getnodes(void *object, IP_Port source, const uint8_t *packet,
     return false;
 }
 
-/* return false if no
+/* If yes, sent_time is set to the time in milliseconds the request was sent at.
+ *
+ * return false if no
  * return true if yes */
 static bool sent_getnode_to_node(DHT *dht, const uint8_t *public_key, IP_Port node_ip_port, uint64_t ping_id,
-                                 Node_format *sendback_node)
+                                 Node_format *sendback_node, uint64_t *sent_time)
 {
-    uint8_t data[sizeof(Node_format) * 2];
+    uint8_t data[sizeof(Node_format) * 2 + sizeof(uint64_t)];
 
-    if (ping_array_check(dht->dht_ping_array, dht->mono_time, data, sizeof(data), ping_id) == sizeof(Node_format)) {
+    if (ping_array_check(dht->dht_ping_array, dht->mono_time, data, sizeof(data), ping_id)
+            == sizeof(Node_format) + sizeof(uint64_t)) {
         memset(sendback_node, 0, sizeof(Node_format));
+        memcpy(sent_time, data + sizeof(Node_format), sizeof(uint64_t));
     } else if (ping_array_check(dht->dht_harden_ping_array, dht->mono_time, data, sizeof(data), ping_id) == sizeof(data)) {
         memcpy(sendback_node, data + sizeof(Node_format), sizeof(Node_format));
+        memcpy(sent_time, data + sizeof(Node_format) * 2, sizeof(uint64_t));
     } else {
         return false;
     }
@@ -1494,11 +1801,12 @@ static int handle_sendnodes_core(void *object, IP_Port source, const uint8_t *pa
     }
 
     Node_format sendback_node;
+    uint64_t sent_time;
 
     uint64_t ping_id;
     memcpy(&ping_id, plain + 1 + data_size, sizeof(ping_id));
 
-    if (!sent_getnode_to_node(dht, packet + 1, source, ping_id, &sendback_node)) {
+    if (!sent_getnode_to_node(dht, packet + 1, source, ping_id, &sendback_node, &sent_time)) {
         return 1;
     }
 
@@ -1518,7 +1826,7 @@ static int handle_sendnodes_core(void *object, IP_Port source, const uint8_t *pa
     }
 
     /* store the address the *request* was sent to */
-    addto_lists(dht, source, packet + 1);
+    addto_lists_answered(dht, source, packet + 1, sent_time);
 
     *num_nodes_out = num_nodes;
 
@@ -1556,7 +1864,7 @@ static int handle_sendnodes_ipv6(void *object, IP_Port source, const uint8_t *pa
 int dht_addfriend(DHT *dht, const uint8_t *public_key, dht_ip_cb *ip_callback,
                   void *data, int32_t number, uint16_t *lock_count)
 {
-    const uint32_t friend_num = index_of_friend_pk(dht->friends_list, dht->num_friends, public_key);
+    const uint32_t friend_num = index_of_friend_pk(dht, public_key);
 
     uint16_t lock_num;
 
@@ -1580,9 +1888,18 @@ int dht_addfriend(DHT *dht, const uint8_t *public_key, dht_ip_cb *ip_callback,
         return 0;
     }
 
+    if (!timer_wheel_reserve(&dht->timers, DHT_TIMER_FRIEND(dht->num_friends + 1))) {
+        return -1;
+    }
+
+    if (!hash_list_add(&dht->friends_index, public_key, dht->num_friends)) {
+        return -1;
+    }
+
     DHT_Friend *const temp = (DHT_Friend *)realloc(dht->friends_list, sizeof(DHT_Friend) * (dht->num_friends + 1));
 
     if (temp == nullptr) {
+        hash_list_remove(&dht->friends_index, public_key, dht->num_friends);
         return -1;
     }
 
@@ -1606,13 +1923,14 @@ int dht_addfriend(DHT *dht, const uint8_t *public_key, dht_ip_cb *ip_callback,
 
     dht_friend->num_to_bootstrap = get_close_nodes(dht, dht_friend->public_key, dht_friend->to_bootstrap, net_family_unspec,
                                    1, 0);
+    dht_schedule(dht, DHT_TIMER_FRIEND(dht->num_friends - 1), 0);
 
     return 0;
 }
 
 int dht_delfriend(DHT *dht, const uint8_t *public_key, uint16_t lock_count)
 {
-    const uint32_t friend_num = index_of_friend_pk(dht->friends_list, dht->num_friends, public_key);
+    const uint32_t friend_num = index_of_friend_pk(dht, public_key);
 
     if (friend_num == UINT32_MAX) {
         return -1;
@@ -1630,11 +1948,21 @@ int dht_delfriend(DHT *dht, const uint8_t *public_key, uint16_t lock_count)
     }
 
     --dht->num_friends;
+    timer_wheel_cancel(&dht->timers, DHT_TIMER_FRIEND(friend_num));
+    hash_list_remove(&dht->friends_index, public_key, friend_num);
 
     if (dht->num_friends != friend_num) {
+        hash_list_update(&dht->friends_index, dht->friends_list[dht->num_friends].public_key, dht->num_friends, friend_num);
         memcpy(&dht->friends_list[friend_num],
                &dht->friends_list[dht->num_friends],
                sizeof(DHT_Friend));
+
+        // The timer moves along with the last friend.
+        if (timer_wheel_is_set(&dht->timers, DHT_TIMER_FRIEND(dht->num_friends))) {
+            timer_wheel_set(&dht->timers, DHT_TIMER_FRIEND(friend_num),
+                            timer_wheel_deadline(&dht->timers, DHT_TIMER_FRIEND(dht->num_friends)));
+            timer_wheel_cancel(&dht->timers, DHT_TIMER_FRIEND(dht->num_friends));
+        }
     }
 
     if (dht->num_friends == 0) {
@@ -1659,7 +1987,7 @@ int dht_getfriendip(const DHT *dht, const uint8_t *public_key, IP_Port *ip_port)
     ip_reset(&ip_port->ip);
     ip_port->port = 0;
 
-    const uint32_t friend_index = index_of_friend_pk(dht->friends_list, dht->num_friends, public_key);
+    const uint32_t friend_index = index_of_friend_pk(dht, public_key);
 
     if (friend_index == UINT32_MAX) {
         return -1;
@@ -1687,21 +2015,18 @@ int dht_getfriendip(const DHT *dht, const uint8_t *public_key, IP_Port *ip_port)
     return -1;
 }
 
-/* returns number of nodes not in kill-timeout */
-static uint8_t do_ping_and_sendnode_requests(DHT *dht, uint64_t *lastgetnode, const uint8_t *public_key,
-        Client_data *list, uint32_t list_count, uint32_t *bootstrap_times, bool sortable)
+/* Send a getnodes request to every node in the list that didn't time out for
+ * good (KILL_NODE_TIMEOUT) and wasn't pinged for PING_INTERVAL seconds.
+ *
+ * return the time at which the next node has to be pinged, or UINT64_MAX if
+ * every node timed out for good.
+ */
+static uint64_t ping_client_list(DHT *dht, const uint8_t *public_key, Client_data *list, uint32_t list_count,
+                                 uint64_t now)
 {
-    uint8_t not_kill = 0;
-    const uint64_t temp_time = mono_time_get(dht->mono_time);
-
-    uint32_t num_nodes = 0;
-    VLA(Client_data *, client_list, list_count * 2);
-    VLA(IPPTsPng *, assoc_list, list_count * 2);
-    unsigned int sort = 0;
-    bool sort_ok = false;
+    uint64_t next = UINT64_MAX;
 
     for (uint32_t i = 0; i < list_count; ++i) {
-        /* If node is not dead. */
         Client_data *client = &list[i];
 
         IPPTsPng *const assocs[] = { &client->assoc6, &client->assoc4 };
@@ -1709,38 +2034,55 @@ static uint8_t do_ping_and_sendnode_requests(DHT *dht, uint64_t *lastgetnode, co
         for (uint32_t j = 0; j < sizeof(assocs) / sizeof(assocs[0]); ++j) {
             IPPTsPng *const assoc = assocs[j];
 
-            if (!mono_time_is_timeout(dht->mono_time, assoc->timestamp, KILL_NODE_TIMEOUT)) {
-                sort = 0;
-                ++not_kill;
+            if (assoc->timestamp + KILL_NODE_TIMEOUT <= now) {
+                continue;
+            }
+
+            if (assoc->last_pinged + PING_INTERVAL <= now) {
+                getnodes(dht, assoc->ip_port, client->public_key, public_key, nullptr);
+                assoc->last_pinged = now;
+            }
 
-                if (mono_time_is_timeout(dht->mono_time, assoc->last_pinged, PING_INTERVAL)) {
-                    getnodes(dht, assoc->ip_port, client->public_key, public_key, nullptr);
-                    assoc->last_pinged = temp_time;
-                }
+            next = min_u64(next, assoc->last_pinged + PING_INTERVAL);
+        }
+    }
 
-                /* If node is good. */
-                if (!assoc_timeout(dht->mono_time, assoc)) {
-                    client_list[num_nodes] = client;
-                    assoc_list[num_nodes] = assoc;
-                    ++num_nodes;
-                }
-            } else {
-                ++sort;
+    return next;
+}
 
-                /* Timed out should be at beginning, if they are not, sort the list. */
-                if (sort > 1 && sort < (((j + 1) * 2) - 1)) {
-                    sort_ok = true;
-                }
+/* Send a getnodes request to a random good node in the list, if it's time to.
+ *
+ * return the time at which the next one is due, or UINT64_MAX if the list has
+ * no good node.
+ */
+static uint64_t getnodes_random_client(DHT *dht, uint64_t *lastgetnode, const uint8_t *public_key,
+                                       const Client_data *list, uint32_t list_count, uint32_t *bootstrap_times,
+                                       uint64_t now)
+{
+    uint32_t num_nodes = 0;
+    VLA(const Client_data *, client_list, list_count * 2);
+    VLA(const IPPTsPng *, assoc_list, list_count * 2);
+
+    for (uint32_t i = 0; i < list_count; ++i) {
+        const Client_data *client = &list[i];
+
+        const IPPTsPng *const assocs[] = { &client->assoc6, &client->assoc4 };
+
+        for (uint32_t j = 0; j < sizeof(assocs) / sizeof(assocs[0]); ++j) {
+            /* If node is good. */
+            if (assocs[j]->timestamp + BAD_NODE_TIMEOUT > now) {
+                client_list[num_nodes] = client;
+                assoc_list[num_nodes] = assocs[j];
+                ++num_nodes;
             }
         }
     }
 
-    if (sortable && sort_ok) {
-        sort_client_list(list, dht->mono_time, list_count, public_key);
+    if (num_nodes == 0) {
+        return UINT64_MAX;
     }
 
-    if ((num_nodes != 0) && (mono_time_is_timeout(dht->mono_time, *lastgetnode, GET_NODE_INTERVAL)
-                             || *bootstrap_times < MAX_BOOTSTRAP_TIMES)) {
+    if (getnodes_time(*lastgetnode, *bootstrap_times) <= now) {
         uint32_t rand_node = random_u32() % num_nodes;
 
         if ((num_nodes - 1) != rand_node) {
@@ -1749,38 +2091,30 @@ static uint8_t do_ping_and_sendnode_requests(DHT *dht, uint64_t *lastgetnode, co
 
         getnodes(dht, assoc_list[rand_node]->ip_port, client_list[rand_node]->public_key, public_key, nullptr);
 
-        *lastgetnode = temp_time;
+        *lastgetnode = now;
         ++*bootstrap_times;
     }
 
-    return not_kill;
+    return getnodes_time(*lastgetnode, *bootstrap_times);
 }
 
-/* Ping each client in the "friends" list every PING_INTERVAL seconds. Send a get nodes request
- * every GET_NODE_INTERVAL seconds to a random good node for each "friend" in our "friends" list.
+/* Ping the nodes in a bucket of the close list every PING_INTERVAL seconds.
  */
-static void do_dht_friends(DHT *dht)
+static void do_close_bucket(DHT *dht, uint32_t bucket, uint64_t now)
 {
-    for (size_t i = 0; i < dht->num_friends; ++i) {
-        DHT_Friend *const dht_friend = &dht->friends_list[i];
-
-        for (size_t j = 0; j < dht_friend->num_to_bootstrap; ++j) {
-            getnodes(dht, dht_friend->to_bootstrap[j].ip_port, dht_friend->to_bootstrap[j].public_key, dht_friend->public_key,
-                     nullptr);
-        }
-
-        dht_friend->num_to_bootstrap = 0;
+    const uint64_t next = ping_client_list(dht, dht->self_public_key, &dht->close_clientlist[bucket * LCLIENT_NODES],
+                                           LCLIENT_NODES, now);
 
-        do_ping_and_sendnode_requests(dht, &dht_friend->lastgetnode, dht_friend->public_key, dht_friend->client_list,
-                                      MAX_FRIEND_CLIENTS,
-                                      &dht_friend->bootstrap_times, 1);
+    if (next != UINT64_MAX) {
+        timer_wheel_set(&dht->timers, bucket, next);
     }
 }
 
-/* Ping each client in the close nodes list every PING_INTERVAL seconds.
- * Send a get nodes request every GET_NODE_INTERVAL seconds to a random good node in the list.
+/* Send the getnodes requests queued for the close list, and one to a random
+ * good node in it every GET_NODE_INTERVAL seconds. The pings are sent per
+ * bucket by do_close_bucket.
  */
-static void do_Close(DHT *dht)
+static void do_Close(DHT *dht, uint64_t now)
 {
     for (size_t i = 0; i < dht->num_to_bootstrap; ++i) {
         getnodes(dht, dht->to_bootstrap[i].ip_port, dht->to_bootstrap[i].public_key, dht->self_public_key, nullptr);
@@ -1788,11 +2122,26 @@ static void do_Close(DHT *dht)
 
     dht->num_to_bootstrap = 0;
 
-    uint8_t not_killed = do_ping_and_sendnode_requests(
-                             dht, &dht->close_lastgetnodes, dht->self_public_key, dht->close_clientlist, LCLIENT_LIST, &dht->close_bootstrap_times,
-                             0);
+    uint64_t next = getnodes_random_client(dht, &dht->close_lastgetnodes, dht->self_public_key, dht->close_clientlist,
+                                           LCLIENT_LIST, &dht->close_bootstrap_times, now);
+
+    uint64_t latest = 0;
+
+    for (size_t i = 0; i < LCLIENT_LIST; ++i) {
+        const Client_data *const client = &dht->close_clientlist[i];
+        latest = max_u64(latest, max_u64(client->assoc4.timestamp, client->assoc6.timestamp));
+    }
+
+    if (latest == 0 || latest + KILL_NODE_TIMEOUT > now) {
+        // Check again when the last node that didn't time out for good does.
+        if (latest != 0) {
+            next = min_u64(next, latest + KILL_NODE_TIMEOUT);
+        }
+
+        if (next != UINT64_MAX) {
+            timer_wheel_set(&dht->timers, DHT_TIMER_CLOSE, next);
+        }
 
-    if (not_killed != 0) {
         return;
     }
 
@@ -1802,7 +2151,7 @@ static void do_Close(DHT *dht)
      *
      * so: reset all nodes to be BAD_NODE_TIMEOUT, but not
      * KILL_NODE_TIMEOUT, so we at least keep trying pings */
-    const uint64_t badonly = mono_time_get(dht->mono_time) - BAD_NODE_TIMEOUT;
+    const uint64_t badonly = now - BAD_NODE_TIMEOUT;
 
     for (size_t i = 0; i < LCLIENT_LIST; ++i) {
         Client_data *const client = &dht->close_clientlist[i];
@@ -1817,6 +2166,12 @@ static void do_Close(DHT *dht)
             }
         }
     }
+
+    for (uint32_t i = 0; i < LCLIENT_LENGTH; ++i) {
+        timer_wheel_set(&dht->timers, i, now);
+    }
+
+    timer_wheel_set(&dht->timers, DHT_TIMER_CLOSE, badonly + KILL_NODE_TIMEOUT);
 }
 
 void dht_getnodes(DHT *dht, const IP_Port *from_ipp, const uint8_t *from_id, const uint8_t *which_id)
@@ -1967,7 +2322,7 @@ static int friend_iplist(const DHT *dht, IP_Port *ip_portlist, uint16_t friend_n
  */
 int route_tofriend(const DHT *dht, const uint8_t *friend_id, const uint8_t *packet, uint16_t length)
 {
-    const uint32_t num = index_of_friend_pk(dht->friends_list, dht->num_friends, friend_id);
+    const uint32_t num = index_of_friend_pk(dht, friend_id);
 
     if (num == UINT32_MAX) {
         return 0;
@@ -2015,7 +2370,7 @@ int route_tofriend(const DHT *dht, const uint8_t *friend_id, const uint8_t *pack
  */
 static int routeone_tofriend(DHT *dht, const uint8_t *friend_id, const uint8_t *packet, uint16_t length)
 {
-    const uint32_t num = index_of_friend_pk(dht->friends_list, dht->num_friends, friend_id);
+    const uint32_t num = index_of_friend_pk(dht, friend_id);
 
     if (num == UINT32_MAX) {
         return 0;
@@ -2103,7 +2458,7 @@ static int handle_NATping(void *object, IP_Port source, const uint8_t *source_pu
     uint64_t ping_id;
     memcpy(&ping_id, packet + 1, sizeof(uint64_t));
 
-    uint32_t friendnumber = index_of_friend_pk(dht->friends_list, dht->num_friends, source_pubkey);
+    uint32_t friendnumber = index_of_friend_pk(dht, source_pubkey);
 
     if (friendnumber == UINT32_MAX) {
         return 1;
@@ -2115,6 +2470,7 @@ static int handle_NATping(void *object, IP_Port source, const uint8_t *source_pu
         /* 1 is reply */
         send_NATping(dht, source_pubkey, ping_id, NAT_PING_RESPONSE);
         dht_friend->nat.recv_nat_ping_timestamp = mono_time_get(dht->mono_time);
+        dht_schedule(dht, DHT_TIMER_FRIEND(friendnumber), 0);
         return 0;
     }
 
@@ -2122,6 +2478,7 @@ static int handle_NATping(void *object, IP_Port source, const uint8_t *source_pu
         if (dht_friend->nat.nat_ping_id == ping_id) {
             dht_friend->nat.nat_ping_id = random_u64();
             dht_friend->nat.hole_punching = 1;
+            dht_schedule(dht, DHT_TIMER_FRIEND(friendnumber), 0);
             return 0;
         }
     }
@@ -2239,48 +2596,59 @@ static void punch_holes(DHT *dht, IP ip, uint16_t *port_list, uint16_t numports,
     ++dht->friends_list[friend_num].nat.tries;
 }
 
-static void do_NAT(DHT *dht)
+/* Send NAT pings to a friend every PUNCH_INTERVAL seconds while enough of its
+ * nodes report the same IP for it, and punch holes once it answered.
+ *
+ * return the time at which to try again, or UINT64_MAX if the friend isn't
+ * seen by enough nodes, which only changes when they report its IP again.
+ */
+static uint64_t do_NAT(DHT *dht, uint32_t friend_num, uint64_t now)
 {
-    const uint64_t temp_time = mono_time_get(dht->mono_time);
+    DHT_Friend *const dht_friend = &dht->friends_list[friend_num];
+    IP_Port ip_list[MAX_FRIEND_CLIENTS];
+    const int num = friend_iplist(dht, ip_list, friend_num);
 
-    for (uint32_t i = 0; i < dht->num_friends; ++i) {
-        IP_Port ip_list[MAX_FRIEND_CLIENTS];
-        const int num = friend_iplist(dht, ip_list, i);
+    /* If already connected or friend is not online don't try to hole punch. */
+    if (num < MAX_FRIEND_CLIENTS / 2) {
+        return UINT64_MAX;
+    }
 
-        /* If already connected or friend is not online don't try to hole punch. */
-        if (num < MAX_FRIEND_CLIENTS / 2) {
-            continue;
-        }
+    if (dht_friend->nat.nat_ping_timestamp + PUNCH_INTERVAL < now) {
+        send_NATping(dht, dht_friend->public_key, dht_friend->nat.nat_ping_id, NAT_PING_REQUEST);
+        dht_friend->nat.nat_ping_timestamp = now;
+    }
 
-        if (dht->friends_list[i].nat.nat_ping_timestamp + PUNCH_INTERVAL < temp_time) {
-            send_NATping(dht, dht->friends_list[i].public_key, dht->friends_list[i].nat.nat_ping_id, NAT_PING_REQUEST);
-            dht->friends_list[i].nat.nat_ping_timestamp = temp_time;
-        }
+    const uint64_t next = dht_friend->nat.nat_ping_timestamp + PUNCH_INTERVAL + 1;
 
-        if (dht->friends_list[i].nat.hole_punching == 1 &&
-                dht->friends_list[i].nat.punching_timestamp + PUNCH_INTERVAL < temp_time &&
-                dht->friends_list[i].nat.recv_nat_ping_timestamp + PUNCH_INTERVAL * 2 >= temp_time) {
+    if (dht_friend->nat.hole_punching == 1 &&
+            dht_friend->nat.punching_timestamp + PUNCH_INTERVAL < now &&
+            dht_friend->nat.recv_nat_ping_timestamp + PUNCH_INTERVAL * 2 >= now) {
 
-            const IP ip = nat_commonip(ip_list, num, MAX_FRIEND_CLIENTS / 2);
+        const IP ip = nat_commonip(ip_list, num, MAX_FRIEND_CLIENTS / 2);
 
-            if (!ip_isset(&ip)) {
-                continue;
-            }
+        if (!ip_isset(&ip)) {
+            return next;
+        }
 
-            if (dht->friends_list[i].nat.punching_timestamp + PUNCH_RESET_TIME < temp_time) {
-                dht->friends_list[i].nat.tries = 0;
-                dht->friends_list[i].nat.punching_index = 0;
-                dht->friends_list[i].nat.punching_index2 = 0;
-            }
+        if (dht_friend->nat.punching_timestamp + PUNCH_RESET_TIME < now) {
+            dht_friend->nat.tries = 0;
+            dht_friend->nat.punching_index = 0;
+            dht_friend->nat.punching_index2 = 0;
+        }
 
-            uint16_t port_list[MAX_FRIEND_CLIENTS];
-            const uint16_t numports = nat_getports(port_list, ip_list, num, ip);
-            punch_holes(dht, ip, port_list, numports, i);
+        uint16_t port_list[MAX_FRIEND_CLIENTS];
+        const uint16_t numports = nat_getports(port_list, ip_list, num, ip);
+        punch_holes(dht, ip, port_list, numports, friend_num);
 
-            dht->friends_list[i].nat.punching_timestamp = temp_time;
-            dht->friends_list[i].nat.hole_punching = 0;
-        }
+        dht_friend->nat.punching_timestamp = now;
+        dht_friend->nat.hole_punching = 0;
+    }
+
+    if (dht_friend->nat.hole_punching == 1) {
+        return min_u64(next, dht_friend->nat.punching_timestamp + PUNCH_INTERVAL + 1);
     }
+
+    return next;
 }
 
 /*----------------------------------------------------------------------------------*/
@@ -2507,6 +2875,30 @@ static Node_format random_node(DHT *dht, Family sa_family)
 }
 #endif
 
+/* Return a good address of client, the faster one if both are good and were
+ * measured, else a random one. Return nullptr if neither is good.
+ */
+static const IPPTsPng *good_assoc(const Mono_Time *mono_time, const Client_data *client)
+{
+    const IPPTsPng *assoc = nullptr;
+
+    if (!assoc_timeout(mono_time, &client->assoc4)) {
+        assoc = &client->assoc4;
+    }
+
+    if (!assoc_timeout(mono_time, &client->assoc6)) {
+        if (assoc == nullptr) {
+            assoc = &client->assoc6;
+        } else if (faster_assoc(assoc, &client->assoc6) != nullptr) {
+            assoc = faster_assoc(assoc, &client->assoc6);
+        } else if (random_u08() % 2) {
+            assoc = &client->assoc6;
+        }
+    }
+
+    return assoc;
+}
+
 /* Put up to max_num nodes in nodes from the closelist.
  *
  * return the number of nodes.
@@ -2521,19 +2913,7 @@ static uint16_t list_nodes(Client_data *list, size_t length, const Mono_Time *mo
     uint16_t count = 0;
 
     for (size_t i = length; i != 0; --i) {
-        const IPPTsPng *assoc = nullptr;
-
-        if (!assoc_timeout(mono_time, &list[i - 1].assoc4)) {
-            assoc = &list[i - 1].assoc4;
-        }
-
-        if (!assoc_timeout(mono_time, &list[i - 1].assoc6)) {
-            if (assoc == nullptr) {
-                assoc = &list[i - 1].assoc6;
-            } else if (random_u08() % 2) {
-                assoc = &list[i - 1].assoc6;
-            }
-        }
+        const IPPTsPng *const assoc = good_assoc(mono_time, &list[i - 1]);
 
         if (assoc != nullptr) {
             memcpy(nodes[count].public_key, list[i - 1].public_key, CRYPTO_PUBLIC_KEY_SIZE);
@@ -2574,13 +2954,55 @@ uint16_t randfriends_nodes(DHT *dht, Node_format *nodes, uint16_t max_num)
     return count;
 }
 
-/* Put up to max_num nodes in nodes from the closelist.
+/* Put up to max_num nodes in nodes from the closelist, the ones answering our
+ * requests fastest. Nodes that never answered one come last, the closest first.
  *
  * return the number of nodes.
  */
 uint16_t closelist_nodes(DHT *dht, Node_format *nodes, uint16_t max_num)
 {
-    return list_nodes(dht->close_clientlist, LCLIENT_LIST, dht->mono_time, nodes, max_num);
+    if (max_num == 0) {
+        return 0;
+    }
+
+    VLA(uint32_t, ranks, max_num);
+    uint16_t count = 0;
+
+    for (size_t i = LCLIENT_LIST; i != 0; --i) {
+        const Client_data *const client = &dht->close_clientlist[i - 1];
+        const IPPTsPng *const assoc = good_assoc(dht->mono_time, client);
+
+        if (assoc == nullptr) {
+            continue;
+        }
+
+        const uint32_t rank = assoc_rtt_rank(assoc);
+
+        if (count == max_num && rank >= ranks[count - 1]) {
+            continue;
+        }
+
+        // Insert into the nodes ordered by round trip time, dropping the
+        // slowest one if they are full.
+        uint16_t j = count - 1;
+
+        if (count < max_num) {
+            j = count;
+            ++count;
+        }
+
+        while (j > 0 && ranks[j - 1] > rank) {
+            nodes[j] = nodes[j - 1];
+            ranks[j] = ranks[j - 1];
+            --j;
+        }
+
+        memcpy(nodes[j].public_key, client->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        nodes[j].ip_port = assoc->ip_port;
+        ranks[j] = rank;
+    }
+
+    return count;
 }
 
 #if DHT_HARDENING
@@ -2706,6 +3128,14 @@ DHT *new_dht(const Logger *log, Mono_Time *mono_time, Networking_Core *net, bool
 
     dht->hole_punching_enabled = holepunching_enabled;
 
+    timer_wheel_init(&dht->timers, mono_time_get(mono_time));
+
+    if (!timer_wheel_reserve(&dht->timers, DHT_TIMER_FRIEND(0))
+            || !hash_list_init(&dht->friends_index, CRYPTO_PUBLIC_KEY_SIZE, DHT_FAKE_FRIEND_NUMBER)) {
+        kill_dht(dht);
+        return nullptr;
+    }
+
     dht->ping = ping_new(mono_time, dht);
 
     if (dht->ping == nullptr) {
@@ -2713,6 +3143,14 @@ DHT *new_dht(const Logger *log, Mono_Time *mono_time, Networking_Core *net, bool
         return nullptr;
     }
 
+    dht->shared_keys_recv = shared_keys_new(SHARED_KEYS_DEFAULT_CAPACITY);
+    dht->shared_keys_sent = shared_keys_new(SHARED_KEYS_DEFAULT_CAPACITY);
+
+    if (dht->shared_keys_recv == nullptr || dht->shared_keys_sent == nullptr) {
+        kill_dht(dht);
+        return nullptr;
+    }
+
     networking_registerhandler(dht->net, NET_PACKET_GET_NODES, &handle_getnodes, dht);
     networking_registerhandler(dht->net, NET_PACKET_SEND_NODES_IPV6, &handle_sendnodes_ipv6, dht);
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO, &cryptopacket_handle, dht);
@@ -2744,6 +3182,45 @@ DHT *new_dht(const Logger *log, Mono_Time *mono_time, Networking_Core *net, bool
     return dht;
 }
 
+/* Send the getnodes requests queued for a friend, ping the nodes in its client
+ * list every PING_INTERVAL seconds, ask a random good one of them for nodes
+ * every GET_NODE_INTERVAL seconds, and try to punch holes to it.
+ */
+static void do_dht_friend(DHT *dht, uint32_t friend_num, uint64_t now)
+{
+    DHT_Friend *const dht_friend = &dht->friends_list[friend_num];
+
+    for (size_t j = 0; j < dht_friend->num_to_bootstrap; ++j) {
+        getnodes(dht, dht_friend->to_bootstrap[j].ip_port, dht_friend->to_bootstrap[j].public_key, dht_friend->public_key,
+                 nullptr);
+    }
+
+    dht_friend->num_to_bootstrap = 0;
+
+    uint64_t next = ping_client_list(dht, dht_friend->public_key, dht_friend->client_list, MAX_FRIEND_CLIENTS, now);
+    next = min_u64(next, getnodes_random_client(dht, &dht_friend->lastgetnode, dht_friend->public_key,
+                   dht_friend->client_list, MAX_FRIEND_CLIENTS, &dht_friend->bootstrap_times, now));
+    next = min_u64(next, do_NAT(dht, friend_num, now));
+
+    if (next != UINT64_MAX) {
+        timer_wheel_set(&dht->timers, DHT_TIMER_FRIEND(friend_num), next);
+    }
+}
+
+static void dht_timer_expired(void *object, uint32_t id)
+{
+    DHT *const dht = (DHT *)object;
+    const uint64_t now = timer_wheel_time(&dht->timers);
+
+    if (id < DHT_TIMER_CLOSE) {
+        do_close_bucket(dht, id, now);
+    } else if (id == DHT_TIMER_CLOSE) {
+        do_Close(dht, now);
+    } else {
+        do_dht_friend(dht, id - DHT_TIMER_FRIEND(0), now);
+    }
+}
+
 void do_dht(DHT *dht)
 {
     if (dht->last_run == mono_time_get(dht->mono_time)) {
@@ -2755,9 +3232,7 @@ void do_dht(DHT *dht)
         dht_connect_after_load(dht);
     }
 
-    do_Close(dht);
-    do_dht_friends(dht);
-    do_NAT(dht);
+    timer_wheel_advance(&dht->timers, mono_time_get(dht->mono_time), &dht_timer_expired, dht);
     ping_iterate(dht->ping);
 #if DHT_HARDENING
     do_hardening(dht);
@@ -2774,6 +3249,10 @@ void kill_dht(DHT *dht)
     ping_array_kill(dht->dht_ping_array);
     ping_array_kill(dht->dht_harden_ping_array);
     ping_kill(dht->ping);
+    shared_keys_free(dht->shared_keys_recv);
+    shared_keys_free(dht->shared_keys_sent);
+    timer_wheel_free(&dht->timers);
+    hash_list_free(&dht->friends_index);
     free(dht->friends_list);
     free(dht->loaded_nodes_list);
     free(dht);
@@ -3013,3 +3492,68 @@ bool dht_non_lan_connected(const DHT *dht)
 
     return false;
 }
+
+uint16_t dht_get_num_close_nodes(const DHT *dht)
+{
+    uint16_t count = 0;
+
+    for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
+        const Client_data *const client = &dht->close_clientlist[i];
+
+        if (!assoc_timeout(dht->mono_time, &client->assoc4) ||
+                !assoc_timeout(dht->mono_time, &client->assoc6)) {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+uint32_t dht_node_rtt(const DHT *dht, const uint8_t *public_key, const IP_Port *ip_port)
+{
+    const unsigned int bucket = close_bucket_index(dht->self_public_key, public_key);
+    const Client_data *const list = dht->close_clientlist + bucket * LCLIENT_NODES;
+    const uint32_t index = index_of_client_pk(list, LCLIENT_NODES, public_key);
+
+    if (index == UINT32_MAX) {
+        return 0;
+    }
+
+    const IPPTsPng *const assoc = net_family_is_ipv4(ip_port->ip.family) ? &list[index].assoc4 : &list[index].assoc6;
+
+    if (!ipport_equal(&assoc->ip_port, ip_port)) {
+        return 0;
+    }
+
+    return assoc->rtt;
+}
+
+void dht_get_rtt_stats(const DHT *dht, DHT_Rtt_Stats *stats)
+{
+    memset(stats, 0, sizeof(DHT_Rtt_Stats));
+    uint64_t total_rtt = 0;
+
+    for (uint32_t i = 0; i < LCLIENT_LIST * 2; ++i) {
+        const Client_data *const client = &dht->close_clientlist[i / 2];
+        const IPPTsPng *const assoc = i % 2 == 0 ? &client->assoc4 : &client->assoc6;
+
+        if (assoc_timeout(dht->mono_time, assoc)) {
+            continue;
+        }
+
+        ++stats->good;
+
+        if (assoc->rtt == 0) {
+            continue;
+        }
+
+        stats->min_rtt = stats->measured == 0 ? assoc->rtt : min_u32(stats->min_rtt, assoc->rtt);
+        stats->max_rtt = max_u32(stats->max_rtt, assoc->rtt);
+        total_rtt += assoc->rtt;
+        ++stats->measured;
+    }
+
+    if (stats->measured != 0) {
+        stats->mean_rtt = (uint32_t)(total_rtt / stats->measured);
+    }
+}
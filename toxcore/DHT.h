@@ -107,6 +107,10 @@ typedef struct IPPTsPng {
     /* Returned by this node. Either our friend or us. */
     IP_Port     ret_ip_port;
     uint64_t    ret_timestamp;
+
+    /* Smoothed round trip time of our requests to this address in milliseconds,
+     * 0 if it never answered one. */
+    uint32_t    rtt;
 } IPPTsPng;
 
 typedef struct Client_data {
@@ -180,21 +184,39 @@ int unpack_nodes(Node_format *nodes, uint16_t max_num_nodes, uint16_t *processed
 
 
 /*----------------------------------------------------------------------------------*/
-/* struct to store some shared keys so we don't have to regenerate them for each request. */
+/* Cache of shared keys so we don't have to regenerate them for each request.
+ *
+ * The cache is a set-associative hash table: each public key hashes to one
+ * slot of MAX_KEYS_PER_SLOT entries, and the least recently used entry of
+ * that slot is evicted when a new key needs to be stored.
+ */
 #define MAX_KEYS_PER_SLOT 4
-#define KEYS_TIMEOUT 600
+#define SHARED_KEYS_DEFAULT_CAPACITY (256 * MAX_KEYS_PER_SLOT)
+
+typedef struct Shared_Keys Shared_Keys;
+
+typedef struct Shared_Keys_Stats {
+    uint64_t hits;
+    uint64_t misses;
+    /* Misses that replaced a stored key rather than filling an empty entry. */
+    uint64_t evictions;
+} Shared_Keys_Stats;
+
+/* Create a shared key cache holding at least capacity keys.
+ *
+ * The capacity is rounded up to a power of two number of slots.
+ *
+ * return new cache on success.
+ * return NULL on failure.
+ */
+Shared_Keys *shared_keys_new(uint32_t capacity);
 
-typedef struct Shared_Key {
-    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
-    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    uint32_t times_requested;
-    bool stored;
-    uint64_t time_last_requested;
-} Shared_Key;
+void shared_keys_free(Shared_Keys *shared_keys);
 
-typedef struct Shared_Keys {
-    Shared_Key keys[256 * MAX_KEYS_PER_SLOT];
-} Shared_Keys;
+/* Return the number of keys the cache can hold. */
+uint32_t shared_keys_capacity(const Shared_Keys *shared_keys);
+
+void shared_keys_get_stats(const Shared_Keys *shared_keys, Shared_Keys_Stats *stats);
 
 /*----------------------------------------------------------------------------------*/
 
@@ -226,8 +248,8 @@ const uint8_t *dht_get_friend_public_key(const DHT *dht, uint32_t friend_num);
  * If shared key is already in shared_keys, copy it to shared_key.
  * else generate it into shared_key and copy it to shared_keys
  */
-void get_shared_key(const Mono_Time *mono_time, Shared_Keys *shared_keys, uint8_t *shared_key,
-                    const uint8_t *secret_key, const uint8_t *public_key);
+void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key,
+                    const uint8_t *public_key);
 
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
  * for packets that we receive.
@@ -239,6 +261,18 @@ void dht_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *publi
  */
 void dht_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *public_key);
 
+/* Replace the DHT's shared key caches with empty ones holding capacity keys each.
+ *
+ * return true on success.
+ * return false on allocation failure, in which case the old caches are kept.
+ */
+bool dht_set_shared_keys_capacity(DHT *dht, uint32_t capacity);
+
+/* Copy the statistics of the caches used for received and sent DHT packets.
+ * Either pointer may be NULL.
+ */
+void dht_get_shared_keys_stats(const DHT *dht, Shared_Keys_Stats *recv, Shared_Keys_Stats *sent);
+
 void dht_getnodes(DHT *dht, const IP_Port *from_ipp, const uint8_t *from_id, const uint8_t *which_id);
 
 typedef void dht_ip_cb(void *object, int32_t number, IP_Port ip_port);
@@ -317,7 +351,8 @@ int get_close_nodes(const DHT *dht, const uint8_t *public_key, Node_format *node
  */
 uint16_t randfriends_nodes(DHT *dht, Node_format *nodes, uint16_t max_num);
 
-/* Put up to max_num nodes in nodes from the closelist.
+/* Put up to max_num nodes in nodes from the closelist, the ones answering our
+ * requests fastest.
  *
  * return the number of nodes.
  */
@@ -402,7 +437,44 @@ bool dht_isconnected(const DHT *dht);
  */
 bool dht_non_lan_connected(const DHT *dht);
 
+/* return the number of nodes in the close list that are not timed out. */
+uint16_t dht_get_num_close_nodes(const DHT *dht);
 
 uint32_t addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key);
 
+/* Same as addto_lists, for a node that just answered a request of ours after
+ * rtt milliseconds. The time is added to the node's smoothed round trip time.
+ */
+uint32_t addto_lists_rtt(DHT *dht, IP_Port ip_port, const uint8_t *public_key, uint32_t rtt);
+
+/* Return the time in milliseconds to store with a request, for
+ * addto_lists_answered once it is answered.
+ */
+uint64_t dht_request_time(DHT *dht);
+
+/* Same as addto_lists_rtt, for a node that just answered a request sent at
+ * sent_time, as returned by dht_request_time.
+ */
+uint32_t addto_lists_answered(DHT *dht, IP_Port ip_port, const uint8_t *public_key, uint64_t sent_time);
+
+/* Return the smoothed round trip time in milliseconds of the node with
+ * public_key at ip_port, or 0 if it isn't in the close list or never answered
+ * one of our requests.
+ */
+uint32_t dht_node_rtt(const DHT *dht, const uint8_t *public_key, const IP_Port *ip_port);
+
+typedef struct DHT_Rtt_Stats {
+    /* Addresses in the close list that are not timed out. */
+    uint32_t good;
+    /* Good addresses with a round trip time, the others never answered one of
+     * our requests. The times below are over these, or 0 if there are none. */
+    uint32_t measured;
+    uint32_t min_rtt;
+    uint32_t mean_rtt;
+    uint32_t max_rtt;
+} DHT_Rtt_Stats;
+
+/* Copy the round trip time statistics of the nodes in the close list. */
+void dht_get_rtt_stats(const DHT *dht, DHT_Rtt_Stats *stats);
+
 #endif
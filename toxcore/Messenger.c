@@ -466,6 +466,25 @@ int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber)
     return CONNECTION_NONE;
 }
 
+int m_get_friend_transport_stats(const Messenger *m, int32_t friendnumber, Crypto_Connection_Stats *stats)
+{
+    if (!friend_is_valid(m, friendnumber)) {
+        return -1;
+    }
+
+    if (m->friendlist[friendnumber].status != FRIEND_ONLINE) {
+        return -2;
+    }
+
+    const int crypt_conn_id = friend_connection_crypt_connection_id(m->fr_c, m->friendlist[friendnumber].friendcon_id);
+
+    if (crypto_connection_stats(m->net_crypto, crypt_conn_id, stats) != 0) {
+        return -2;
+    }
+
+    return 0;
+}
+
 int m_friend_exists(const Messenger *m, int32_t friendnumber)
 {
     if (!friend_is_valid(m, friendnumber)) {
@@ -1969,6 +1988,11 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
 
     m->net_crypto = new_net_crypto(m->log, m->mono_time, m->dht, &options->proxy_info);
 
+    if (m->net_crypto != nullptr && net_crypto_set_congestion_control(m->net_crypto, options->congestion_control) != 0) {
+        kill_net_crypto(m->net_crypto);
+        m->net_crypto = nullptr;
+    }
+
     if (m->net_crypto == nullptr) {
         kill_dht(m->dht);
         kill_networking(m->net);
@@ -2529,6 +2553,69 @@ uint32_t messenger_run_interval(const Messenger *m)
     return crypto_interval;
 }
 
+uint32_t messenger_copy_wait_sockets(const Messenger *m, Socket *socks, uint32_t max_num)
+{
+    uint32_t copied = 0;
+
+    const Socket udp_sock = net_sock(m->net);
+
+    if (sock_valid(udp_sock)) {
+        if (socks != nullptr && copied < max_num) {
+            socks[copied] = udp_sock;
+        }
+
+        ++copied;
+    }
+
+    if (m->tcp_server) {
+        const Socket server_sock = tcp_server_event_socket(m->tcp_server);
+
+        if (sock_valid(server_sock)) {
+            if (socks != nullptr && copied < max_num) {
+                socks[copied] = server_sock;
+            }
+
+            ++copied;
+        }
+    }
+
+    if (socks != nullptr) {
+        copied = min_u32(copied, max_num);
+        return copied + tcp_copy_sockets(nc_get_tcp_c(m->net_crypto), socks + copied, max_num - copied, nullptr);
+    }
+
+    return copied + tcp_copy_sockets(nc_get_tcp_c(m->net_crypto), nullptr, 0, nullptr);
+}
+
+uint64_t messenger_run_deadline(const Messenger *m)
+{
+    /* Everything except net_crypto's packet sending works in whole seconds. */
+    uint64_t deadline = min_u64(mono_time_next_second(m->mono_time), crypto_run_deadline(m->net_crypto));
+
+    bool tcp_wants_write;
+    tcp_copy_sockets(nc_get_tcp_c(m->net_crypto), nullptr, 0, &tcp_wants_write);
+
+    bool needs_polling = tcp_wants_write;
+
+    if (m->tcp_server) {
+        deadline = min_u64(deadline, tcp_server_run_deadline(m->tcp_server, m->mono_time));
+    }
+
+    /* File senders are fed from do_messenger() whenever there is room in the
+     * send queue, not when a socket becomes readable. */
+    for (uint32_t i = 0; i < m->numfriends && !needs_polling; ++i) {
+        if (m->friendlist[i].num_sending_files > 0) {
+            needs_polling = true;
+        }
+    }
+
+    if (needs_polling) {
+        deadline = min_u64(deadline, current_time_monotonic(m->mono_time) + MIN_RUN_INTERVAL);
+    }
+
+    return deadline;
+}
+
 /* The main loop that needs to be run at least 20 times per second. */
 void do_messenger(Messenger *m, void *userdata)
 {
@@ -2568,6 +2655,9 @@ void do_messenger(Messenger *m, void *userdata)
     do_friends(m, userdata);
     connection_status_callback(m, userdata);
 
+    /* Send everything queued during this iteration if send batching is on. */
+    networking_flush(m->net);
+
     if (mono_time_get(m->mono_time) > m->lastdump + DUMPING_CLIENTS_FRIENDS_EVERY_N_SECONDS) {
         m->lastdump = mono_time_get(m->mono_time);
         uint32_t last_pinged;
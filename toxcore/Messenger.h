@@ -64,6 +64,8 @@ typedef struct Messenger_Options {
     bool hole_punching_enabled;
     bool local_discovery_enabled;
 
+    Congestion_Control_Type congestion_control;
+
     logger_cb *log_callback;
     void *log_context;
     void *log_user_data;
@@ -369,6 +371,14 @@ int m_delfriend(Messenger *m, int32_t friendnumber);
  */
 int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber);
 
+/* Get the transport statistics of the connection to a friend.
+ *
+ *  return 0 on success.
+ *  return -1 if friendnumber is invalid.
+ *  return -2 if the friend is not online.
+ */
+int m_get_friend_transport_stats(const Messenger *m, int32_t friendnumber, Crypto_Connection_Stats *stats);
+
 /* Checks if there exists a friend with given friendnumber.
  *
  *  return 1 if friend exists.
@@ -739,6 +749,20 @@ void do_messenger(Messenger *m, void *userdata);
  */
 uint32_t messenger_run_interval(const Messenger *m);
 
+/* Copy the sockets that need to be watched for incoming data between calls to
+ * do_messenger() to socks, at most max_num of them. If socks is NULL, the
+ * sockets are only counted.
+ *
+ * return number of sockets.
+ */
+uint32_t messenger_copy_wait_sockets(const Messenger *m, Socket *socks, uint32_t max_num);
+
+/* Return the time in milliseconds, on the clock of current_time_monotonic(),
+ * at which do_messenger() has to be called again if none of the sockets from
+ * messenger_copy_wait_sockets() became readable before then.
+ */
+uint64_t messenger_run_deadline(const Messenger *m);
+
 /* SAVING AND LOADING FUNCTIONS: */
 
 /* Registers a state plugin for saving, loadding, and getting the size of a section of the save
@@ -1363,6 +1363,36 @@ int set_tcp_onion_status(TCP_Connections *tcp_c, bool status)
     return 0;
 }
 
+uint32_t tcp_copy_sockets(const TCP_Connections *tcp_c, Socket *socks, uint32_t max_num, bool *wants_write)
+{
+    uint32_t copied = 0;
+
+    if (wants_write != nullptr) {
+        *wants_write = false;
+    }
+
+    for (uint32_t i = 0; i < tcp_c->tcp_connections_length; ++i) {
+        const TCP_con *tcp_con = get_tcp_connection(tcp_c, i);
+
+        if (tcp_con == nullptr || tcp_con->connection == nullptr) {
+            continue;
+        }
+
+        if (wants_write != nullptr && tcp_con_wants_write(tcp_con->connection)) {
+            *wants_write = true;
+        }
+
+        if (socks == nullptr) {
+            ++copied;
+        } else if (copied < max_num) {
+            socks[copied] = tcp_con_sock(tcp_con->connection);
+            ++copied;
+        }
+    }
+
+    return copied;
+}
+
 /* Returns a new TCP_Connections object associated with the secret_key.
  *
  * In order for others to connect to this instance new_tcp_connection_to() must be called with the
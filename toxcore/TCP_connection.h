@@ -197,6 +197,16 @@ int add_tcp_relay_global(TCP_Connections *tcp_c, IP_Port ip_port, const uint8_t
  */
 uint32_t tcp_copy_connected_relays(TCP_Connections *tcp_c, Node_format *tcp_relays, uint16_t max_num);
 
+/* Copy the sockets of at most max_num TCP relay connections that are not
+ * sleeping to socks. If socks is NULL, the sockets are only counted.
+ *
+ * If wants_write is not NULL, it is set to whether any of these connections is
+ * waiting for its socket to become writable.
+ *
+ * return number of sockets.
+ */
+uint32_t tcp_copy_sockets(const TCP_Connections *tcp_c, Socket *socks, uint32_t max_num, bool *wants_write);
+
 /* Returns a new TCP_Connections object associated with the secret_key.
  *
  * In order for others to connect to this instance new_tcp_connection_to() must be called with the
@@ -12,6 +12,7 @@
 
 #include "TCP_server.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
@@ -20,10 +21,18 @@
 
 #ifdef TCP_SERVER_USE_EPOLL
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #endif
 
+#ifdef TCP_SERVER_USE_IO_URING
+#include <errno.h>
+#endif
+
+#include "hash_list.h"
 #include "mono_time.h"
+#include "timer_wheel.h"
+#include "uring.h"
 #include "util.h"
 
 #ifdef TCP_SERVER_USE_EPOLL
@@ -31,52 +40,191 @@
 #define TCP_SOCKET_INCOMING 1
 #define TCP_SOCKET_UNCONFIRMED 2
 #define TCP_SOCKET_CONFIRMED 3
+#define TCP_SOCKET_WAKEUP 4
+#endif
+
+#ifdef TCP_SERVER_USE_IO_URING
+/* Operation types besides the TCP_SOCKET_* ones, which are polls on the socket
+ * (or accepts for TCP_SOCKET_LISTENING, receives for TCP_SOCKET_CONFIRMED). */
+#define TCP_URING_SEND 5
+#define TCP_URING_DETACHED 6
+#define TCP_URING_FREE 7
+
+/* Number and size of the buffers each shard's ring receives into. */
+#define TCP_URING_BUFFERS 256
+#define TCP_URING_BUFFER_SIZE 4096
+
+/* Number of operations each shard's ring queues before submitting them. */
+#define TCP_URING_ENTRIES 1024
+
+/* How many times the send queue limit a connection queues on io_uring. */
+#define TCP_URING_SEND_QUEUE_SCALE 8
+
+/* An operation running on a shard's ring, for the connection at index in the
+ * queue or array type says. A killed connection leaves its operations
+ * detached, to be cleaned up once the kernel is done with them.
+ */
+typedef struct TCP_Uring_Op {
+    uint8_t type;
+    uint32_t index;
+    /* The send queue memory a send took over, of which it sends the bytes
+     * from offset to length. Freed along with the operation. */
+    uint8_t *buffer;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t next_free; /* Id of the next free operation, if this one is free. */
+} TCP_Uring_Op;
 #endif
 
 typedef struct TCP_Secure_Conn {
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint32_t shard; /* Shard the other connection is on. */
     uint32_t index;
+    uint64_t identifier; /* Identifier of the other connection. */
     // TODO(iphydf): Add an enum for this (same as in TCP_client.c, probably).
     uint8_t status; /* 0 if not used, 1 if other is offline, 2 if other is online. */
     uint8_t other_id;
 } TCP_Secure_Conn;
 
+/* Routes of a connection to other connections, by connection id (the id the
+ * client sees minus NUM_RESERVED_PORTS). Entries are only allocated up to the
+ * highest id in use, which stays low as the lowest free id is handed out
+ * first, and everything is freed once the last route is gone: most clients
+ * route to a handful of peers, if any.
+ */
+typedef struct TCP_Routing_Table {
+    TCP_Secure_Conn *entries; /* capacity entries, status 0 if unused. */
+    Hash_List keys; /* Public key of every used entry to its id. */
+    uint8_t capacity;
+    uint8_t count; /* Number of used entries. */
+} TCP_Routing_Table;
+
+/* Smallest number of entries allocated for a routing table. */
+#define TCP_ROUTING_TABLE_MIN_CAPACITY 4
+
+/* Ring buffer of encrypted packets waiting to be written to the socket. The
+ * memory is allocated the first time the socket can't take a packet right
+ * away and kept until the connection is killed, so queueing a packet never
+ * allocates after that.
+ */
+typedef struct TCP_Send_Queue {
+    uint8_t *data;
+    uint32_t capacity; /* Size of data. */
+    uint32_t start; /* Offset of the first byte not sent yet. */
+    uint32_t size; /* Number of bytes queued. */
+} TCP_Send_Queue;
+
 typedef struct TCP_Secure_Connection {
     Socket sock;
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
     uint8_t recv_nonce[CRYPTO_NONCE_SIZE]; /* Nonce of received packets. */
     uint8_t sent_nonce[CRYPTO_NONCE_SIZE]; /* Nonce of sent packets. */
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    uint16_t next_packet_length;
-    TCP_Secure_Conn connections[NUM_CLIENT_CONNECTIONS];
-    uint8_t last_packet[2 + MAX_PACKET_SIZE];
+    TCP_Recv_Buffer *recv_buffer; /* Only held while it has data, see read_packet_TCP_shard. */
+    TCP_Routing_Table routes;
     uint8_t status;
-    uint16_t last_packet_length;
-    uint16_t last_packet_sent;
 
-    TCP_Priority_List *priority_queue_start;
-    TCP_Priority_List *priority_queue_end;
+    TCP_Send_Queue send_queue;
 
     uint64_t identifier;
 
     uint64_t last_pinged;
     uint64_t ping_id;
+
+    uint32_t pending_position; /* Position in the shard's pending list plus 1, 0 if not on it. */
+
+#ifdef TCP_SERVER_USE_IO_URING
+    uint32_t read_op; /* Id of the poll or receive running on the socket, 0 if none. */
+    uint32_t send_op; /* Id of the send running on the socket, 0 if none. */
+#endif
 } TCP_Secure_Connection;
 
+/* Initial size of each of the two buffers of a shard's message queue, and the
+ * most bytes of messages it holds before packets posted to it get dropped.
+ * Control messages grow the buffers instead, as losing one would leave the two
+ * sides of a link disagreeing. */
+#define TCP_SHARD_QUEUE_SIZE (256 * 1024)
+
+/* Longest time in ms a worker thread waits for events before checking whether
+ * its connections need pinging. */
+#define TCP_SHARD_WAIT_TIMEOUT 1000
+
+/* Same, while connections have data queued that the socket didn't take. */
+#define TCP_SHARD_PENDING_WAIT_TIMEOUT 10
+
+/* How often in ms do_TCP_server has to run when it can't wait for events. */
+#define TCP_SERVER_POLL_INTERVAL 50
+
+typedef enum TCP_Shard_Message_Type {
+    /* A socket shard 0 accepted for the destination shard. */
+    TCP_SHARD_MESSAGE_ACCEPT,
+    /* The connection with public_key was confirmed on another shard under
+     * identifier, kill the one here if it is older. */
+    TCP_SHARD_MESSAGE_KILL,
+    /* The source connection asked to be routed to the connection with
+     * public_key. */
+    TCP_SHARD_MESSAGE_LINK,
+    /* Reply to TCP_SHARD_MESSAGE_LINK: the source connection linked its slot
+     * to the destination slot. */
+    TCP_SHARD_MESSAGE_LINKED,
+    /* The source connection dropped the link to the destination slot. */
+    TCP_SHARD_MESSAGE_UNLINK,
+    /* A packet to write to the destination connection. */
+    TCP_SHARD_MESSAGE_PACKET,
+    /* A packet to write to the connection with public_key. */
+    TCP_SHARD_MESSAGE_KEY_PACKET,
+    /* An onion request from the source connection, for the thread running
+     * do_TCP_server. */
+    TCP_SHARD_MESSAGE_ONION_REQUEST,
+} TCP_Shard_Message_Type;
+
+/* A message from one thread to another, followed by length bytes of data.
+ * Connections on other shards are addressed by index and identifier (as the
+ * index gets reused once the connection is killed) or by public key.
+ */
+typedef struct TCP_Shard_Message {
+    uint8_t type;
+    uint8_t slot; /* Connection slot of the destination. */
+    uint16_t length;
+    uint32_t index;
+    uint64_t identifier;
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    Socket sock;
 
-struct TCP_Server {
-    const Logger *logger;
-    Onion *onion;
+    uint32_t source_shard;
+    uint32_t source_index;
+    uint64_t source_identifier;
+    uint8_t source_slot;
+    uint8_t source_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+} TCP_Shard_Message;
 
+/* Messages for one thread. Senders append to pending under the lock, the
+ * receiver swaps the two buffers and handles the whole batch without holding
+ * it.
+ */
+typedef struct TCP_Shard_Queue {
+    pthread_mutex_t lock;
+    uint8_t *pending;
+    uint32_t pending_size;
+    uint32_t pending_capacity;
+    uint8_t *processing;
+    uint32_t processing_capacity;
+    bool stop;
 #ifdef TCP_SERVER_USE_EPOLL
-    int efd;
-    uint64_t last_run_pinged;
+    int wakeup_fd; /* eventfd that is readable while messages are pending. */
 #endif
-    Socket *socks_listening;
-    unsigned int num_listening_socks;
+} TCP_Shard_Queue;
 
-    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
-    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+/* A share of the server's connections with everything needed to run them. All
+ * fields are only used by the thread running the shard, except for queue.
+ */
+typedef struct TCP_Shard {
+    TCP_Server *tcp_server;
+    uint32_t id;
+
+#ifdef TCP_SERVER_USE_EPOLL
+    int efd;
+#endif
     TCP_Secure_Connection incoming_connection_queue[MAX_INCOMING_CONNECTIONS];
     uint16_t incoming_connection_queue_index;
     TCP_Secure_Connection unconfirmed_connection_queue[MAX_INCOMING_CONNECTIONS];
@@ -86,9 +234,64 @@ struct TCP_Server {
     uint32_t size_accepted_connections;
     uint32_t num_accepted_connections;
 
-    uint64_t counter;
+    Hash_List accepted_key_list;
+
+    /* Ping deadline of every accepted connection, by index, in seconds. */
+    Timer_Wheel ping_timers;
+
+    /* Indices of the accepted connections with data in their send queue. Has
+     * room for all of them, so adding one never fails. */
+    uint32_t *pending;
+    uint32_t num_pending;
+
+    /* Statistics of the shard as of stats_time, for tcp_server_get_stats while
+     * a worker thread runs it. */
+    TCP_Server_Stats stats;
+    uint64_t stats_time;
+
+    /* Receive buffer given back by the last connection that emptied its own,
+     * for the next one that reads. */
+    TCP_Recv_Buffer *spare_recv_buffer;
+
+    TCP_Shard_Queue queue;
+    pthread_t thread;
+
+#ifdef TCP_SERVER_USE_IO_URING
+    Uring *uring; /* nullptr if the shard runs on epoll. */
+    TCP_Uring_Op *uring_ops; /* By id minus 1. */
+    uint32_t size_uring_ops;
+    uint32_t num_uring_ops; /* Number of operations in use. */
+    uint32_t free_uring_op; /* Id of the first free operation, 0 if none. */
+#endif
+} TCP_Shard;
+
+struct TCP_Server {
+    const Logger *logger;
+    Onion *onion;
+
+    Socket *socks_listening;
+    unsigned int num_listening_socks;
+
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
 
-    BS_List accepted_key_list;
+    uint64_t counter;
+    uint32_t send_queue_limit;
+    bool use_io_uring; /* Whether shards try io_uring before epoll. */
+
+    TCP_Shard *shards;
+    uint32_t num_shards;
+
+    /* Everything below is only used once worker threads run the shards. */
+    bool threaded;
+    const Mono_Time *mono_time;
+    TCP_Shard_Queue queue; /* Onion requests for the thread calling do_TCP_server. */
+    uint32_t next_shard; /* Shard the next accepted socket goes to, only used by shard 0. */
+
+    /* Protects counter, key_shards and the stats of the shards when there is
+     * more than one shard. */
+    pthread_mutex_t directory_lock;
+    Hash_List key_shards; /* Shard of each accepted connection, by public key. */
 };
 
 const uint8_t *tcp_server_public_key(const TCP_Server *tcp_server)
@@ -101,6 +304,122 @@ size_t tcp_server_listen_count(const TCP_Server *tcp_server)
     return tcp_server->num_listening_socks;
 }
 
+void tcp_server_set_send_queue_limit(TCP_Server *tcp_server, uint32_t limit)
+{
+    tcp_server->send_queue_limit = max_u32(limit, TCP_SEND_QUEUE_MIN_LIMIT);
+}
+
+static void shard_get_stats(const TCP_Shard *shard, TCP_Server_Stats *stats)
+{
+    memset(stats, 0, sizeof(TCP_Server_Stats));
+
+    for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
+        if (shard->incoming_connection_queue[i].status == TCP_STATUS_CONNECTED) {
+            ++stats->incoming;
+        }
+
+        if (shard->unconfirmed_connection_queue[i].status == TCP_STATUS_UNCONFIRMED) {
+            ++stats->unconfirmed;
+        }
+    }
+
+    stats->confirmed = shard->num_accepted_connections;
+
+    for (uint32_t i = 0; i < shard->size_accepted_connections; ++i) {
+        const uint32_t size = shard->accepted_connection_array[i].send_queue.size;
+
+        if (size != 0) {
+            ++stats->queued;
+            stats->queued_bytes += size;
+            stats->max_queued_bytes = max_u32(stats->max_queued_bytes, size);
+        }
+    }
+}
+
+static void add_stats(TCP_Server_Stats *stats, const TCP_Server_Stats *shard_stats)
+{
+    stats->incoming += shard_stats->incoming;
+    stats->unconfirmed += shard_stats->unconfirmed;
+    stats->confirmed += shard_stats->confirmed;
+    stats->queued += shard_stats->queued;
+    stats->queued_bytes += shard_stats->queued_bytes;
+    stats->max_queued_bytes = max_u32(stats->max_queued_bytes, shard_stats->max_queued_bytes);
+}
+
+void tcp_server_get_stats(TCP_Server *tcp_server, TCP_Server_Stats *stats)
+{
+    if (!tcp_server->threaded) {
+        shard_get_stats(&tcp_server->shards[0], stats);
+        return;
+    }
+
+    memset(stats, 0, sizeof(TCP_Server_Stats));
+    pthread_mutex_lock(&tcp_server->directory_lock);
+
+    for (uint32_t i = 0; i < tcp_server->num_shards; ++i) {
+        add_stats(stats, &tcp_server->shards[i].stats);
+    }
+
+    pthread_mutex_unlock(&tcp_server->directory_lock);
+}
+
+Socket tcp_server_event_socket(const TCP_Server *tcp_server)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_server->threaded) {
+        const Socket sock = {tcp_server->queue.wakeup_fd};
+        return sock;
+    }
+
+#ifdef TCP_SERVER_USE_IO_URING
+
+    if (tcp_server->shards[0].uring != nullptr) {
+        const Socket sock = {uring_fd(tcp_server->shards[0].uring)};
+        return sock;
+    }
+
+#endif
+    const Socket sock = {tcp_server->shards[0].efd};
+    return sock;
+#else
+    return net_invalid_socket;
+#endif
+}
+
+uint64_t tcp_server_run_deadline(const TCP_Server *tcp_server, Mono_Time *mono_time)
+{
+    /* Pings are scheduled in whole seconds. */
+    const uint64_t next_second = mono_time_next_second(mono_time);
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_server->threaded) {
+        return next_second;
+    }
+
+    const TCP_Shard *const shard = &tcp_server->shards[0];
+
+#ifdef TCP_SERVER_USE_IO_URING
+
+    if (shard->uring != nullptr) {
+        /* Send completions make the ring readable. */
+        return next_second;
+    }
+
+#endif
+
+    if (shard->num_pending == 0) {
+        return next_second;
+    }
+
+    /* The socket didn't take all queued data, try again soon. */
+    return min_u64(next_second, current_time_monotonic(mono_time) + TCP_SHARD_PENDING_WAIT_TIMEOUT);
+#else
+    return min_u64(next_second, current_time_monotonic(mono_time) + TCP_SERVER_POLL_INTERVAL);
+#endif
+}
+
 /* This is needed to compile on Android below API 21
  */
 #ifdef TCP_SERVER_USE_EPOLL
@@ -114,28 +433,41 @@ size_t tcp_server_listen_count(const TCP_Server *tcp_server)
  *  return -1 on failure
  *  return 0 on success.
  */
-static int alloc_new_connections(TCP_Server *tcp_server, uint32_t num)
+static int alloc_new_connections(TCP_Shard *shard, uint32_t num)
 {
-    const uint32_t new_size = tcp_server->size_accepted_connections + num;
+    const uint32_t new_size = shard->size_accepted_connections + num;
 
-    if (new_size < tcp_server->size_accepted_connections) {
+    if (new_size < shard->size_accepted_connections) {
         return -1;
     }
 
     TCP_Secure_Connection *new_connections = (TCP_Secure_Connection *)realloc(
-                tcp_server->accepted_connection_array,
+                shard->accepted_connection_array,
                 new_size * sizeof(TCP_Secure_Connection));
 
     if (new_connections == nullptr) {
         return -1;
     }
 
-    const uint32_t old_size = tcp_server->size_accepted_connections;
+    shard->accepted_connection_array = new_connections;
+
+    uint32_t *new_pending = (uint32_t *)realloc(shard->pending, new_size * sizeof(uint32_t));
+
+    if (new_pending == nullptr) {
+        return -1;
+    }
+
+    shard->pending = new_pending;
+
+    if (!timer_wheel_reserve(&shard->ping_timers, new_size)) {
+        return -1;
+    }
+
+    const uint32_t old_size = shard->size_accepted_connections;
     const uint32_t size_new_entries = num * sizeof(TCP_Secure_Connection);
     memset(new_connections + old_size, 0, size_new_entries);
 
-    tcp_server->accepted_connection_array = new_connections;
-    tcp_server->size_accepted_connections = new_size;
+    shard->size_accepted_connections = new_size;
     return 0;
 }
 
@@ -148,1312 +480,3253 @@ void wipe_priority_list(TCP_Priority_List *p)
     }
 }
 
-static void wipe_secure_connection(TCP_Secure_Connection *con)
+/* return the entry with connection id in table, nullptr if it isn't used. */
+static TCP_Secure_Conn *get_route(const TCP_Routing_Table *table, uint32_t id)
 {
-    if (con->status) {
-        wipe_priority_list(con->priority_queue_start);
-        crypto_memzero(con, sizeof(TCP_Secure_Connection));
+    if (id >= table->capacity || table->entries[id].status == 0) {
+        return nullptr;
     }
-}
 
-static void move_secure_connection(TCP_Secure_Connection *con_new, TCP_Secure_Connection *con_old)
-{
-    memcpy(con_new, con_old, sizeof(TCP_Secure_Connection));
-    crypto_memzero(con_old, sizeof(TCP_Secure_Connection));
+    return &table->entries[id];
 }
 
-static void free_accepted_connection_array(TCP_Server *tcp_server)
+/* return the connection id of the route to public_key.
+ * return -1 if there is none.
+ */
+static int find_route(const TCP_Routing_Table *table, const uint8_t *public_key)
 {
-    if (tcp_server->accepted_connection_array == nullptr) {
-        return;
-    }
-
-    for (uint32_t i = 0; i < tcp_server->size_accepted_connections; ++i) {
-        wipe_secure_connection(&tcp_server->accepted_connection_array[i]);
-    }
-
-    free(tcp_server->accepted_connection_array);
-    tcp_server->accepted_connection_array = nullptr;
-    tcp_server->size_accepted_connections = 0;
+    return hash_list_find(&table->keys, public_key);
 }
 
-/* return index corresponding to connection with peer on success
- * return -1 on failure.
- */
-static int get_TCP_connection_index(const TCP_Server *tcp_server, const uint8_t *public_key)
+static void free_routes(TCP_Routing_Table *table)
 {
-    return bs_list_find(&tcp_server->accepted_key_list, public_key);
+    free(table->entries);
+    hash_list_free(&table->keys);
+    table->entries = nullptr;
+    table->capacity = 0;
+    table->count = 0;
 }
 
-
-static int kill_accepted(TCP_Server *tcp_server, int index);
-
-/* Add accepted TCP connection to the list.
+/* Add a route to public_key, which must not have one yet, with status 1 under
+ * the lowest free connection id.
  *
- * return index on success
- * return -1 on failure
+ * return the connection id.
+ * return -1 if all ids are used or memory allocation failed.
  */
-static int add_accepted(TCP_Server *tcp_server, const Mono_Time *mono_time, TCP_Secure_Connection *con)
+static int add_route(TCP_Routing_Table *table, const uint8_t *public_key)
 {
-    int index = get_TCP_connection_index(tcp_server, con->public_key);
+    uint32_t id = 0;
 
-    if (index != -1) { /* If an old connection to the same public key exists, kill it. */
-        kill_accepted(tcp_server, index);
-        index = -1;
+    while (id < table->capacity && table->entries[id].status != 0) {
+        ++id;
     }
 
-    if (tcp_server->size_accepted_connections == tcp_server->num_accepted_connections) {
-        if (alloc_new_connections(tcp_server, 4) == -1) {
+    if (id == table->capacity) {
+        if (table->capacity == NUM_CLIENT_CONNECTIONS) {
             return -1;
         }
 
-        index = tcp_server->num_accepted_connections;
-    } else {
-        uint32_t i;
+        uint32_t capacity = table->capacity * 2;
 
-        for (i = tcp_server->size_accepted_connections; i != 0; --i) {
-            if (tcp_server->accepted_connection_array[i - 1].status == TCP_STATUS_NO_STATUS) {
-                index = i - 1;
-                break;
-            }
+        if (capacity < TCP_ROUTING_TABLE_MIN_CAPACITY) {
+            capacity = TCP_ROUTING_TABLE_MIN_CAPACITY;
         }
-    }
 
-    if (index == -1) {
-        LOGGER_ERROR(tcp_server->logger, "FAIL index is -1");
-        return -1;
-    }
+        if (capacity > NUM_CLIENT_CONNECTIONS) {
+            capacity = NUM_CLIENT_CONNECTIONS;
+        }
 
-    if (!bs_list_add(&tcp_server->accepted_key_list, con->public_key, index)) {
-        return -1;
-    }
+        TCP_Secure_Conn *entries = (TCP_Secure_Conn *)realloc(table->entries, capacity * sizeof(TCP_Secure_Conn));
 
-    move_secure_connection(&tcp_server->accepted_connection_array[index], con);
+        if (entries == nullptr) {
+            return -1;
+        }
 
-    tcp_server->accepted_connection_array[index].status = TCP_STATUS_CONFIRMED;
-    ++tcp_server->num_accepted_connections;
-    tcp_server->accepted_connection_array[index].identifier = ++tcp_server->counter;
-    tcp_server->accepted_connection_array[index].last_pinged = mono_time_get(mono_time);
-    tcp_server->accepted_connection_array[index].ping_id = 0;
+        memset(entries + table->capacity, 0, (capacity - table->capacity) * sizeof(TCP_Secure_Conn));
 
-    return index;
-}
+        if (table->capacity == 0 && !hash_list_init(&table->keys, CRYPTO_PUBLIC_KEY_SIZE, 0)) {
+            free(entries);
+            return -1;
+        }
 
-/* Delete accepted connection from list.
- *
- * return 0 on success
- * return -1 on failure
- */
-static int del_accepted(TCP_Server *tcp_server, int index)
-{
-    if ((uint32_t)index >= tcp_server->size_accepted_connections) {
-        return -1;
+        table->entries = entries;
+        table->capacity = capacity;
     }
 
-    if (tcp_server->accepted_connection_array[index].status == TCP_STATUS_NO_STATUS) {
-        return -1;
-    }
+    if (!hash_list_add(&table->keys, public_key, id)) {
+        if (table->count == 0) {
+            free_routes(table);
+        }
 
-    if (!bs_list_remove(&tcp_server->accepted_key_list, tcp_server->accepted_connection_array[index].public_key, index)) {
         return -1;
     }
 
-    wipe_secure_connection(&tcp_server->accepted_connection_array[index]);
-    --tcp_server->num_accepted_connections;
-
-    if (tcp_server->num_accepted_connections == 0) {
-        free_accepted_connection_array(tcp_server);
-    }
-
-    return 0;
+    TCP_Secure_Conn *const conn = &table->entries[id];
+    memset(conn, 0, sizeof(TCP_Secure_Conn));
+    memcpy(conn->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    conn->status = 1;
+    ++table->count;
+    return id;
 }
 
-/* Read the next two bytes in TCP stream then convert them to
- * length (host byte order).
- *
- * return length on success
- * return 0 if nothing has been read from socket.
- * return -1 on failure.
+/* Remove the route with connection id from table, freeing the table once it
+ * is empty.
  */
-uint16_t read_TCP_length(const Logger *logger, Socket sock)
+static void remove_route(TCP_Routing_Table *table, uint32_t id)
 {
-    const unsigned int count = net_socket_data_recv_buffer(sock);
+    TCP_Secure_Conn *const conn = get_route(table, id);
 
-    if (count >= sizeof(uint16_t)) {
-        uint16_t length;
-        const int len = net_recv(sock, &length, sizeof(uint16_t));
-
-        if (len != sizeof(uint16_t)) {
-            LOGGER_ERROR(logger, "FAIL recv packet");
-            return 0;
-        }
-
-        length = net_ntohs(length);
+    if (conn == nullptr) {
+        return;
+    }
 
-        if (length > MAX_PACKET_SIZE) {
-            return -1;
-        }
+    hash_list_remove(&table->keys, conn->public_key, id);
+    memset(conn, 0, sizeof(TCP_Secure_Conn));
 
-        return length;
+    if (--table->count == 0) {
+        free_routes(table);
     }
-
-    return 0;
 }
 
-/* Read length bytes from socket.
- *
- * return length on success
- * return -1 on failure/no data in buffer.
- */
-int read_TCP_packet(const Logger *logger, Socket sock, uint8_t *data, uint16_t length)
+static void wipe_secure_connection(TCP_Secure_Connection *con)
 {
-    unsigned int count = net_socket_data_recv_buffer(sock);
+    if (con->status) {
+        free(con->recv_buffer);
+        free_routes(&con->routes);
+        free(con->send_queue.data);
+        crypto_memzero(con, sizeof(TCP_Secure_Connection));
+    }
+}
 
-    if (count >= length) {
-        const int len = net_recv(sock, data, length);
+static void move_secure_connection(TCP_Secure_Connection *con_new, TCP_Secure_Connection *con_old)
+{
+    memcpy(con_new, con_old, sizeof(TCP_Secure_Connection));
+    crypto_memzero(con_old, sizeof(TCP_Secure_Connection));
+}
 
-        if (len != length) {
-            LOGGER_ERROR(logger, "FAIL recv packet");
-            return -1;
-        }
+static void free_accepted_connection_array(TCP_Shard *shard)
+{
+    if (shard->accepted_connection_array == nullptr) {
+        return;
+    }
 
-        return len;
+    for (uint32_t i = 0; i < shard->size_accepted_connections; ++i) {
+        wipe_secure_connection(&shard->accepted_connection_array[i]);
     }
 
-    return -1;
+    free(shard->accepted_connection_array);
+    shard->accepted_connection_array = nullptr;
+    shard->size_accepted_connections = 0;
+
+    free(shard->pending);
+    shard->pending = nullptr;
+    shard->num_pending = 0;
 }
 
-/* return length of received packet on success.
- * return 0 if could not read any packet.
- * return -1 on failure (connection must be killed).
+#ifdef TCP_SERVER_USE_IO_URING
+/* return id of a new operation of type for the connection at index.
+ * return 0 on failure.
  */
-int read_packet_TCP_secure_connection(const Logger *logger, Socket sock, uint16_t *next_packet_length,
-                                      const uint8_t *shared_key, uint8_t *recv_nonce, uint8_t *data, uint16_t max_len)
+static uint32_t new_uring_op(TCP_Shard *shard, uint8_t type, uint32_t index)
 {
-    if (*next_packet_length == 0) {
-        uint16_t len = read_TCP_length(logger, sock);
+    if (shard->free_uring_op == 0) {
+        const uint32_t size = shard->size_uring_ops == 0 ? 64 : shard->size_uring_ops * 2;
+        TCP_Uring_Op *const ops = (TCP_Uring_Op *)realloc(shard->uring_ops, size * sizeof(TCP_Uring_Op));
 
-        if (len == (uint16_t) -1) {
-            return -1;
+        if (ops == nullptr) {
+            return 0;
         }
 
-        if (len == 0) {
-            return 0;
+        for (uint32_t i = shard->size_uring_ops; i < size; ++i) {
+            ops[i].type = TCP_URING_FREE;
+            ops[i].buffer = nullptr;
+            ops[i].next_free = i + 1 < size ? i + 2 : 0;
         }
 
-        *next_packet_length = len;
+        shard->uring_ops = ops;
+        shard->free_uring_op = shard->size_uring_ops + 1;
+        shard->size_uring_ops = size;
     }
 
-    if (max_len + CRYPTO_MAC_SIZE < *next_packet_length) {
-        return -1;
-    }
+    const uint32_t id = shard->free_uring_op;
+    TCP_Uring_Op *const op = &shard->uring_ops[id - 1];
+    shard->free_uring_op = op->next_free;
+    op->type = type;
+    op->index = index;
+    op->buffer = nullptr;
+    ++shard->num_uring_ops;
+    return id;
+}
 
-    VLA(uint8_t, data_encrypted, *next_packet_length);
-    int len_packet = read_TCP_packet(logger, sock, data_encrypted, *next_packet_length);
+static void free_uring_op(TCP_Shard *shard, uint32_t id)
+{
+    TCP_Uring_Op *const op = &shard->uring_ops[id - 1];
+    free(op->buffer);
+    op->buffer = nullptr;
+    op->type = TCP_URING_FREE;
+    op->next_free = shard->free_uring_op;
+    shard->free_uring_op = id;
+    --shard->num_uring_ops;
+}
 
-    if (len_packet != *next_packet_length) {
-        return 0;
+/* Cancel the operations running for a connection that is being killed. They
+ * stay allocated until their last completion, along with the memory a send
+ * may still read from.
+ */
+static void detach_uring_ops(TCP_Shard *shard, TCP_Secure_Connection *con)
+{
+    if (con->read_op != 0) {
+        shard->uring_ops[con->read_op - 1].type = TCP_URING_DETACHED;
+        uring_cancel(shard->uring, con->read_op);
+        con->read_op = 0;
     }
 
-    *next_packet_length = 0;
+    if (con->send_op != 0) {
+        shard->uring_ops[con->send_op - 1].type = TCP_URING_DETACHED;
+        uring_cancel(shard->uring, con->send_op);
+        con->send_op = 0;
+    }
+}
 
-    int len = decrypt_data_symmetric(shared_key, recv_nonce, data_encrypted, len_packet, data);
+/* Poll the socket of an incoming (type TCP_SOCKET_INCOMING) or unconfirmed
+ * (TCP_SOCKET_UNCONFIRMED) connection for the next part of the handshake.
+ *
+ * return false on failure.
+ */
+static bool tcp_uring_poll(TCP_Shard *shard, uint8_t type, uint32_t index)
+{
+    TCP_Secure_Connection *const con = type == TCP_SOCKET_INCOMING
+                                       ? &shard->incoming_connection_queue[index]
+                                       : &shard->unconfirmed_connection_queue[index];
+    const uint32_t id = new_uring_op(shard, type, index);
 
-    if (len + CRYPTO_MAC_SIZE != len_packet) {
-        return -1;
+    if (id == 0) {
+        return false;
     }
 
-    increment_nonce(recv_nonce);
+    if (!uring_poll(shard->uring, con->sock.socket, false, id)) {
+        free_uring_op(shard, id);
+        return false;
+    }
 
-    return len;
+    con->read_op = id;
+    return true;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
+/* Receive on the socket of an accepted connection, until it is killed.
+ *
+ * return false on failure.
  */
-static int send_pending_data_nonpriority(TCP_Secure_Connection *con)
+static bool tcp_uring_recv(TCP_Shard *shard, uint32_t index)
 {
-    if (con->last_packet_length == 0) {
-        return 0;
+    TCP_Secure_Connection *const con = &shard->accepted_connection_array[index];
+    const uint32_t id = new_uring_op(shard, TCP_SOCKET_CONFIRMED, index);
+
+    if (id == 0) {
+        return false;
     }
 
-    const uint16_t left = con->last_packet_length - con->last_packet_sent;
-    const int len = net_send(con->sock, con->last_packet + con->last_packet_sent, left);
+    if (!uring_recv(shard->uring, con->sock.socket, id)) {
+        free_uring_op(shard, id);
+        return false;
+    }
 
-    if (len <= 0) {
-        return -1;
+    con->read_op = id;
+    return true;
+}
+
+/* Send the bytes of buffer from offset to length on an accepted connection.
+ * The send owns buffer if this succeeds.
+ *
+ * return false on failure.
+ */
+static bool tcp_uring_send_buffer(TCP_Shard *shard, uint32_t index, uint8_t *buffer, uint32_t offset,
+                                  uint32_t length)
+{
+    TCP_Secure_Connection *const con = &shard->accepted_connection_array[index];
+    const uint32_t id = new_uring_op(shard, TCP_URING_SEND, index);
+
+    if (id == 0) {
+        return false;
     }
 
-    if (len == left) {
-        con->last_packet_length = 0;
-        con->last_packet_sent = 0;
-        return 0;
+    if (!uring_send(shard->uring, con->sock.socket, buffer + offset, length - offset, id)) {
+        free_uring_op(shard, id);
+        return false;
     }
 
-    con->last_packet_sent += len;
-    return -1;
+    TCP_Uring_Op *const op = &shard->uring_ops[id - 1];
+    op->buffer = buffer;
+    op->offset = offset;
+    op->length = length;
+    con->send_op = id;
+    return true;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
+/* Hand the send queue of an accepted connection over to a send, leaving it
+ * empty for the packets that follow. On io_uring the queue never wraps, as it
+ * only ever grows until a send takes all of it.
+ *
+ * return false on failure.
  */
-static int send_pending_data(TCP_Secure_Connection *con)
+static bool tcp_uring_send(TCP_Shard *shard, uint32_t index)
 {
-    /* finish sending current non-priority packet */
-    if (send_pending_data_nonpriority(con) == -1) {
-        return -1;
-    }
-
-    TCP_Priority_List *p = con->priority_queue_start;
+    TCP_Send_Queue *const queue = &shard->accepted_connection_array[index].send_queue;
 
-    while (p) {
-        const uint16_t left = p->size - p->sent;
-        const int len = net_send(con->sock, p->data + p->sent, left);
+    if (!tcp_uring_send_buffer(shard, index, queue->data, 0, queue->size)) {
+        return false;
+    }
 
-        if (len != left) {
-            if (len > 0) {
-                p->sent += len;
-            }
+    queue->data = nullptr;
+    queue->size = 0;
+    return true;
+}
 
-            break;
-        }
+/* Accept on the listening socket with index i, until the ring is destroyed.
+ *
+ * return false on failure.
+ */
+static bool tcp_uring_accept(TCP_Shard *shard, uint32_t i)
+{
+    const uint32_t id = new_uring_op(shard, TCP_SOCKET_LISTENING, i);
 
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
+    if (id == 0) {
+        return false;
     }
 
-    con->priority_queue_start = p;
-
-    if (!p) {
-        con->priority_queue_end = nullptr;
-        return 0;
+    if (!uring_accept(shard->uring, shard->tcp_server->socks_listening[i].socket, id)) {
+        free_uring_op(shard, id);
+        return false;
     }
 
-    return -1;
+    return true;
 }
 
-/* return 0 on failure (only if malloc fails)
- * return 1 on success
+/* Poll the eventfd of the shard's message queue, until the ring is destroyed.
+ *
+ * return false on failure.
  */
-static bool add_priority(TCP_Secure_Connection *con, const uint8_t *packet, uint16_t size, uint16_t sent)
+static bool tcp_uring_wakeup(TCP_Shard *shard)
 {
-    TCP_Priority_List *p = con->priority_queue_end;
-    TCP_Priority_List *new_list = (TCP_Priority_List *)malloc(sizeof(TCP_Priority_List) + size);
+    const uint32_t id = new_uring_op(shard, TCP_SOCKET_WAKEUP, 0);
 
-    if (!new_list) {
-        return 0;
+    if (id == 0) {
+        return false;
     }
 
-    new_list->next = nullptr;
-    new_list->size = size;
-    new_list->sent = sent;
-    memcpy(new_list->data, packet, size);
-
-    if (p) {
-        p->next = new_list;
-    } else {
-        con->priority_queue_start = new_list;
+    if (!uring_poll(shard->uring, shard->queue.wakeup_fd, true, id)) {
+        free_uring_op(shard, id);
+        return false;
     }
 
-    con->priority_queue_end = new_list;
-    return 1;
+    return true;
 }
+#endif
 
-/* return 1 on success.
- * return 0 if could not send packet.
- * return -1 on failure (connection must be killed).
+/* return index corresponding to connection with peer on success
+ * return -1 on failure.
  */
-static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const uint8_t *data, uint16_t length,
-        bool priority)
+static int get_TCP_connection_index(const TCP_Shard *shard, const uint8_t *public_key)
 {
-    if (length + CRYPTO_MAC_SIZE > MAX_PACKET_SIZE) {
-        return -1;
-    }
+    return hash_list_find(&shard->accepted_key_list, public_key);
+}
 
-    bool sendpriority = 1;
+/* Message size rounded up so that the next message in a queue is aligned. */
+static uint32_t shard_message_size(uint16_t length)
+{
+    const uint32_t size = sizeof(TCP_Shard_Message) + length;
+    return (size + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+}
 
-    if (send_pending_data(con) == -1) {
-        if (priority) {
-            sendpriority = 0;
-        } else {
-            return 0;
-        }
-    }
+#ifdef TCP_SERVER_USE_EPOLL
+/* return true on success.
+ * return false on failure.
+ */
+static bool shard_queue_init(TCP_Shard_Queue *queue)
+{
+    queue->pending = (uint8_t *)malloc(TCP_SHARD_QUEUE_SIZE);
+    queue->processing = (uint8_t *)malloc(TCP_SHARD_QUEUE_SIZE);
+    queue->pending_size = 0;
+    queue->pending_capacity = TCP_SHARD_QUEUE_SIZE;
+    queue->processing_capacity = TCP_SHARD_QUEUE_SIZE;
+    queue->stop = false;
 
-    VLA(uint8_t, packet, sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
+    bool ok = queue->pending != nullptr && queue->processing != nullptr;
 
-    const uint16_t c_length = net_htons(length + CRYPTO_MAC_SIZE);
-    memcpy(packet, &c_length, sizeof(uint16_t));
-    int len = encrypt_data_symmetric(con->shared_key, con->sent_nonce, data, length, packet + sizeof(uint16_t));
+#ifdef TCP_SERVER_USE_EPOLL
+    queue->wakeup_fd = -1;
 
-    if ((unsigned int)len != (SIZEOF_VLA(packet) - sizeof(uint16_t))) {
-        return -1;
+    if (ok) {
+        queue->wakeup_fd = eventfd(0, EFD_NONBLOCK);
+        ok = queue->wakeup_fd != -1;
     }
 
-    if (priority) {
-        len = sendpriority ? net_send(con->sock, packet, SIZEOF_VLA(packet)) : 0;
-
-        if (len <= 0) {
-            len = 0;
-        }
-
-        increment_nonce(con->sent_nonce);
-
-        if ((unsigned int)len == SIZEOF_VLA(packet)) {
-            return 1;
-        }
+#endif
 
-        return add_priority(con, packet, SIZEOF_VLA(packet), len);
+    if (ok && pthread_mutex_init(&queue->lock, nullptr) == 0) {
+        return true;
     }
 
-    len = net_send(con->sock, packet, SIZEOF_VLA(packet));
+#ifdef TCP_SERVER_USE_EPOLL
 
-    if (len <= 0) {
-        return 0;
+    if (queue->wakeup_fd != -1) {
+        close(queue->wakeup_fd);
     }
 
-    increment_nonce(con->sent_nonce);
+#endif
+    free(queue->pending);
+    free(queue->processing);
+    queue->pending = nullptr;
+    queue->processing = nullptr;
+    return false;
+}
 
-    if ((unsigned int)len == SIZEOF_VLA(packet)) {
-        return 1;
+#endif
+
+static void shard_queue_free(TCP_Shard_Queue *queue)
+{
+    if (queue->pending == nullptr) {
+        return;
     }
 
-    memcpy(con->last_packet, packet, SIZEOF_VLA(packet));
-    con->last_packet_length = SIZEOF_VLA(packet);
-    con->last_packet_sent = len;
-    return 1;
+#ifdef TCP_SERVER_USE_EPOLL
+    close(queue->wakeup_fd);
+#endif
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->pending);
+    free(queue->processing);
+    queue->pending = nullptr;
+    queue->processing = nullptr;
 }
 
-/* Kill a TCP_Secure_Connection
- */
-static void kill_TCP_secure_connection(TCP_Secure_Connection *con)
+static void shard_queue_wake(TCP_Shard_Queue *queue)
 {
-    kill_sock(con->sock);
-    wipe_secure_connection(con);
-}
+#ifdef TCP_SERVER_USE_EPOLL
+    const uint64_t one = 1;
+
+    if (write(queue->wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+        // The counter can only be full if the receiver is already awake.
+    }
 
-static int rm_connection_index(TCP_Server *tcp_server, TCP_Secure_Connection *con, uint8_t con_number);
+#endif
+}
 
-/* Kill an accepted TCP_Secure_Connection
+/* Grow the pending buffer of a queue to hold at least size bytes. Must be
+ * called with the queue's lock held.
  *
- * return -1 on failure.
- * return 0 on success.
+ * return true on success.
+ * return false on failure.
  */
-static int kill_accepted(TCP_Server *tcp_server, int index)
+static bool shard_queue_grow(TCP_Shard_Queue *queue, uint32_t size)
 {
-    if ((uint32_t)index >= tcp_server->size_accepted_connections) {
-        return -1;
-    }
+    uint32_t capacity = queue->pending_capacity;
 
-    uint32_t i;
+    while (capacity < size) {
+        if (capacity > UINT32_MAX / 2) {
+            return false;
+        }
 
-    for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
-        rm_connection_index(tcp_server, &tcp_server->accepted_connection_array[index], i);
+        capacity *= 2;
     }
 
-    Socket sock = tcp_server->accepted_connection_array[index].sock;
+    uint8_t *const pending = (uint8_t *)realloc(queue->pending, capacity);
 
-    if (del_accepted(tcp_server, index) != 0) {
-        return -1;
+    if (pending == nullptr) {
+        return false;
     }
 
-    kill_sock(sock);
-    return 0;
+    queue->pending = pending;
+    queue->pending_capacity = capacity;
+    return true;
 }
 
-/* return 1 if everything went well.
- * return -1 if the connection must be killed.
+/* Append a message and its data to a queue. Only the thread owning the queue
+ * gets woken up, and only if it didn't have messages pending already.
+ *
+ * Packets are dropped once the queue holds TCP_SHARD_QUEUE_SIZE bytes, while
+ * control messages grow it as far as memory allows.
+ *
+ * return true on success.
+ * return false if the queue is full.
  */
-static int handle_TCP_handshake(TCP_Secure_Connection *con, const uint8_t *data, uint16_t length,
-                                const uint8_t *self_secret_key)
+static bool shard_queue_post(TCP_Shard_Queue *queue, const TCP_Shard_Message *msg, const uint8_t *data, bool control)
 {
-    if (length != TCP_CLIENT_HANDSHAKE_SIZE) {
-        return -1;
-    }
+    const uint32_t size = shard_message_size(msg->length);
 
-    if (con->status != TCP_STATUS_CONNECTED) {
-        return -1;
-    }
+    pthread_mutex_lock(&queue->lock);
 
-    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    encrypt_precompute(data, self_secret_key, shared_key);
-    uint8_t plain[TCP_HANDSHAKE_PLAIN_SIZE];
-    int len = decrypt_data_symmetric(shared_key, data + CRYPTO_PUBLIC_KEY_SIZE,
-                                     data + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE, TCP_HANDSHAKE_PLAIN_SIZE + CRYPTO_MAC_SIZE, plain);
+    const uint32_t needed = queue->pending_size + size;
+    const bool fits = control ? (needed <= queue->pending_capacity || shard_queue_grow(queue, needed))
+                      : needed <= TCP_SHARD_QUEUE_SIZE;
 
-    if (len != TCP_HANDSHAKE_PLAIN_SIZE) {
-        return -1;
+    if (!fits) {
+        pthread_mutex_unlock(&queue->lock);
+        return false;
     }
 
-    memcpy(con->public_key, data, CRYPTO_PUBLIC_KEY_SIZE);
-    uint8_t temp_secret_key[CRYPTO_SECRET_KEY_SIZE];
-    uint8_t resp_plain[TCP_HANDSHAKE_PLAIN_SIZE];
-    crypto_new_keypair(resp_plain, temp_secret_key);
-    random_nonce(con->sent_nonce);
-    memcpy(resp_plain + CRYPTO_PUBLIC_KEY_SIZE, con->sent_nonce, CRYPTO_NONCE_SIZE);
-    memcpy(con->recv_nonce, plain + CRYPTO_PUBLIC_KEY_SIZE, CRYPTO_NONCE_SIZE);
-
-    uint8_t response[TCP_SERVER_HANDSHAKE_SIZE];
-    random_nonce(response);
-
-    len = encrypt_data_symmetric(shared_key, response, resp_plain, TCP_HANDSHAKE_PLAIN_SIZE,
-                                 response + CRYPTO_NONCE_SIZE);
+    uint8_t *const pos = queue->pending + queue->pending_size;
+    memcpy(pos, msg, sizeof(TCP_Shard_Message));
 
-    if (len != TCP_HANDSHAKE_PLAIN_SIZE + CRYPTO_MAC_SIZE) {
-        return -1;
+    if (msg->length != 0) {
+        memcpy(pos + sizeof(TCP_Shard_Message), data, msg->length);
     }
 
-    if (TCP_SERVER_HANDSHAKE_SIZE != net_send(con->sock, response, TCP_SERVER_HANDSHAKE_SIZE)) {
-        return -1;
+    const bool was_empty = queue->pending_size == 0;
+    queue->pending_size += size;
+    pthread_mutex_unlock(&queue->lock);
+
+    if (was_empty) {
+        shard_queue_wake(queue);
     }
 
-    encrypt_precompute(plain, temp_secret_key, con->shared_key);
-    con->status = TCP_STATUS_UNCONFIRMED;
-    return 1;
+    return true;
 }
 
-/* return 1 if connection handshake was handled correctly.
- * return 0 if we didn't get it yet.
- * return -1 if the connection must be killed.
+/* Move the pending messages to the processing buffer.
+ *
+ * return the number of bytes of messages in the processing buffer.
  */
-static int read_connection_handshake(const Logger *logger, TCP_Secure_Connection *con, const uint8_t *self_secret_key)
+static uint32_t shard_queue_take(TCP_Shard_Queue *queue, bool *stop)
 {
-    uint8_t data[TCP_CLIENT_HANDSHAKE_SIZE];
-    const int len = read_TCP_packet(logger, con->sock, data, TCP_CLIENT_HANDSHAKE_SIZE);
+#ifdef TCP_SERVER_USE_EPOLL
+    /* Reset the eventfd before taking the messages, so that one posted right
+     * after the swap wakes the receiver up again. */
+    uint64_t count;
 
-    if (len != -1) {
-        return handle_TCP_handshake(con, data, len, self_secret_key);
+    if (read(queue->wakeup_fd, &count, sizeof(count)) != sizeof(count)) {
+        // Nothing was posted since the last call.
     }
 
-    return 0;
-}
-
-/* return 1 on success.
- * return 0 if could not send packet.
- * return -1 on failure (connection must be killed).
- */
-static int send_routing_response(TCP_Secure_Connection *con, uint8_t rpid, const uint8_t *public_key)
-{
-    uint8_t data[1 + 1 + CRYPTO_PUBLIC_KEY_SIZE];
-    data[0] = TCP_PACKET_ROUTING_RESPONSE;
-    data[1] = rpid;
-    memcpy(data + 2, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+#endif
 
-    return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
+    pthread_mutex_lock(&queue->lock);
+    uint8_t *const batch = queue->pending;
+    const uint32_t size = queue->pending_size;
+    const uint32_t capacity = queue->pending_capacity;
+    queue->pending = queue->processing;
+    queue->pending_size = 0;
+    queue->pending_capacity = queue->processing_capacity;
+    queue->processing = batch;
+    queue->processing_capacity = capacity;
+    *stop = queue->stop;
+    pthread_mutex_unlock(&queue->lock);
+
+    return size;
 }
 
-/* return 1 on success.
- * return 0 if could not send packet.
- * return -1 on failure (connection must be killed).
- */
-static int send_connect_notification(TCP_Secure_Connection *con, uint8_t id)
+#ifdef TCP_SERVER_USE_EPOLL
+static void shard_queue_stop(TCP_Shard_Queue *queue)
 {
-    uint8_t data[2] = {TCP_PACKET_CONNECTION_NOTIFICATION, (uint8_t)(id + NUM_RESERVED_PORTS)};
-    return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
+    pthread_mutex_lock(&queue->lock);
+    queue->stop = true;
+    pthread_mutex_unlock(&queue->lock);
+    shard_queue_wake(queue);
 }
 
-/* return 1 on success.
- * return 0 if could not send packet.
- * return -1 on failure (connection must be killed).
+#endif
+
+/* Post a message to another shard. Only packets are dropped when its queue is
+ * full, the other messages only fail to post if memory runs out.
+ *
+ * return true on success.
+ * return false on failure.
  */
-static int send_disconnect_notification(TCP_Secure_Connection *con, uint8_t id)
+static bool post_to_shard(const TCP_Server *tcp_server, uint32_t shard_id, const TCP_Shard_Message *msg,
+                          const uint8_t *data)
 {
-    uint8_t data[2] = {TCP_PACKET_DISCONNECT_NOTIFICATION, (uint8_t)(id + NUM_RESERVED_PORTS)};
-    return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
+    const bool control = msg->type != TCP_SHARD_MESSAGE_PACKET && msg->type != TCP_SHARD_MESSAGE_KEY_PACKET;
+    return shard_queue_post(&tcp_server->shards[shard_id].queue, msg, data, control);
 }
 
-/* return 0 on success.
- * return -1 on failure (connection must be killed).
+/* Assign the identifier of a newly accepted connection. With more than one
+ * shard, also record that the connection with public_key is on this shard and
+ * tell the shard it was on before, if any, to kill it there. If that shard
+ * can't be told, the old connection is kept and the new one refused.
+ *
+ * return identifier on success.
+ * return 0 on failure.
  */
-static int handle_TCP_routing_req(TCP_Server *tcp_server, uint32_t con_id, const uint8_t *public_key)
+static uint64_t register_accepted_key(TCP_Shard *shard, const uint8_t *public_key)
 {
-    uint32_t i;
-    uint32_t index = -1;
-    TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[con_id];
-
-    /* If person tries to cennect to himself we deny the request*/
-    if (public_key_cmp(con->public_key, public_key) == 0) {
-        if (send_routing_response(con, 0, public_key) == -1) {
-            return -1;
-        }
+    TCP_Server *const tcp_server = shard->tcp_server;
 
-        return 0;
+    if (tcp_server->num_shards == 1) {
+        return ++tcp_server->counter;
     }
 
-    for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
-        if (con->connections[i].status != 0) {
-            if (public_key_cmp(public_key, con->connections[i].public_key) == 0) {
-                if (send_routing_response(con, i + NUM_RESERVED_PORTS, public_key) == -1) {
-                    return -1;
-                }
+    pthread_mutex_lock(&tcp_server->directory_lock);
+    const int old_shard = hash_list_find(&tcp_server->key_shards, public_key);
+    bool ok = old_shard == -1 || hash_list_remove(&tcp_server->key_shards, public_key, old_shard);
+    ok = ok && hash_list_add(&tcp_server->key_shards, public_key, shard->id);
+    const uint64_t identifier = ok ? ++tcp_server->counter : 0;
+    pthread_mutex_unlock(&tcp_server->directory_lock);
 
-                return 0;
-            }
-        } else if (index == (uint32_t) -1) {
-            index = i;
-        }
+    if (identifier == 0 || old_shard == -1 || (uint32_t)old_shard == shard->id) {
+        return identifier;
     }
 
-    if (index == (uint32_t) -1) {
-        if (send_routing_response(con, 0, public_key) == -1) {
-            return -1;
-        }
+    TCP_Shard_Message msg = {0};
+    msg.type = TCP_SHARD_MESSAGE_KILL;
+    msg.identifier = identifier;
+    memcpy(msg.public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
 
-        return 0;
+    if (post_to_shard(tcp_server, old_shard, &msg, nullptr)) {
+        return identifier;
     }
 
-    int ret = send_routing_response(con, index + NUM_RESERVED_PORTS, public_key);
+    LOGGER_WARNING(tcp_server->logger, "failed to tell shard %d to kill a replaced connection", old_shard);
 
-    if (ret == 0) {
-        return 0;
-    }
+    pthread_mutex_lock(&tcp_server->directory_lock);
 
-    if (ret == -1) {
-        return -1;
+    if (hash_list_find(&tcp_server->key_shards, public_key) == (int)shard->id) {
+        hash_list_remove(&tcp_server->key_shards, public_key, shard->id);
+        hash_list_add(&tcp_server->key_shards, public_key, old_shard);
     }
 
-    con->connections[index].status = 1;
-    memcpy(con->connections[index].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    int other_index = get_TCP_connection_index(tcp_server, public_key);
+    pthread_mutex_unlock(&tcp_server->directory_lock);
+    return 0;
+}
 
-    if (other_index != -1) {
-        uint32_t other_id = -1;
-        TCP_Secure_Connection *other_conn = &tcp_server->accepted_connection_array[other_index];
+static void unregister_accepted_key(TCP_Shard *shard, const uint8_t *public_key)
+{
+    TCP_Server *const tcp_server = shard->tcp_server;
 
-        for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
-            if (other_conn->connections[i].status == 1
-                    && public_key_cmp(other_conn->connections[i].public_key, con->public_key) == 0) {
-                other_id = i;
-                break;
-            }
-        }
+    if (tcp_server->num_shards == 1) {
+        return;
+    }
 
-        if (other_id != (uint32_t) -1) {
-            con->connections[index].status = 2;
-            con->connections[index].index = other_index;
-            con->connections[index].other_id = other_id;
-            other_conn->connections[other_id].status = 2;
-            other_conn->connections[other_id].index = con_id;
-            other_conn->connections[other_id].other_id = index;
-            // TODO(irungentoo): return values?
-            send_connect_notification(con, index);
-            send_connect_notification(other_conn, other_id);
-        }
+    pthread_mutex_lock(&tcp_server->directory_lock);
+
+    if (hash_list_find(&tcp_server->key_shards, public_key) == (int)shard->id) {
+        hash_list_remove(&tcp_server->key_shards, public_key, shard->id);
     }
 
-    return 0;
+    pthread_mutex_unlock(&tcp_server->directory_lock);
 }
 
-/* return 0 on success.
- * return -1 on failure (connection must be killed).
+/* return the shard the connection with public_key is on.
+ * return -1 if there is no such connection or it is on this shard.
  */
-static int handle_TCP_oob_send(TCP_Server *tcp_server, uint32_t con_id, const uint8_t *public_key, const uint8_t *data,
-                               uint16_t length)
+static int find_other_shard(const TCP_Shard *shard, const uint8_t *public_key)
 {
-    if (length == 0 || length > TCP_MAX_OOB_DATA_LENGTH) {
+    TCP_Server *const tcp_server = shard->tcp_server;
+
+    if (tcp_server->num_shards == 1) {
         return -1;
     }
 
-    TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[con_id];
+    pthread_mutex_lock(&tcp_server->directory_lock);
+    const int other_shard = hash_list_find(&tcp_server->key_shards, public_key);
+    pthread_mutex_unlock(&tcp_server->directory_lock);
 
-    int other_index = get_TCP_connection_index(tcp_server, public_key);
+    return other_shard == (int)shard->id ? -1 : other_shard;
+}
 
-    if (other_index != -1) {
-        VLA(uint8_t, resp_packet, 1 + CRYPTO_PUBLIC_KEY_SIZE + length);
-        resp_packet[0] = TCP_PACKET_OOB_RECV;
-        memcpy(resp_packet + 1, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
-        memcpy(resp_packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, data, length);
-        write_packet_TCP_secure_connection(&tcp_server->accepted_connection_array[other_index], resp_packet,
-                                           SIZEOF_VLA(resp_packet), 0);
-    }
 
-    return 0;
-}
+static int kill_accepted(TCP_Shard *shard, int index);
 
-/* Remove connection with con_number from the connections array of con.
- *
- * return -1 on failure.
- * return 0 on success.
+/* Put an accepted connection on the list of connections with queued data.
  */
-static int rm_connection_index(TCP_Server *tcp_server, TCP_Secure_Connection *con, uint8_t con_number)
+static void add_pending(TCP_Shard *shard, uint32_t index)
 {
-    if (con_number >= NUM_CLIENT_CONNECTIONS) {
-        return -1;
+    TCP_Secure_Connection *const con = &shard->accepted_connection_array[index];
+
+    if (con->pending_position != 0) {
+        return;
     }
 
-    if (con->connections[con_number].status) {
-        uint32_t index = con->connections[con_number].index;
-        uint8_t other_id = con->connections[con_number].other_id;
+    shard->pending[shard->num_pending] = index;
+    ++shard->num_pending;
+    con->pending_position = shard->num_pending;
+}
 
-        if (con->connections[con_number].status == 2) {
+static void remove_pending(TCP_Shard *shard, uint32_t index)
+{
+    TCP_Secure_Connection *const con = &shard->accepted_connection_array[index];
 
-            if (index >= tcp_server->size_accepted_connections) {
-                return -1;
+    if (con->pending_position == 0) {
+        return;
+    }
+
+    /* Move the last one into the hole. */
+    const uint32_t last = shard->pending[shard->num_pending - 1];
+    shard->pending[con->pending_position - 1] = last;
+    shard->accepted_connection_array[last].pending_position = con->pending_position;
+    --shard->num_pending;
+    con->pending_position = 0;
+}
+
+/* Add accepted TCP connection to the list.
+ *
+ * return index on success
+ * return -1 on failure
+ */
+static int add_accepted(TCP_Shard *shard, const Mono_Time *mono_time, TCP_Secure_Connection *con)
+{
+    int index = get_TCP_connection_index(shard, con->public_key);
+
+    if (index != -1) { /* If an old connection to the same public key exists, kill it. */
+        kill_accepted(shard, index);
+        index = -1;
+    }
+
+    if (shard->size_accepted_connections == shard->num_accepted_connections) {
+        if (alloc_new_connections(shard, 4) == -1) {
+            return -1;
+        }
+
+        index = shard->num_accepted_connections;
+    } else {
+        uint32_t i;
+
+        for (i = shard->size_accepted_connections; i != 0; --i) {
+            if (shard->accepted_connection_array[i - 1].status == TCP_STATUS_NO_STATUS) {
+                index = i - 1;
+                break;
             }
+        }
+    }
 
-            tcp_server->accepted_connection_array[index].connections[other_id].other_id = 0;
-            tcp_server->accepted_connection_array[index].connections[other_id].index = 0;
-            tcp_server->accepted_connection_array[index].connections[other_id].status = 1;
-            // TODO(irungentoo): return values?
-            send_disconnect_notification(&tcp_server->accepted_connection_array[index], other_id);
+    if (index == -1) {
+        LOGGER_ERROR(shard->tcp_server->logger, "FAIL index is -1");
+        return -1;
+    }
+
+    if (!hash_list_add(&shard->accepted_key_list, con->public_key, index)) {
+        return -1;
+    }
+
+    const uint64_t identifier = register_accepted_key(shard, con->public_key);
+
+    if (identifier == 0) {
+        hash_list_remove(&shard->accepted_key_list, con->public_key, index);
+        return -1;
+    }
+
+    move_secure_connection(&shard->accepted_connection_array[index], con);
+
+    shard->accepted_connection_array[index].status = TCP_STATUS_CONFIRMED;
+    ++shard->num_accepted_connections;
+    shard->accepted_connection_array[index].identifier = identifier;
+    shard->accepted_connection_array[index].last_pinged = mono_time_get(mono_time);
+    shard->accepted_connection_array[index].ping_id = 0;
+
+    /* The wheel is only advanced by do_TCP_confirmed, so bring it up to date
+     * if it sat idle. */
+    if (shard->ping_timers.count == 0) {
+        timer_wheel_advance(&shard->ping_timers, mono_time_get(mono_time), nullptr, nullptr);
+    }
+
+    timer_wheel_set(&shard->ping_timers, index, mono_time_get(mono_time) + TCP_PING_FREQUENCY);
+
+    return index;
+}
+
+/* Delete accepted connection from list.
+ *
+ * return 0 on success
+ * return -1 on failure
+ */
+static int del_accepted(TCP_Shard *shard, int index)
+{
+    if ((uint32_t)index >= shard->size_accepted_connections) {
+        return -1;
+    }
+
+    if (shard->accepted_connection_array[index].status == TCP_STATUS_NO_STATUS) {
+        return -1;
+    }
+
+    if (!hash_list_remove(&shard->accepted_key_list, shard->accepted_connection_array[index].public_key, index)) {
+        return -1;
+    }
+
+    unregister_accepted_key(shard, shard->accepted_connection_array[index].public_key);
+    timer_wheel_cancel(&shard->ping_timers, index);
+    remove_pending(shard, index);
+#ifdef TCP_SERVER_USE_IO_URING
+    detach_uring_ops(shard, &shard->accepted_connection_array[index]);
+#endif
+    wipe_secure_connection(&shard->accepted_connection_array[index]);
+    --shard->num_accepted_connections;
+
+    if (shard->num_accepted_connections == 0) {
+        free_accepted_connection_array(shard);
+    }
+
+    return 0;
+}
+
+/* Read length bytes from socket.
+ *
+ * return length on success
+ * return -1 on failure/no data in buffer.
+ */
+int read_TCP_packet(const Logger *logger, Socket sock, uint8_t *data, uint16_t length)
+{
+    unsigned int count = net_socket_data_recv_buffer(sock);
+
+    if (count >= length) {
+        const int len = net_recv(sock, data, length);
+
+        if (len != length) {
+            LOGGER_ERROR(logger, "FAIL recv packet");
+            return -1;
+        }
+
+        return len;
+    }
+
+    return -1;
+}
+
+/* return true if the buffer holds a length and the complete packet following it.
+ */
+static bool recv_buffer_has_packet(const TCP_Recv_Buffer *recv_buffer)
+{
+    const uint16_t count = recv_buffer->end - recv_buffer->start;
+
+    if (count < sizeof(uint16_t)) {
+        return false;
+    }
+
+    uint16_t length;
+    memcpy(&length, recv_buffer->data + recv_buffer->start, sizeof(uint16_t));
+    return count >= sizeof(uint16_t) + net_ntohs(length);
+}
+
+/* Move the unparsed bytes to the start of the buffer.
+ */
+static void compact_recv_buffer(TCP_Recv_Buffer *recv_buffer)
+{
+    if (recv_buffer->start != 0) {
+        memmove(recv_buffer->data, recv_buffer->data + recv_buffer->start, recv_buffer->end - recv_buffer->start);
+        recv_buffer->end -= recv_buffer->start;
+        recv_buffer->start = 0;
+    }
+}
+
+/* Move the unparsed bytes to the start of the buffer and append as much data
+ * from the socket as fits after them.
+ */
+static void fill_recv_buffer(Socket sock, TCP_Recv_Buffer *recv_buffer)
+{
+    compact_recv_buffer(recv_buffer);
+
+    if (recv_buffer->end == sizeof(recv_buffer->data)) {
+        return;
+    }
+
+    const int len = net_recv(sock, recv_buffer->data + recv_buffer->end, sizeof(recv_buffer->data) - recv_buffer->end);
+
+    if (len > 0) {
+        recv_buffer->end += len;
+    }
+}
+
+/* Like read_packet_TCP_secure_connection, without reading from the socket.
+ *
+ * return length of received packet on success.
+ * return 0 if could not read any packet.
+ * return -1 on failure (connection must be killed).
+ */
+static int parse_packet_TCP_secure_connection(TCP_Recv_Buffer *recv_buffer, const uint8_t *shared_key,
+        uint8_t *recv_nonce, uint8_t *data, uint16_t max_len)
+{
+    if ((size_t)(recv_buffer->end - recv_buffer->start) < sizeof(uint16_t)) {
+        return 0;
+    }
+
+    uint16_t length;
+    memcpy(&length, recv_buffer->data + recv_buffer->start, sizeof(uint16_t));
+    length = net_ntohs(length);
+
+    if (length > MAX_PACKET_SIZE || max_len + CRYPTO_MAC_SIZE < length) {
+        return -1;
+    }
+
+    if (length == 0) {
+        /* Empty packets carry nothing, skip them. */
+        recv_buffer->start += sizeof(uint16_t);
+        return 0;
+    }
+
+    if (!recv_buffer_has_packet(recv_buffer)) {
+        return 0;
+    }
+
+    const uint8_t *const data_encrypted = recv_buffer->data + recv_buffer->start + sizeof(uint16_t);
+    recv_buffer->start += sizeof(uint16_t) + length;
+
+    if (recv_buffer->start == recv_buffer->end) {
+        recv_buffer->start = 0;
+        recv_buffer->end = 0;
+    }
+
+    const int len = decrypt_data_symmetric(shared_key, recv_nonce, data_encrypted, length, data);
+
+    if (len + CRYPTO_MAC_SIZE != length) {
+        return -1;
+    }
+
+    increment_nonce(recv_nonce);
+
+    return len;
+}
+
+/* return length of received packet on success.
+ * return 0 if could not read any packet.
+ * return -1 on failure (connection must be killed).
+ */
+int read_packet_TCP_secure_connection(const Logger *logger, Socket sock, TCP_Recv_Buffer *recv_buffer,
+                                      const uint8_t *shared_key, uint8_t *recv_nonce, uint8_t *data, uint16_t max_len)
+{
+    if (!recv_buffer_has_packet(recv_buffer)) {
+        fill_recv_buffer(sock, recv_buffer);
+    }
+
+    return parse_packet_TCP_secure_connection(recv_buffer, shared_key, recv_nonce, data, max_len);
+}
+
+/* Priority packets may fill the whole send queue, other packets only half of
+ * it, so that pings and replies to the client still get through when the
+ * data relayed to it backs up.
+ */
+static bool send_queue_has_room(const TCP_Send_Queue *queue, uint32_t length, bool priority)
+{
+    const uint32_t limit = priority ? queue->capacity : queue->capacity / 2;
+    return queue->size + length <= limit;
+}
+
+/* Append length bytes to the send queue. The caller must make sure they fit.
+ *
+ * return false on failure (only if malloc fails).
+ * return true on success.
+ */
+static bool send_queue_add(TCP_Send_Queue *queue, const uint8_t *packet, uint32_t length)
+{
+    if (queue->data == nullptr) {
+        queue->data = (uint8_t *)malloc(queue->capacity);
+
+        if (queue->data == nullptr) {
+            return false;
         }
+    }
+
+    const uint32_t end = (queue->start + queue->size) % queue->capacity;
+    const uint32_t first = min_u32(length, queue->capacity - end);
+    memcpy(queue->data + end, packet, first);
+    memcpy(queue->data, packet + first, length - first);
+    queue->size += length;
+    return true;
+}
+
+/* Write as much of the send queue to the socket as it takes, with a single
+ * system call.
+ *
+ * return 0 if pending data was sent completely
+ * return -1 if it wasn't
+ */
+static int send_pending_data(TCP_Secure_Connection *con)
+{
+    TCP_Send_Queue *const queue = &con->send_queue;
+
+    if (queue->size == 0) {
+        return 0;
+    }
 
-        con->connections[con_number].index = 0;
-        con->connections[con_number].other_id = 0;
-        con->connections[con_number].status = 0;
+    /* The queued bytes wrap around the end of the ring at most once. */
+    Net_Send_Buffer bufs[2];
+    uint32_t count = 1;
+    bufs[0].data = queue->data + queue->start;
+    bufs[0].length = min_u32(queue->size, queue->capacity - queue->start);
+
+    if (bufs[0].length < queue->size) {
+        bufs[1].data = queue->data;
+        bufs[1].length = queue->size - bufs[0].length;
+        count = 2;
+    }
+
+    const int len = net_sendv(con->sock, bufs, count);
+
+    if (len <= 0) {
+        return -1;
+    }
+
+    queue->start = (queue->start + len) % queue->capacity;
+    queue->size -= len;
+
+    if (queue->size == 0) {
+        queue->start = 0;
         return 0;
     }
 
     return -1;
 }
 
-static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data, uint16_t length)
+/* return 1 on success.
+ * return 0 if could not send packet.
+ * return -1 on failure (connection must be killed).
+ */
+static int write_packet_TCP_secure_connection(TCP_Shard *shard, uint32_t index, const uint8_t *data,
+        uint16_t length, bool priority)
 {
-    TCP_Server *tcp_server = (TCP_Server *)object;
-    uint32_t index = dest.ip.ip.v6.uint32[0];
+    TCP_Secure_Connection *const con = &shard->accepted_connection_array[index];
 
-    if (index >= tcp_server->size_accepted_connections) {
-        return 1;
+    if (length + CRYPTO_MAC_SIZE > MAX_PACKET_SIZE) {
+        return -1;
     }
 
-    TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[index];
+    const uint16_t packet_length = sizeof(uint16_t) + length + CRYPTO_MAC_SIZE;
 
-    if (con->identifier != dest.ip.ip.v6.uint64[1]) {
+#ifdef TCP_SERVER_USE_IO_URING
+    /* On io_uring every packet goes through the send queue, and the queues of
+     * all connections are sent in one batch. */
+    const bool send_now = shard->uring == nullptr;
+#else
+    const bool send_now = true;
+#endif
+
+    if (send_now) {
+        send_pending_data(con);
+    }
+
+#ifdef TCP_SERVER_USE_IO_URING
+
+    /* What is queued goes to the kernel whenever no send is running, so
+     * packets only get dropped while it didn't take the previous batch yet. */
+    if (!send_now && con->send_op == 0 && con->send_queue.size != 0
+            && !send_queue_has_room(&con->send_queue, packet_length, priority)) {
+        tcp_uring_send(shard, index);
+    }
+
+#endif
+
+    if (!send_queue_has_room(&con->send_queue, packet_length, priority)) {
+        return 0;
+    }
+
+    uint8_t packet[sizeof(uint16_t) + MAX_PACKET_SIZE];
+
+    const uint16_t c_length = net_htons(length + CRYPTO_MAC_SIZE);
+    memcpy(packet, &c_length, sizeof(uint16_t));
+    int len = encrypt_data_symmetric(con->shared_key, con->sent_nonce, data, length, packet + sizeof(uint16_t));
+
+    if ((unsigned int)len != packet_length - sizeof(uint16_t)) {
+        return -1;
+    }
+
+    len = 0;
+
+    if (send_now && con->send_queue.size == 0) {
+        len = net_send(con->sock, packet, packet_length);
+
+        if (len < 0) {
+            len = 0;
+        }
+    }
+
+    if (len == packet_length) {
+        increment_nonce(con->sent_nonce);
         return 1;
     }
 
-    VLA(uint8_t, packet, 1 + length);
-    memcpy(packet + 1, data, length);
-    packet[0] = TCP_PACKET_ONION_RESPONSE;
+    if (!send_queue_add(&con->send_queue, packet + len, packet_length - len)) {
+        /* Nothing of the packet went out, so it can be dropped cleanly. */
+        return len == 0 ? 0 : -1;
+    }
+
+    increment_nonce(con->sent_nonce);
+    add_pending(shard, index);
+    return 1;
+}
+
+/* Kill a TCP_Secure_Connection
+ */
+static void kill_TCP_secure_connection(TCP_Shard *shard, TCP_Secure_Connection *con)
+{
+#ifdef TCP_SERVER_USE_IO_URING
+    detach_uring_ops(shard, con);
+#endif
+    kill_sock(con->sock);
+    wipe_secure_connection(con);
+}
+
+static int rm_connection_index(TCP_Shard *shard, TCP_Secure_Connection *con, uint8_t con_number);
+
+/* Kill an accepted TCP_Secure_Connection
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int kill_accepted(TCP_Shard *shard, int index)
+{
+    if ((uint32_t)index >= shard->size_accepted_connections) {
+        return -1;
+    }
+
+    TCP_Secure_Connection *const con = &shard->accepted_connection_array[index];
+
+    /* The table is freed along with its last route. */
+    for (uint32_t i = 0; con->routes.count != 0 && i < con->routes.capacity; ++i) {
+        rm_connection_index(shard, con, i);
+    }
+
+    Socket sock = shard->accepted_connection_array[index].sock;
+
+    if (del_accepted(shard, index) != 0) {
+        return -1;
+    }
+
+    kill_sock(sock);
+    return 0;
+}
+
+/* Write a packet to an accepted connection other than the one whose packet is
+ * being handled. If that connection's stream can't be continued it is killed
+ * here, as the caller would kill the wrong one.
+ *
+ * return 1 on success.
+ * return 0 if could not send packet.
+ */
+static int write_packet_TCP_accepted(TCP_Shard *shard, uint32_t index, const uint8_t *data, uint16_t length,
+                                     bool priority)
+{
+    const int ret = write_packet_TCP_secure_connection(shard, index, data, length, priority);
+
+    if (ret == -1) {
+        kill_accepted(shard, index);
+        return 0;
+    }
+
+    return ret;
+}
+
+/* return 1 if everything went well.
+ * return -1 if the connection must be killed.
+ */
+static int handle_TCP_handshake(TCP_Secure_Connection *con, const uint8_t *data, uint16_t length,
+                                const uint8_t *self_secret_key)
+{
+    if (length != TCP_CLIENT_HANDSHAKE_SIZE) {
+        return -1;
+    }
+
+    if (con->status != TCP_STATUS_CONNECTED) {
+        return -1;
+    }
+
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    encrypt_precompute(data, self_secret_key, shared_key);
+    uint8_t plain[TCP_HANDSHAKE_PLAIN_SIZE];
+    int len = decrypt_data_symmetric(shared_key, data + CRYPTO_PUBLIC_KEY_SIZE,
+                                     data + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE, TCP_HANDSHAKE_PLAIN_SIZE + CRYPTO_MAC_SIZE, plain);
+
+    if (len != TCP_HANDSHAKE_PLAIN_SIZE) {
+        return -1;
+    }
+
+    memcpy(con->public_key, data, CRYPTO_PUBLIC_KEY_SIZE);
+    uint8_t temp_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    uint8_t resp_plain[TCP_HANDSHAKE_PLAIN_SIZE];
+    crypto_new_keypair(resp_plain, temp_secret_key);
+    random_nonce(con->sent_nonce);
+    memcpy(resp_plain + CRYPTO_PUBLIC_KEY_SIZE, con->sent_nonce, CRYPTO_NONCE_SIZE);
+    memcpy(con->recv_nonce, plain + CRYPTO_PUBLIC_KEY_SIZE, CRYPTO_NONCE_SIZE);
+
+    uint8_t response[TCP_SERVER_HANDSHAKE_SIZE];
+    random_nonce(response);
+
+    len = encrypt_data_symmetric(shared_key, response, resp_plain, TCP_HANDSHAKE_PLAIN_SIZE,
+                                 response + CRYPTO_NONCE_SIZE);
+
+    if (len != TCP_HANDSHAKE_PLAIN_SIZE + CRYPTO_MAC_SIZE) {
+        return -1;
+    }
+
+    if (TCP_SERVER_HANDSHAKE_SIZE != net_send(con->sock, response, TCP_SERVER_HANDSHAKE_SIZE)) {
+        return -1;
+    }
+
+    encrypt_precompute(plain, temp_secret_key, con->shared_key);
+    con->status = TCP_STATUS_UNCONFIRMED;
+    return 1;
+}
+
+/* return 1 if connection handshake was handled correctly.
+ * return 0 if we didn't get it yet.
+ * return -1 if the connection must be killed.
+ */
+static int read_connection_handshake(const Logger *logger, TCP_Secure_Connection *con, const uint8_t *self_secret_key)
+{
+    uint8_t data[TCP_CLIENT_HANDSHAKE_SIZE];
+    const int len = read_TCP_packet(logger, con->sock, data, TCP_CLIENT_HANDSHAKE_SIZE);
+
+    if (len != -1) {
+        return handle_TCP_handshake(con, data, len, self_secret_key);
+    }
+
+    return 0;
+}
+
+/* return 1 on success.
+ * return 0 if could not send packet.
+ * return -1 on failure (connection must be killed).
+ */
+static int send_routing_response(TCP_Shard *shard, uint32_t index, uint8_t rpid, const uint8_t *public_key)
+{
+    uint8_t data[1 + 1 + CRYPTO_PUBLIC_KEY_SIZE];
+    data[0] = TCP_PACKET_ROUTING_RESPONSE;
+    data[1] = rpid;
+    memcpy(data + 2, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+
+    return write_packet_TCP_secure_connection(shard, index, data, sizeof(data), 1);
+}
+
+/* return 1 on success.
+ * return 0 if could not send packet.
+ * return -1 on failure (connection must be killed).
+ */
+static int send_connect_notification(TCP_Shard *shard, uint32_t index, uint8_t id)
+{
+    uint8_t data[2] = {TCP_PACKET_CONNECTION_NOTIFICATION, (uint8_t)(id + NUM_RESERVED_PORTS)};
+    return write_packet_TCP_secure_connection(shard, index, data, sizeof(data), 1);
+}
+
+/* return 1 on success.
+ * return 0 if could not send packet.
+ * return -1 on failure (connection must be killed).
+ */
+static int send_disconnect_notification(TCP_Shard *shard, uint32_t index, uint8_t id)
+{
+    uint8_t data[2] = {TCP_PACKET_DISCONNECT_NOTIFICATION, (uint8_t)(id + NUM_RESERVED_PORTS)};
+    return write_packet_TCP_secure_connection(shard, index, data, sizeof(data), 1);
+}
+
+/* Fill in the source of a message from the accepted connection con.
+ */
+static void set_message_source(TCP_Shard_Message *msg, const TCP_Shard *shard, const TCP_Secure_Connection *con,
+                               uint8_t slot)
+{
+    msg->source_shard = shard->id;
+    msg->source_index = (uint32_t)(con - shard->accepted_connection_array);
+    msg->source_identifier = con->identifier;
+    msg->source_slot = slot;
+    memcpy(msg->source_public_key, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+}
+
+/* Mark slot con_number of con as linked to slot other_id of another connection.
+ */
+static void link_connection(TCP_Secure_Connection *con, uint8_t con_number, uint32_t shard_id, uint32_t index,
+                            uint64_t identifier, uint8_t other_id)
+{
+    TCP_Secure_Conn *const conn = &con->routes.entries[con_number];
+    conn->status = 2;
+    conn->shard = shard_id;
+    conn->index = index;
+    conn->identifier = identifier;
+    conn->other_id = other_id;
+}
+
+/* return 0 on success.
+ * return -1 on failure (connection must be killed).
+ */
+static int handle_TCP_routing_req(TCP_Shard *shard, uint32_t con_id, const uint8_t *public_key)
+{
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[con_id];
+
+    /* If person tries to cennect to himself we deny the request*/
+    if (public_key_cmp(con->public_key, public_key) == 0) {
+        if (send_routing_response(shard, con_id, 0, public_key) == -1) {
+            return -1;
+        }
+
+        return 0;
+    }
+
+    const int existing = find_route(&con->routes, public_key);
+
+    if (existing != -1) {
+        if (send_routing_response(shard, con_id, existing + NUM_RESERVED_PORTS, public_key) == -1) {
+            return -1;
+        }
+
+        return 0;
+    }
+
+    const int index = add_route(&con->routes, public_key);
+
+    if (index == -1) {
+        if (send_routing_response(shard, con_id, 0, public_key) == -1) {
+            return -1;
+        }
+
+        return 0;
+    }
+
+    int ret = send_routing_response(shard, con_id, index + NUM_RESERVED_PORTS, public_key);
+
+    if (ret != 1) {
+        remove_route(&con->routes, index);
+        return ret;
+    }
+
+    int other_index = get_TCP_connection_index(shard, public_key);
+
+    if (other_index != -1) {
+        TCP_Secure_Connection *other_conn = &shard->accepted_connection_array[other_index];
+        const int other_id = find_route(&other_conn->routes, con->public_key);
+
+        if (other_id != -1 && other_conn->routes.entries[other_id].status == 1) {
+            link_connection(con, index, shard->id, other_index, other_conn->identifier, other_id);
+            link_connection(other_conn, other_id, shard->id, con_id, con->identifier, index);
+            // TODO(irungentoo): return values?
+            send_connect_notification(shard, con_id, index);
+            send_connect_notification(shard, other_index, other_id);
+        }
+
+        return 0;
+    }
+
+    const int other_shard = find_other_shard(shard, public_key);
+
+    if (other_shard != -1) {
+        /* The other shard links the two if the other side asked for this
+         * connection too. */
+        TCP_Shard_Message msg = {0};
+        msg.type = TCP_SHARD_MESSAGE_LINK;
+        memcpy(msg.public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        set_message_source(&msg, shard, con, index);
+
+        if (!post_to_shard(shard->tcp_server, other_shard, &msg, nullptr)) {
+            /* The other side would never get linked to the route the client
+             * was just given. */
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* return 0 on success.
+ * return -1 on failure (connection must be killed).
+ */
+static int handle_TCP_oob_send(TCP_Shard *shard, uint32_t con_id, const uint8_t *public_key, const uint8_t *data,
+                               uint16_t length)
+{
+    if (length == 0 || length > TCP_MAX_OOB_DATA_LENGTH) {
+        return -1;
+    }
+
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[con_id];
+
+    int other_index = get_TCP_connection_index(shard, public_key);
+    int other_shard = -1;
+
+    if (other_index == -1) {
+        other_shard = find_other_shard(shard, public_key);
+    }
+
+    if (other_index != -1 || other_shard != -1) {
+        VLA(uint8_t, resp_packet, 1 + CRYPTO_PUBLIC_KEY_SIZE + length);
+        resp_packet[0] = TCP_PACKET_OOB_RECV;
+        memcpy(resp_packet + 1, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        memcpy(resp_packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, data, length);
+
+        if (other_index != -1) {
+            write_packet_TCP_accepted(shard, other_index, resp_packet, SIZEOF_VLA(resp_packet), 0);
+        } else {
+            TCP_Shard_Message msg = {0};
+            msg.type = TCP_SHARD_MESSAGE_KEY_PACKET;
+            msg.length = SIZEOF_VLA(resp_packet);
+            memcpy(msg.public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            post_to_shard(shard->tcp_server, other_shard, &msg, resp_packet);
+        }
+    }
+
+    return 0;
+}
+
+/* Remove connection with con_number from the connections array of con.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int rm_connection_index(TCP_Shard *shard, TCP_Secure_Connection *con, uint8_t con_number)
+{
+    const TCP_Secure_Conn *const conn = get_route(&con->routes, con_number);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    if (conn->status == 2) {
+        const uint32_t index = conn->index;
+        const uint8_t other_id = conn->other_id;
+
+        if (conn->shard != shard->id) {
+            TCP_Shard_Message msg = {0};
+            msg.type = TCP_SHARD_MESSAGE_UNLINK;
+            msg.slot = other_id;
+            msg.index = index;
+            msg.identifier = conn->identifier;
+            set_message_source(&msg, shard, con, con_number);
+
+            if (!post_to_shard(shard->tcp_server, conn->shard, &msg, nullptr)) {
+                /* The other side finds out from the next packet it relays
+                 * here, see the handling of TCP_SHARD_MESSAGE_PACKET. */
+                LOGGER_WARNING(shard->tcp_server->logger, "failed to tell shard %u about a dropped link", conn->shard);
+            }
+        } else {
+            if (index >= shard->size_accepted_connections) {
+                return -1;
+            }
+
+            TCP_Secure_Conn *const other = get_route(&shard->accepted_connection_array[index].routes, other_id);
+
+            if (other != nullptr) {
+                other->other_id = 0;
+                other->index = 0;
+                other->status = 1;
+                // TODO(irungentoo): return values?
+                send_disconnect_notification(shard, index, other_id);
+            }
+        }
+    }
+
+    remove_route(&con->routes, con_number);
+    return 0;
+}
+
+/* Write a packet relayed from another connection. When the connection's send
+ * queue is backed up, drop the packet like a congested link would: the end to
+ * end connection relayed through here recovers from loss, while queueing more
+ * would only add delay.
+ */
+static void relay_packet(TCP_Shard *shard, uint32_t index, const uint8_t *data, uint16_t length)
+{
+    TCP_Secure_Connection *const con = &shard->accepted_connection_array[index];
+
+#ifdef TCP_SERVER_USE_IO_URING
+
+    /* The queue must only go out through the kernel's sends, which
+     * write_packet_TCP_secure_connection hands it to when it's full. */
+    if (shard->uring != nullptr) {
+        write_packet_TCP_accepted(shard, index, data, length, 0);
+        return;
+    }
+
+#endif
+    send_pending_data(con);
+
+    if (!send_queue_has_room(&con->send_queue, sizeof(uint16_t) + length + CRYPTO_MAC_SIZE, 0)) {
+        return;
+    }
+
+    write_packet_TCP_accepted(shard, index, data, length, 0);
+}
+
+static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data, uint16_t length)
+{
+    TCP_Server *tcp_server = (TCP_Server *)object;
+    uint32_t index = dest.ip.ip.v6.uint32[0];
+    const uint32_t shard_id = dest.ip.ip.v6.uint32[1];
+
+    if (shard_id >= tcp_server->num_shards) {
+        return 1;
+    }
+
+    VLA(uint8_t, packet, 1 + length);
+    memcpy(packet + 1, data, length);
+    packet[0] = TCP_PACKET_ONION_RESPONSE;
+
+    if (tcp_server->threaded) {
+        TCP_Shard_Message msg = {0};
+        msg.type = TCP_SHARD_MESSAGE_PACKET;
+        msg.length = SIZEOF_VLA(packet);
+        msg.index = index;
+        msg.identifier = dest.ip.ip.v6.uint64[1];
+        return post_to_shard(tcp_server, shard_id, &msg, packet) ? 0 : 1;
+    }
+
+    TCP_Shard *shard = &tcp_server->shards[shard_id];
+
+    if (index >= shard->size_accepted_connections) {
+        return 1;
+    }
+
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[index];
+
+    if (con->identifier != dest.ip.ip.v6.uint64[1]) {
+        return 1;
+    }
+
+    if (write_packet_TCP_accepted(shard, index, packet, SIZEOF_VLA(packet), 0) != 1) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* return 0 on success
+ * return -1 on failure
+ */
+static int handle_TCP_packet(TCP_Shard *shard, uint32_t con_id, const uint8_t *data, uint16_t length)
+{
+    if (length == 0) {
+        return -1;
+    }
+
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[con_id];
+
+    switch (data[0]) {
+        case TCP_PACKET_ROUTING_REQUEST: {
+            if (length != 1 + CRYPTO_PUBLIC_KEY_SIZE) {
+                return -1;
+            }
+
+            return handle_TCP_routing_req(shard, con_id, data + 1);
+        }
+
+        case TCP_PACKET_CONNECTION_NOTIFICATION: {
+            if (length != 2) {
+                return -1;
+            }
+
+            break;
+        }
+
+        case TCP_PACKET_DISCONNECT_NOTIFICATION: {
+            if (length != 2) {
+                return -1;
+            }
+
+            return rm_connection_index(shard, con, data[1] - NUM_RESERVED_PORTS);
+        }
+
+        case TCP_PACKET_PING: {
+            if (length != 1 + sizeof(uint64_t)) {
+                return -1;
+            }
+
+            uint8_t response[1 + sizeof(uint64_t)];
+            response[0] = TCP_PACKET_PONG;
+            memcpy(response + 1, data + 1, sizeof(uint64_t));
+            write_packet_TCP_secure_connection(shard, con_id, response, sizeof(response), 1);
+            return 0;
+        }
+
+        case TCP_PACKET_PONG: {
+            if (length != 1 + sizeof(uint64_t)) {
+                return -1;
+            }
+
+            uint64_t ping_id;
+            memcpy(&ping_id, data + 1, sizeof(uint64_t));
+
+            if (ping_id) {
+                if (ping_id == con->ping_id) {
+                    con->ping_id = 0;
+                }
+
+                return 0;
+            }
+
+            return -1;
+        }
+
+        case TCP_PACKET_OOB_SEND: {
+            if (length <= 1 + CRYPTO_PUBLIC_KEY_SIZE) {
+                return -1;
+            }
+
+            return handle_TCP_oob_send(shard, con_id, data + 1, data + 1 + CRYPTO_PUBLIC_KEY_SIZE,
+                                       length - (1 + CRYPTO_PUBLIC_KEY_SIZE));
+        }
+
+        case TCP_PACKET_ONION_REQUEST: {
+            TCP_Server *const tcp_server = shard->tcp_server;
+
+            if (tcp_server->onion) {
+                if (length <= 1 + CRYPTO_NONCE_SIZE + ONION_SEND_BASE * 2) {
+                    return -1;
+                }
+
+                if (tcp_server->threaded) {
+                    /* The onion is only used by the thread running do_TCP_server. */
+                    TCP_Shard_Message msg = {0};
+                    msg.type = TCP_SHARD_MESSAGE_ONION_REQUEST;
+                    msg.length = length - 1;
+                    set_message_source(&msg, shard, con, 0);
+                    shard_queue_post(&tcp_server->queue, &msg, data + 1, false);
+                    return 0;
+                }
+
+                IP_Port source;
+                source.port = 0;  // dummy initialise
+                source.ip.family = net_family_tcp_onion;
+                source.ip.ip.v6.uint32[0] = con_id;
+                source.ip.ip.v6.uint32[1] = shard->id;
+                source.ip.ip.v6.uint64[1] = con->identifier;
+                onion_send_1(tcp_server->onion, data + 1 + CRYPTO_NONCE_SIZE, length - (1 + CRYPTO_NONCE_SIZE), source,
+                             data + 1);
+            }
+
+            return 0;
+        }
+
+        case TCP_PACKET_ONION_RESPONSE: {
+            return -1;
+        }
+
+        default: {
+            if (data[0] < NUM_RESERVED_PORTS) {
+                return -1;
+            }
+
+            uint8_t c_id = data[0] - NUM_RESERVED_PORTS;
+
+            const TCP_Secure_Conn *const other = get_route(&con->routes, c_id);
+
+            if (other == nullptr) {
+                return -1;
+            }
+
+            if (other->status != 2) {
+                return 0;
+            }
+
+            VLA(uint8_t, new_data, length);
+            memcpy(new_data, data, length);
+            new_data[0] = other->other_id + NUM_RESERVED_PORTS;
+
+            if (other->shard != shard->id) {
+                /* Dropped here if the other shard's message queue is full, or
+                 * there if the connection's send queue is. */
+                TCP_Shard_Message msg = {0};
+                msg.type = TCP_SHARD_MESSAGE_PACKET;
+                msg.length = length;
+                msg.slot = other->other_id;
+                msg.index = other->index;
+                msg.identifier = other->identifier;
+                set_message_source(&msg, shard, con, c_id);
+                post_to_shard(shard->tcp_server, other->shard, &msg, new_data);
+                return 0;
+            }
+
+            relay_packet(shard, other->index, new_data, length);
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+static int confirm_TCP_connection(TCP_Shard *shard, const Mono_Time *mono_time, TCP_Secure_Connection *con,
+                                  const uint8_t *data,
+                                  uint16_t length)
+{
+    int index = add_accepted(shard, mono_time, con);
+
+    if (index == -1) {
+        kill_TCP_secure_connection(shard, con);
+        return -1;
+    }
+
+    wipe_secure_connection(con);
+
+    if (handle_TCP_packet(shard, index, data, length) == -1) {
+        kill_accepted(shard, index);
+        return -1;
+    }
+
+    return index;
+}
+
+/* return index on success
+ * return -1 on failure
+ */
+static int accept_connection(TCP_Shard *shard, Socket sock)
+{
+    if (!sock_valid(sock)) {
+        return -1;
+    }
+
+    if (!set_socket_nonblock(sock)) {
+        kill_sock(sock);
+        return -1;
+    }
+
+    if (!set_socket_nosigpipe(sock)) {
+        kill_sock(sock);
+        return -1;
+    }
+
+    uint16_t index = shard->incoming_connection_queue_index % MAX_INCOMING_CONNECTIONS;
+
+    TCP_Secure_Connection *conn = &shard->incoming_connection_queue[index];
+
+    if (conn->status != TCP_STATUS_NO_STATUS) {
+        kill_TCP_secure_connection(shard, conn);
+    }
+
+    conn->status = TCP_STATUS_CONNECTED;
+    conn->sock = sock;
+    conn->send_queue.capacity = shard->tcp_server->send_queue_limit;
+
+#ifdef TCP_SERVER_USE_IO_URING
+
+    /* Only one send at a time goes to the kernel, so the queue has to absorb
+     * the bursts the socket's send buffer takes on epoll. */
+    if (shard->uring != nullptr) {
+        conn->send_queue.capacity *= TCP_URING_SEND_QUEUE_SCALE;
+    }
+
+#endif
+
+    ++shard->incoming_connection_queue_index;
+    return index;
+}
+
+/* Start the handshake on a newly accepted socket.
+ */
+static void add_incoming(TCP_Shard *shard, Socket sock)
+{
+    const int index_new = accept_connection(shard, sock);
+
+    if (index_new == -1) {
+        return;
+    }
+
+#ifdef TCP_SERVER_USE_IO_URING
+
+    if (shard->uring != nullptr) {
+        if (!tcp_uring_poll(shard, TCP_SOCKET_INCOMING, index_new)) {
+            kill_TCP_secure_connection(shard, &shard->incoming_connection_queue[index_new]);
+        }
+
+        return;
+    }
+
+#endif
+#ifdef TCP_SERVER_USE_EPOLL
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+
+    ev.data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_INCOMING << 32) | ((uint64_t)index_new << 40);
+
+    if (epoll_ctl(shard->efd, EPOLL_CTL_ADD, sock.socket, &ev) == -1) {
+        kill_TCP_secure_connection(shard, &shard->incoming_connection_queue[index_new]);
+    }
+
+#endif
+}
+
+/* Hand a socket accepted by shard 0 to the shards in turn, so that they all
+ * get an equal share of the connections.
+ */
+static void distribute_accepted(TCP_Shard *shard, Socket sock)
+{
+    TCP_Server *const tcp_server = shard->tcp_server;
+    const uint32_t target = tcp_server->next_shard;
+    tcp_server->next_shard = (target + 1) % tcp_server->num_shards;
+
+    if (target != shard->id) {
+        TCP_Shard_Message msg = {0};
+        msg.type = TCP_SHARD_MESSAGE_ACCEPT;
+        msg.sock = sock;
+
+        if (post_to_shard(tcp_server, target, &msg, nullptr)) {
+            return;
+        }
+    }
+
+    add_incoming(shard, sock);
+}
+
+static Socket new_listening_TCP_socket(Family family, uint16_t port)
+{
+    Socket sock = net_socket(family, TOX_SOCK_STREAM, TOX_PROTO_TCP);
+
+    if (!sock_valid(sock)) {
+        return net_invalid_socket;
+    }
+
+    int ok = set_socket_nonblock(sock);
+
+    if (ok && net_family_is_ipv6(family)) {
+        ok = set_socket_dualstack(sock);
+    }
+
+    if (ok) {
+        ok = set_socket_reuseaddr(sock);
+    }
+
+    ok = ok && bind_to_port(sock, family, port) && (net_listen(sock, TCP_MAX_BACKLOG) == 0);
+
+    if (!ok) {
+        kill_sock(sock);
+        return net_invalid_socket;
+    }
+
+    return sock;
+}
+
+#ifdef TCP_SERVER_USE_IO_URING
+/* Longest time in ms shard_stop_uring waits for the kernel to finish the
+ * cancelled operations. */
+#define TCP_URING_STOP_TIMEOUT 1000
+
+/* Cancel everything running on the shard's ring and destroy it once the
+ * kernel no longer touches the buffers and send queues.
+ */
+static void shard_stop_uring(TCP_Shard *shard)
+{
+    if (shard->uring == nullptr) {
+        return;
+    }
+
+    for (uint32_t id = 1; id <= shard->size_uring_ops; ++id) {
+        if (shard->uring_ops[id - 1].type != TCP_URING_FREE) {
+            uring_cancel(shard->uring, id);
+        }
+    }
+
+    for (uint32_t waited = 0; shard->num_uring_ops != 0 && waited < TCP_URING_STOP_TIMEOUT; waited += 100) {
+        if (!uring_submit(shard->uring, 100)) {
+            break;
+        }
+
+        Uring_Completion completion;
+
+        while (uring_completion(shard->uring, &completion)) {
+            if ((completion.flags & URING_COMPLETION_BUFFER) != 0) {
+                uring_buffer_return(shard->uring, completion.buffer);
+            }
+
+            if ((completion.flags & URING_COMPLETION_MORE) == 0 && completion.user_data != 0
+                    && completion.user_data <= shard->size_uring_ops) {
+                free_uring_op(shard, (uint32_t)completion.user_data);
+            }
+        }
+    }
+
+    uring_kill(shard->uring);
+    shard->uring = nullptr;
+
+    for (uint32_t i = 0; i < shard->size_uring_ops; ++i) {
+        free(shard->uring_ops[i].buffer);
+    }
+
+    free(shard->uring_ops);
+    shard->uring_ops = nullptr;
+    shard->size_uring_ops = 0;
+    shard->num_uring_ops = 0;
+    shard->free_uring_op = 0;
+}
+
+/* Move a shard from epoll to io_uring. Shard 0 takes the listening sockets
+ * along.
+ *
+ * return true on success.
+ * return false if io_uring isn't available, in which case the shard stays on
+ *   epoll.
+ */
+static bool shard_start_uring(TCP_Shard *shard)
+{
+    shard->uring = uring_new(TCP_URING_ENTRIES, TCP_URING_BUFFERS, TCP_URING_BUFFER_SIZE);
+
+    if (shard->uring == nullptr) {
+        return false;
+    }
+
+    const TCP_Server *const tcp_server = shard->tcp_server;
+
+    for (uint32_t i = 0; shard->id == 0 && i < tcp_server->num_listening_socks; ++i) {
+        if (!tcp_uring_accept(shard, i)) {
+            shard_stop_uring(shard);
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; shard->id == 0 && i < tcp_server->num_listening_socks; ++i) {
+        epoll_ctl(shard->efd, EPOLL_CTL_DEL, tcp_server->socks_listening[i].socket, nullptr);
+    }
+
+    return true;
+}
+#endif
+
+/* Initialise a shard. Shard 0 accepts the connections for all shards, so only
+ * it listens.
+ *
+ * return true on success.
+ * return false on failure.
+ */
+static bool shard_init(TCP_Server *tcp_server, TCP_Shard *shard, uint32_t id)
+{
+    shard->tcp_server = tcp_server;
+    shard->id = id;
+
+    if (!hash_list_init(&shard->accepted_key_list, CRYPTO_PUBLIC_KEY_SIZE, 8)) {
+        return false;
+    }
+
+    timer_wheel_init(&shard->ping_timers, 0);
+
+#ifdef TCP_SERVER_USE_EPOLL
+    shard->efd = epoll_create(8);
+
+    if (shard->efd == -1) {
+        hash_list_free(&shard->accepted_key_list);
+        return false;
+    }
+
+    for (uint32_t i = 0; id == 0 && i < tcp_server->num_listening_socks; ++i) {
+        const Socket sock = tcp_server->socks_listening[i];
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_LISTENING << 32);
+
+        if (epoll_ctl(shard->efd, EPOLL_CTL_ADD, sock.socket, &ev) == -1) {
+            close(shard->efd);
+            hash_list_free(&shard->accepted_key_list);
+            return false;
+        }
+    }
+
+#endif
+#ifdef TCP_SERVER_USE_IO_URING
+
+    if (tcp_server->use_io_uring) {
+        shard_start_uring(shard);
+    }
+
+#endif
+
+    return true;
+}
+
+static void shard_kill(TCP_Shard *shard)
+{
+#ifdef TCP_SERVER_USE_IO_URING
+    shard_stop_uring(shard);
+#endif
+    hash_list_free(&shard->accepted_key_list);
+
+#ifdef TCP_SERVER_USE_EPOLL
+    close(shard->efd);
+#endif
+
+    for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
+        wipe_secure_connection(&shard->incoming_connection_queue[i]);
+        wipe_secure_connection(&shard->unconfirmed_connection_queue[i]);
+    }
+
+    free_accepted_connection_array(shard);
+    free(shard->spare_recv_buffer);
+    timer_wheel_free(&shard->ping_timers);
+    shard_queue_free(&shard->queue);
+}
+
+TCP_Server *new_TCP_server(const Logger *logger, uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports,
+                           const uint8_t *secret_key, Onion *onion)
+{
+    if (num_sockets == 0 || ports == nullptr) {
+        return nullptr;
+    }
+
+    if (networking_at_startup() != 0) {
+        return nullptr;
+    }
+
+    TCP_Server *temp = (TCP_Server *)calloc(1, sizeof(TCP_Server));
+
+    if (temp == nullptr) {
+        return nullptr;
+    }
+
+    temp->logger = logger;
+    temp->send_queue_limit = TCP_SEND_QUEUE_DEFAULT_LIMIT;
+
+    temp->socks_listening = (Socket *)calloc(num_sockets, sizeof(Socket));
+
+    if (temp->socks_listening == nullptr) {
+        free(temp);
+        return nullptr;
+    }
+
+    const Family family = ipv6_enabled ? net_family_ipv6 : net_family_ipv4;
+
+    uint32_t i;
+
+    for (i = 0; i < num_sockets; ++i) {
+        Socket sock = new_listening_TCP_socket(family, ports[i]);
+
+        if (sock_valid(sock)) {
+            temp->socks_listening[temp->num_listening_socks] = sock;
+            ++temp->num_listening_socks;
+        }
+    }
+
+    if (temp->num_listening_socks == 0) {
+        free(temp->socks_listening);
+        free(temp);
+        return nullptr;
+    }
+
+    temp->shards = (TCP_Shard *)calloc(1, sizeof(TCP_Shard));
+
+    if (temp->shards == nullptr || !shard_init(temp, &temp->shards[0], 0)) {
+        for (i = 0; i < temp->num_listening_socks; ++i) {
+            kill_sock(temp->socks_listening[i]);
+        }
+
+        free(temp->shards);
+        free(temp->socks_listening);
+        free(temp);
+        return nullptr;
+    }
+
+    temp->num_shards = 1;
+
+    if (onion) {
+        temp->onion = onion;
+        set_callback_handle_recv_1(onion, &handle_onion_recv_1, temp);
+    }
+
+    memcpy(temp->secret_key, secret_key, CRYPTO_SECRET_KEY_SIZE);
+    crypto_derive_public_key(temp->public_key, temp->secret_key);
+
+    return temp;
+}
+
+#ifndef TCP_SERVER_USE_EPOLL
+static void do_TCP_accept_new(TCP_Shard *shard)
+{
+    uint32_t i;
+
+    for (i = 0; i < shard->tcp_server->num_listening_socks; ++i) {
+        Socket sock;
+
+        do {
+            sock = net_accept(shard->tcp_server->socks_listening[i]);
+        } while (accept_connection(shard, sock) != -1);
+    }
+}
+#endif
+
+static int do_incoming(TCP_Shard *shard, uint32_t i)
+{
+    if (shard->incoming_connection_queue[i].status != TCP_STATUS_CONNECTED) {
+        return -1;
+    }
+
+    int ret = read_connection_handshake(shard->tcp_server->logger, &shard->incoming_connection_queue[i],
+                                        shard->tcp_server->secret_key);
+
+    if (ret == -1) {
+        kill_TCP_secure_connection(shard, &shard->incoming_connection_queue[i]);
+    } else if (ret == 1) {
+        int index_new = shard->unconfirmed_connection_queue_index % MAX_INCOMING_CONNECTIONS;
+        TCP_Secure_Connection *conn_old = &shard->incoming_connection_queue[i];
+        TCP_Secure_Connection *conn_new = &shard->unconfirmed_connection_queue[index_new];
+
+        if (conn_new->status != TCP_STATUS_NO_STATUS) {
+            kill_TCP_secure_connection(shard, conn_new);
+        }
+
+        move_secure_connection(conn_new, conn_old);
+        ++shard->unconfirmed_connection_queue_index;
+
+        return index_new;
+    }
+
+    return -1;
+}
+
+/* Give a connection a receive buffer if it doesn't have one.
+ *
+ * return false on failure.
+ */
+static bool take_recv_buffer(TCP_Shard *shard, TCP_Secure_Connection *con)
+{
+    if (con->recv_buffer != nullptr) {
+        return true;
+    }
+
+    if (shard->spare_recv_buffer != nullptr) {
+        con->recv_buffer = shard->spare_recv_buffer;
+        shard->spare_recv_buffer = nullptr;
+    } else {
+        con->recv_buffer = (TCP_Recv_Buffer *)malloc(sizeof(TCP_Recv_Buffer));
+
+        if (con->recv_buffer == nullptr) {
+            return false;
+        }
+    }
+
+    con->recv_buffer->start = 0;
+    con->recv_buffer->end = 0;
+    return true;
+}
+
+/* Take a connection's receive buffer back once everything in it is parsed.
+ */
+static void release_recv_buffer(TCP_Shard *shard, TCP_Secure_Connection *con)
+{
+    if (con->recv_buffer->start != con->recv_buffer->end) {
+        return;
+    }
+
+    if (shard->spare_recv_buffer == nullptr) {
+        shard->spare_recv_buffer = con->recv_buffer;
+    } else {
+        free(con->recv_buffer);
+    }
+
+    con->recv_buffer = nullptr;
+}
+
+/* Like read_packet_TCP_secure_connection, for a connection of shard. A
+ * connection only holds a receive buffer while there is data in it: it takes
+ * the shard's spare one to read and gives it back once everything in it is
+ * parsed, so idle connections don't keep one and reading doesn't allocate.
+ *
+ * return length of received packet on success.
+ * return 0 if could not read any packet.
+ * return -1 on failure (connection must be killed).
+ */
+static int read_packet_TCP_shard(TCP_Shard *shard, TCP_Secure_Connection *con, uint8_t *data, uint16_t max_len)
+{
+    if (!take_recv_buffer(shard, con)) {
+        return -1;
+    }
+
+    const int len = read_packet_TCP_secure_connection(shard->tcp_server->logger, con->sock, con->recv_buffer,
+                    con->shared_key, con->recv_nonce, data, max_len);
+
+    release_recv_buffer(shard, con);
+    return len;
+}
+
+static int do_unconfirmed(TCP_Shard *shard, const Mono_Time *mono_time, uint32_t i)
+{
+    TCP_Secure_Connection *conn = &shard->unconfirmed_connection_queue[i];
+
+    if (conn->status != TCP_STATUS_UNCONFIRMED) {
+        return -1;
+    }
+
+    uint8_t packet[MAX_PACKET_SIZE];
+    int len = read_packet_TCP_shard(shard, conn, packet, sizeof(packet));
+
+    if (len == 0) {
+        return -1;
+    }
+
+    if (len == -1) {
+        kill_TCP_secure_connection(shard, conn);
+        return -1;
+    }
+
+    return confirm_TCP_connection(shard, mono_time, conn, packet, len);
+}
+
+static bool tcp_process_secure_packet(TCP_Shard *shard, uint32_t i)
+{
+    TCP_Secure_Connection *const conn = &shard->accepted_connection_array[i];
+
+    uint8_t packet[MAX_PACKET_SIZE];
+    int len = read_packet_TCP_shard(shard, conn, packet, sizeof(packet));
+
+    if (len == 0) {
+        return false;
+    }
+
+    if (len == -1) {
+        kill_accepted(shard, i);
+        return false;
+    }
+
+    if (handle_TCP_packet(shard, i, packet, len) == -1) {
+        kill_accepted(shard, i);
+        return false;
+    }
+
+    return true;
+}
+
+/* Maximum number of packets handled from one connection in one go. A client
+ * can send faster than the server can relay, so reading until the socket is
+ * empty would let it keep the server from serving anyone else.
+ */
+#define TCP_MAX_PACKETS_PER_RECV 64
+
+/* return true if the connection may have more packets to read.
+ * return false if there is no more data to read or the connection was killed.
+ */
+static bool do_confirmed_recv(TCP_Shard *shard, uint32_t i)
+{
+    for (uint32_t n = 0; n < TCP_MAX_PACKETS_PER_RECV; ++n) {
+        // Keep reading until an error occurs or there is no more data to read.
+        if (!tcp_process_secure_packet(shard, i)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#ifndef TCP_SERVER_USE_EPOLL
+static void do_TCP_incoming(TCP_Shard *shard)
+{
+    for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
+        do_incoming(shard, i);
+    }
+}
+
+static void do_TCP_unconfirmed(TCP_Shard *shard, const Mono_Time *mono_time)
+{
+    for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
+        do_unconfirmed(shard, mono_time, i);
+    }
+}
+#endif
+
+typedef struct TCP_Ping_Run {
+    TCP_Shard *shard;
+    const Mono_Time *mono_time;
+} TCP_Ping_Run;
+
+/* Ping an accepted connection whose ping timer expired, or kill it if it
+ * didn't answer the last ping in time, and set the timer for the next time
+ * it needs looking at.
+ */
+static void do_confirmed_ping(void *object, uint32_t i)
+{
+    const TCP_Ping_Run *const run = (const TCP_Ping_Run *)object;
+    TCP_Shard *const shard = run->shard;
+    const Mono_Time *const mono_time = run->mono_time;
+    TCP_Secure_Connection *const conn = &shard->accepted_connection_array[i];
+
+    if (mono_time_is_timeout(mono_time, conn->last_pinged, TCP_PING_FREQUENCY)) {
+        uint8_t ping[1 + sizeof(uint64_t)];
+        ping[0] = TCP_PACKET_PING;
+        uint64_t ping_id = random_u64();
+
+        if (!ping_id) {
+            ++ping_id;
+        }
+
+        memcpy(ping + 1, &ping_id, sizeof(uint64_t));
+        int ret = write_packet_TCP_secure_connection(shard, i, ping, sizeof(ping), 1);
+
+        if (ret == 1) {
+            conn->last_pinged = mono_time_get(mono_time);
+            conn->ping_id = ping_id;
+        } else {
+            if (mono_time_is_timeout(mono_time, conn->last_pinged, TCP_PING_FREQUENCY + TCP_PING_TIMEOUT)) {
+                kill_accepted(shard, i);
+                return;
+            }
+
+            /* Try again at the next tick. */
+            timer_wheel_set(&shard->ping_timers, i, mono_time_get(mono_time) + 1);
+            return;
+        }
+    }
+
+    if (conn->ping_id && mono_time_is_timeout(mono_time, conn->last_pinged, TCP_PING_TIMEOUT)) {
+        kill_accepted(shard, i);
+        return;
+    }
+
+    /* A pong clears ping_id without touching the timer, so with a ping out
+     * the timer goes off once more when it times out. */
+    const uint64_t next = conn->ping_id ? TCP_PING_TIMEOUT : TCP_PING_FREQUENCY;
+    timer_wheel_set(&shard->ping_timers, i, conn->last_pinged + next);
+}
+
+/* Write what the connections on the pending list have queued.
+ */
+static void send_pending_connections(TCP_Shard *shard)
+{
+#ifdef TCP_SERVER_USE_IO_URING
+
+    if (shard->uring != nullptr) {
+        /* Connections with a send running are left to its completion, which
+         * sends what was queued in the meantime. */
+        while (shard->num_pending != 0) {
+            const uint32_t index = shard->pending[0];
+            const TCP_Secure_Connection *const con = &shard->accepted_connection_array[index];
+
+            if (con->send_op == 0 && con->send_queue.size != 0 && !tcp_uring_send(shard, index)) {
+                break;
+            }
+
+            remove_pending(shard, index);
+        }
+
+        return;
+    }
+
+#endif
+    uint32_t i = 0;
+
+    while (i < shard->num_pending) {
+        const uint32_t index = shard->pending[i];
+
+        if (send_pending_data(&shard->accepted_connection_array[index]) == 0) {
+            /* Replaces this entry with the last one. */
+            remove_pending(shard, index);
+            continue;
+        }
+
+        ++i;
+    }
+}
+
+static void do_TCP_confirmed(TCP_Shard *shard, const Mono_Time *mono_time)
+{
+    TCP_Ping_Run run = {shard, mono_time};
+    timer_wheel_advance(&shard->ping_timers, mono_time_get(mono_time), &do_confirmed_ping, &run);
+
+    send_pending_connections(shard);
+
+#ifndef TCP_SERVER_USE_EPOLL
+
+    for (uint32_t i = 0; i < shard->size_accepted_connections; ++i) {
+        if (shard->accepted_connection_array[i].status == TCP_STATUS_CONFIRMED) {
+            do_confirmed_recv(shard, i);
+        }
+    }
+
+#endif
+}
+
+#ifdef TCP_SERVER_USE_EPOLL
+/* return the accepted connection a message is addressed to.
+ * return NULL if it was killed since the message was posted.
+ */
+static TCP_Secure_Connection *message_destination(TCP_Shard *shard, const TCP_Shard_Message *msg)
+{
+    if (msg->index >= shard->size_accepted_connections) {
+        return nullptr;
+    }
+
+    TCP_Secure_Connection *const con = &shard->accepted_connection_array[msg->index];
+
+    if (con->status != TCP_STATUS_CONFIRMED || con->identifier != msg->identifier) {
+        return nullptr;
+    }
+
+    return con;
+}
+
+/* Tell the source of a message that its link to the destination is gone.
+ */
+static void reply_unlink(TCP_Shard *shard, const TCP_Shard_Message *msg)
+{
+    TCP_Shard_Message reply = {0};
+    reply.type = TCP_SHARD_MESSAGE_UNLINK;
+    reply.slot = msg->source_slot;
+    reply.index = msg->source_index;
+    reply.identifier = msg->source_identifier;
+    reply.source_shard = shard->id;
+    reply.source_index = msg->index;
+    reply.source_identifier = msg->identifier;
+    reply.source_slot = msg->slot;
+
+    if (!post_to_shard(shard->tcp_server, msg->source_shard, &reply, nullptr)) {
+        LOGGER_WARNING(shard->tcp_server->logger, "failed to tell shard %u about a dropped link", msg->source_shard);
+    }
+}
+
+/* return true if slot conn is linked to the source of msg.
+ */
+static bool linked_to_source(const TCP_Secure_Conn *conn, const TCP_Shard_Message *msg)
+{
+    return conn->status == 2 && conn->shard == msg->source_shard && conn->index == msg->source_index
+           && conn->identifier == msg->source_identifier && conn->other_id == msg->source_slot;
+}
+
+/* A connection on another shard asked to be routed to one here. Link them if
+ * this one asked for that connection too, like handle_TCP_routing_req does for
+ * connections on the same shard.
+ */
+static void handle_link_message(TCP_Shard *shard, const TCP_Shard_Message *msg)
+{
+    const int index = get_TCP_connection_index(shard, msg->public_key);
+
+    if (index == -1) {
+        return;
+    }
+
+    TCP_Secure_Connection *const con = &shard->accepted_connection_array[index];
+
+    const int i = find_route(&con->routes, msg->source_public_key);
+
+    if (i == -1 || con->routes.entries[i].status != 1) {
+        return;
+    }
+
+    /* Only link this side once the other one is sure to be linked too. */
+    TCP_Shard_Message reply = {0};
+    reply.type = TCP_SHARD_MESSAGE_LINKED;
+    reply.slot = msg->source_slot;
+    reply.index = msg->source_index;
+    reply.identifier = msg->source_identifier;
+    set_message_source(&reply, shard, con, i);
+
+    if (!post_to_shard(shard->tcp_server, msg->source_shard, &reply, nullptr)) {
+        LOGGER_WARNING(shard->tcp_server->logger, "failed to link a connection to shard %u", msg->source_shard);
+        return;
+    }
+
+    link_connection(con, i, msg->source_shard, msg->source_index, msg->source_identifier, msg->source_slot);
+    send_connect_notification(shard, index, i);
+}
+
+static void handle_linked_message(TCP_Shard *shard, const TCP_Shard_Message *msg)
+{
+    TCP_Secure_Connection *const con = message_destination(shard, msg);
+
+    TCP_Secure_Conn *const conn = con == nullptr ? nullptr : get_route(&con->routes, msg->slot);
+
+    if (conn == nullptr) {
+        reply_unlink(shard, msg);
+        return;
+    }
+
+    if (linked_to_source(conn, msg)) {
+        /* Both sides asked at the same time, so both shards linked them. */
+        return;
+    }
+
+    if (conn->status != 1 || public_key_cmp(conn->public_key, msg->source_public_key) != 0) {
+        reply_unlink(shard, msg);
+        return;
+    }
+
+    link_connection(con, msg->slot, msg->source_shard, msg->source_index, msg->source_identifier, msg->source_slot);
+    send_connect_notification(shard, msg->index, msg->slot);
+}
+
+static void handle_unlink_message(TCP_Shard *shard, const TCP_Shard_Message *msg)
+{
+    TCP_Secure_Connection *const con = message_destination(shard, msg);
+
+    TCP_Secure_Conn *const conn = con == nullptr ? nullptr : get_route(&con->routes, msg->slot);
+
+    if (conn == nullptr || !linked_to_source(conn, msg)) {
+        return;
+    }
+
+    conn->other_id = 0;
+    conn->index = 0;
+    conn->status = 1;
+    send_disconnect_notification(shard, msg->index, msg->slot);
+}
+
+static void handle_shard_message(TCP_Shard *shard, const TCP_Shard_Message *msg, const uint8_t *data)
+{
+    switch (msg->type) {
+        case TCP_SHARD_MESSAGE_ACCEPT: {
+            add_incoming(shard, msg->sock);
+            break;
+        }
+
+        case TCP_SHARD_MESSAGE_KILL: {
+            const int index = get_TCP_connection_index(shard, msg->public_key);
+
+            if (index != -1 && shard->accepted_connection_array[index].identifier < msg->identifier) {
+                kill_accepted(shard, index);
+            }
+
+            break;
+        }
+
+        case TCP_SHARD_MESSAGE_LINK: {
+            handle_link_message(shard, msg);
+            break;
+        }
+
+        case TCP_SHARD_MESSAGE_LINKED: {
+            handle_linked_message(shard, msg);
+            break;
+        }
+
+        case TCP_SHARD_MESSAGE_UNLINK: {
+            handle_unlink_message(shard, msg);
+            break;
+        }
+
+        case TCP_SHARD_MESSAGE_PACKET: {
+            if (msg->length == 0) {
+                break;
+            }
+
+            const TCP_Secure_Connection *const con = message_destination(shard, msg);
+
+            if (data[0] < NUM_RESERVED_PORTS) {
+                if (con != nullptr) {
+                    write_packet_TCP_accepted(shard, msg->index, data, msg->length, 0);
+                }
+
+                break;
+            }
+
+            const uint8_t c_id = data[0] - NUM_RESERVED_PORTS;
+
+            const TCP_Secure_Conn *const conn = con == nullptr ? nullptr : get_route(&con->routes, c_id);
+
+            if (conn != nullptr && c_id == msg->slot && linked_to_source(conn, msg)) {
+                relay_packet(shard, msg->index, data, msg->length);
+                break;
+            }
+
+            /* The link was dropped here, or never made, and the source missed
+             * being told. */
+            reply_unlink(shard, msg);
+            break;
+        }
+
+        case TCP_SHARD_MESSAGE_KEY_PACKET: {
+            const int index = get_TCP_connection_index(shard, msg->public_key);
+
+            if (index != -1) {
+                write_packet_TCP_accepted(shard, index, data, msg->length, 0);
+            }
+
+            break;
+        }
+    }
+}
+
+/* Handle the messages other threads posted to the shard.
+ *
+ * return false if the shard was told to stop.
+ */
+static bool handle_shard_messages(TCP_Shard *shard)
+{
+    bool stop;
+    const uint32_t size = shard_queue_take(&shard->queue, &stop);
+    const uint8_t *const batch = shard->queue.processing;
 
-    if (write_packet_TCP_secure_connection(con, packet, SIZEOF_VLA(packet), 0) != 1) {
-        return 1;
+    for (uint32_t pos = 0; pos < size;) {
+        TCP_Shard_Message msg;
+        memcpy(&msg, batch + pos, sizeof(TCP_Shard_Message));
+        handle_shard_message(shard, &msg, batch + pos + sizeof(TCP_Shard_Message));
+        pos += shard_message_size(msg.length);
     }
 
-    return 0;
+    return !stop;
 }
 
-/* return 0 on success
- * return -1 on failure
+/* Have epoll report a connection again that was left with data to read. In
+ * edge triggered mode it otherwise only would be once more data arrives.
  */
-static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint8_t *data, uint16_t length)
+static void tcp_epoll_rearm(TCP_Shard *shard, struct epoll_event *ev)
 {
-    if (length == 0) {
-        return -1;
-    }
+    const int sock = ev->data.u64 & 0xFFFFFFFF;
+    ev->events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+    epoll_ctl(shard->efd, EPOLL_CTL_MOD, sock, ev);
+}
 
-    TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[con_id];
+static bool tcp_epoll_process(TCP_Shard *shard, const Mono_Time *mono_time, int timeout)
+{
+#define MAX_EVENTS 16
+    struct epoll_event events[MAX_EVENTS];
+    const int nfds = epoll_wait(shard->efd, events, MAX_EVENTS, timeout);
+#undef MAX_EVENTS
 
-    switch (data[0]) {
-        case TCP_PACKET_ROUTING_REQUEST: {
-            if (length != 1 + CRYPTO_PUBLIC_KEY_SIZE) {
-                return -1;
-            }
+    for (int n = 0; n < nfds; ++n) {
+        const Socket sock = {(int)(events[n].data.u64 & 0xFFFFFFFF)};
+        const int status = (events[n].data.u64 >> 32) & 0xFF;
+        const int index = events[n].data.u64 >> 40;
 
-            return handle_TCP_routing_req(tcp_server, con_id, data + 1);
-        }
+        if ((events[n].events & EPOLLERR) || (events[n].events & EPOLLHUP) || (events[n].events & EPOLLRDHUP)) {
+            switch (status) {
+                case TCP_SOCKET_LISTENING: {
+                    // should never happen
+                    break;
+                }
 
-        case TCP_PACKET_CONNECTION_NOTIFICATION: {
-            if (length != 2) {
-                return -1;
-            }
+                case TCP_SOCKET_INCOMING: {
+                    kill_TCP_secure_connection(shard, &shard->incoming_connection_queue[index]);
+                    break;
+                }
 
-            break;
-        }
+                case TCP_SOCKET_UNCONFIRMED: {
+                    kill_TCP_secure_connection(shard, &shard->unconfirmed_connection_queue[index]);
+                    break;
+                }
 
-        case TCP_PACKET_DISCONNECT_NOTIFICATION: {
-            if (length != 2) {
-                return -1;
+                case TCP_SOCKET_CONFIRMED: {
+                    kill_accepted(shard, index);
+                    break;
+                }
             }
 
-            return rm_connection_index(tcp_server, con, data[1] - NUM_RESERVED_PORTS);
+            continue;
         }
 
-        case TCP_PACKET_PING: {
-            if (length != 1 + sizeof(uint64_t)) {
-                return -1;
-            }
 
-            uint8_t response[1 + sizeof(uint64_t)];
-            response[0] = TCP_PACKET_PONG;
-            memcpy(response + 1, data + 1, sizeof(uint64_t));
-            write_packet_TCP_secure_connection(con, response, sizeof(response), 1);
-            return 0;
+        if (!(events[n].events & EPOLLIN)) {
+            continue;
         }
 
-        case TCP_PACKET_PONG: {
-            if (length != 1 + sizeof(uint64_t)) {
-                return -1;
-            }
+        switch (status) {
+            case TCP_SOCKET_LISTENING: {
+                // socket is from socks_listening, accept connection
+                while (1) {
+                    Socket sock_new = net_accept(sock);
 
-            uint64_t ping_id;
-            memcpy(&ping_id, data + 1, sizeof(uint64_t));
+                    if (!sock_valid(sock_new)) {
+                        break;
+                    }
 
-            if (ping_id) {
-                if (ping_id == con->ping_id) {
-                    con->ping_id = 0;
+                    distribute_accepted(shard, sock_new);
                 }
 
-                return 0;
+                break;
             }
 
-            return -1;
-        }
-
-        case TCP_PACKET_OOB_SEND: {
-            if (length <= 1 + CRYPTO_PUBLIC_KEY_SIZE) {
-                return -1;
-            }
+            case TCP_SOCKET_INCOMING: {
+                const int index_new = do_incoming(shard, index);
 
-            return handle_TCP_oob_send(tcp_server, con_id, data + 1, data + 1 + CRYPTO_PUBLIC_KEY_SIZE,
-                                       length - (1 + CRYPTO_PUBLIC_KEY_SIZE));
-        }
+                if (index_new != -1) {
+                    events[n].events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+                    events[n].data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_UNCONFIRMED << 32) | ((uint64_t)index_new << 40);
 
-        case TCP_PACKET_ONION_REQUEST: {
-            if (tcp_server->onion) {
-                if (length <= 1 + CRYPTO_NONCE_SIZE + ONION_SEND_BASE * 2) {
-                    return -1;
+                    if (epoll_ctl(shard->efd, EPOLL_CTL_MOD, sock.socket, &events[n]) == -1) {
+                        kill_TCP_secure_connection(shard, &shard->unconfirmed_connection_queue[index_new]);
+                        break;
+                    }
                 }
 
-                IP_Port source;
-                source.port = 0;  // dummy initialise
-                source.ip.family = net_family_tcp_onion;
-                source.ip.ip.v6.uint32[0] = con_id;
-                source.ip.ip.v6.uint32[1] = 0;
-                source.ip.ip.v6.uint64[1] = con->identifier;
-                onion_send_1(tcp_server->onion, data + 1 + CRYPTO_NONCE_SIZE, length - (1 + CRYPTO_NONCE_SIZE), source,
-                             data + 1);
+                break;
             }
 
-            return 0;
-        }
+            case TCP_SOCKET_UNCONFIRMED: {
+                const int index_new = do_unconfirmed(shard, mono_time, index);
 
-        case TCP_PACKET_ONION_RESPONSE: {
-            return -1;
-        }
+                if (index_new != -1) {
+                    events[n].events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+                    events[n].data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_CONFIRMED << 32) | ((uint64_t)index_new << 40);
 
-        default: {
-            if (data[0] < NUM_RESERVED_PORTS) {
-                return -1;
-            }
+                    if (epoll_ctl(shard->efd, EPOLL_CTL_MOD, sock.socket, &events[n]) == -1) {
+                        // remove from confirmed connections
+                        kill_accepted(shard, index_new);
+                        break;
+                    }
 
-            uint8_t c_id = data[0] - NUM_RESERVED_PORTS;
+                    /* Packets that arrived along with the first one are in
+                     * the receive buffer already and won't trigger another
+                     * event. */
+                    if (do_confirmed_recv(shard, index_new)) {
+                        tcp_epoll_rearm(shard, &events[n]);
+                    }
+                }
 
-            if (c_id >= NUM_CLIENT_CONNECTIONS) {
-                return -1;
+                break;
             }
 
-            if (con->connections[c_id].status == 0) {
-                return -1;
+            case TCP_SOCKET_CONFIRMED: {
+                if (do_confirmed_recv(shard, index)) {
+                    tcp_epoll_rearm(shard, &events[n]);
+                }
+
+                break;
             }
 
-            if (con->connections[c_id].status != 2) {
-                return 0;
+            case TCP_SOCKET_WAKEUP: {
+                // Messages are handled by the caller.
+                break;
             }
+        }
+    }
 
-            uint32_t index = con->connections[c_id].index;
-            uint8_t other_c_id = con->connections[c_id].other_id + NUM_RESERVED_PORTS;
-            VLA(uint8_t, new_data, length);
-            memcpy(new_data, data, length);
-            new_data[0] = other_c_id;
-            int ret = write_packet_TCP_secure_connection(&tcp_server->accepted_connection_array[index], new_data, length, 0);
+    return nfds > 0;
+}
 
-            if (ret == -1) {
-                return -1;
-            }
+/* Maximum number of epoll_wait calls in one do_TCP_server. Under a steady
+ * stream of packets there are always FDs ready, so without a limit
+ * do_TCP_server would never return.
+ */
+#define TCP_EPOLL_MAX_ROUNDS 64
 
-            return 0;
+static void do_TCP_epoll(TCP_Shard *shard, const Mono_Time *mono_time)
+{
+    for (uint32_t i = 0; i < TCP_EPOLL_MAX_ROUNDS; ++i) {
+        // Keep processing packets until there are no more FDs ready for reading.
+        if (!tcp_epoll_process(shard, mono_time, 0)) {
+            break;
         }
     }
-
-    return 0;
 }
 
+#ifdef TCP_SERVER_USE_IO_URING
+/* Maximum number of completions handled in one tcp_uring_process, like
+ * MAX_EVENTS for epoll. */
+#define TCP_URING_MAX_COMPLETIONS 256
 
-static int confirm_TCP_connection(TCP_Server *tcp_server, const Mono_Time *mono_time, TCP_Secure_Connection *con,
-                                  const uint8_t *data,
-                                  uint16_t length)
+/* return the field of the connection an operation runs for that holds its id.
+ * return NULL if the operation isn't for a connection or is detached.
+ */
+static uint32_t *uring_op_owner(TCP_Shard *shard, const TCP_Uring_Op *op)
 {
-    int index = add_accepted(tcp_server, mono_time, con);
+    switch (op->type) {
+        case TCP_SOCKET_INCOMING:
+            return &shard->incoming_connection_queue[op->index].read_op;
 
-    if (index == -1) {
-        kill_TCP_secure_connection(con);
-        return -1;
-    }
+        case TCP_SOCKET_UNCONFIRMED:
+            return &shard->unconfirmed_connection_queue[op->index].read_op;
 
-    wipe_secure_connection(con);
+        case TCP_SOCKET_CONFIRMED:
+            return &shard->accepted_connection_array[op->index].read_op;
 
-    if (handle_TCP_packet(tcp_server, index, data, length) == -1) {
-        kill_accepted(tcp_server, index);
-        return -1;
+        case TCP_URING_SEND:
+            return &shard->accepted_connection_array[op->index].send_op;
     }
 
-    return index;
+    return nullptr;
 }
 
-/* return index on success
- * return -1 on failure
+/* Append data received on an accepted connection to its receive buffer, as
+ * much at a time as fits, and handle the packets it completes.
+ *
+ * return false if the connection was killed.
  */
-static int accept_connection(TCP_Server *tcp_server, Socket sock)
+static bool tcp_uring_handle_data(TCP_Shard *shard, uint32_t index, const uint8_t *data, uint32_t length)
 {
-    if (!sock_valid(sock)) {
-        return -1;
-    }
+    uint8_t packet[MAX_PACKET_SIZE];
 
-    if (!set_socket_nonblock(sock)) {
-        kill_sock(sock);
-        return -1;
-    }
+    do {
+        TCP_Secure_Connection *con = &shard->accepted_connection_array[index];
 
-    if (!set_socket_nosigpipe(sock)) {
-        kill_sock(sock);
-        return -1;
-    }
+        if (!take_recv_buffer(shard, con)) {
+            kill_accepted(shard, index);
+            return false;
+        }
 
-    uint16_t index = tcp_server->incoming_connection_queue_index % MAX_INCOMING_CONNECTIONS;
+        TCP_Recv_Buffer *const recv_buffer = con->recv_buffer;
+        compact_recv_buffer(recv_buffer);
+        const uint32_t size = min_u32(length, sizeof(recv_buffer->data) - recv_buffer->end);
 
-    TCP_Secure_Connection *conn = &tcp_server->incoming_connection_queue[index];
+        if (size != 0) {
+            memcpy(recv_buffer->data + recv_buffer->end, data, size);
+            recv_buffer->end += size;
+            data += size;
+            length -= size;
+        }
 
-    if (conn->status != TCP_STATUS_NO_STATUS) {
-        kill_TCP_secure_connection(conn);
-    }
+        while (true) {
+            const uint16_t start = recv_buffer->start;
+            const int len = parse_packet_TCP_secure_connection(recv_buffer, con->shared_key, con->recv_nonce, packet,
+                            sizeof(packet));
 
-    conn->status = TCP_STATUS_CONNECTED;
-    conn->sock = sock;
-    conn->next_packet_length = 0;
+            if (len == 0) {
+                /* Empty packets are skipped without returning anything. */
+                if (recv_buffer->start == start) {
+                    break;
+                }
 
-    ++tcp_server->incoming_connection_queue_index;
-    return index;
+                continue;
+            }
+
+            if (len == -1 || handle_TCP_packet(shard, index, packet, len) == -1) {
+                kill_accepted(shard, index);
+                return false;
+            }
+
+            con = &shard->accepted_connection_array[index];
+        }
+
+        release_recv_buffer(shard, con);
+    } while (length != 0);
+
+    return true;
 }
 
-static Socket new_listening_TCP_socket(Family family, uint16_t port)
+/* return true if a poll on a connection's socket says it was closed. Poll
+ * events have the same values as epoll's.
+ */
+static bool uring_poll_hangup(int32_t result)
 {
-    Socket sock = net_socket(family, TOX_SOCK_STREAM, TOX_PROTO_TCP);
+    return result < 0 || (result & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) != 0;
+}
 
-    if (!sock_valid(sock)) {
-        return net_invalid_socket;
+static void tcp_uring_complete(TCP_Shard *shard, const Mono_Time *mono_time, const Uring_Completion *completion)
+{
+    /* The completions of cancels have no operation. */
+    if (completion->user_data == 0 || completion->user_data > shard->size_uring_ops) {
+        return;
     }
 
-    int ok = set_socket_nonblock(sock);
+    const uint32_t id = (uint32_t)completion->user_data;
+    const TCP_Uring_Op op = shard->uring_ops[id - 1];
+    const bool more = (completion->flags & URING_COMPLETION_MORE) != 0;
+    const int32_t result = completion->result;
 
-    if (ok && net_family_is_ipv6(family)) {
-        ok = set_socket_dualstack(sock);
-    }
+    if (!more) {
+        uint32_t *const owner = uring_op_owner(shard, &op);
 
-    if (ok) {
-        ok = set_socket_reuseaddr(sock);
-    }
+        if (owner != nullptr) {
+            *owner = 0;
+        }
 
-    ok = ok && bind_to_port(sock, family, port) && (net_listen(sock, TCP_MAX_BACKLOG) == 0);
+        /* The buffer of a send is passed on below. */
+        if (op.type == TCP_URING_SEND) {
+            shard->uring_ops[id - 1].buffer = nullptr;
+        }
 
-    if (!ok) {
-        kill_sock(sock);
-        return net_invalid_socket;
+        free_uring_op(shard, id);
     }
 
-    return sock;
-}
+    switch (op.type) {
+        case TCP_SOCKET_LISTENING: {
+            if (result >= 0) {
+                const Socket sock = {result};
+                distribute_accepted(shard, sock);
+            }
 
-TCP_Server *new_TCP_server(const Logger *logger, uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports,
-                           const uint8_t *secret_key, Onion *onion)
-{
-    if (num_sockets == 0 || ports == nullptr) {
-        return nullptr;
-    }
+            if (!more) {
+                tcp_uring_accept(shard, op.index);
+            }
 
-    if (networking_at_startup() != 0) {
-        return nullptr;
-    }
+            break;
+        }
 
-    TCP_Server *temp = (TCP_Server *)calloc(1, sizeof(TCP_Server));
+        case TCP_SOCKET_INCOMING: {
+            TCP_Secure_Connection *const con = &shard->incoming_connection_queue[op.index];
 
-    if (temp == nullptr) {
-        return nullptr;
-    }
+            if (uring_poll_hangup(result)) {
+                kill_TCP_secure_connection(shard, con);
+                break;
+            }
 
-    temp->logger = logger;
+            const int index_new = do_incoming(shard, op.index);
 
-    temp->socks_listening = (Socket *)calloc(num_sockets, sizeof(Socket));
+            if (index_new != -1) {
+                if (!tcp_uring_poll(shard, TCP_SOCKET_UNCONFIRMED, index_new)) {
+                    kill_TCP_secure_connection(shard, &shard->unconfirmed_connection_queue[index_new]);
+                }
+            } else if (con->status == TCP_STATUS_CONNECTED && !tcp_uring_poll(shard, TCP_SOCKET_INCOMING, op.index)) {
+                kill_TCP_secure_connection(shard, con);
+            }
 
-    if (temp->socks_listening == nullptr) {
-        free(temp);
-        return nullptr;
-    }
+            break;
+        }
 
-#ifdef TCP_SERVER_USE_EPOLL
-    temp->efd = epoll_create(8);
+        case TCP_SOCKET_UNCONFIRMED: {
+            TCP_Secure_Connection *const con = &shard->unconfirmed_connection_queue[op.index];
+
+            if (uring_poll_hangup(result)) {
+                kill_TCP_secure_connection(shard, con);
+                break;
+            }
+
+            const int index_new = do_unconfirmed(shard, mono_time, op.index);
+
+            if (index_new != -1) {
+                /* Packets that arrived along with the first one are in the
+                 * receive buffer already. */
+                if (tcp_uring_handle_data(shard, index_new, nullptr, 0) && !tcp_uring_recv(shard, index_new)) {
+                    kill_accepted(shard, index_new);
+                }
+            } else if (con->status == TCP_STATUS_UNCONFIRMED
+                       && !tcp_uring_poll(shard, TCP_SOCKET_UNCONFIRMED, op.index)) {
+                kill_TCP_secure_connection(shard, con);
+            }
+
+            break;
+        }
+
+        case TCP_SOCKET_CONFIRMED: {
+            bool alive = true;
+
+            if (result > 0 && (completion->flags & URING_COMPLETION_BUFFER) != 0) {
+                alive = tcp_uring_handle_data(shard, op.index, uring_buffer(shard->uring, completion->buffer),
+                                              result);
+            } else if (result != -ENOBUFS) {
+                /* The end of the stream or an error. */
+                kill_accepted(shard, op.index);
+                alive = false;
+            }
+
+            /* Out of buffers, or the kernel stopped the receive for another
+             * reason: start over. */
+            if (alive && !more && !tcp_uring_recv(shard, op.index)) {
+                kill_accepted(shard, op.index);
+            }
 
-    if (temp->efd == -1) {
-        free(temp->socks_listening);
-        free(temp);
-        return nullptr;
-    }
+            break;
+        }
 
-#endif
+        case TCP_URING_SEND: {
+            if (result <= 0) {
+                free(op.buffer);
+                kill_accepted(shard, op.index);
+                break;
+            }
 
-    const Family family = ipv6_enabled ? net_family_ipv6 : net_family_ipv4;
+            if (op.offset + result < op.length) {
+                if (!tcp_uring_send_buffer(shard, op.index, op.buffer, op.offset + result, op.length)) {
+                    free(op.buffer);
+                    kill_accepted(shard, op.index);
+                }
 
-    uint32_t i;
-#ifdef TCP_SERVER_USE_EPOLL
-    struct epoll_event ev;
-#endif
+                break;
+            }
 
-    for (i = 0; i < num_sockets; ++i) {
-        Socket sock = new_listening_TCP_socket(family, ports[i]);
+            TCP_Send_Queue *const queue = &shard->accepted_connection_array[op.index].send_queue;
 
-        if (sock_valid(sock)) {
-#ifdef TCP_SERVER_USE_EPOLL
-            ev.events = EPOLLIN | EPOLLET;
-            ev.data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_LISTENING << 32);
+            /* Send what was queued in the meantime, and keep the memory for
+             * what comes next. Connections with nothing to send don't hold on
+             * to any. */
+            if (queue->size == 0 || !tcp_uring_send(shard, op.index)) {
+                if (queue->size != 0) {
+                    add_pending(shard, op.index);
+                }
 
-            if (epoll_ctl(temp->efd, EPOLL_CTL_ADD, sock.socket, &ev) == -1) {
-                continue;
+                free(op.buffer);
+                break;
             }
 
-#endif
+            queue->data = op.buffer;
+            break;
+        }
 
-            temp->socks_listening[temp->num_listening_socks] = sock;
-            ++temp->num_listening_socks;
+        case TCP_SOCKET_WAKEUP: {
+            // Messages are handled by the caller.
+            if (!more) {
+                tcp_uring_wakeup(shard);
+            }
+
+            break;
         }
     }
 
-    if (temp->num_listening_socks == 0) {
-        free(temp->socks_listening);
-        free(temp);
-        return nullptr;
+    if ((completion->flags & URING_COMPLETION_BUFFER) != 0) {
+        uring_buffer_return(shard->uring, completion->buffer);
     }
+}
 
-    if (onion) {
-        temp->onion = onion;
-        set_callback_handle_recv_1(onion, &handle_onion_recv_1, temp);
+/* Submit the operations queued since the last call, with sends for the
+ * connections that queued data, and handle the completions. Waits up to
+ * timeout ms if there are none yet.
+ *
+ * return true if there were completions.
+ */
+static bool tcp_uring_process(TCP_Shard *shard, const Mono_Time *mono_time, int timeout)
+{
+    send_pending_connections(shard);
+
+    if (!uring_submit(shard->uring, timeout)) {
+        return false;
     }
 
-    memcpy(temp->secret_key, secret_key, CRYPTO_SECRET_KEY_SIZE);
-    crypto_derive_public_key(temp->public_key, temp->secret_key);
+    Uring_Completion completion;
+    uint32_t count = 0;
 
-    bs_list_init(&temp->accepted_key_list, CRYPTO_PUBLIC_KEY_SIZE, 8);
+    while (count < TCP_URING_MAX_COMPLETIONS && uring_completion(shard->uring, &completion)) {
+        tcp_uring_complete(shard, mono_time, &completion);
+        ++count;
+    }
 
-    return temp;
+    return count != 0;
 }
 
-#ifndef TCP_SERVER_USE_EPOLL
-static void do_TCP_accept_new(TCP_Server *tcp_server)
+static void do_TCP_uring(TCP_Shard *shard, const Mono_Time *mono_time)
 {
-    uint32_t i;
-
-    for (i = 0; i < tcp_server->num_listening_socks; ++i) {
-        Socket sock;
-
-        do {
-            sock = net_accept(tcp_server->socks_listening[i]);
-        } while (accept_connection(tcp_server, sock) != -1);
+    for (uint32_t i = 0; i < TCP_EPOLL_MAX_ROUNDS; ++i) {
+        if (!tcp_uring_process(shard, mono_time, 0)) {
+            break;
+        }
     }
 }
 #endif
 
-static int do_incoming(TCP_Server *tcp_server, uint32_t i)
+/* Update the statistics tcp_server_get_stats reports for the shard, once a
+ * second.
+ */
+static void shard_publish_stats(TCP_Shard *shard, const Mono_Time *mono_time)
 {
-    if (tcp_server->incoming_connection_queue[i].status != TCP_STATUS_CONNECTED) {
-        return -1;
+    if (shard->stats_time == mono_time_get(mono_time)) {
+        return;
     }
 
-    int ret = read_connection_handshake(tcp_server->logger, &tcp_server->incoming_connection_queue[i],
-                                        tcp_server->secret_key);
-
-    if (ret == -1) {
-        kill_TCP_secure_connection(&tcp_server->incoming_connection_queue[i]);
-    } else if (ret == 1) {
-        int index_new = tcp_server->unconfirmed_connection_queue_index % MAX_INCOMING_CONNECTIONS;
-        TCP_Secure_Connection *conn_old = &tcp_server->incoming_connection_queue[i];
-        TCP_Secure_Connection *conn_new = &tcp_server->unconfirmed_connection_queue[index_new];
-
-        if (conn_new->status != TCP_STATUS_NO_STATUS) {
-            kill_TCP_secure_connection(conn_new);
-        }
-
-        move_secure_connection(conn_new, conn_old);
-        ++tcp_server->unconfirmed_connection_queue_index;
+    TCP_Server_Stats stats;
+    shard_get_stats(shard, &stats);
+    shard->stats_time = mono_time_get(mono_time);
 
-        return index_new;
-    }
-
-    return -1;
+    pthread_mutex_lock(&shard->tcp_server->directory_lock);
+    shard->stats = stats;
+    pthread_mutex_unlock(&shard->tcp_server->directory_lock);
 }
 
-static int do_unconfirmed(TCP_Server *tcp_server, const Mono_Time *mono_time, uint32_t i)
+static void *shard_thread(void *arg)
 {
-    TCP_Secure_Connection *conn = &tcp_server->unconfirmed_connection_queue[i];
+    TCP_Shard *const shard = (TCP_Shard *)arg;
+    const Mono_Time *const mono_time = shard->tcp_server->mono_time;
 
-    if (conn->status != TCP_STATUS_UNCONFIRMED) {
-        return -1;
-    }
-
-    uint8_t packet[MAX_PACKET_SIZE];
-    int len = read_packet_TCP_secure_connection(tcp_server->logger, conn->sock, &conn->next_packet_length, conn->shared_key,
-              conn->recv_nonce, packet, sizeof(packet));
+    while (handle_shard_messages(shard)) {
+#ifdef TCP_SERVER_USE_IO_URING
 
-    if (len == 0) {
-        return -1;
-    }
+        if (shard->uring != nullptr) {
+            /* Sends are submitted right away, the completions wake it up. */
+            tcp_uring_process(shard, mono_time, TCP_SHARD_WAIT_TIMEOUT);
+            do_TCP_confirmed(shard, mono_time);
+            shard_publish_stats(shard, mono_time);
+            continue;
+        }
 
-    if (len == -1) {
-        kill_TCP_secure_connection(conn);
-        return -1;
+#endif
+        tcp_epoll_process(shard, mono_time,
+                          shard->num_pending != 0 ? TCP_SHARD_PENDING_WAIT_TIMEOUT : TCP_SHARD_WAIT_TIMEOUT);
+        do_TCP_confirmed(shard, mono_time);
+        shard_publish_stats(shard, mono_time);
     }
 
-    return confirm_TCP_connection(tcp_server, mono_time, conn, packet, len);
+    return nullptr;
 }
 
-static bool tcp_process_secure_packet(TCP_Server *tcp_server, uint32_t i)
+/* Set up the message queue of a shard and have its epoll instance report it.
+ *
+ * return true on success.
+ * return false on failure.
+ */
+static bool shard_init_queue(TCP_Shard *shard)
 {
-    TCP_Secure_Connection *const conn = &tcp_server->accepted_connection_array[i];
-
-    uint8_t packet[MAX_PACKET_SIZE];
-    int len = read_packet_TCP_secure_connection(tcp_server->logger, conn->sock, &conn->next_packet_length, conn->shared_key,
-              conn->recv_nonce, packet, sizeof(packet));
-
-    if (len == 0) {
+    if (!shard_queue_init(&shard->queue)) {
         return false;
     }
 
-    if (len == -1) {
-        kill_accepted(tcp_server, i);
-        return false;
+#ifdef TCP_SERVER_USE_IO_URING
+
+    if (shard->uring != nullptr) {
+        if (!tcp_uring_wakeup(shard)) {
+            shard_queue_free(&shard->queue);
+            return false;
+        }
+
+        return true;
     }
 
-    if (handle_TCP_packet(tcp_server, i, packet, len) == -1) {
-        kill_accepted(tcp_server, i);
+#endif
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = shard->queue.wakeup_fd | ((uint64_t)TCP_SOCKET_WAKEUP << 32);
+
+    if (epoll_ctl(shard->efd, EPOLL_CTL_ADD, shard->queue.wakeup_fd, &ev) == -1) {
+        shard_queue_free(&shard->queue);
         return false;
     }
 
     return true;
 }
 
-static void do_confirmed_recv(TCP_Server *tcp_server, uint32_t i)
-{
-    while (tcp_process_secure_packet(tcp_server, i)) {
-        // Keep reading until an error occurs or there is no more data to read.
-        continue;
-    }
-}
-
-#ifndef TCP_SERVER_USE_EPOLL
-static void do_TCP_incoming(TCP_Server *tcp_server)
+static void stop_shard_threads(TCP_Server *tcp_server, uint32_t num_threads)
 {
-    for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
-        do_incoming(tcp_server, i);
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        shard_queue_stop(&tcp_server->shards[i].queue);
     }
-}
 
-static void do_TCP_unconfirmed(TCP_Server *tcp_server, const Mono_Time *mono_time)
-{
-    for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
-        do_unconfirmed(tcp_server, mono_time, i);
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        pthread_join(tcp_server->shards[i].thread, nullptr);
     }
 }
 #endif
 
-static void do_TCP_confirmed(TCP_Server *tcp_server, const Mono_Time *mono_time)
+int tcp_server_start_threads(TCP_Server *tcp_server, const Mono_Time *mono_time, uint32_t num_threads)
 {
 #ifdef TCP_SERVER_USE_EPOLL
+    TCP_Shard *const old_shards = tcp_server->shards;
 
-    if (tcp_server->last_run_pinged == mono_time_get(mono_time)) {
-        return;
+    if (tcp_server->threaded || num_threads == 0 || num_threads > TCP_SERVER_MAX_THREADS
+            || old_shards[0].num_accepted_connections != 0 || old_shards[0].incoming_connection_queue_index != 0) {
+        return -1;
     }
 
-    tcp_server->last_run_pinged = mono_time_get(mono_time);
-#endif
-    uint32_t i;
-
-    for (i = 0; i < tcp_server->size_accepted_connections; ++i) {
-        TCP_Secure_Connection *conn = &tcp_server->accepted_connection_array[i];
-
-        if (conn->status != TCP_STATUS_CONFIRMED) {
-            continue;
-        }
-
-        if (mono_time_is_timeout(mono_time, conn->last_pinged, TCP_PING_FREQUENCY)) {
-            uint8_t ping[1 + sizeof(uint64_t)];
-            ping[0] = TCP_PACKET_PING;
-            uint64_t ping_id = random_u64();
+    TCP_Shard *const shards = (TCP_Shard *)calloc(num_threads, sizeof(TCP_Shard));
 
-            if (!ping_id) {
-                ++ping_id;
-            }
+    if (shards == nullptr) {
+        return -1;
+    }
 
-            memcpy(ping + 1, &ping_id, sizeof(uint64_t));
-            int ret = write_packet_TCP_secure_connection(conn, ping, sizeof(ping), 1);
+    uint32_t num_init = 0;
 
-            if (ret == 1) {
-                conn->last_pinged = mono_time_get(mono_time);
-                conn->ping_id = ping_id;
-            } else {
-                if (mono_time_is_timeout(mono_time, conn->last_pinged, TCP_PING_FREQUENCY + TCP_PING_TIMEOUT)) {
-                    kill_accepted(tcp_server, i);
-                    continue;
-                }
-            }
+    while (num_init < num_threads) {
+        if (!shard_init(tcp_server, &shards[num_init], num_init)) {
+            break;
         }
 
-        if (conn->ping_id && mono_time_is_timeout(mono_time, conn->last_pinged, TCP_PING_TIMEOUT)) {
-            kill_accepted(tcp_server, i);
-            continue;
+        if (!shard_init_queue(&shards[num_init])) {
+            shard_kill(&shards[num_init]);
+            break;
         }
 
-        send_pending_data(conn);
-
-#ifndef TCP_SERVER_USE_EPOLL
-
-        do_confirmed_recv(tcp_server, i);
-
-#endif
+        ++num_init;
     }
-}
-
-#ifdef TCP_SERVER_USE_EPOLL
-static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time)
-{
-#define MAX_EVENTS 16
-    struct epoll_event events[MAX_EVENTS];
-    const int nfds = epoll_wait(tcp_server->efd, events, MAX_EVENTS, 0);
-#undef MAX_EVENTS
 
-    for (int n = 0; n < nfds; ++n) {
-        const Socket sock = {(int)(events[n].data.u64 & 0xFFFFFFFF)};
-        const int status = (events[n].data.u64 >> 32) & 0xFF;
-        const int index = events[n].data.u64 >> 40;
+    bool ok = num_init == num_threads && shard_queue_init(&tcp_server->queue);
 
-        if ((events[n].events & EPOLLERR) || (events[n].events & EPOLLHUP) || (events[n].events & EPOLLRDHUP)) {
-            switch (status) {
-                case TCP_SOCKET_LISTENING: {
-                    // should never happen
-                    break;
-                }
+    if (ok && pthread_mutex_init(&tcp_server->directory_lock, nullptr) != 0) {
+        shard_queue_free(&tcp_server->queue);
+        ok = false;
+    }
 
-                case TCP_SOCKET_INCOMING: {
-                    kill_TCP_secure_connection(&tcp_server->incoming_connection_queue[index]);
-                    break;
-                }
+    if (ok && !hash_list_init(&tcp_server->key_shards, CRYPTO_PUBLIC_KEY_SIZE, 8)) {
+        pthread_mutex_destroy(&tcp_server->directory_lock);
+        shard_queue_free(&tcp_server->queue);
+        ok = false;
+    }
 
-                case TCP_SOCKET_UNCONFIRMED: {
-                    kill_TCP_secure_connection(&tcp_server->unconfirmed_connection_queue[index]);
-                    break;
-                }
+    if (!ok) {
+        for (uint32_t i = 0; i < num_init; ++i) {
+            shard_kill(&shards[i]);
+        }
 
-                case TCP_SOCKET_CONFIRMED: {
-                    kill_accepted(tcp_server, index);
-                    break;
-                }
-            }
+        free(shards);
+        return -1;
+    }
 
-            continue;
-        }
+    /* The threads post to each other's queues as soon as they run, so switch
+     * the server over first. */
+    tcp_server->shards = shards;
+    tcp_server->num_shards = num_threads;
+    tcp_server->mono_time = mono_time;
+    tcp_server->threaded = true;
 
+    uint32_t num_started = 0;
 
-        if (!(events[n].events & EPOLLIN)) {
-            continue;
+    while (num_started < num_threads) {
+        if (pthread_create(&shards[num_started].thread, nullptr, &shard_thread, &shards[num_started]) != 0) {
+            break;
         }
 
-        switch (status) {
-            case TCP_SOCKET_LISTENING: {
-                // socket is from socks_listening, accept connection
-                while (1) {
-                    Socket sock_new = net_accept(sock);
+        ++num_started;
+    }
 
-                    if (!sock_valid(sock_new)) {
-                        break;
-                    }
+    if (num_started < num_threads) {
+        stop_shard_threads(tcp_server, num_started);
 
-                    int index_new = accept_connection(tcp_server, sock_new);
+        for (uint32_t i = 0; i < num_threads; ++i) {
+            shard_kill(&shards[i]);
+        }
 
-                    if (index_new == -1) {
-                        continue;
-                    }
+        free(shards);
+        hash_list_free(&tcp_server->key_shards);
+        pthread_mutex_destroy(&tcp_server->directory_lock);
+        shard_queue_free(&tcp_server->queue);
 
-                    struct epoll_event ev;
+        tcp_server->shards = old_shards;
+        tcp_server->num_shards = 1;
+        tcp_server->threaded = false;
+        return -1;
+    }
 
-                    ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+    shard_kill(&old_shards[0]);
+    free(old_shards);
+    return 0;
+#else
+    return -1;
+#endif
+}
 
-                    ev.data.u64 = sock_new.socket | ((uint64_t)TCP_SOCKET_INCOMING << 32) | ((uint64_t)index_new << 40);
+bool tcp_server_use_io_uring(TCP_Server *tcp_server)
+{
+#ifdef TCP_SERVER_USE_IO_URING
+    TCP_Shard *const shard = &tcp_server->shards[0];
 
-                    if (epoll_ctl(tcp_server->efd, EPOLL_CTL_ADD, sock_new.socket, &ev) == -1) {
-                        kill_TCP_secure_connection(&tcp_server->incoming_connection_queue[index_new]);
-                        continue;
-                    }
-                }
+    if (tcp_server->threaded || shard->num_accepted_connections != 0 || shard->incoming_connection_queue_index != 0) {
+        return false;
+    }
 
-                break;
-            }
+    if (shard->uring == nullptr && !shard_start_uring(shard)) {
+        return false;
+    }
 
-            case TCP_SOCKET_INCOMING: {
-                const int index_new = do_incoming(tcp_server, index);
+    tcp_server->use_io_uring = true;
+    return true;
+#else
+    return false;
+#endif
+}
 
-                if (index_new != -1) {
-                    events[n].events = EPOLLIN | EPOLLET | EPOLLRDHUP;
-                    events[n].data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_UNCONFIRMED << 32) | ((uint64_t)index_new << 40);
+/* Pass the onion requests the worker threads received to the onion.
+ */
+static void handle_onion_requests(TCP_Server *tcp_server)
+{
+    bool stop;
+    const uint32_t size = shard_queue_take(&tcp_server->queue, &stop);
+    const uint8_t *const batch = tcp_server->queue.processing;
 
-                    if (epoll_ctl(tcp_server->efd, EPOLL_CTL_MOD, sock.socket, &events[n]) == -1) {
-                        kill_TCP_secure_connection(&tcp_server->unconfirmed_connection_queue[index_new]);
-                        break;
-                    }
-                }
+    for (uint32_t pos = 0; pos < size;) {
+        TCP_Shard_Message msg;
+        memcpy(&msg, batch + pos, sizeof(TCP_Shard_Message));
+        const uint8_t *const data = batch + pos + sizeof(TCP_Shard_Message);
+        pos += shard_message_size(msg.length);
 
-                break;
-            }
+        if (msg.type != TCP_SHARD_MESSAGE_ONION_REQUEST || tcp_server->onion == nullptr) {
+            continue;
+        }
 
-            case TCP_SOCKET_UNCONFIRMED: {
-                const int index_new = do_unconfirmed(tcp_server, mono_time, index);
+        IP_Port source;
+        source.port = 0;  // dummy initialise
+        source.ip.family = net_family_tcp_onion;
+        source.ip.ip.v6.uint32[0] = msg.source_index;
+        source.ip.ip.v6.uint32[1] = msg.source_shard;
+        source.ip.ip.v6.uint64[1] = msg.source_identifier;
+        onion_send_1(tcp_server->onion, data + CRYPTO_NONCE_SIZE, msg.length - CRYPTO_NONCE_SIZE, source, data);
+    }
+}
 
-                if (index_new != -1) {
-                    events[n].events = EPOLLIN | EPOLLET | EPOLLRDHUP;
-                    events[n].data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_CONFIRMED << 32) | ((uint64_t)index_new << 40);
+void do_TCP_server(TCP_Server *tcp_server, Mono_Time *mono_time)
+{
+    if (tcp_server->threaded) {
+        handle_onion_requests(tcp_server);
+        return;
+    }
 
-                    if (epoll_ctl(tcp_server->efd, EPOLL_CTL_MOD, sock.socket, &events[n]) == -1) {
-                        // remove from confirmed connections
-                        kill_accepted(tcp_server, index_new);
-                        break;
-                    }
-                }
+    TCP_Shard *const shard = &tcp_server->shards[0];
 
-                break;
-            }
+#ifdef TCP_SERVER_USE_IO_URING
 
-            case TCP_SOCKET_CONFIRMED: {
-                do_confirmed_recv(tcp_server, index);
-                break;
-            }
-        }
+    if (shard->uring != nullptr) {
+        do_TCP_uring(shard, mono_time);
+        do_TCP_confirmed(shard, mono_time);
+        /* Submit the sends do_TCP_confirmed queued. */
+        uring_submit(shard->uring, 0);
+        return;
     }
 
-    return nfds > 0;
-}
-
-static void do_TCP_epoll(TCP_Server *tcp_server, const Mono_Time *mono_time)
-{
-    while (tcp_epoll_process(tcp_server, mono_time)) {
-        // Keep processing packets until there are no more FDs ready for reading.
-        continue;
-    }
-}
 #endif
-
-void do_TCP_server(TCP_Server *tcp_server, Mono_Time *mono_time)
-{
 #ifdef TCP_SERVER_USE_EPOLL
-    do_TCP_epoll(tcp_server, mono_time);
+    do_TCP_epoll(shard, mono_time);
 
 #else
-    do_TCP_accept_new(tcp_server);
-    do_TCP_incoming(tcp_server);
-    do_TCP_unconfirmed(tcp_server, mono_time);
+    do_TCP_accept_new(shard);
+    do_TCP_incoming(shard);
+    do_TCP_unconfirmed(shard, mono_time);
 #endif
 
-    do_TCP_confirmed(tcp_server, mono_time);
+    do_TCP_confirmed(shard, mono_time);
 }
 
 void kill_TCP_server(TCP_Server *tcp_server)
 {
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_server->threaded) {
+        stop_shard_threads(tcp_server, tcp_server->num_shards);
+    }
+
+#endif
+
     for (uint32_t i = 0; i < tcp_server->num_listening_socks; ++i) {
         kill_sock(tcp_server->socks_listening[i]);
     }
@@ -1462,19 +3735,17 @@ void kill_TCP_server(TCP_Server *tcp_server)
         set_callback_handle_recv_1(tcp_server->onion, nullptr, nullptr);
     }
 
-    bs_list_free(&tcp_server->accepted_key_list);
-
-#ifdef TCP_SERVER_USE_EPOLL
-    close(tcp_server->efd);
-#endif
-
-    for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
-        wipe_secure_connection(&tcp_server->incoming_connection_queue[i]);
-        wipe_secure_connection(&tcp_server->unconfirmed_connection_queue[i]);
+    for (uint32_t i = 0; i < tcp_server->num_shards; ++i) {
+        shard_kill(&tcp_server->shards[i]);
     }
 
-    free_accepted_connection_array(tcp_server);
+    if (tcp_server->threaded) {
+        hash_list_free(&tcp_server->key_shards);
+        pthread_mutex_destroy(&tcp_server->directory_lock);
+        shard_queue_free(&tcp_server->queue);
+    }
 
+    free(tcp_server->shards);
     free(tcp_server->socks_listening);
     free(tcp_server);
 }
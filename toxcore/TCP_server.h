@@ -67,6 +67,83 @@ typedef struct TCP_Server TCP_Server;
 const uint8_t *tcp_server_public_key(const TCP_Server *tcp_server);
 size_t tcp_server_listen_count(const TCP_Server *tcp_server);
 
+/* Default and minimum number of bytes of encrypted packets that may be queued
+ * for sending on one connection. The minimum leaves room for two packets of
+ * the maximum size.
+ */
+#define TCP_SEND_QUEUE_DEFAULT_LIMIT (8 * (sizeof(uint16_t) + MAX_PACKET_SIZE))
+#define TCP_SEND_QUEUE_MIN_LIMIT (2 * (sizeof(uint16_t) + MAX_PACKET_SIZE))
+
+/* Set the maximum number of bytes queued for sending per connection. Only
+ * priority packets (pings, routing responses and connection notifications)
+ * may use the second half, relayed packets get dropped once the first half is
+ * full. Applies to connections accepted after this call.
+ */
+void tcp_server_set_send_queue_limit(TCP_Server *tcp_server, uint32_t limit);
+
+typedef struct TCP_Server_Stats {
+    uint32_t incoming; /* connections doing the handshake */
+    uint32_t unconfirmed; /* connections that did the handshake but sent no packet yet */
+    uint32_t confirmed;
+    /* Confirmed connections with data in their send queue, the total of that
+     * data and the most of it on one connection, in bytes. */
+    uint32_t queued;
+    uint64_t queued_bytes;
+    uint32_t max_queued_bytes;
+} TCP_Server_Stats;
+
+/* Count the connections of the server by state, and the data waiting in their
+ * send queues. With worker threads, the numbers of each thread are up to two
+ * seconds old.
+ */
+void tcp_server_get_stats(TCP_Server *tcp_server, TCP_Server_Stats *stats);
+
+/* Return a socket that becomes readable whenever do_TCP_server has I/O to
+ * handle (the epoll instance), or net_invalid_socket if the server isn't
+ * event driven on this platform and needs to be polled.
+ */
+Socket tcp_server_event_socket(const TCP_Server *tcp_server);
+
+/* Return the time in milliseconds, on the clock of current_time_monotonic, at
+ * which do_TCP_server has to run again if its event socket didn't become
+ * readable before then. It is earlier than the next second only while queued
+ * data waits for room in a socket, or if the server can't wait for events.
+ */
+uint64_t tcp_server_run_deadline(const TCP_Server *tcp_server, Mono_Time *mono_time);
+
+#define TCP_SERVER_MAX_THREADS 64
+
+/* Run the server on num_threads worker threads, each handling its own share of
+ * the connections with its own epoll instance. Packets between connections on
+ * different threads are passed through per-thread message queues.
+ *
+ * Afterwards do_TCP_server only hands onion requests to the onion (which isn't
+ * thread safe), and needs to be called as before. mono_time is read by the
+ * worker threads, so it must be kept updated and outlive the server.
+ *
+ * Must be called before the first call to do_TCP_server. Only available where
+ * the server uses epoll.
+ *
+ * return 0 on success.
+ * return -1 on failure, in which case the server keeps running on the thread
+ *   calling do_TCP_server.
+ */
+int tcp_server_start_threads(TCP_Server *tcp_server, const Mono_Time *mono_time, uint32_t num_threads);
+
+/* Run the server on io_uring instead of epoll: each listening socket accepts
+ * with a single multishot accept, connections receive into buffers provided
+ * to the kernel up front, and what the connections queued to send in a round
+ * is submitted with a single system call.
+ *
+ * Must be called before tcp_server_start_threads and the first call to
+ * do_TCP_server. Only available on Linux 6.0 and later, if built with
+ * TCP_SERVER_USE_IO_URING.
+ *
+ * return true on success.
+ * return false on failure, in which case the server keeps using epoll.
+ */
+bool tcp_server_use_io_uring(TCP_Server *tcp_server);
+
 /* Create new TCP server instance.
  */
 TCP_Server *new_TCP_server(const Logger *logger, uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports,
@@ -80,15 +157,6 @@ void do_TCP_server(TCP_Server *tcp_server, Mono_Time *mono_time);
  */
 void kill_TCP_server(TCP_Server *tcp_server);
 
-/* Read the next two bytes in TCP stream then convert them to
- * length (host byte order).
- *
- * return length on success
- * return 0 if nothing has been read from socket.
- * return -1 on failure.
- */
-uint16_t read_TCP_length(const Logger *logger, Socket sock);
-
 /* Read length bytes from socket.
  *
  * return length on success
@@ -96,11 +164,27 @@ uint16_t read_TCP_length(const Logger *logger, Socket sock);
  */
 int read_TCP_packet(const Logger *logger, Socket sock, uint8_t *data, uint16_t length);
 
-/* return length of received packet on success.
+/* Size of the buffer secure connections read the TCP stream into. It holds two
+ * packets of the maximum size, so there is always room for the rest of a
+ * partially received packet and one recv usually fetches several packets.
+ */
+#define TCP_RECV_BUFFER_SIZE (2 * (sizeof(uint16_t) + MAX_PACKET_SIZE))
+
+typedef struct TCP_Recv_Buffer {
+    uint8_t data[TCP_RECV_BUFFER_SIZE];
+    uint16_t start; /* Offset of the first byte not parsed yet. */
+    uint16_t end; /* Offset after the last byte received. */
+} TCP_Recv_Buffer;
+
+/* Parse the next packet out of recv_buffer and decrypt it into data. The
+ * socket is only read from, with a single recv for as much as fits, when the
+ * buffer doesn't hold a complete packet.
+ *
+ * return length of received packet on success.
  * return 0 if could not read any packet.
  * return -1 on failure (connection must be killed).
  */
-int read_packet_TCP_secure_connection(const Logger *logger, Socket sock, uint16_t *next_packet_length,
+int read_packet_TCP_secure_connection(const Logger *logger, Socket sock, TCP_Recv_Buffer *recv_buffer,
                                       const uint8_t *shared_key, uint8_t *recv_nonce, uint8_t *data, uint16_t max_len);
 
 
@@ -0,0 +1,310 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/*
+ * Congestion controllers for net_crypto connections.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "congestion_control.h"
+
+#include <string.h>
+
+#include "ccompat.h"
+
+struct Congestion_Control_Ops {
+    Congestion_Control_Type type;
+    void (*update)(Congestion_Controller *cc, const Congestion_Sample *sample, double *send_rate,
+                   double *send_rate_requested);
+};
+
+/** BEGIN: Send queue based controller */
+
+/* If the send queue is SEND_QUEUE_RATIO times larger than the
+ * calculated link speed the packet send speed will be reduced
+ * by a value depending on this number.
+ */
+#define SEND_QUEUE_RATIO 2.0
+
+static void queue_update(Congestion_Controller *cc, const Congestion_Sample *sample, double *send_rate,
+                         double *send_rate_requested)
+{
+    Queue_Congestion_State *q = &cc->state.queue;
+
+    unsigned int pos = q->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
+    q->last_sendqueue_size[pos] = sample->send_queue_size;
+
+    long signed int sum = 0;
+    sum = (long signed int)q->last_sendqueue_size[pos] -
+          (long signed int)q->last_sendqueue_size[(pos + 1) % CONGESTION_QUEUE_ARRAY_SIZE];
+
+    unsigned int n_p_pos = q->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
+    q->last_num_packets_sent[n_p_pos] = sample->packets_sent;
+    q->last_num_packets_resent[n_p_pos] = sample->packets_resent;
+
+    q->last_sendqueue_counter = (q->last_sendqueue_counter + 1) %
+                                (CONGESTION_QUEUE_ARRAY_SIZE * CONGESTION_LAST_SENT_ARRAY_SIZE);
+
+    if (sample->hold_rate) {
+        return;
+    }
+
+    long signed int total_sent = 0;
+    long signed int total_resent = 0;
+
+    // TODO(irungentoo): use real delay
+    unsigned int delay = (unsigned int)((sample->min_rtt / PACKET_COUNTER_AVERAGE_INTERVAL) + 0.5);
+    unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
+
+    if (delay > packets_set_rem_array) {
+        delay = packets_set_rem_array;
+    }
+
+    for (unsigned j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
+        unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
+        total_sent += q->last_num_packets_sent[ind];
+        total_resent += q->last_num_packets_resent[ind];
+    }
+
+    if (sum > 0) {
+        total_sent -= sum;
+    } else {
+        if (total_resent > -sum) {
+            total_resent = -sum;
+        }
+    }
+
+    /* if queue is too big only allow resending packets. */
+    uint32_t npackets = sample->send_queue_size;
+    double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
+                                 PACKET_COUNTER_AVERAGE_INTERVAL));
+
+    double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
+            CONGESTION_QUEUE_ARRAY_SIZE) * PACKET_COUNTER_AVERAGE_INTERVAL));
+
+    if (min_speed < CRYPTO_PACKET_MIN_RATE) {
+        min_speed = CRYPTO_PACKET_MIN_RATE;
+    }
+
+    double send_array_ratio = (((double)npackets) / min_speed);
+
+    // TODO(irungentoo): Improve formula?
+    if (send_array_ratio > SEND_QUEUE_RATIO && CRYPTO_MIN_QUEUE_LENGTH < npackets) {
+        *send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
+    } else if (sample->last_congestion_event + CONGESTION_EVENT_TIMEOUT < sample->time) {
+        *send_rate = min_speed * 1.2;
+    } else {
+        *send_rate = min_speed * 0.9;
+    }
+
+    *send_rate_requested = min_speed_request * 1.2;
+
+    if (*send_rate < CRYPTO_PACKET_MIN_RATE) {
+        *send_rate = CRYPTO_PACKET_MIN_RATE;
+    }
+
+    if (*send_rate_requested < *send_rate) {
+        *send_rate_requested = *send_rate;
+    }
+}
+
+/** END: Send queue based controller */
+
+/** BEGIN: Delay based controller */
+
+/* Queueing delay in ms the delay controller aims for. */
+#define DELAY_TARGET 25
+
+/* How strongly the rate reacts to the distance from DELAY_TARGET after slow
+ * start: per control loop round the rate grows by up to this fraction when
+ * there is no queueing delay, and shrinks by up to it when the delay is twice
+ * the target. During slow start the rate doubles every round. */
+#define DELAY_GAIN 0.25
+
+/* Factor the rate is multiplied with when packets get lost. Random loss on
+ * wireless links shouldn't collapse the rate, so this is much gentler than
+ * halving; on congested links the delay signal does the rest. */
+#define DELAY_LOSS_BACKOFF 0.85
+
+/* Slow start ends when more than one in this many packets sent is a resend. */
+#define DELAY_SLOW_START_LOSS 10
+
+/* The rate never drops below this many packets per round trip time, so lost
+ * packets keep getting resent at a useful pace. */
+#define DELAY_MIN_WINDOW 2
+
+/* Length in ms of each slot of the base round trip time history. */
+#define DELAY_BASE_INTERVAL 60000
+
+static uint64_t min_nonzero(const uint64_t *values, uint32_t length)
+{
+    uint64_t min = 0;
+
+    for (uint32_t i = 0; i < length; ++i) {
+        if (values[i] != 0 && (min == 0 || values[i] < min)) {
+            min = values[i];
+        }
+    }
+
+    return min;
+}
+
+static void delay_add_rtt(Delay_Congestion_State *d, uint64_t time, uint64_t rtt)
+{
+    if (d->base_rtt_time + DELAY_BASE_INTERVAL < time) {
+        d->base_rtt_pos = (d->base_rtt_pos + 1) % CONGESTION_DELAY_BASE_HISTORY;
+        d->base_rtt[d->base_rtt_pos] = 0;
+        d->base_rtt_time = time;
+    }
+
+    if (d->base_rtt[d->base_rtt_pos] == 0 || rtt < d->base_rtt[d->base_rtt_pos]) {
+        d->base_rtt[d->base_rtt_pos] = rtt;
+    }
+
+    d->current_rtt_pos = (d->current_rtt_pos + 1) % CONGESTION_DELAY_CURRENT_FILTER;
+    d->current_rtt[d->current_rtt_pos] = rtt;
+}
+
+static void delay_update(Congestion_Controller *cc, const Congestion_Sample *sample, double *send_rate,
+                         double *send_rate_requested)
+{
+    Delay_Congestion_State *d = &cc->state.delay;
+
+    if (sample->rtt != 0) {
+        delay_add_rtt(d, sample->time, sample->rtt);
+    }
+
+    if (sample->hold_rate) {
+        return;
+    }
+
+    const uint64_t base_rtt = min_nonzero(d->base_rtt, CONGESTION_DELAY_BASE_HISTORY);
+    uint64_t current_rtt = min_nonzero(d->current_rtt, CONGESTION_DELAY_CURRENT_FILTER);
+
+    d->queue_delay = current_rtt > base_rtt ? current_rtt - base_rtt : 0;
+
+    if (current_rtt == 0) {
+        current_rtt = sample->min_rtt;
+    }
+
+    double rate = *send_rate;
+    const uint32_t used = sample->packets_sent + sample->packets_resent;
+
+    /* The peer acknowledges the newest packet it got, which at low rates can
+     * be up to one packet interval old, so delays below that are noise rather
+     * than queueing. */
+    const double target = DELAY_TARGET + 1000.0 / rate;
+
+    /* Leave slow start once the queue starts building or packets are lost
+     * in numbers that random loss doesn't explain. The rate at that point
+     * overshot by up to the growth of one round, so give that back. */
+    if (!d->slow_start_done
+            && (d->queue_delay > target / 2
+                || (sample->packets_resent > 1 && sample->packets_resent * DELAY_SLOW_START_LOSS > used))) {
+        d->slow_start_done = true;
+        rate /= 2;
+    }
+
+    /* Only react to the delay when the peer acknowledged something since the
+     * last update; without fresh samples the estimate is stale. */
+    if (sample->rtt != 0) {
+        /* A change of rate shows up in the samples one round trip time, plus
+         * the time the peer waits before acknowledging, plus one update
+         * interval later. Scale the per-round change down to the time since
+         * the last sample. */
+        const uint64_t elapsed = sample->time - d->last_sample_time;
+        double rtt_fraction = (double)elapsed / (double)(current_rtt + elapsed + PACKET_COUNTER_AVERAGE_INTERVAL);
+
+        if (rtt_fraction > 1.0) {
+            rtt_fraction = 1.0;
+        }
+
+        d->last_sample_time = sample->time;
+
+        double off_target = (target - (double)d->queue_delay) / target;
+
+        if (off_target < -1.0) {
+            off_target = -1.0;
+        }
+
+        if (off_target > 1.0) {
+            off_target = 1.0;
+        }
+
+        /* Only grow when the rate is what limits the sender, otherwise an
+         * idle connection would build up a rate it never tested. */
+        const double allowed = rate * PACKET_COUNTER_AVERAGE_INTERVAL / 1000.0;
+
+        if (!d->slow_start_done) {
+            if (used >= allowed / 2) {
+                rate *= 1.0 + rtt_fraction;
+            }
+        } else if (off_target < 0.0 || used >= allowed / 2) {
+            rate *= 1.0 + DELAY_GAIN * off_target * rtt_fraction;
+        }
+    }
+
+    /* Resending the packets lost in one burst takes several intervals, so
+     * only back off once per CONGESTION_EVENT_TIMEOUT. */
+    if (d->slow_start_done && sample->packets_resent != 0
+            && d->last_decrease + CONGESTION_EVENT_TIMEOUT < sample->time) {
+        rate *= DELAY_LOSS_BACKOFF;
+        d->last_decrease = sample->time;
+    }
+
+    double min_rate = DELAY_MIN_WINDOW * 1000.0 / (double)(current_rtt != 0 ? current_rtt : 1);
+
+    if (min_rate < CRYPTO_PACKET_MIN_RATE) {
+        min_rate = CRYPTO_PACKET_MIN_RATE;
+    }
+
+    if (rate < min_rate) {
+        rate = min_rate;
+    }
+
+    *send_rate = rate;
+    *send_rate_requested = rate;
+}
+
+/** END: Delay based controller */
+
+static const Congestion_Control_Ops congestion_control_ops[] = {
+    {CONGESTION_CONTROL_QUEUE, &queue_update},
+    {CONGESTION_CONTROL_DELAY, &delay_update},
+};
+
+int congestion_control_init(Congestion_Controller *cc, Congestion_Control_Type type)
+{
+    for (size_t i = 0; i < sizeof(congestion_control_ops) / sizeof(congestion_control_ops[0]); ++i) {
+        if (congestion_control_ops[i].type == type) {
+            memset(&cc->state, 0, sizeof(cc->state));
+            cc->ops = &congestion_control_ops[i];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+Congestion_Control_Type congestion_control_type(const Congestion_Controller *cc)
+{
+    return cc->ops->type;
+}
+
+void congestion_control_update(Congestion_Controller *cc, const Congestion_Sample *sample, double *send_rate,
+                               double *send_rate_requested)
+{
+    cc->ops->update(cc, sample, send_rate, send_rate_requested);
+}
+
+uint64_t congestion_control_queue_delay(const Congestion_Controller *cc)
+{
+    if (cc->ops->type == CONGESTION_CONTROL_DELAY) {
+        return cc->state.delay.queue_delay;
+    }
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/*
+ * Congestion controllers for net_crypto connections.
+ *
+ * A controller is fed one Congestion_Sample per PACKET_COUNTER_AVERAGE_INTERVAL
+ * and decides how many lossless packets per second the connection may send.
+ */
+#ifndef C_TOXCORE_TOXCORE_CONGESTION_CONTROL_H
+#define C_TOXCORE_TOXCORE_CONGESTION_CONTROL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Minimum packet rate per second. */
+#define CRYPTO_PACKET_MIN_RATE 4.0
+
+/* Minimum packet queue max length. */
+#define CRYPTO_MIN_QUEUE_LENGTH 64
+
+/* Interval in ms at which controllers are updated. */
+#define PACKET_COUNTER_AVERAGE_INTERVAL 50
+
+/* Base current transfer speed on last CONGESTION_QUEUE_ARRAY_SIZE number of points taken
+ * at the dT defined above */
+#define CONGESTION_QUEUE_ARRAY_SIZE 12
+#define CONGESTION_LAST_SENT_ARRAY_SIZE (CONGESTION_QUEUE_ARRAY_SIZE * 2)
+
+/* Don't increase the send rate for this long in ms after the send queue was
+ * found full, or after switching from TCP to UDP. */
+#define CONGESTION_EVENT_TIMEOUT 1000
+
+/* Number of per-minute minimum round trip times the delay controller keeps to
+ * find the base (queue free) round trip time. */
+#define CONGESTION_DELAY_BASE_HISTORY 10
+
+/* Number of per-interval round trip times the delay controller takes the
+ * minimum of to filter out noise from delayed acknowledgements. */
+#define CONGESTION_DELAY_CURRENT_FILTER 2
+
+typedef enum Congestion_Control_Type {
+    /* Adjust the rate by how fast the send queue grows (the original net_crypto
+     * algorithm). */
+    CONGESTION_CONTROL_QUEUE,
+    /* LEDBAT-style: keep the queueing delay measured through round trip times
+     * close to a fixed target, backing off on sustained loss. */
+    CONGESTION_CONTROL_DELAY,
+} Congestion_Control_Type;
+
+/* What a connection observed during the last update interval. */
+typedef struct Congestion_Sample {
+    uint64_t time; /* current time in ms */
+    uint32_t packets_sent; /* new lossless packets sent */
+    uint32_t packets_resent; /* lossless packets resent because the peer requested them */
+    uint32_t send_queue_size; /* packets sent but not yet acknowledged */
+    uint64_t min_rtt; /* lowest round trip time seen on the connection, in ms */
+    uint64_t rtt; /* lowest round trip time measured in this interval, 0 if none */
+    uint64_t last_congestion_event; /* last time the send queue was found full */
+    bool hold_rate; /* record the sample but don't change the rate */
+} Congestion_Sample;
+
+typedef struct Queue_Congestion_State {
+    uint32_t last_sendqueue_size[CONGESTION_QUEUE_ARRAY_SIZE];
+    uint32_t last_sendqueue_counter;
+    long signed int last_num_packets_sent[CONGESTION_LAST_SENT_ARRAY_SIZE];
+    long signed int last_num_packets_resent[CONGESTION_LAST_SENT_ARRAY_SIZE];
+} Queue_Congestion_State;
+
+typedef struct Delay_Congestion_State {
+    uint64_t base_rtt[CONGESTION_DELAY_BASE_HISTORY]; /* 0 for empty slots */
+    uint64_t base_rtt_time; /* when the current base_rtt slot was started */
+    uint32_t base_rtt_pos;
+    uint64_t current_rtt[CONGESTION_DELAY_CURRENT_FILTER]; /* 0 for empty slots */
+    uint32_t current_rtt_pos;
+    uint64_t last_sample_time; /* time of the last update with a round trip time sample */
+    uint64_t last_decrease; /* time of the last loss triggered decrease */
+    uint64_t queue_delay; /* last queueing delay estimate in ms */
+    bool slow_start_done;
+} Delay_Congestion_State;
+
+typedef struct Congestion_Control_Ops Congestion_Control_Ops;
+
+typedef struct Congestion_Controller {
+    const Congestion_Control_Ops *ops;
+
+    union {
+        Queue_Congestion_State queue;
+        Delay_Congestion_State delay;
+    } state;
+} Congestion_Controller;
+
+/* Initialise a controller of the given type.
+ *
+ * return 0 on success.
+ * return -1 if the type is unknown.
+ */
+int congestion_control_init(Congestion_Controller *cc, Congestion_Control_Type type);
+
+Congestion_Control_Type congestion_control_type(const Congestion_Controller *cc);
+
+/* Feed a sample to the controller.
+ *
+ * send_rate is the rate in packets per second at which new packets may be
+ * sent and send_rate_requested the rate at which packets the peer requested
+ * may be resent. Both hold the current values on entry and are updated unless
+ * sample->hold_rate is set.
+ */
+void congestion_control_update(Congestion_Controller *cc, const Congestion_Sample *sample, double *send_rate,
+                               double *send_rate_requested);
+
+/* return the last estimate of the queueing delay on the path in ms, or 0 if
+ * the controller doesn't estimate it.
+ */
+uint64_t congestion_control_queue_delay(const Congestion_Controller *cc);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
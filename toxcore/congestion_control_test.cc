@@ -0,0 +1,111 @@
+#include "congestion_control.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+
+Congestion_Sample make_sample(uint64_t time, double rate, uint64_t rtt) {
+  Congestion_Sample sample{};
+  sample.time = time;
+  // Send everything the rate allows, so the controller is rate limited.
+  sample.packets_sent = static_cast<uint32_t>(rate * PACKET_COUNTER_AVERAGE_INTERVAL / 1000.0);
+  sample.min_rtt = rtt;
+  sample.rtt = rtt;
+  return sample;
+}
+
+TEST(CongestionControl, UnknownTypeIsRejected) {
+  Congestion_Controller cc;
+  EXPECT_EQ(congestion_control_init(&cc, static_cast<Congestion_Control_Type>(1234)), -1);
+  EXPECT_EQ(congestion_control_init(&cc, CONGESTION_CONTROL_DELAY), 0);
+  EXPECT_EQ(congestion_control_type(&cc), CONGESTION_CONTROL_DELAY);
+}
+
+TEST(CongestionControl, HoldKeepsRates) {
+  for (Congestion_Control_Type type : {CONGESTION_CONTROL_QUEUE, CONGESTION_CONTROL_DELAY}) {
+    Congestion_Controller cc;
+    ASSERT_EQ(congestion_control_init(&cc, type), 0);
+
+    double rate = 100.0;
+    double requested = 150.0;
+    Congestion_Sample sample = make_sample(1000, rate, 20);
+    sample.hold_rate = true;
+    congestion_control_update(&cc, &sample, &rate, &requested);
+
+    EXPECT_EQ(rate, 100.0);
+    EXPECT_EQ(requested, 150.0);
+  }
+}
+
+TEST(CongestionControl, DelayGrowsWithoutQueueing) {
+  Congestion_Controller cc;
+  ASSERT_EQ(congestion_control_init(&cc, CONGESTION_CONTROL_DELAY), 0);
+
+  double rate = 100.0;
+  double requested = rate;
+
+  for (uint64_t t = 1000; t < 2000; t += PACKET_COUNTER_AVERAGE_INTERVAL) {
+    Congestion_Sample sample = make_sample(t, rate, 20);
+    congestion_control_update(&cc, &sample, &rate, &requested);
+  }
+
+  EXPECT_GT(rate, 1000.0);
+  EXPECT_EQ(congestion_control_queue_delay(&cc), 0u);
+}
+
+TEST(CongestionControl, DelayDoesNotGrowWhenIdle) {
+  Congestion_Controller cc;
+  ASSERT_EQ(congestion_control_init(&cc, CONGESTION_CONTROL_DELAY), 0);
+
+  double rate = 100.0;
+  double requested = rate;
+
+  for (uint64_t t = 1000; t < 2000; t += PACKET_COUNTER_AVERAGE_INTERVAL) {
+    Congestion_Sample sample = make_sample(t, rate, 20);
+    sample.packets_sent = 0;
+    congestion_control_update(&cc, &sample, &rate, &requested);
+  }
+
+  EXPECT_EQ(rate, 100.0);
+}
+
+TEST(CongestionControl, DelayBacksOffWhenQueueing) {
+  Congestion_Controller cc;
+  ASSERT_EQ(congestion_control_init(&cc, CONGESTION_CONTROL_DELAY), 0);
+
+  double rate = 1000.0;
+  double requested = rate;
+
+  // Establish the base round trip time.
+  Congestion_Sample sample = make_sample(1000, rate, 20);
+  congestion_control_update(&cc, &sample, &rate, &requested);
+  const double start_rate = rate;
+
+  for (uint64_t t = 1050; t < 2000; t += PACKET_COUNTER_AVERAGE_INTERVAL) {
+    sample = make_sample(t, rate, 220);
+    congestion_control_update(&cc, &sample, &rate, &requested);
+  }
+
+  EXPECT_LT(rate, start_rate / 2);
+  EXPECT_GE(rate, CRYPTO_PACKET_MIN_RATE);
+  EXPECT_EQ(congestion_control_queue_delay(&cc), 200u);
+}
+
+TEST(CongestionControl, DelayToleratesLightLoss) {
+  Congestion_Controller cc;
+  ASSERT_EQ(congestion_control_init(&cc, CONGESTION_CONTROL_DELAY), 0);
+
+  double rate = 1000.0;
+  double requested = rate;
+
+  for (uint64_t t = 1000; t < 2000; t += PACKET_COUNTER_AVERAGE_INTERVAL) {
+    Congestion_Sample sample = make_sample(t, rate, 20);
+    // 2% of the packets get lost and resent.
+    sample.packets_resent = sample.packets_sent / 50;
+    congestion_control_update(&cc, &sample, &rate, &requested);
+  }
+
+  EXPECT_GT(rate, 1000.0);
+}
+
+}  // namespace
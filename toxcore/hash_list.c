@@ -0,0 +1,220 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/*
+ * Hash table which associates ids with fixed size keys.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "hash_list.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ccompat.h"
+#include "crypto_core.h"
+#include "util.h"
+
+/* Markers stored in the ids array for slots that don't hold an element. */
+#define HASH_LIST_EMPTY (-1)
+#define HASH_LIST_DELETED (-2)
+
+#define HASH_LIST_MIN_CAPACITY 8
+
+static uint32_t hash_data(const Hash_List *list, const uint8_t *data)
+{
+    return (uint32_t)(hash_bytes(list->hash_key, data, list->element_size) >> 32);
+}
+
+/* Find data in list
+ *
+ * return value:
+ *  >= 0 : index of data in array
+ *  -1   : no match
+ */
+static int64_t find(const Hash_List *list, const uint8_t *data)
+{
+    if (list->capacity == 0) {
+        return -1;
+    }
+
+    const uint32_t mask = list->capacity - 1;
+
+    for (uint32_t i = hash_data(list, data) & mask;; i = (i + 1) & mask) {
+        if (list->ids[i] == HASH_LIST_EMPTY) {
+            return -1;
+        }
+
+        if (list->ids[i] != HASH_LIST_DELETED
+                && memcmp(data, list->data + (size_t)list->element_size * i, list->element_size) == 0) {
+            return i;
+        }
+    }
+}
+
+/* Put data into the first free slot of its probe sequence. The list must have
+ * a free slot and must not contain data yet.
+ */
+static void insert(Hash_List *list, const uint8_t *data, int id)
+{
+    const uint32_t mask = list->capacity - 1;
+    uint32_t i = hash_data(list, data) & mask;
+
+    while (list->ids[i] >= 0) {
+        i = (i + 1) & mask;
+    }
+
+    if (list->ids[i] == HASH_LIST_DELETED) {
+        --list->deleted;
+    }
+
+    memcpy(list->data + (size_t)list->element_size * i, data, list->element_size);
+    list->ids[i] = id;
+    ++list->n;
+}
+
+/**
+ * Rebuilds the table with new_capacity slots, dropping deleted markers.
+ *
+ * @return true on success.
+ */
+static bool rehash(Hash_List *list, uint32_t new_capacity)
+{
+    uint8_t *data = (uint8_t *)malloc((size_t)list->element_size * new_capacity);
+    int *ids = (int *)malloc(sizeof(int) * new_capacity);
+
+    if (data == nullptr || ids == nullptr) {
+        free(data);
+        free(ids);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < new_capacity; ++i) {
+        ids[i] = HASH_LIST_EMPTY;
+    }
+
+    uint8_t *const old_data = list->data;
+    int *const old_ids = list->ids;
+    const uint32_t old_capacity = list->capacity;
+
+    list->data = data;
+    list->ids = ids;
+    list->capacity = new_capacity;
+    list->n = 0;
+    list->deleted = 0;
+
+    for (uint32_t i = 0; i < old_capacity; ++i) {
+        if (old_ids[i] >= 0) {
+            insert(list, old_data + (size_t)list->element_size * i, old_ids[i]);
+        }
+    }
+
+    free(old_data);
+    free(old_ids);
+    return true;
+}
+
+int hash_list_init(Hash_List *list, uint32_t element_size, uint32_t initial_capacity)
+{
+    // set initial values
+    list->n = 0;
+    list->deleted = 0;
+    list->capacity = 0;
+    list->element_size = element_size;
+    list->hash_key = random_u64();
+    list->data = nullptr;
+    list->ids = nullptr;
+
+    if (initial_capacity != 0) {
+        uint32_t capacity = HASH_LIST_MIN_CAPACITY;
+
+        // keep the load factor at or below 1/2
+        while (capacity < initial_capacity * 2) {
+            capacity *= 2;
+        }
+
+        if (!rehash(list, capacity)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void hash_list_free(Hash_List *list)
+{
+    // free both arrays
+    free(list->data);
+    list->data = nullptr;
+
+    free(list->ids);
+    list->ids = nullptr;
+
+    list->n = 0;
+    list->deleted = 0;
+    list->capacity = 0;
+}
+
+int hash_list_find(const Hash_List *list, const uint8_t *data)
+{
+    const int64_t i = find(list, data);
+
+    if (i < 0) {
+        return -1;
+    }
+
+    return list->ids[i];
+}
+
+int hash_list_add(Hash_List *list, const uint8_t *data, int id)
+{
+    if (id < 0 || find(list, data) >= 0) {
+        return 0;
+    }
+
+    // keep at least half of the slots empty so probe sequences stay short
+    if ((list->n + list->deleted + 1) * 2 > list->capacity) {
+        uint32_t new_capacity = list->capacity == 0 ? HASH_LIST_MIN_CAPACITY : list->capacity;
+
+        while ((list->n + 1) * 2 > new_capacity) {
+            new_capacity *= 2;
+        }
+
+        if (!rehash(list, new_capacity)) {
+            return 0;
+        }
+    }
+
+    insert(list, data, id);
+    return 1;
+}
+
+int hash_list_remove(Hash_List *list, const uint8_t *data, int id)
+{
+    const int64_t i = find(list, data);
+
+    if (i < 0 || list->ids[i] != id) {
+        return 0;
+    }
+
+    list->ids[i] = HASH_LIST_DELETED;
+    --list->n;
+    ++list->deleted;
+    return 1;
+}
+
+int hash_list_update(Hash_List *list, const uint8_t *data, int old_id, int new_id)
+{
+    const int64_t i = find(list, data);
+
+    if (new_id < 0 || i < 0 || list->ids[i] != old_id) {
+        return 0;
+    }
+
+    list->ids[i] = new_id;
+    return 1;
+}
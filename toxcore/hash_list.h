@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/*
+ * Hash table which associates ids with fixed size keys.
+ * -Same interface as BS_List, but lookups, adds and removes take constant time
+ * -Uses open addressing with linear probing, keyed with a random per-table
+ *  hash key so remote peers can't craft colliding keys
+ */
+#ifndef C_TOXCORE_TOXCORE_HASH_LIST_H
+#define C_TOXCORE_TOXCORE_HASH_LIST_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Hash_List {
+    uint32_t n; // number of elements
+    uint32_t deleted; // number of slots marked as deleted
+    uint32_t capacity; // number of slots, 0 or a power of 2
+    uint32_t element_size; // size of the keys
+    uint64_t hash_key; // random hash key
+    uint8_t *data; // array of keys
+    int *ids; // array of element ids, or one of the HASH_LIST_* slot markers
+} Hash_List;
+
+/* Initialize a hash list, element_size is the size of the keys in the list and
+ * initial_capacity is the number of elements the memory will be initially allocated for
+ *
+ * return value:
+ *  1 : success
+ *  0 : failure
+ */
+int hash_list_init(Hash_List *list, uint32_t element_size, uint32_t initial_capacity);
+
+/* Free a list initiated with hash_list_init */
+void hash_list_free(Hash_List *list);
+
+/* Retrieve the id of an element in the list
+ *
+ * return value:
+ *  >= 0 : id associated with data
+ *  -1   : failure
+ */
+int hash_list_find(const Hash_List *list, const uint8_t *data);
+
+/* Add an element with associated id to the list, id must be >= 0
+ *
+ * return value:
+ *  1 : success
+ *  0 : failure (data already in list or memory allocation failed)
+ */
+int hash_list_add(Hash_List *list, const uint8_t *data, int id);
+
+/* Remove element from the list
+ *
+ * return value:
+ *  1 : success
+ *  0 : failure (element not found or id does not match)
+ */
+int hash_list_remove(Hash_List *list, const uint8_t *data, int id);
+
+/* Change the id of an element in the list from old_id to new_id, new_id must be >= 0
+ * Never allocates, so it can't fail for an element that is in the list
+ *
+ * return value:
+ *  1 : success
+ *  0 : failure (element not found or old_id does not match)
+ */
+int hash_list_update(Hash_List *list, const uint8_t *data, int old_id, int new_id);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,105 @@
+#include "hash_list.h"
+
+#include <gtest/gtest.h>
+
+#include <array>
+#include <cstring>
+
+namespace {
+
+using Key = std::array<uint8_t, 19>;
+
+Key make_key(uint32_t n) {
+  Key key{};
+  std::memcpy(key.data() + 3, &n, sizeof(n));
+  return key;
+}
+
+class HashList : public ::testing::Test {
+ protected:
+  void SetUp() override { ASSERT_EQ(hash_list_init(&list_, sizeof(Key), 0), 1); }
+  void TearDown() override { hash_list_free(&list_); }
+
+  Hash_List list_;
+};
+
+TEST_F(HashList, EmptyListFindsNothing) {
+  Key key = make_key(1);
+  EXPECT_EQ(hash_list_find(&list_, key.data()), -1);
+  EXPECT_EQ(hash_list_remove(&list_, key.data(), 0), 0);
+}
+
+TEST_F(HashList, AddedKeysCanBeFound) {
+  for (uint32_t i = 0; i < 1000; ++i) {
+    Key key = make_key(i);
+    ASSERT_EQ(hash_list_add(&list_, key.data(), i), 1);
+  }
+
+  EXPECT_EQ(list_.n, 1000u);
+
+  for (uint32_t i = 0; i < 1000; ++i) {
+    Key key = make_key(i);
+    EXPECT_EQ(hash_list_find(&list_, key.data()), static_cast<int>(i));
+  }
+
+  Key missing = make_key(1000);
+  EXPECT_EQ(hash_list_find(&list_, missing.data()), -1);
+}
+
+TEST_F(HashList, DuplicateKeysAreRejected) {
+  Key key = make_key(7);
+  EXPECT_EQ(hash_list_add(&list_, key.data(), 1), 1);
+  EXPECT_EQ(hash_list_add(&list_, key.data(), 2), 0);
+  EXPECT_EQ(hash_list_find(&list_, key.data()), 1);
+}
+
+TEST_F(HashList, NegativeIdsAreRejected) {
+  Key key = make_key(7);
+  EXPECT_EQ(hash_list_add(&list_, key.data(), -1), 0);
+  EXPECT_EQ(hash_list_find(&list_, key.data()), -1);
+}
+
+TEST_F(HashList, RemoveRequiresMatchingId) {
+  Key key = make_key(7);
+  ASSERT_EQ(hash_list_add(&list_, key.data(), 3), 1);
+  EXPECT_EQ(hash_list_remove(&list_, key.data(), 4), 0);
+  EXPECT_EQ(hash_list_find(&list_, key.data()), 3);
+  EXPECT_EQ(hash_list_remove(&list_, key.data(), 3), 1);
+  EXPECT_EQ(hash_list_find(&list_, key.data()), -1);
+}
+
+TEST_F(HashList, UpdateRequiresMatchingId) {
+  Key key = make_key(7);
+  Key missing = make_key(8);
+  ASSERT_EQ(hash_list_add(&list_, key.data(), 3), 1);
+  EXPECT_EQ(hash_list_update(&list_, key.data(), 4, 5), 0);
+  EXPECT_EQ(hash_list_update(&list_, key.data(), 3, -1), 0);
+  EXPECT_EQ(hash_list_update(&list_, missing.data(), 3, 5), 0);
+  EXPECT_EQ(hash_list_find(&list_, key.data()), 3);
+  EXPECT_EQ(hash_list_update(&list_, key.data(), 3, 5), 1);
+  EXPECT_EQ(hash_list_find(&list_, key.data()), 5);
+  EXPECT_EQ(list_.n, 1u);
+}
+
+TEST_F(HashList, ChurnKeepsTableSmall) {
+  // Repeatedly adding and removing must reuse deleted slots instead of growing.
+  for (uint32_t i = 0; i < 10000; ++i) {
+    Key key = make_key(i);
+    ASSERT_EQ(hash_list_add(&list_, key.data(), i), 1);
+
+    if (i >= 4) {
+      Key old = make_key(i - 4);
+      ASSERT_EQ(hash_list_remove(&list_, old.data(), i - 4), 1);
+    }
+  }
+
+  EXPECT_EQ(list_.n, 4u);
+  EXPECT_LE(list_.capacity, 16u);
+
+  for (uint32_t i = 9996; i < 10000; ++i) {
+    Key key = make_key(i);
+    EXPECT_EQ(hash_list_find(&list_, key.data()), static_cast<int>(i));
+  }
+}
+
+}  // namespace
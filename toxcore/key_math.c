@@ -0,0 +1,160 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/*
+ * XOR distance arithmetic on public keys, as used to sort and bucket DHT nodes.
+ */
+#include "key_math.h"
+
+#include <string.h>
+
+#include "ccompat.h"
+
+#if CRYPTO_PUBLIC_KEY_SIZE != 32
+#error "key_math assumes 32 byte public keys"
+#endif
+
+#if defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#define KEY_MATH_AVX2
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define KEY_MATH_SSE2
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON) && \
+      defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define KEY_MATH_NEON
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+      (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ || __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define KEY_MATH_WORD
+#endif
+
+/* Return the index of the first byte in which pk1 and pk2 differ, or
+ * CRYPTO_PUBLIC_KEY_SIZE if they are equal.
+ *
+ * Every implementation builds a mask of the unequal bytes, in which the lowest
+ * set bit belongs to the first unequal byte.
+ */
+static unsigned int first_unequal_byte(const uint8_t *pk1, const uint8_t *pk2)
+{
+#if defined(KEY_MATH_AVX2)
+    const __m256i a = _mm256_loadu_si256((const __m256i *)(const void *)pk1);
+    const __m256i b = _mm256_loadu_si256((const __m256i *)(const void *)pk2);
+    const uint32_t unequal = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+    return unequal == 0 ? CRYPTO_PUBLIC_KEY_SIZE : (unsigned int)__builtin_ctz(unequal);
+#elif defined(KEY_MATH_SSE2)
+    const __m128i a0 = _mm_loadu_si128((const __m128i *)(const void *)pk1);
+    const __m128i b0 = _mm_loadu_si128((const __m128i *)(const void *)pk2);
+    const __m128i a1 = _mm_loadu_si128((const __m128i *)(const void *)(pk1 + 16));
+    const __m128i b1 = _mm_loadu_si128((const __m128i *)(const void *)(pk2 + 16));
+    const uint32_t equal = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a0, b0))
+                           | ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a1, b1)) << 16);
+    const uint32_t unequal = ~equal;
+
+    return unequal == 0 ? CRYPTO_PUBLIC_KEY_SIZE : (unsigned int)__builtin_ctz(unequal);
+#elif defined(KEY_MATH_NEON)
+
+    // NEON has no movemask, narrowing the byte compare results leaves 4 bits
+    // per byte in a 64-bit lane instead.
+    for (unsigned int i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; i += 16) {
+        const uint8x16_t equal = vceqq_u8(vld1q_u8(pk1 + i), vld1q_u8(pk2 + i));
+        const uint64_t unequal = ~vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(equal), 4)), 0);
+
+        if (unequal != 0) {
+            return i + (unsigned int)__builtin_ctzll(unequal) / 4;
+        }
+    }
+
+    return CRYPTO_PUBLIC_KEY_SIZE;
+#elif defined(KEY_MATH_WORD)
+
+    for (unsigned int i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; i += sizeof(uint64_t)) {
+        uint64_t a;
+        uint64_t b;
+        memcpy(&a, pk1 + i, sizeof(a));
+        memcpy(&b, pk2 + i, sizeof(b));
+        const uint64_t unequal = a ^ b;
+
+        if (unequal != 0) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return i + (unsigned int)__builtin_ctzll(unequal) / 8;
+#else
+            return i + (unsigned int)__builtin_clzll(unequal) / 8;
+#endif
+        }
+    }
+
+    return CRYPTO_PUBLIC_KEY_SIZE;
+#else
+
+    for (unsigned int i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
+        if (pk1[i] != pk2[i]) {
+            return i;
+        }
+    }
+
+    return CRYPTO_PUBLIC_KEY_SIZE;
+#endif
+}
+
+/* Return the number of leading zero bits in a non-zero byte. */
+static unsigned int byte_leading_zeros(uint8_t byte)
+{
+    unsigned int zeros = 0;
+
+    while ((byte & 0x80) == 0) {
+        byte <<= 1;
+        ++zeros;
+    }
+
+    return zeros;
+}
+
+int key_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
+{
+    // Both distances are equal up to the first byte in which pk1 and pk2
+    // differ, and that byte decides which of them is smaller.
+    const unsigned int i = first_unequal_byte(pk1, pk2);
+
+    if (i == CRYPTO_PUBLIC_KEY_SIZE) {
+        return 0;
+    }
+
+    const uint8_t distance1 = pk[i] ^ pk1[i];
+    const uint8_t distance2 = pk[i] ^ pk2[i];
+
+    return distance1 < distance2 ? 1 : 2;
+}
+
+unsigned int key_common_prefix(const uint8_t *pk1, const uint8_t *pk2)
+{
+    const unsigned int i = first_unequal_byte(pk1, pk2);
+
+    if (i == CRYPTO_PUBLIC_KEY_SIZE) {
+        return KEY_MATH_BITS;
+    }
+
+    return i * 8 + byte_leading_zeros(pk1[i] ^ pk2[i]);
+}
+
+bool key_equal(const uint8_t *pk1, const uint8_t *pk2)
+{
+    return first_unequal_byte(pk1, pk2) == CRYPTO_PUBLIC_KEY_SIZE;
+}
+
+const char *key_math_implementation(void)
+{
+#if defined(KEY_MATH_AVX2)
+    return "avx2";
+#elif defined(KEY_MATH_SSE2)
+    return "sse2";
+#elif defined(KEY_MATH_NEON)
+    return "neon";
+#elif defined(KEY_MATH_WORD)
+    return "word";
+#else
+    return "byte";
+#endif
+}
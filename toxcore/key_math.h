@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/*
+ * XOR distance arithmetic on public keys, as used to sort and bucket DHT nodes.
+ * -Compares whole 64-bit words, or 16/32 bytes at once with SSE2, AVX2 or NEON
+ *  when the compiler targets them, instead of one byte at a time
+ * -None of these run in constant time, so they must only be used on public keys
+ */
+#ifndef C_TOXCORE_TOXCORE_KEY_MATH_H
+#define C_TOXCORE_TOXCORE_KEY_MATH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "crypto_core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Number of bits in a public key, returned by key_common_prefix for equal keys. */
+#define KEY_MATH_BITS (CRYPTO_PUBLIC_KEY_SIZE * 8)
+
+/* Compares the XOR distance of pk1 and pk2 to pk.
+ *
+ *  return 0 if both are same distance.
+ *  return 1 if pk1 is closer.
+ *  return 2 if pk2 is closer.
+ */
+int key_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2);
+
+/* Return the number of leading bits pk1 and pk2 have in common, which is the
+ * index of the first unequal bit, or KEY_MATH_BITS if the keys are equal.
+ */
+unsigned int key_common_prefix(const uint8_t *pk1, const uint8_t *pk2);
+
+/* Return true if pk1 and pk2 are equal.
+ */
+bool key_equal(const uint8_t *pk1, const uint8_t *pk2);
+
+/* Return the name of the implementation selected at compile time: "avx2",
+ * "sse2", "neon", "word" (64-bit words) or "byte".
+ */
+const char *key_math_implementation(void);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_KEY_MATH_H
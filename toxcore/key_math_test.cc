@@ -0,0 +1,124 @@
+#include "key_math.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <array>
+#include <random>
+
+namespace {
+
+using PublicKey = std::array<uint8_t, CRYPTO_PUBLIC_KEY_SIZE>;
+
+// Byte by byte versions of the functions, as DHT.c had them.
+int reference_closest(const PublicKey &pk, const PublicKey &pk1, const PublicKey &pk2) {
+  for (size_t i = 0; i < pk.size(); ++i) {
+    const uint8_t distance1 = pk[i] ^ pk1[i];
+    const uint8_t distance2 = pk[i] ^ pk2[i];
+
+    if (distance1 < distance2) {
+      return 1;
+    }
+
+    if (distance1 > distance2) {
+      return 2;
+    }
+  }
+
+  return 0;
+}
+
+unsigned int reference_common_prefix(const PublicKey &pk1, const PublicKey &pk2) {
+  for (unsigned int bit = 0; bit < KEY_MATH_BITS; ++bit) {
+    const uint8_t mask = 0x80 >> (bit % 8);
+
+    if ((pk1[bit / 8] & mask) != (pk2[bit / 8] & mask)) {
+      return bit;
+    }
+  }
+
+  return KEY_MATH_BITS;
+}
+
+class KeyMath : public ::testing::Test {
+ protected:
+  PublicKey random_key() {
+    PublicKey key;
+
+    for (uint8_t &byte : key) {
+      byte = static_cast<uint8_t>(rng_());
+    }
+
+    return key;
+  }
+
+  // Copy of key with the bit at index flipped, so they share exactly index bits.
+  static PublicKey flip_bit(PublicKey key, unsigned int index) {
+    key[index / 8] ^= 0x80 >> (index % 8);
+    return key;
+  }
+
+  std::mt19937 rng_{12345};
+};
+
+TEST_F(KeyMath, EqualKeys) {
+  const PublicKey pk = random_key();
+  const PublicKey pk1 = random_key();
+
+  EXPECT_TRUE(key_equal(pk1.data(), pk1.data()));
+  EXPECT_EQ(key_common_prefix(pk1.data(), pk1.data()), KEY_MATH_BITS);
+  EXPECT_EQ(key_closest(pk.data(), pk1.data(), pk1.data()), 0);
+}
+
+TEST_F(KeyMath, EveryBitIsFound) {
+  const PublicKey pk = random_key();
+
+  for (unsigned int i = 0; i < KEY_MATH_BITS; ++i) {
+    const PublicKey pk1 = random_key();
+    const PublicKey pk2 = flip_bit(pk1, i);
+
+    EXPECT_FALSE(key_equal(pk1.data(), pk2.data())) << "bit " << i;
+    EXPECT_EQ(key_common_prefix(pk1.data(), pk2.data()), i);
+    EXPECT_EQ(key_common_prefix(pk2.data(), pk1.data()), i);
+    EXPECT_EQ(key_closest(pk.data(), pk1.data(), pk2.data()), reference_closest(pk, pk1, pk2))
+        << "bit " << i;
+    EXPECT_EQ(key_closest(pk1.data(), pk1.data(), pk2.data()), 1);
+    EXPECT_EQ(key_closest(pk2.data(), pk1.data(), pk2.data()), 2);
+  }
+}
+
+TEST_F(KeyMath, MatchesByteWiseReference) {
+  for (int n = 0; n < 10000; ++n) {
+    const PublicKey pk = random_key();
+    // Keys sharing long prefixes with each other and with pk exercise every
+    // word and lane boundary, random ones mostly differ in the first byte.
+    const unsigned int shared = rng_() % (KEY_MATH_BITS + 1);
+    const PublicKey pk1 = shared == KEY_MATH_BITS ? pk : flip_bit(pk, shared);
+    const PublicKey pk2 = n % 2 == 0 ? random_key() : flip_bit(pk1, rng_() % KEY_MATH_BITS);
+
+    ASSERT_EQ(key_closest(pk.data(), pk1.data(), pk2.data()), reference_closest(pk, pk1, pk2));
+    ASSERT_EQ(key_closest(pk.data(), pk2.data(), pk1.data()), reference_closest(pk, pk2, pk1));
+    ASSERT_EQ(key_common_prefix(pk1.data(), pk2.data()), reference_common_prefix(pk1, pk2));
+    ASSERT_EQ(key_common_prefix(pk.data(), pk1.data()), reference_common_prefix(pk, pk1));
+    ASSERT_EQ(key_equal(pk1.data(), pk2.data()), pk1 == pk2);
+    ASSERT_EQ(key_equal(pk.data(), pk1.data()), pk == pk1);
+  }
+}
+
+TEST_F(KeyMath, UnalignedKeys) {
+  std::array<uint8_t, CRYPTO_PUBLIC_KEY_SIZE * 2 + 2> buffer{};
+  const PublicKey pk = random_key();
+  const PublicKey pk1 = random_key();
+  const PublicKey pk2 = flip_bit(pk1, KEY_MATH_BITS - 1);
+  std::copy(pk1.begin(), pk1.end(), buffer.begin() + 1);
+  std::copy(pk2.begin(), pk2.end(), buffer.begin() + CRYPTO_PUBLIC_KEY_SIZE + 2);
+
+  const uint8_t *const unaligned1 = buffer.data() + 1;
+  const uint8_t *const unaligned2 = buffer.data() + CRYPTO_PUBLIC_KEY_SIZE + 2;
+
+  EXPECT_EQ(key_common_prefix(unaligned1, unaligned2), KEY_MATH_BITS - 1);
+  EXPECT_EQ(key_closest(pk.data(), unaligned1, unaligned2), reference_closest(pk, pk1, pk2));
+  EXPECT_TRUE(key_equal(unaligned1, pk1.data()));
+}
+
+}  // namespace
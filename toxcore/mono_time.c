@@ -178,6 +178,11 @@ uint64_t mono_time_get(const Mono_Time *mono_time)
     return time;
 }
 
+uint64_t mono_time_next_second(const Mono_Time *mono_time)
+{
+    return (mono_time_get(mono_time) - mono_time->base_time + 1) * 1000ULL;
+}
+
 bool mono_time_is_timeout(const Mono_Time *mono_time, uint64_t timestamp, uint64_t timeout)
 {
     return timestamp + timeout <= mono_time_get(mono_time);
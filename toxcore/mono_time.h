@@ -60,6 +60,13 @@ void mono_time_update(Mono_Time *mono_time);
  */
 uint64_t mono_time_get(const Mono_Time *mono_time);
 
+/**
+ * Return the time in milliseconds, on the clock of current_time_monotonic,
+ * at which mono_time_get will return a new value once mono_time_update is
+ * called. Anything scheduled in whole seconds can't become due before then.
+ */
+uint64_t mono_time_next_second(const Mono_Time *mono_time);
+
 /**
  * Return true iff timestamp is at least timeout seconds in the past.
  */
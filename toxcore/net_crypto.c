@@ -18,21 +18,50 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "hash_list.h"
 #include "mono_time.h"
 #include "util.h"
 
 typedef struct Packet_Data {
     uint64_t sent_time;
+    bool resent; /* Acknowledgements of resent packets give no usable round trip time. */
     uint16_t length;
     uint8_t data[MAX_CRYPTO_DATA_SIZE];
 } Packet_Data;
 
+/* Ring of packets indexed by packet number.
+ *
+ * The ring starts out unallocated and doubles in size on demand, up to
+ * CRYPTO_PACKET_BUFFER_SIZE slots. It always has room for every packet
+ * number in `{buffer_start, buffer_end)`.
+ */
 typedef struct Packets_Array {
-    Packet_Data *buffer[CRYPTO_PACKET_BUFFER_SIZE];
+    Packet_Data **buffer;
+    uint32_t  capacity; /* number of slots in buffer, 0 or a power of 2 */
     uint32_t  buffer_start;
     uint32_t  buffer_end; /* packet numbers in array: `{buffer_start, buffer_end)` */
+    uint64_t  low_use_time; /* time in ms the array dropped below a quarter of capacity, 0 if it isn't */
 } Packets_Array;
 
+/* Smallest ring allocated for a Packets_Array. */
+#define PACKETS_ARRAY_MIN_SIZE 16
+
+/* Time in ms a grown ring must stay less than a quarter full before it is
+ * halved, or released if it is empty, so bursty traffic doesn't reallocate it
+ * over and over. */
+#define PACKETS_ARRAY_SHRINK_DELAY 5000
+
+/* Maximum number of unused Packet_Data buffers kept around for reuse. */
+#define PACKET_POOL_SIZE 1024
+
+/* Per-Net_Crypto cache of Packet_Data buffers, so queueing a packet doesn't
+ * need a malloc/free pair in the steady state. */
+typedef struct Packet_Pool {
+    Packet_Data *free_packets[PACKET_POOL_SIZE];
+    uint32_t num_free;
+    pthread_mutex_t mutex;
+} Packet_Pool;
+
 typedef enum Crypto_Conn_State {
     CRYPTO_CONN_FREE = 0,            /* the connection slot is free. This value is 0 so it is valid after
                                       * `crypto_memzero(...)` of the parent struct
@@ -101,14 +130,18 @@ typedef struct Crypto_Connection {
     uint64_t last_packets_left_requested_set;
     double last_packets_left_requested_rem;
 
-    uint32_t last_sendqueue_size[CONGESTION_QUEUE_ARRAY_SIZE];
-    uint32_t last_sendqueue_counter;
-    long signed int last_num_packets_sent[CONGESTION_LAST_SENT_ARRAY_SIZE];
-    long signed int last_num_packets_resent[CONGESTION_LAST_SENT_ARRAY_SIZE];
+    Congestion_Controller congestion;
     uint32_t packets_sent;
     uint32_t packets_resent;
     uint64_t last_congestion_event;
     uint64_t rtt_time;
+    uint64_t rtt_sample; /* Lowest rtt measured since the last congestion control update, 0 if none. */
+    uint64_t rtt_last; /* Most recent rtt measured, 0 if none yet. */
+    uint64_t rtt_min; /* Lowest of the rtt_last values, 0 if none yet. */
+
+    /* Totals since the connection was created, for crypto_connection_stats. */
+    uint64_t total_packets_sent;
+    uint64_t total_packets_resent;
 
     /* TCP_connection connection_number */
     unsigned int connection_number_tcp;
@@ -150,8 +183,16 @@ struct Net_Crypto {
 
     /* The current optimal sleep time */
     uint32_t current_sleep_time;
+    /* Congestion controller used for new connections. */
+    Congestion_Control_Type congestion_control;
+    /* When send_crypto_packets last ran, in milliseconds. */
+    uint64_t last_run_time;
+
+    /* Maps IP_Port keys (see ip_port_key) and peer real public keys to connection ids. */
+    Hash_List ip_port_list;
+    Hash_List public_key_list;
 
-    BS_List ip_port_list;
+    Packet_Pool packet_pool;
 };
 
 const uint8_t *nc_get_self_public_key(const Net_Crypto *c)
@@ -563,6 +604,40 @@ static Crypto_Connection *get_crypto_connection(const Net_Crypto *c, int crypt_c
 }
 
 
+/* Size of the keys in ip_port_list: family, address and port. */
+#define IP_PORT_KEY_SIZE (1 + SIZE_IP6 + sizeof(uint16_t))
+
+/* Pack the parts of ip_port that identify it into key, leaving out the padding
+ * of IP_Port and the unused bytes of IPv4 addresses.
+ */
+static void ip_port_key(uint8_t *key, const IP_Port *ip_port)
+{
+    memset(key, 0, IP_PORT_KEY_SIZE);
+    key[0] = ip_port->ip.family.value;
+
+    if (net_family_is_ipv4(ip_port->ip.family)) {
+        memcpy(key + 1, &ip_port->ip.ip.v4, SIZE_IP4);
+    } else if (net_family_is_ipv6(ip_port->ip.family)) {
+        memcpy(key + 1, &ip_port->ip.ip.v6, SIZE_IP6);
+    }
+
+    memcpy(key + 1 + SIZE_IP6, &ip_port->port, sizeof(uint16_t));
+}
+
+static bool ip_port_list_add(Net_Crypto *c, const IP_Port *ip_port, int crypt_connection_id)
+{
+    uint8_t key[IP_PORT_KEY_SIZE];
+    ip_port_key(key, ip_port);
+    return hash_list_add(&c->ip_port_list, key, crypt_connection_id);
+}
+
+static void ip_port_list_remove(Net_Crypto *c, const IP_Port *ip_port, int crypt_connection_id)
+{
+    uint8_t key[IP_PORT_KEY_SIZE];
+    ip_port_key(key, ip_port);
+    hash_list_remove(&c->ip_port_list, key, crypt_connection_id);
+}
+
 /* Associate an ip_port to a connection.
  *
  * return -1 on failure.
@@ -578,21 +653,21 @@ static int add_ip_port_connection(Net_Crypto *c, int crypt_connection_id, IP_Por
 
     if (net_family_is_ipv4(ip_port.ip.family)) {
         if (!ipport_equal(&ip_port, &conn->ip_portv4) && !ip_is_lan(conn->ip_portv4.ip)) {
-            if (!bs_list_add(&c->ip_port_list, (uint8_t *)&ip_port, crypt_connection_id)) {
+            if (!ip_port_list_add(c, &ip_port, crypt_connection_id)) {
                 return -1;
             }
 
-            bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
+            ip_port_list_remove(c, &conn->ip_portv4, crypt_connection_id);
             conn->ip_portv4 = ip_port;
             return 0;
         }
     } else if (net_family_is_ipv6(ip_port.ip.family)) {
         if (!ipport_equal(&ip_port, &conn->ip_portv6)) {
-            if (!bs_list_add(&c->ip_port_list, (uint8_t *)&ip_port, crypt_connection_id)) {
+            if (!ip_port_list_add(c, &ip_port, crypt_connection_id)) {
                 return -1;
             }
 
-            bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
+            ip_port_list_remove(c, &conn->ip_portv6, crypt_connection_id);
             conn->ip_portv6 = ip_port;
             return 0;
         }
@@ -729,6 +804,111 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
 /** START: Array Related functions */
 
 
+static Packet_Data *packet_pool_get(Packet_Pool *pool)
+{
+    Packet_Data *data = nullptr;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (pool->num_free > 0) {
+        --pool->num_free;
+        data = pool->free_packets[pool->num_free];
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (data == nullptr) {
+        data = (Packet_Data *)malloc(sizeof(Packet_Data));
+    }
+
+    return data;
+}
+
+static void packet_pool_put(Packet_Pool *pool, Packet_Data *data)
+{
+    pthread_mutex_lock(&pool->mutex);
+
+    if (pool->num_free < PACKET_POOL_SIZE) {
+        pool->free_packets[pool->num_free] = data;
+        ++pool->num_free;
+        data = nullptr;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    free(data);
+}
+
+static void packet_pool_clear(Packet_Pool *pool)
+{
+    for (uint32_t i = 0; i < pool->num_free; ++i) {
+        free(pool->free_packets[i]);
+    }
+
+    pool->num_free = 0;
+}
+
+/* Return the slot of packet number in the array's ring.
+ * The ring must be allocated.
+ */
+static uint32_t packets_array_index(const Packets_Array *array, uint32_t number)
+{
+    return number & (array->capacity - 1);
+}
+
+/* Move the packets into a new ring of capacity slots, which must be 0 or a
+ * power of 2 that holds them all.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int packets_array_resize(Packets_Array *array, uint32_t capacity)
+{
+    Packet_Data **buffer = nullptr;
+
+    if (capacity != 0) {
+        buffer = (Packet_Data **)calloc(capacity, sizeof(Packet_Data *));
+
+        if (buffer == nullptr) {
+            return -1;
+        }
+    }
+
+    for (uint32_t i = array->buffer_start; i != array->buffer_end; ++i) {
+        buffer[i & (capacity - 1)] = array->buffer[packets_array_index(array, i)];
+    }
+
+    free(array->buffer);
+    array->buffer = buffer;
+    array->capacity = capacity;
+    array->low_use_time = 0;
+    return 0;
+}
+
+/* Grow the ring so that it has at least size slots counted from buffer_start.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int packets_array_reserve(Packets_Array *array, uint32_t size)
+{
+    if (size <= array->capacity) {
+        return 0;
+    }
+
+    if (size > CRYPTO_PACKET_BUFFER_SIZE) {
+        return -1;
+    }
+
+    uint32_t capacity = array->capacity == 0 ? PACKETS_ARRAY_MIN_SIZE : array->capacity;
+
+    while (capacity < size) {
+        capacity *= 2;
+    }
+
+    return packets_array_resize(array, capacity);
+}
+
 /* Return number of packets in array
  * Note that holes are counted too.
  */
@@ -737,24 +917,67 @@ static uint32_t num_packets_array(const Packets_Array *array)
     return array->buffer_end - array->buffer_start;
 }
 
+/* Called periodically with the current time in ms. Halve a grown ring once it
+ * has been less than a quarter full for PACKETS_ARRAY_SHRINK_DELAY, and release
+ * it if it is empty, so connections that are idle after a burst of traffic
+ * don't keep it.
+ */
+static void packets_array_shrink(Packets_Array *array, uint64_t current_time)
+{
+    const uint32_t used = num_packets_array(array);
+
+    if (array->capacity == 0 || (array->capacity <= PACKETS_ARRAY_MIN_SIZE && used != 0)
+            || used >= array->capacity / 4) {
+        array->low_use_time = 0;
+        return;
+    }
+
+    if (array->low_use_time == 0) {
+        array->low_use_time = current_time;
+        return;
+    }
+
+    if (array->low_use_time + PACKETS_ARRAY_SHRINK_DELAY > current_time) {
+        return;
+    }
+
+    uint32_t capacity = 0;
+
+    if (used != 0) {
+        capacity = array->capacity;
+
+        while (capacity > PACKETS_ARRAY_MIN_SIZE && used < capacity / 4) {
+            capacity /= 2;
+        }
+    }
+
+    // On allocation failure the ring is just kept.
+    packets_array_resize(array, capacity);
+}
+
 /* Add data with packet number to array.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int add_data_to_buffer(const Logger *log, Packets_Array *array, uint32_t number, const Packet_Data *data)
+static int add_data_to_buffer(const Logger *log, Packet_Pool *pool, Packets_Array *array, uint32_t number,
+                              const Packet_Data *data)
 {
     if (number - array->buffer_start >= CRYPTO_PACKET_BUFFER_SIZE) {
         return -1;
     }
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
+    if (packets_array_reserve(array, number - array->buffer_start + 1) != 0) {
+        return -1;
+    }
+
+    const uint32_t num = packets_array_index(array, number);
 
     if (array->buffer[num]) {
         return -1;
     }
 
-    Packet_Data *new_d = (Packet_Data *)malloc(sizeof(Packet_Data));
+    Packet_Data *new_d = packet_pool_get(pool);
 
     if (new_d == nullptr) {
         return -1;
@@ -784,7 +1007,7 @@ static int get_data_pointer(const Logger *log, const Packets_Array *array, Packe
         return -1;
     }
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
+    const uint32_t num = packets_array_index(array, number);
 
     if (!array->buffer[num]) {
         return 0;
@@ -799,7 +1022,8 @@ static int get_data_pointer(const Logger *log, const Packets_Array *array, Packe
  * return -1 on failure.
  * return packet number on success.
  */
-static int64_t add_data_end_of_buffer(const Logger *log, Packets_Array *array, const Packet_Data *data)
+static int64_t add_data_end_of_buffer(const Logger *log, Packet_Pool *pool, Packets_Array *array,
+                                      const Packet_Data *data)
 {
     const uint32_t num_spots = num_packets_array(array);
 
@@ -807,7 +1031,11 @@ static int64_t add_data_end_of_buffer(const Logger *log, Packets_Array *array, c
         return -1;
     }
 
-    Packet_Data *new_d = (Packet_Data *)malloc(sizeof(Packet_Data));
+    if (packets_array_reserve(array, num_spots + 1) != 0) {
+        return -1;
+    }
+
+    Packet_Data *new_d = packet_pool_get(pool);
 
     if (new_d == nullptr) {
         return -1;
@@ -815,7 +1043,7 @@ static int64_t add_data_end_of_buffer(const Logger *log, Packets_Array *array, c
 
     memcpy(new_d, data, sizeof(Packet_Data));
     uint32_t id = array->buffer_end;
-    array->buffer[id % CRYPTO_PACKET_BUFFER_SIZE] = new_d;
+    array->buffer[packets_array_index(array, id)] = new_d;
     ++array->buffer_end;
     return id;
 }
@@ -825,13 +1053,13 @@ static int64_t add_data_end_of_buffer(const Logger *log, Packets_Array *array, c
  * return -1 on failure.
  * return packet number on success.
  */
-static int64_t read_data_beg_buffer(const Logger *log, Packets_Array *array, Packet_Data *data)
+static int64_t read_data_beg_buffer(const Logger *log, Packet_Pool *pool, Packets_Array *array, Packet_Data *data)
 {
     if (array->buffer_end == array->buffer_start) {
         return -1;
     }
 
-    const uint32_t num = array->buffer_start % CRYPTO_PACKET_BUFFER_SIZE;
+    const uint32_t num = packets_array_index(array, array->buffer_start);
 
     if (!array->buffer[num]) {
         return -1;
@@ -840,7 +1068,7 @@ static int64_t read_data_beg_buffer(const Logger *log, Packets_Array *array, Pac
     memcpy(data, array->buffer[num], sizeof(Packet_Data));
     uint32_t id = array->buffer_start;
     ++array->buffer_start;
-    free(array->buffer[num]);
+    packet_pool_put(pool, array->buffer[num]);
     array->buffer[num] = nullptr;
     return id;
 }
@@ -850,7 +1078,7 @@ static int64_t read_data_beg_buffer(const Logger *log, Packets_Array *array, Pac
  * return -1 on failure.
  * return 0 on success
  */
-static int clear_buffer_until(const Logger *log, Packets_Array *array, uint32_t number)
+static int clear_buffer_until(const Logger *log, Packet_Pool *pool, Packets_Array *array, uint32_t number)
 {
     const uint32_t num_spots = num_packets_array(array);
 
@@ -861,10 +1089,10 @@ static int clear_buffer_until(const Logger *log, Packets_Array *array, uint32_t
     uint32_t i;
 
     for (i = array->buffer_start; i != number; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        const uint32_t num = packets_array_index(array, i);
 
         if (array->buffer[num]) {
-            free(array->buffer[num]);
+            packet_pool_put(pool, array->buffer[num]);
             array->buffer[num] = nullptr;
         }
     }
@@ -873,20 +1101,24 @@ static int clear_buffer_until(const Logger *log, Packets_Array *array, uint32_t
     return 0;
 }
 
-static int clear_buffer(Packets_Array *array)
+/* Delete all packets in array and release its ring. */
+static int clear_buffer(Packet_Pool *pool, Packets_Array *array)
 {
     uint32_t i;
 
     for (i = array->buffer_start; i != array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        const uint32_t num = packets_array_index(array, i);
 
         if (array->buffer[num]) {
-            free(array->buffer[num]);
+            packet_pool_put(pool, array->buffer[num]);
             array->buffer[num] = nullptr;
         }
     }
 
     array->buffer_start = i;
+    free(array->buffer);
+    array->buffer = nullptr;
+    array->capacity = 0;
     return 0;
 }
 
@@ -905,6 +1137,10 @@ static int set_buffer_end(const Logger *log, Packets_Array *array, uint32_t numb
         return -1;
     }
 
+    if (packets_array_reserve(array, number - array->buffer_start) != 0) {
+        return -1;
+    }
+
     array->buffer_end = number;
     return 0;
 }
@@ -936,7 +1172,7 @@ static int generate_request_packet(const Logger *log, uint8_t *data, uint16_t le
     uint32_t n = 1;
 
     for (uint32_t i = recv_array->buffer_start; i != recv_array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        const uint32_t num = packets_array_index(recv_array, i);
 
         if (!recv_array->buffer[num]) {
             data[cur_len] = n;
@@ -965,11 +1201,15 @@ static int generate_request_packet(const Logger *log, uint8_t *data, uint16_t le
 /* Handle a request data packet.
  * Remove all the packets the other received from the array.
  *
+ * latest_sample_time is raised to the send time of the newest packet received
+ * that was only sent once, for round trip time samples.
+ *
  * return -1 on failure.
  * return number of requested packets on success.
  */
-static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packets_Array *send_array,
-                                 const uint8_t *data, uint16_t length, uint64_t *latest_send_time, uint64_t rtt_time)
+static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packet_Pool *pool, Packets_Array *send_array,
+                                 const uint8_t *data, uint16_t length, uint64_t *latest_send_time,
+                                 uint64_t *latest_sample_time, uint64_t rtt_time)
 {
     if (length == 0) {
         return -1;
@@ -991,13 +1231,14 @@ static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packet
 
     const uint64_t temp_time = current_time_monotonic(mono_time);
     uint64_t l_sent_time = -1;
+    uint64_t l_sample_time = 0;
 
     for (uint32_t i = send_array->buffer_start; i != send_array->buffer_end; ++i) {
         if (length == 0) {
             break;
         }
 
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        const uint32_t num = packets_array_index(send_array, i);
 
         if (n == data[0]) {
             if (send_array->buffer[num]) {
@@ -1005,6 +1246,7 @@ static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packet
 
                 if ((sent_time + rtt_time) < temp_time) {
                     send_array->buffer[num]->sent_time = 0;
+                    send_array->buffer[num]->resent = true;
                 }
             }
 
@@ -1020,7 +1262,11 @@ static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packet
                     l_sent_time = sent_time;
                 }
 
-                free(send_array->buffer[num]);
+                if (l_sample_time < sent_time && !send_array->buffer[num]->resent) {
+                    l_sample_time = sent_time;
+                }
+
+                packet_pool_put(pool, send_array->buffer[num]);
                 send_array->buffer[num] = nullptr;
             }
         }
@@ -1043,6 +1289,10 @@ static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packet
         *latest_send_time = l_sent_time;
     }
 
+    if (*latest_sample_time < l_sample_time) {
+        *latest_sample_time = l_sample_time;
+    }
+
     return requested;
 }
 
@@ -1110,6 +1360,42 @@ static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint3
     return send_data_packet(c, crypt_connection_id, packet, SIZEOF_VLA(packet));
 }
 
+/* Copy packet packet_num of the send array into data.
+ *
+ * The ring can be reallocated by add_data_end_of_buffer on another thread, so
+ * it's only touched with conn->mutex held, and packets are sent from a copy.
+ *
+ * return -1 on failure.
+ * return 0 if the packet is empty.
+ * return 1 if it was copied.
+ */
+static int copy_send_packet(const Net_Crypto *c, Crypto_Connection *conn, uint32_t packet_num, Packet_Data *data)
+{
+    Packet_Data *dt = nullptr;
+    pthread_mutex_lock(conn->mutex);
+    const int ret = get_data_pointer(c->log, &conn->send_array, &dt, packet_num);
+
+    if (ret == 1) {
+        memcpy(data, dt, sizeof(Packet_Data));
+    }
+
+    pthread_mutex_unlock(conn->mutex);
+    return ret;
+}
+
+/* Set the sent time of packet packet_num of the send array, if it's still in it. */
+static void set_send_packet_time(const Net_Crypto *c, Crypto_Connection *conn, uint32_t packet_num, uint64_t sent_time)
+{
+    Packet_Data *dt = nullptr;
+    pthread_mutex_lock(conn->mutex);
+
+    if (get_data_pointer(c->log, &conn->send_array, &dt, packet_num) == 1) {
+        dt->sent_time = sent_time;
+    }
+
+    pthread_mutex_unlock(conn->mutex);
+}
+
 static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
 {
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
@@ -1121,17 +1407,17 @@ static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
     /* If last packet send failed, try to send packet again.
      * If sending it fails we won't be able to send the new packet. */
     if (conn->maximum_speed_reached) {
-        Packet_Data *dt = nullptr;
+        Packet_Data dt;
         const uint32_t packet_num = conn->send_array.buffer_end - 1;
-        const int ret = get_data_pointer(c->log, &conn->send_array, &dt, packet_num);
+        const int ret = copy_send_packet(c, conn, packet_num, &dt);
 
-        if (ret == 1 && dt->sent_time == 0) {
+        if (ret == 1 && dt.sent_time == 0) {
             if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num,
-                                        dt->data, dt->length) != 0) {
+                                        dt.data, dt.length) != 0) {
                 return -1;
             }
 
-            dt->sent_time = current_time_monotonic(c->mono_time);
+            set_send_packet_time(c, conn, packet_num, current_time_monotonic(c->mono_time));
         }
 
         conn->maximum_speed_reached = 0;
@@ -1166,10 +1452,11 @@ static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, cons
 
     Packet_Data dt;
     dt.sent_time = 0;
+    dt.resent = false;
     dt.length = length;
     memcpy(dt.data, data, length);
     pthread_mutex_lock(conn->mutex);
-    int64_t packet_num = add_data_end_of_buffer(c->log, &conn->send_array, &dt);
+    int64_t packet_num = add_data_end_of_buffer(c->log, &c->packet_pool, &conn->send_array, &dt);
     pthread_mutex_unlock(conn->mutex);
 
     if (packet_num == -1) {
@@ -1181,11 +1468,7 @@ static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, cons
     }
 
     if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data, length) == 0) {
-        Packet_Data *dt1 = nullptr;
-
-        if (get_data_pointer(c->log, &conn->send_array, &dt1, packet_num) == 1) {
-            dt1->sent_time = current_time_monotonic(c->mono_time);
-        }
+        set_send_packet_time(c, conn, packet_num, current_time_monotonic(c->mono_time));
     } else {
         conn->maximum_speed_reached = 1;
         LOGGER_DEBUG(c->log, "send_data_packet failed");
@@ -1295,9 +1578,9 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
     uint32_t num_sent = 0;
 
     for (uint32_t i = 0; i < array_size; ++i) {
-        Packet_Data *dt;
+        Packet_Data dt;
         const uint32_t packet_num = i + conn->send_array.buffer_start;
-        const int ret = get_data_pointer(c->log, &conn->send_array, &dt, packet_num);
+        const int ret = copy_send_packet(c, conn, packet_num, &dt);
 
         if (ret == -1) {
             return -1;
@@ -1307,13 +1590,13 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
             continue;
         }
 
-        if (dt->sent_time) {
+        if (dt.sent_time) {
             continue;
         }
 
-        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
-                                    dt->length) == 0) {
-            dt->sent_time = temp_time;
+        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt.data,
+                                    dt.length) == 0) {
+            set_send_packet_time(c, conn, packet_num, temp_time);
             ++num_sent;
         }
 
@@ -1520,19 +1803,40 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
     num = net_ntohl(num);
 
     uint64_t rtt_calc_time = 0;
+    /* Send time of the newest packet acknowledged, for the round trip time
+     * samples of the congestion controller and the transport stats. They don't
+     * include the time the peer waited before acknowledging, and leave out
+     * resent packets as their acknowledgements can't tell which copy arrived
+     * (Karn's rule). conn->rtt_time keeps being measured from rtt_calc_time. */
+    uint64_t newest_acked_time = 0;
+
+    // The send array's ring can be reallocated by a sending thread.
+    pthread_mutex_lock(conn->mutex);
 
     if (buffer_start != conn->send_array.buffer_start) {
         Packet_Data *packet_time;
 
         if (get_data_pointer(c->log, &conn->send_array, &packet_time, conn->send_array.buffer_start) == 1) {
             rtt_calc_time = packet_time->sent_time;
+
+            if (!packet_time->resent) {
+                newest_acked_time = packet_time->sent_time;
+            }
+        }
+
+        if (get_data_pointer(c->log, &conn->send_array, &packet_time, buffer_start - 1) == 1 && !packet_time->resent
+                && newest_acked_time < packet_time->sent_time) {
+            newest_acked_time = packet_time->sent_time;
         }
 
-        if (clear_buffer_until(c->log, &conn->send_array, buffer_start) != 0) {
+        if (clear_buffer_until(c->log, &c->packet_pool, &conn->send_array, buffer_start) != 0) {
+            pthread_mutex_unlock(conn->mutex);
             return -1;
         }
     }
 
+    pthread_mutex_unlock(conn->mutex);
+
     uint8_t *real_data = data + (sizeof(uint32_t) * 2);
     uint16_t real_length = len - (sizeof(uint32_t) * 2);
 
@@ -1569,8 +1873,10 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
             rtt_time = DEFAULT_TCP_PING_CONNECTION;
         }
 
-        int requested = handle_request_packet(c->mono_time, c->log, &conn->send_array, real_data, real_length, &rtt_calc_time,
-                                              rtt_time);
+        pthread_mutex_lock(conn->mutex);
+        int requested = handle_request_packet(c->mono_time, c->log, &c->packet_pool, &conn->send_array, real_data,
+                                              real_length, &rtt_calc_time, &newest_acked_time, rtt_time);
+        pthread_mutex_unlock(conn->mutex);
 
         if (requested == -1) {
             return -1;
@@ -1582,13 +1888,13 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
         dt.length = real_length;
         memcpy(dt.data, real_data, real_length);
 
-        if (add_data_to_buffer(c->log, &conn->recv_array, num, &dt) != 0) {
+        if (add_data_to_buffer(c->log, &c->packet_pool, &conn->recv_array, num, &dt) != 0) {
             return -1;
         }
 
         while (1) {
             pthread_mutex_lock(conn->mutex);
-            int ret = read_data_beg_buffer(c->log, &conn->recv_array, &dt);
+            int ret = read_data_beg_buffer(c->log, &c->packet_pool, &conn->recv_array, &dt);
             pthread_mutex_unlock(conn->mutex);
 
             if (ret == -1) {
@@ -1630,6 +1936,25 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
         }
     }
 
+    if (newest_acked_time != 0) {
+        uint64_t rtt_time = current_time_monotonic(c->mono_time) - newest_acked_time;
+
+        /* conn->rtt_sample uses 0 for "no sample". */
+        if (rtt_time == 0) {
+            rtt_time = 1;
+        }
+
+        if (conn->rtt_sample == 0 || rtt_time < conn->rtt_sample) {
+            conn->rtt_sample = rtt_time;
+        }
+
+        conn->rtt_last = rtt_time;
+
+        if (conn->rtt_min == 0 || rtt_time < conn->rtt_min) {
+            conn->rtt_min = rtt_time;
+        }
+    }
+
     return 0;
 }
 
@@ -1834,6 +2159,7 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
 
     uint32_t i;
 
+    hash_list_remove(&c->public_key_list, c->crypto_connections[crypt_connection_id].public_key, crypt_connection_id);
     pthread_mutex_destroy(c->crypto_connections[crypt_connection_id].mutex);
     free(c->crypto_connections[crypt_connection_id].mutex);
     crypto_memzero(&c->crypto_connections[crypt_connection_id], sizeof(Crypto_Connection));
@@ -1860,17 +2186,7 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
  */
 static int getcryptconnection_id(const Net_Crypto *c, const uint8_t *public_key)
 {
-    for (uint32_t i = 0; i < c->crypto_connections_length; ++i) {
-        if (!crypt_connection_id_is_valid(c, i)) {
-            continue;
-        }
-
-        if (public_key_cmp(public_key, c->crypto_connections[i].public_key) == 0) {
-            return i;
-        }
-    }
-
-    return -1;
+    return hash_list_find(&c->public_key_list, public_key);
 }
 
 /* Add a source to the crypto connection.
@@ -2024,6 +2340,15 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
 
     conn->connection_number_tcp = connection_number_tcp;
     memcpy(conn->public_key, n_c->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+
+    if (!hash_list_add(&c->public_key_list, conn->public_key, crypt_connection_id)) {
+        pthread_mutex_lock(&c->tcp_mutex);
+        kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
+        pthread_mutex_unlock(&c->tcp_mutex);
+        wipe_crypto_connection(c, crypt_connection_id);
+        return -1;
+    }
+
     memcpy(conn->recv_nonce, n_c->recv_nonce, CRYPTO_NONCE_SIZE);
     memcpy(conn->peersessionpublic_key, n_c->peersessionpublic_key, CRYPTO_PUBLIC_KEY_SIZE);
     random_nonce(conn->sent_nonce);
@@ -2040,6 +2365,7 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
     }
 
     memcpy(conn->dht_public_key, n_c->dht_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    congestion_control_init(&conn->congestion, c->congestion_control);
     conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
     conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
     conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
@@ -2081,9 +2407,19 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
 
     conn->connection_number_tcp = connection_number_tcp;
     memcpy(conn->public_key, real_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+
+    if (!hash_list_add(&c->public_key_list, conn->public_key, crypt_connection_id)) {
+        pthread_mutex_lock(&c->tcp_mutex);
+        kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
+        pthread_mutex_unlock(&c->tcp_mutex);
+        wipe_crypto_connection(c, crypt_connection_id);
+        return -1;
+    }
+
     random_nonce(conn->sent_nonce);
     crypto_new_keypair(conn->sessionpublic_key, conn->sessionsecret_key);
     conn->status = CRYPTO_CONN_COOKIE_REQUESTING;
+    congestion_control_init(&conn->congestion, c->congestion_control);
     conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
     conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
     conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
@@ -2414,7 +2750,9 @@ int nc_dht_pk_callback(Net_Crypto *c, int crypt_connection_id, dht_pk_cb *functi
  */
 static int crypto_id_ip_port(const Net_Crypto *c, IP_Port ip_port)
 {
-    return bs_list_find(&c->ip_port_list, (uint8_t *)&ip_port);
+    uint8_t key[IP_PORT_KEY_SIZE];
+    ip_port_key(key, &ip_port);
+    return hash_list_find(&c->ip_port_list, key);
 }
 
 #define CRYPTO_MIN_PACKET_SIZE (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE)
@@ -2471,30 +2809,19 @@ static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet
     return 0;
 }
 
-/* The dT for the average packet receiving rate calculations.
- * Also used as the */
-#define PACKET_COUNTER_AVERAGE_INTERVAL 50
-
 /* Ratio of recv queue size / recv packet rate (in seconds) times
  * the number of ms between request packets to send at that ratio
  */
 #define REQUEST_PACKETS_COMPARE_CONSTANT (0.125 * 100.0)
 
-/* Timeout for increasing speed after congestion event (in ms). */
-#define CONGESTION_EVENT_TIMEOUT 1000
-
-/* If the send queue is SEND_QUEUE_RATIO times larger than the
- * calculated link speed the packet send speed will be reduced
- * by a value depending on this number.
- */
-#define SEND_QUEUE_RATIO 2.0
-
 static void send_crypto_packets(Net_Crypto *c)
 {
     const uint64_t temp_time = current_time_monotonic(c->mono_time);
     double total_send_rate = 0;
     uint32_t peak_request_packet_interval = -1;
 
+    c->last_run_time = temp_time;
+
     for (uint32_t i = 0; i < c->crypto_connections_length; ++i) {
         Crypto_Connection *conn = get_crypto_connection(c, i);
 
@@ -2557,88 +2884,30 @@ static void send_crypto_packets(Net_Crypto *c)
                 uint32_t packets_resent = conn->packets_resent;
                 conn->packets_resent = 0;
 
-                /* conjestion control
-                 *  calculate a new value of conn->packet_send_rate based on some data
-                 */
-
-                unsigned int pos = conn->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
-                conn->last_sendqueue_size[pos] = num_packets_array(&conn->send_array);
-
-                long signed int sum = 0;
-                sum = (long signed int)conn->last_sendqueue_size[pos] -
-                      (long signed int)conn->last_sendqueue_size[(pos + 1) % CONGESTION_QUEUE_ARRAY_SIZE];
-
-                unsigned int n_p_pos = conn->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                conn->last_num_packets_sent[n_p_pos] = packets_sent;
-                conn->last_num_packets_resent[n_p_pos] = packets_resent;
-
-                conn->last_sendqueue_counter = (conn->last_sendqueue_counter + 1) %
-                                               (CONGESTION_QUEUE_ARRAY_SIZE * CONGESTION_LAST_SENT_ARRAY_SIZE);
-
                 bool direct_connected = 0;
                 /* return value can be ignored since the `if` above ensures the connection is established */
                 crypto_connection_status(c, i, &direct_connected, nullptr);
 
+                Congestion_Sample sample;
+                sample.time = temp_time;
+                sample.packets_sent = packets_sent;
+                sample.packets_resent = packets_resent;
+                sample.send_queue_size = num_packets_array(&conn->send_array);
+                sample.min_rtt = conn->rtt_time;
+                sample.rtt = conn->rtt_sample;
+                sample.last_congestion_event = conn->last_congestion_event;
                 /* When switching from TCP to UDP, don't change the packet send rate for CONGESTION_EVENT_TIMEOUT ms. */
-                if (!(direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > temp_time)) {
-                    long signed int total_sent = 0;
-                    long signed int total_resent = 0;
-
-                    // TODO(irungentoo): use real delay
-                    unsigned int delay = (unsigned int)((conn->rtt_time / PACKET_COUNTER_AVERAGE_INTERVAL) + 0.5);
-                    unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
-
-                    if (delay > packets_set_rem_array) {
-                        delay = packets_set_rem_array;
-                    }
+                sample.hold_rate = direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > temp_time;
 
-                    for (unsigned j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
-                        unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                        total_sent += conn->last_num_packets_sent[ind];
-                        total_resent += conn->last_num_packets_resent[ind];
-                    }
-
-                    if (sum > 0) {
-                        total_sent -= sum;
-                    } else {
-                        if (total_resent > -sum) {
-                            total_resent = -sum;
-                        }
-                    }
-
-                    /* if queue is too big only allow resending packets. */
-                    uint32_t npackets = num_packets_array(&conn->send_array);
-                    double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
-                                                 PACKET_COUNTER_AVERAGE_INTERVAL));
-
-                    double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
-                            CONGESTION_QUEUE_ARRAY_SIZE) * PACKET_COUNTER_AVERAGE_INTERVAL));
-
-                    if (min_speed < CRYPTO_PACKET_MIN_RATE) {
-                        min_speed = CRYPTO_PACKET_MIN_RATE;
-                    }
+                conn->rtt_sample = 0;
 
-                    double send_array_ratio = (((double)npackets) / min_speed);
+                congestion_control_update(&conn->congestion, &sample, &conn->packet_send_rate,
+                                          &conn->packet_send_rate_requested);
 
-                    // TODO(irungentoo): Improve formula?
-                    if (send_array_ratio > SEND_QUEUE_RATIO && CRYPTO_MIN_QUEUE_LENGTH < npackets) {
-                        conn->packet_send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
-                    } else if (conn->last_congestion_event + CONGESTION_EVENT_TIMEOUT < temp_time) {
-                        conn->packet_send_rate = min_speed * 1.2;
-                    } else {
-                        conn->packet_send_rate = min_speed * 0.9;
-                    }
-
-                    conn->packet_send_rate_requested = min_speed_request * 1.2;
-
-                    if (conn->packet_send_rate < CRYPTO_PACKET_MIN_RATE) {
-                        conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
-                    }
-
-                    if (conn->packet_send_rate_requested < conn->packet_send_rate) {
-                        conn->packet_send_rate_requested = conn->packet_send_rate;
-                    }
-                }
+                pthread_mutex_lock(conn->mutex);
+                packets_array_shrink(&conn->send_array, temp_time);
+                packets_array_shrink(&conn->recv_array, temp_time);
+                pthread_mutex_unlock(conn->mutex);
             }
 
             if (conn->last_packets_left_set == 0 || conn->last_packets_left_requested_set == 0) {
@@ -2688,6 +2957,7 @@ static void send_crypto_packets(Net_Crypto *c)
             if (ret != -1) {
                 conn->packets_left_requested -= ret;
                 conn->packets_resent += ret;
+                conn->total_packets_resent += ret;
 
                 if ((unsigned int)ret < conn->packets_left) {
                     conn->packets_left -= ret;
@@ -2797,6 +3067,7 @@ int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         --conn->packets_left;
         --conn->packets_left_requested;
         ++conn->packets_sent;
+        ++conn->total_packets_sent;
     }
 
     return ret;
@@ -2894,11 +3165,11 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id)
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
 
-        bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
-        bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
+        ip_port_list_remove(c, &conn->ip_portv4, crypt_connection_id);
+        ip_port_list_remove(c, &conn->ip_portv6, crypt_connection_id);
         clear_temp_packet(c, crypt_connection_id);
-        clear_buffer(&conn->send_array);
-        clear_buffer(&conn->recv_array);
+        clear_buffer(&c->packet_pool, &conn->send_array);
+        clear_buffer(&c->packet_pool, &conn->recv_array);
         ret = wipe_crypto_connection(c, crypt_connection_id);
     }
 
@@ -2935,6 +3206,26 @@ bool crypto_connection_status(const Net_Crypto *c, int crypt_connection_id, bool
     return true;
 }
 
+int crypto_connection_stats(const Net_Crypto *c, int crypt_connection_id, Crypto_Connection_Stats *stats)
+{
+    const Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    stats->rtt_min = conn->rtt_min;
+    stats->rtt_last = conn->rtt_last;
+    stats->send_rate = conn->packet_send_rate;
+    stats->recv_rate = conn->packet_recv_rate;
+    stats->packets_sent = conn->total_packets_sent;
+    stats->packets_resent = conn->total_packets_resent;
+    stats->send_queue_size = num_packets_array(&conn->send_array);
+    stats->recv_queue_size = num_packets_array(&conn->recv_array);
+    stats->queue_delay = congestion_control_queue_delay(&conn->congestion);
+    return 0;
+}
+
 void new_keys(Net_Crypto *c)
 {
     crypto_new_keypair(c->self_public_key, c->self_secret_key);
@@ -2989,29 +3280,53 @@ Net_Crypto *new_net_crypto(const Logger *log, Mono_Time *mono_time, DHT *dht, TC
     set_oob_packet_tcp_connection_callback(temp->tcp_c, &tcp_oob_callback, temp);
 
     if (create_recursive_mutex(&temp->tcp_mutex) != 0 ||
-            pthread_mutex_init(&temp->connections_mutex, nullptr) != 0) {
+            pthread_mutex_init(&temp->connections_mutex, nullptr) != 0 ||
+            pthread_mutex_init(&temp->packet_pool.mutex, nullptr) != 0) {
         kill_tcp_connections(temp->tcp_c);
         free(temp);
         return nullptr;
     }
 
+    if (!hash_list_init(&temp->ip_port_list, IP_PORT_KEY_SIZE, 8)
+            || !hash_list_init(&temp->public_key_list, CRYPTO_PUBLIC_KEY_SIZE, 8)) {
+        hash_list_free(&temp->ip_port_list);
+        hash_list_free(&temp->public_key_list);
+        kill_tcp_connections(temp->tcp_c);
+        pthread_mutex_destroy(&temp->tcp_mutex);
+        pthread_mutex_destroy(&temp->connections_mutex);
+        pthread_mutex_destroy(&temp->packet_pool.mutex);
+        free(temp);
+        return nullptr;
+    }
+
     temp->dht = dht;
 
     new_keys(temp);
     new_symmetric_key(temp->secret_symmetric_key);
 
     temp->current_sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
+    temp->congestion_control = CONGESTION_CONTROL_QUEUE;
 
     networking_registerhandler(dht_get_net(dht), NET_PACKET_COOKIE_REQUEST, &udp_handle_cookie_request, temp);
     networking_registerhandler(dht_get_net(dht), NET_PACKET_COOKIE_RESPONSE, &udp_handle_packet, temp);
     networking_registerhandler(dht_get_net(dht), NET_PACKET_CRYPTO_HS, &udp_handle_packet, temp);
     networking_registerhandler(dht_get_net(dht), NET_PACKET_CRYPTO_DATA, &udp_handle_packet, temp);
 
-    bs_list_init(&temp->ip_port_list, sizeof(IP_Port), 8);
-
     return temp;
 }
 
+int net_crypto_set_congestion_control(Net_Crypto *c, Congestion_Control_Type type)
+{
+    Congestion_Controller cc;
+
+    if (congestion_control_init(&cc, type) != 0) {
+        return -1;
+    }
+
+    c->congestion_control = type;
+    return 0;
+}
+
 static void kill_timedout(Net_Crypto *c, void *userdata)
 {
     for (uint32_t i = 0; i < c->crypto_connections_length; ++i) {
@@ -3048,6 +3363,11 @@ uint32_t crypto_run_interval(const Net_Crypto *c)
     return c->current_sleep_time;
 }
 
+uint64_t crypto_run_deadline(const Net_Crypto *c)
+{
+    return c->last_run_time + c->current_sleep_time;
+}
+
 /* Main loop. */
 void do_net_crypto(Net_Crypto *c, void *userdata)
 {
@@ -3064,11 +3384,15 @@ void kill_net_crypto(Net_Crypto *c)
         crypto_kill(c, i);
     }
 
+    packet_pool_clear(&c->packet_pool);
+
     pthread_mutex_destroy(&c->tcp_mutex);
     pthread_mutex_destroy(&c->connections_mutex);
+    pthread_mutex_destroy(&c->packet_pool.mutex);
 
     kill_tcp_connections(c->tcp_c);
-    bs_list_free(&c->ip_port_list);
+    hash_list_free(&c->ip_port_list);
+    hash_list_free(&c->public_key_list);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_COOKIE_REQUEST, nullptr, nullptr);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_COOKIE_RESPONSE, nullptr, nullptr);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_CRYPTO_HS, nullptr, nullptr);
@@ -12,6 +12,7 @@
 #include "DHT.h"
 #include "LAN_discovery.h"
 #include "TCP_connection.h"
+#include "congestion_control.h"
 #include "logger.h"
 
 #include <pthread.h>
@@ -69,12 +70,6 @@
 /* Maximum size of receiving and sending packet buffers. */
 #define CRYPTO_PACKET_BUFFER_SIZE 32768 // Must be a power of 2
 
-/* Minimum packet rate per second. */
-#define CRYPTO_PACKET_MIN_RATE 4.0
-
-/* Minimum packet queue max length. */
-#define CRYPTO_MIN_QUEUE_LENGTH 64
-
 /* Maximum total size of packets that net_crypto sends. */
 #define MAX_CRYPTO_PACKET_SIZE (uint16_t)1400
 
@@ -99,11 +94,6 @@
 /* All packets will be padded a number of bytes based on this number. */
 #define CRYPTO_MAX_PADDING 8
 
-/* Base current transfer speed on last CONGESTION_QUEUE_ARRAY_SIZE number of points taken
- * at the dT defined in net_crypto.c */
-#define CONGESTION_QUEUE_ARRAY_SIZE 12
-#define CONGESTION_LAST_SENT_ARRAY_SIZE (CONGESTION_QUEUE_ARRAY_SIZE * 2)
-
 /* Default connection ping in ms. */
 #define DEFAULT_PING_CONNECTION 1000
 #define DEFAULT_TCP_PING_CONNECTION 500
@@ -302,6 +292,25 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id);
 bool crypto_connection_status(const Net_Crypto *c, int crypt_connection_id, bool *direct_connected,
                               unsigned int *online_tcp_relays);
 
+typedef struct Crypto_Connection_Stats {
+    uint64_t rtt_min; /* lowest round trip time measured in ms, 0 if none yet */
+    uint64_t rtt_last; /* most recent round trip time measured in ms, 0 if none yet */
+    double send_rate; /* lossless packets per second the congestion controller allows */
+    double recv_rate; /* packets per second received */
+    uint64_t packets_sent; /* lossless packets sent since the connection was created */
+    uint64_t packets_resent; /* lossless packets resent because the peer requested them */
+    uint32_t send_queue_size; /* packets sent but not yet acknowledged */
+    uint32_t recv_queue_size; /* packets from the first one not received yet to the newest one received */
+    uint64_t queue_delay; /* queueing delay estimate in ms, 0 if the controller doesn't estimate it */
+} Crypto_Connection_Stats;
+
+/* Fill stats with a snapshot of the transport state of a connection.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int crypto_connection_stats(const Net_Crypto *c, int crypt_connection_id, Crypto_Connection_Stats *stats);
+
 /* Generate our public and private keys.
  *  Only call this function the first time the program starts.
  */
@@ -322,10 +331,22 @@ void load_secret_key(Net_Crypto *c, const uint8_t *sk);
  */
 Net_Crypto *new_net_crypto(const Logger *log, Mono_Time *mono_time, DHT *dht, TCP_Proxy_Info *proxy_info);
 
+/* Set the congestion controller used by connections created after this call.
+ *
+ * return 0 on success.
+ * return -1 if the type is unknown.
+ */
+int net_crypto_set_congestion_control(Net_Crypto *c, Congestion_Control_Type type);
+
 /* return the optimal interval in ms for running do_net_crypto.
  */
 uint32_t crypto_run_interval(const Net_Crypto *c);
 
+/* return the time in ms (on the current_time_monotonic clock) at which
+ * do_net_crypto should run next.
+ */
+uint64_t crypto_run_deadline(const Net_Crypto *c);
+
 /* Main loop. */
 void do_net_crypto(Net_Crypto *c, void *userdata);
 
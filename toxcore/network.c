@@ -19,6 +19,11 @@
 #define __EXTENSIONS__ 1
 #endif
 
+// For recvmmsg on Linux.
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 // For Linux (and some BSDs).
 #ifndef _XOPEN_SOURCE
 #define _XOPEN_SOURCE 700
@@ -83,6 +88,16 @@
 
 #define TOX_EWOULDBLOCK EWOULDBLOCK
 
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define USE_RECVMMSG
+#define USE_SENDMMSG
+#include <netinet/udp.h>
+#endif
+
+#if defined(USE_SENDMMSG) && defined(UDP_SEGMENT)
+#define USE_UDP_GSO
+#endif
+
 static const char *inet_ntop4(const struct in_addr *addr, char *buf, size_t bufsize)
 {
     return inet_ntop(AF_INET, addr, buf, bufsize);
@@ -479,6 +494,50 @@ typedef struct Packet_Handler {
     void *object;
 } Packet_Handler;
 
+#ifdef USE_RECVMMSG
+/* Maximum number of datagrams read from the socket with one recvmmsg call. */
+#define NET_RECV_BATCH_SIZE 32
+
+/* Reusable buffers for batched receiving. Allocated once per Networking_Core
+ * so that networking_poll doesn't need NET_RECV_BATCH_SIZE * 2 KiB of stack.
+ */
+typedef struct Net_Recv_Batch {
+    struct mmsghdr msgs[NET_RECV_BATCH_SIZE];
+    struct iovec iovecs[NET_RECV_BATCH_SIZE];
+    struct sockaddr_storage addrs[NET_RECV_BATCH_SIZE];
+    uint8_t data[NET_RECV_BATCH_SIZE][MAX_UDP_PACKET_SIZE];
+} Net_Recv_Batch;
+#endif
+
+#ifdef USE_SENDMMSG
+/* Maximum number of datagrams queued before the send queue is flushed. */
+#define NET_SEND_QUEUE_SIZE 64
+
+/* Limits for a single UDP GSO message: the kernel accepts at most 64 segments
+ * and the whole message must fit into one (IPv4) UDP datagram. */
+#define NET_GSO_MAX_SEGMENTS 64
+#define NET_GSO_MAX_BYTES 65000
+
+/* Outgoing datagrams collected by sendpacket until networking_flush. */
+typedef struct Net_Send_Queue {
+    uint32_t count;
+
+    IP_Port ip_ports[NET_SEND_QUEUE_SIZE];
+    struct sockaddr_storage addrs[NET_SEND_QUEUE_SIZE];
+    socklen_t addrsizes[NET_SEND_QUEUE_SIZE];
+    uint8_t data[NET_SEND_QUEUE_SIZE][MAX_UDP_PACKET_SIZE];
+    struct iovec iovecs[NET_SEND_QUEUE_SIZE];
+
+    /* One message per datagram, or per run of datagrams sent with GSO. */
+    struct mmsghdr msgs[NET_SEND_QUEUE_SIZE];
+    uint32_t msg_packets[NET_SEND_QUEUE_SIZE];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } control[NET_SEND_QUEUE_SIZE];
+} Net_Send_Queue;
+#endif
+
 struct Networking_Core {
     const Logger *log;
     Packet_Handler packethandlers[256];
@@ -487,6 +546,17 @@ struct Networking_Core {
     uint16_t port;
     /* Our UDP socket. */
     Socket sock;
+
+    /* Buffers for recvmmsg, NULL if batched receiving is disabled or not
+     * supported by the platform/kernel. */
+    struct Net_Recv_Batch *recv_batch;
+
+    /* Send queue for sendmmsg, NULL if sendpacket sends immediately. */
+    struct Net_Send_Queue *send_queue;
+    /* Whether the kernel supports UDP segmentation offload on our socket. */
+    bool udp_gso;
+
+    Net_Stats stats;
 };
 
 Family net_family(const Networking_Core *net)
@@ -494,15 +564,43 @@ Family net_family(const Networking_Core *net)
     return net->family;
 }
 
+const Net_Stats *networking_get_stats(const Networking_Core *net)
+{
+    return &net->stats;
+}
+
+static void count_sent_packet(Net_Stats *stats, const uint8_t *data, uint16_t length)
+{
+    if (length == 0) {
+        return;
+    }
+
+    ++stats->packets_sent[data[0]];
+    stats->bytes_sent[data[0]] += length;
+}
+
 uint16_t net_port(const Networking_Core *net)
 {
     return net->port;
 }
 
-/* Basic network functions:
- * Function to send packet(data) of length length to ip_port.
+Socket net_sock(const Networking_Core *net)
+{
+    if (net_family_is_unspec(net->family)) {
+        return net_invalid_socket;
+    }
+
+    return net->sock;
+}
+
+/* Convert the destination of a packet into a socket address for our socket,
+ * mapping IPv4 addresses into IPv6 if our socket is IPv6.
+ *
+ * return 0 on success.
+ * return -1 if a packet can't be sent to this address.
  */
-int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+static int ip_port_to_sockaddr(const Networking_Core *net, IP_Port *ip_port, uint16_t length,
+                               struct sockaddr_storage *addr, size_t *addrsize)
 {
     if (net_family_is_unspec(net->family)) { /* Socket not initialized */
         LOGGER_ERROR(net->log, "attempted to send message of length %u on uninitialised socket", (unsigned)length);
@@ -510,13 +608,13 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
     }
 
     /* socket TOX_AF_INET, but target IP NOT: can't send */
-    if (net_family_is_ipv4(net->family) && !net_family_is_ipv4(ip_port.ip.family)) {
+    if (net_family_is_ipv4(net->family) && !net_family_is_ipv4(ip_port->ip.family)) {
         LOGGER_ERROR(net->log, "attempted to send message with network family %d (probably IPv6) on IPv4 socket",
-                     ip_port.ip.family.value);
+                     ip_port->ip.family.value);
         return -1;
     }
 
-    if (net_family_is_ipv4(ip_port.ip.family) && net_family_is_ipv6(net->family)) {
+    if (net_family_is_ipv4(ip_port->ip.family) && net_family_is_ipv6(net->family)) {
         /* must convert to IPV4-in-IPV6 address */
         IP6 ip6;
 
@@ -525,78 +623,270 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
         ip6.uint32[0] = 0;
         ip6.uint32[1] = 0;
         ip6.uint32[2] = net_htonl(0xFFFF);
-        ip6.uint32[3] = ip_port.ip.ip.v4.uint32;
+        ip6.uint32[3] = ip_port->ip.ip.v4.uint32;
 
-        ip_port.ip.family = net_family_ipv6;
-        ip_port.ip.ip.v6 = ip6;
+        ip_port->ip.family = net_family_ipv6;
+        ip_port->ip.ip.v6 = ip6;
     }
 
-    struct sockaddr_storage addr;
-
-    size_t addrsize;
+    memset(addr, 0, sizeof(struct sockaddr_storage));
 
-    if (net_family_is_ipv4(ip_port.ip.family)) {
-        struct sockaddr_in *const addr4 = (struct sockaddr_in *)&addr;
+    if (net_family_is_ipv4(ip_port->ip.family)) {
+        struct sockaddr_in *const addr4 = (struct sockaddr_in *)addr;
 
-        addrsize = sizeof(struct sockaddr_in);
+        *addrsize = sizeof(struct sockaddr_in);
         addr4->sin_family = AF_INET;
-        addr4->sin_port = ip_port.port;
-        fill_addr4(ip_port.ip.ip.v4, &addr4->sin_addr);
-    } else if (net_family_is_ipv6(ip_port.ip.family)) {
-        struct sockaddr_in6 *const addr6 = (struct sockaddr_in6 *)&addr;
+        addr4->sin_port = ip_port->port;
+        fill_addr4(ip_port->ip.ip.v4, &addr4->sin_addr);
+    } else if (net_family_is_ipv6(ip_port->ip.family)) {
+        struct sockaddr_in6 *const addr6 = (struct sockaddr_in6 *)addr;
 
-        addrsize = sizeof(struct sockaddr_in6);
+        *addrsize = sizeof(struct sockaddr_in6);
         addr6->sin6_family = AF_INET6;
-        addr6->sin6_port = ip_port.port;
-        fill_addr6(ip_port.ip.ip.v6, &addr6->sin6_addr);
+        addr6->sin6_port = ip_port->port;
+        fill_addr6(ip_port->ip.ip.v6, &addr6->sin6_addr);
 
         addr6->sin6_flowinfo = 0;
         addr6->sin6_scope_id = 0;
     } else {
-        LOGGER_WARNING(net->log, "unknown address type: %d", ip_port.ip.family.value);
+        LOGGER_WARNING(net->log, "unknown address type: %d", ip_port->ip.family.value);
         return -1;
     }
 
-    const int res = sendto(net->sock.socket, (const char *)data, length, 0, (struct sockaddr *)&addr, addrsize);
+    return 0;
+}
 
-    loglogdata(net->log, "O=>", data, length, ip_port, res);
+#ifdef USE_SENDMMSG
+/* Number of queued packets starting at `first` that can be sent as one GSO
+ * message: same destination, all of the same size except for a shorter last
+ * one.
+ */
+static uint32_t gso_segment_count(const Net_Send_Queue *queue, uint32_t first)
+{
+    const size_t segment_size = queue->iovecs[first].iov_len;
+    size_t total = segment_size;
+    uint32_t count = 1;
+
+    while (first + count < queue->count && count < NET_GSO_MAX_SEGMENTS) {
+        const uint32_t i = first + count;
+        const size_t size = queue->iovecs[i].iov_len;
+
+        if (size > segment_size || total + size > NET_GSO_MAX_BYTES
+                || queue->addrsizes[i] != queue->addrsizes[first]
+                || memcmp(&queue->addrs[i], &queue->addrs[first], queue->addrsizes[first]) != 0) {
+            break;
+        }
+
+        total += size;
+        ++count;
+
+        if (size < segment_size) {
+            break;
+        }
+    }
+
+    return count;
+}
+
+/* Fill in the mmsghdr array for the queued packets starting at `first`.
+ *
+ * return the number of messages.
+ */
+static uint32_t prepare_send_queue_msgs(const Networking_Core *net, Net_Send_Queue *queue, uint32_t first)
+{
+    uint32_t num_msgs = 0;
+
+    for (uint32_t i = first; i < queue->count; ++num_msgs) {
+        const uint32_t segments = net->udp_gso ? gso_segment_count(queue, i) : 1;
+        struct msghdr *hdr = &queue->msgs[num_msgs].msg_hdr;
+
+        memset(hdr, 0, sizeof(struct msghdr));
+        hdr->msg_name = &queue->addrs[i];
+        hdr->msg_namelen = queue->addrsizes[i];
+        hdr->msg_iov = &queue->iovecs[i];
+        hdr->msg_iovlen = segments;
+
+#ifdef USE_UDP_GSO
+
+        if (segments > 1) {
+            const uint16_t segment_size = queue->iovecs[i].iov_len;
+
+            hdr->msg_control = queue->control[num_msgs].buf;
+            hdr->msg_controllen = sizeof(queue->control[num_msgs].buf);
+
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(uint16_t));
+        }
+
+#endif
+
+        queue->msg_packets[num_msgs] = segments;
+        i += segments;
+    }
+
+    return num_msgs;
+}
+
+static void log_sent_packets(Networking_Core *net, const Net_Send_Queue *queue, uint32_t first, uint32_t count,
+                             bool failed)
+{
+    for (uint32_t i = first; i < first + count; ++i) {
+        const uint16_t length = queue->iovecs[i].iov_len;
+        loglogdata(net->log, "O=>", queue->data[i], length, queue->ip_ports[i], failed ? -1 : length);
+
+        if (!failed) {
+            count_sent_packet(&net->stats, queue->data[i], length);
+        }
+    }
+}
+#endif
+
+int networking_flush(Networking_Core *net)
+{
+    int res = 0;
+#ifdef USE_SENDMMSG
+    Net_Send_Queue *queue = net->send_queue;
+
+    if (queue == nullptr) {
+        return 0;
+    }
+
+    uint32_t next = 0;
+
+    while (next < queue->count) {
+        const uint32_t num_msgs = prepare_send_queue_msgs(net, queue, next);
+        const int sent = sendmmsg(net->sock.socket, queue->msgs, num_msgs, 0);
+
+        if (sent < 0) {
+            const int error = net_error();
+
+            if (queue->msg_packets[0] > 1 && (error == EIO || error == EINVAL || error == ENOPROTOOPT)) {
+                /* The socket or device can't do segmentation offload after all. */
+                LOGGER_DEBUG(net->log, "UDP GSO failed (%d), sending datagrams individually", error);
+                net->udp_gso = false;
+                continue;
+            }
+
+            /* Same as a failed sendto: the datagram is dropped. */
+            log_sent_packets(net, queue, next, queue->msg_packets[0], true);
+            next += queue->msg_packets[0];
+            res = -1;
+            continue;
+        }
 
+        for (int i = 0; i < sent; ++i) {
+            log_sent_packets(net, queue, next, queue->msg_packets[i], false);
+            next += queue->msg_packets[i];
+        }
+    }
+
+    queue->count = 0;
+#endif
     return res;
 }
 
-/* Function to receive data
- *  ip and port of sender is put into ip_port.
- *  Packet data is put into data.
- *  Packet length is put into length.
+void networking_set_send_batching(Networking_Core *net, bool enabled)
+{
+#ifdef USE_SENDMMSG
+
+    if (!enabled) {
+        networking_flush(net);
+        free(net->send_queue);
+        net->send_queue = nullptr;
+        return;
+    }
+
+    if (net->send_queue != nullptr || net_family_is_unspec(net->family)) {
+        return;
+    }
+
+    Net_Send_Queue *queue = (Net_Send_Queue *)calloc(1, sizeof(Net_Send_Queue));
+
+    if (queue == nullptr) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < NET_SEND_QUEUE_SIZE; ++i) {
+        queue->iovecs[i].iov_base = queue->data[i];
+    }
+
+    net->send_queue = queue;
+    net->udp_gso = false;
+
+#ifdef USE_UDP_GSO
+    int gso_size = 0;
+    socklen_t optlen = sizeof(gso_size);
+    net->udp_gso = getsockopt(net->sock.socket, SOL_UDP, UDP_SEGMENT, &gso_size, &optlen) == 0;
+#endif
+
+    LOGGER_DEBUG(net->log, "UDP send batching enabled (GSO %s)", net->udp_gso ? "supported" : "not supported");
+#endif
+}
+
+/* Basic network functions:
+ * Function to send packet(data) of length length to ip_port.
  */
-static int receivepacket(const Logger *log, Socket sock, IP_Port *ip_port, uint8_t *data, uint32_t *length)
+int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
 {
-    memset(ip_port, 0, sizeof(IP_Port));
     struct sockaddr_storage addr;
-#ifdef OS_WIN32
-    int addrlen = sizeof(addr);
-#else
-    socklen_t addrlen = sizeof(addr);
-#endif
-    *length = 0;
-    int fail_or_len = recvfrom(sock.socket, (char *) data, MAX_UDP_PACKET_SIZE, 0, (struct sockaddr *)&addr, &addrlen);
+    size_t addrsize;
 
-    if (fail_or_len < 0) {
-        int error = net_error();
+    if (ip_port_to_sockaddr(net, &ip_port, length, &addr, &addrsize) == -1) {
+        return -1;
+    }
 
-        if (fail_or_len < 0 && error != TOX_EWOULDBLOCK) {
-            const char *strerror = net_new_strerror(error);
-            LOGGER_ERROR(log, "Unexpected error reading from socket: %u, %s", error, strerror);
-            net_kill_strerror(strerror);
+#ifdef USE_SENDMMSG
+    Net_Send_Queue *queue = net->send_queue;
+
+    if (queue != nullptr && length <= MAX_UDP_PACKET_SIZE) {
+        const uint32_t i = queue->count;
+
+        queue->ip_ports[i] = ip_port;
+        memcpy(&queue->addrs[i], &addr, addrsize);
+        queue->addrsizes[i] = addrsize;
+        memcpy(queue->data[i], data, length);
+        queue->iovecs[i].iov_len = length;
+        ++queue->count;
+
+        if (queue->count == NET_SEND_QUEUE_SIZE) {
+            networking_flush(net);
         }
 
-        return -1; /* Nothing received. */
+        /* Errors from the actual send are reported by networking_flush. */
+        return length;
     }
 
-    *length = (uint32_t)fail_or_len;
+    if (queue != nullptr) {
+        /* Oversized packet: keep the ordering with what's already queued. */
+        networking_flush(net);
+    }
+
+#endif
+
+    const int res = sendto(net->sock.socket, (const char *)data, length, 0, (struct sockaddr *)&addr, addrsize);
+
+    loglogdata(net->log, "O=>", data, length, ip_port, res);
+
+    if (res > 0) {
+        count_sent_packet(&net->stats, data, res);
+    }
 
-    if (addr.ss_family == AF_INET) {
-        struct sockaddr_in *addr_in = (struct sockaddr_in *)&addr;
+    return res;
+}
+
+/* Convert a socket address filled in by recvfrom/recvmmsg into an IP_Port.
+ * IPv4 addresses mapped into IPv6 are converted back into IPv4.
+ *
+ * return 0 on success.
+ * return -1 if the address family is unknown.
+ */
+static int ip_port_from_sockaddr(const struct sockaddr_storage *addr, IP_Port *ip_port)
+{
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *addr_in = (const struct sockaddr_in *)addr;
 
         const Family *const family = make_tox_family(addr_in->sin_family);
         assert(family != nullptr);
@@ -608,8 +898,8 @@ static int receivepacket(const Logger *log, Socket sock, IP_Port *ip_port, uint8
         ip_port->ip.family = *family;
         get_ip4(&ip_port->ip.ip.v4, &addr_in->sin_addr);
         ip_port->port = addr_in->sin_port;
-    } else if (addr.ss_family == AF_INET6) {
-        struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)&addr;
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *addr_in6 = (const struct sockaddr_in6 *)addr;
         const Family *const family = make_tox_family(addr_in6->sin6_family);
         assert(family != nullptr);
 
@@ -629,6 +919,44 @@ static int receivepacket(const Logger *log, Socket sock, IP_Port *ip_port, uint8
         return -1;
     }
 
+    return 0;
+}
+
+/* Function to receive data
+ *  ip and port of sender is put into ip_port.
+ *  Packet data is put into data.
+ *  Packet length is put into length.
+ */
+static int receivepacket(const Logger *log, Socket sock, IP_Port *ip_port, uint8_t *data, uint32_t *length)
+{
+    memset(ip_port, 0, sizeof(IP_Port));
+    struct sockaddr_storage addr;
+#ifdef OS_WIN32
+    int addrlen = sizeof(addr);
+#else
+    socklen_t addrlen = sizeof(addr);
+#endif
+    *length = 0;
+    int fail_or_len = recvfrom(sock.socket, (char *) data, MAX_UDP_PACKET_SIZE, 0, (struct sockaddr *)&addr, &addrlen);
+
+    if (fail_or_len < 0) {
+        int error = net_error();
+
+        if (fail_or_len < 0 && error != TOX_EWOULDBLOCK) {
+            const char *strerror = net_new_strerror(error);
+            LOGGER_ERROR(log, "Unexpected error reading from socket: %u, %s", error, strerror);
+            net_kill_strerror(strerror);
+        }
+
+        return -1; /* Nothing received. */
+    }
+
+    *length = (uint32_t)fail_or_len;
+
+    if (ip_port_from_sockaddr(&addr, ip_port) == -1) {
+        return -1;
+    }
+
     loglogdata(log, "=>O", data, MAX_UDP_PACKET_SIZE, *ip_port, *length);
 
     return 0;
@@ -640,6 +968,109 @@ void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handl
     net->packethandlers[byte].object = object;
 }
 
+static void handle_received_packet(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint32_t length,
+                                   void *userdata)
+{
+    if (length < 1) {
+        return;
+    }
+
+    ++net->stats.packets_recv[data[0]];
+    net->stats.bytes_recv[data[0]] += length;
+
+    if (!(net->packethandlers[data[0]].function)) {
+        LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
+        return;
+    }
+
+    net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+}
+
+#ifdef USE_RECVMMSG
+/* Receive and handle all pending packets, up to NET_RECV_BATCH_SIZE per
+ * syscall.
+ *
+ * return true if the socket was drained.
+ * return false if recvmmsg is not supported, in which case nothing was received.
+ */
+static bool receivepackets_batched(Networking_Core *net, void *userdata)
+{
+    Net_Recv_Batch *batch = net->recv_batch;
+
+    while (true) {
+        for (uint32_t i = 0; i < NET_RECV_BATCH_SIZE; ++i) {
+            batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+        }
+
+        const int count = recvmmsg(net->sock.socket, batch->msgs, NET_RECV_BATCH_SIZE, 0, nullptr);
+
+        if (count < 0) {
+            const int error = net_error();
+
+            if (error == ENOSYS || error == EOPNOTSUPP) {
+                return false;
+            }
+
+            if (error != TOX_EWOULDBLOCK) {
+                const char *strerror = net_new_strerror(error);
+                LOGGER_ERROR(net->log, "Unexpected error reading from socket: %u, %s", error, strerror);
+                net_kill_strerror(strerror);
+            }
+
+            return true;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            IP_Port ip_port = {{{0}}};
+
+            if (ip_port_from_sockaddr(&batch->addrs[i], &ip_port) == -1) {
+                continue;
+            }
+
+            const uint32_t length = batch->msgs[i].msg_len;
+            loglogdata(net->log, "=>O", batch->data[i], MAX_UDP_PACKET_SIZE, ip_port, length);
+            handle_received_packet(net, ip_port, batch->data[i], length, userdata);
+        }
+
+        if (count < NET_RECV_BATCH_SIZE) {
+            return true;
+        }
+    }
+}
+#endif
+
+void networking_set_recv_batching(Networking_Core *net, bool enabled)
+{
+#ifdef USE_RECVMMSG
+
+    if (!enabled) {
+        free(net->recv_batch);
+        net->recv_batch = nullptr;
+        return;
+    }
+
+    if (net->recv_batch != nullptr) {
+        return;
+    }
+
+    Net_Recv_Batch *batch = (Net_Recv_Batch *)calloc(1, sizeof(Net_Recv_Batch));
+
+    if (batch == nullptr) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < NET_RECV_BATCH_SIZE; ++i) {
+        batch->iovecs[i].iov_base = batch->data[i];
+        batch->iovecs[i].iov_len = MAX_UDP_PACKET_SIZE;
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovecs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+    }
+
+    net->recv_batch = batch;
+#endif
+}
+
 void networking_poll(Networking_Core *net, void *userdata)
 {
     if (net_family_is_unspec(net->family)) {
@@ -647,21 +1078,26 @@ void networking_poll(Networking_Core *net, void *userdata)
         return;
     }
 
+#ifdef USE_RECVMMSG
+
+    if (net->recv_batch != nullptr) {
+        if (receivepackets_batched(net, userdata)) {
+            return;
+        }
+
+        /* Kernel without recvmmsg support: fall back to recvfrom for good. */
+        LOGGER_DEBUG(net->log, "recvmmsg not supported, falling back to recvfrom");
+        networking_set_recv_batching(net, false);
+    }
+
+#endif
+
     IP_Port ip_port;
     uint8_t data[MAX_UDP_PACKET_SIZE];
     uint32_t length;
 
     while (receivepacket(net->log, net->sock, &ip_port, data, &length) != -1) {
-        if (length < 1) {
-            continue;
-        }
-
-        if (!(net->packethandlers[data[0]].function)) {
-            LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
-            continue;
-        }
-
-        net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+        handle_received_packet(net, ip_port, data, length, userdata);
     }
 }
 
@@ -927,6 +1363,8 @@ Networking_Core *new_networking_ex(const Logger *log, IP ip, uint16_t port_from,
                 *error = 0;
             }
 
+            networking_set_recv_batching(temp, true);
+
             return temp;
         }
 
@@ -980,10 +1418,13 @@ void kill_networking(Networking_Core *net)
     }
 
     if (!net_family_is_unspec(net->family)) {
-        /* Socket is initialized, so we close it. */
+        /* Send whatever is still queued, then close the socket. */
+        networking_flush(net);
         kill_sock(net->sock);
     }
 
+    free(net->send_queue);
+    free(net->recv_batch);
     free(net);
 }
 
@@ -1449,6 +1890,43 @@ int net_send(Socket sock, const void *buf, size_t len)
     return send(sock.socket, (const char *)buf, len, MSG_NOSIGNAL);
 }
 
+int net_sendv(Socket sock, const Net_Send_Buffer *bufs, uint32_t count)
+{
+    if (count > NET_SENDV_MAX_BUFFERS) {
+        count = NET_SENDV_MAX_BUFFERS;
+    }
+
+#ifdef OS_WIN32
+    WSABUF wsa_bufs[NET_SENDV_MAX_BUFFERS];
+
+    for (uint32_t i = 0; i < count; ++i) {
+        wsa_bufs[i].buf = (char *)bufs[i].data;
+        wsa_bufs[i].len = (ULONG)bufs[i].length;
+    }
+
+    DWORD sent = 0;
+
+    if (WSASend(sock.socket, wsa_bufs, count, &sent, 0, nullptr, nullptr) != 0) {
+        return -1;
+    }
+
+    return (int)sent;
+#else
+    struct iovec iov[NET_SENDV_MAX_BUFFERS];
+
+    for (uint32_t i = 0; i < count; ++i) {
+        iov[i].iov_base = (void *)bufs[i].data;
+        iov[i].iov_len = bufs[i].length;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    return sendmsg(sock.socket, &msg, MSG_NOSIGNAL);
+#endif
+}
+
 int net_recv(Socket sock, void *buf, size_t len)
 {
     return recv(sock.socket, (char *)buf, len, MSG_NOSIGNAL);
@@ -62,6 +62,22 @@ extern const Socket net_invalid_socket;
  * Calls send(sockfd, buf, len, MSG_NOSIGNAL).
  */
 int net_send(Socket sock, const void *buf, size_t len);
+
+/* Maximum number of buffers net_sendv sends at once. */
+#define NET_SENDV_MAX_BUFFERS 4
+
+typedef struct Net_Send_Buffer {
+    const void *data;
+    size_t length;
+} Net_Send_Buffer;
+
+/**
+ * Sends count buffers in order with a single sendmsg(sockfd, ..., MSG_NOSIGNAL)
+ * (WSASend on Windows). Buffers past NET_SENDV_MAX_BUFFERS are not sent.
+ *
+ * @return the number of bytes sent, or -1 on failure.
+ */
+int net_sendv(Socket sock, const Net_Send_Buffer *bufs, uint32_t count);
 /**
  * Calls recv(sockfd, buf, len, MSG_NOSIGNAL).
  */
@@ -322,6 +338,8 @@ typedef struct Networking_Core Networking_Core;
 
 Family net_family(const Networking_Core *net);
 uint16_t net_port(const Networking_Core *net);
+/* Our UDP socket, or net_invalid_socket if UDP is disabled. */
+Socket net_sock(const Networking_Core *net);
 
 /* Run this before creating sockets.
  *
@@ -364,15 +382,60 @@ bool set_socket_dualstack(Socket sock);
 
 /* Basic network functions: */
 
-/* Function to send packet(data) of length length to ip_port. */
+/* Function to send packet(data) of length length to ip_port.
+ *
+ * With send batching enabled the packet is only queued and the return value
+ * is the packet length unless the destination is invalid. Packets that fail
+ * to send later are reported by networking_flush and left out of the sent
+ * packet counts in Net_Stats.
+ */
 int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length);
 
+/**
+ * Enable or disable queueing of outgoing UDP packets.
+ *
+ * While enabled, sendpacket copies packets into a queue which is sent with as
+ * few syscalls as possible (Linux sendmmsg, with UDP GSO if the kernel
+ * supports it) by networking_flush or when the queue is full. The owner of the
+ * Networking_Core must call networking_flush at the end of each iteration.
+ * Disabling flushes the queue. Does nothing on platforms without sendmmsg.
+ */
+void networking_set_send_batching(Networking_Core *net, bool enabled);
+
+/* Send all packets queued by sendpacket, in the order they were queued.
+ *
+ * return 0 if all packets were sent (or nothing was queued).
+ * return -1 if at least one packet was dropped.
+ */
+int networking_flush(Networking_Core *net);
+
 /* Function to call when packet beginning with byte is received. */
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_cb *cb, void *object);
 
 /* Call this several times a second. */
 void networking_poll(Networking_Core *net, void *userdata);
 
+/**
+ * Enable or disable reading several datagrams per syscall in networking_poll.
+ *
+ * Batching is enabled by default on platforms that support it (Linux
+ * recvmmsg) and silently falls back to one recvfrom per datagram otherwise.
+ */
+void networking_set_recv_batching(Networking_Core *net, bool enabled);
+
+/* UDP packets and bytes received and sent, by packet id (the first byte).
+ * Received packets are counted whether or not they have a handler, sent ones
+ * once the kernel took them.
+ */
+typedef struct Net_Stats {
+    uint64_t packets_recv[256];
+    uint64_t bytes_recv[256];
+    uint64_t packets_sent[256];
+    uint64_t bytes_sent[256];
+} Net_Stats;
+
+const Net_Stats *networking_get_stats(const Networking_Core *net);
+
 /* Connect a socket to the address specified by the ip_port. */
 int net_connect(Socket sock, IP_Port ip_port);
 
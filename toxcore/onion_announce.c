@@ -26,33 +26,59 @@
 #define DATA_REQUEST_MIN_SIZE ONION_DATA_REQUEST_MIN_SIZE
 #define DATA_REQUEST_MIN_SIZE_RECV (DATA_REQUEST_MIN_SIZE + ONION_RETURN_3)
 
+#define ENTRY_NONE UINT32_MAX
+
 typedef struct Onion_Announce_Entry {
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
     IP_Port ret_ip_port;
     uint8_t ret[ONION_RETURN_3];
     uint8_t data_public_key[CRYPTO_PUBLIC_KEY_SIZE];
     uint64_t time;
+    /* Slots of the entries announced right before and after this one. Unused
+     * slots are linked through newer. */
+    uint32_t older;
+    uint32_t newer;
 } Onion_Announce_Entry;
 
 struct Onion_Announce {
     Mono_Time *mono_time;
     DHT     *dht;
     Networking_Core *net;
-    Onion_Announce_Entry entries[ONION_ANNOUNCE_MAX_ENTRIES];
+
+    /* Stored entries, by slot. sorted holds the slots of the stored entries
+     * from the closest to base_public_key to the farthest, so finding a public
+     * key is a binary search and the entry to evict is the last one. oldest and
+     * newest are the ends of the list of stored entries in the order they were
+     * announced in, so the timed out ones are found first. */
+    Onion_Announce_Entry *entries;
+    uint32_t *sorted;
+    uint32_t capacity;
+    uint32_t num_entries;
+    uint32_t oldest;
+    uint32_t newest;
+    uint32_t free_slot;
+    /* Our DHT public key when the entries were sorted. */
+    uint8_t base_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+
     /* This is CRYPTO_SYMMETRIC_KEY_SIZE long just so we can use new_symmetric_key() to fill it */
     uint8_t secret_bytes[CRYPTO_SYMMETRIC_KEY_SIZE];
 
-    Shared_Keys shared_keys_recv;
+    Shared_Keys *shared_keys_recv;
 };
 
-uint8_t *onion_announce_entry_public_key(Onion_Announce *onion_a, uint32_t entry)
+uint32_t onion_announce_num_entries(const Onion_Announce *onion_a)
 {
-    return onion_a->entries[entry].public_key;
-}
+    uint32_t count = onion_a->num_entries;
 
-void onion_announce_entry_set_time(Onion_Announce *onion_a, uint32_t entry, uint64_t time)
-{
-    onion_a->entries[entry].time = time;
+    for (uint32_t slot = onion_a->oldest; slot != ENTRY_NONE; slot = onion_a->entries[slot].newer) {
+        if (!mono_time_is_timeout(onion_a->mono_time, onion_a->entries[slot].time, ONION_ANNOUNCE_TIMEOUT)) {
+            break;
+        }
+
+        --count;
+    }
+
+    return count;
 }
 
 /* Create an onion announce request packet in packet of max_packet_length (recommended size ONION_ANNOUNCE_REQUEST_SIZE).
@@ -232,127 +258,276 @@ static void generate_ping_id(const Onion_Announce *onion_a, uint64_t time, const
     crypto_sha256(ping_id, data, sizeof(data));
 }
 
-/* check if public key is in entries list
+/* Find public_key in the sorted entries with a binary search. The distance to
+ * base_public_key is different for every public key, so it orders them fully.
  *
- * return -1 if no
- * return position in list if yes
+ * return true with its position in pos if it is stored.
+ * return false with the position to insert it at in pos if it isn't.
  */
-static int in_entries(const Onion_Announce *onion_a, const uint8_t *public_key)
+static bool find_sorted(const Onion_Announce *onion_a, const uint8_t *public_key, uint32_t *pos)
 {
-    unsigned int i;
+    uint32_t low = 0;
+    uint32_t high = onion_a->num_entries;
+
+    while (low < high) {
+        const uint32_t mid = low + (high - low) / 2;
+        const int closest = id_closest(onion_a->base_public_key, public_key,
+                                       onion_a->entries[onion_a->sorted[mid]].public_key);
 
-    for (i = 0; i < ONION_ANNOUNCE_MAX_ENTRIES; ++i) {
-        if (!mono_time_is_timeout(onion_a->mono_time, onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT)
-                && public_key_cmp(onion_a->entries[i].public_key, public_key) == 0) {
-            return i;
+        if (closest == 0) {
+            *pos = mid;
+            return true;
+        }
+
+        if (closest == 1) {
+            high = mid;
+        } else {
+            low = mid + 1;
         }
     }
 
-    return -1;
+    *pos = low;
+    return false;
 }
 
-typedef struct Cmp_data {
-    const Mono_Time *mono_time;
-    const uint8_t *base_public_key;
-    Onion_Announce_Entry entry;
-} Cmp_data;
+static void insert_sorted(Onion_Announce *onion_a, uint32_t pos, uint32_t slot)
+{
+    memmove(&onion_a->sorted[pos + 1], &onion_a->sorted[pos], (onion_a->num_entries - pos) * sizeof(uint32_t));
+    onion_a->sorted[pos] = slot;
+    ++onion_a->num_entries;
+}
 
-static int cmp_entry(const void *a, const void *b)
+static void link_newest(Onion_Announce *onion_a, uint32_t slot)
 {
-    Cmp_data cmp1;
-    Cmp_data cmp2;
-    memcpy(&cmp1, a, sizeof(Cmp_data));
-    memcpy(&cmp2, b, sizeof(Cmp_data));
-    Onion_Announce_Entry entry1 = cmp1.entry;
-    Onion_Announce_Entry entry2 = cmp2.entry;
-    const uint8_t *cmp_public_key = cmp1.base_public_key;
+    Onion_Announce_Entry *const entry = &onion_a->entries[slot];
+    entry->older = onion_a->newest;
+    entry->newer = ENTRY_NONE;
 
-    int t1 = mono_time_is_timeout(cmp1.mono_time, entry1.time, ONION_ANNOUNCE_TIMEOUT);
-    int t2 = mono_time_is_timeout(cmp1.mono_time, entry2.time, ONION_ANNOUNCE_TIMEOUT);
+    if (onion_a->newest != ENTRY_NONE) {
+        onion_a->entries[onion_a->newest].newer = slot;
+    } else {
+        onion_a->oldest = slot;
+    }
 
-    if (t1 && t2) {
-        return 0;
+    onion_a->newest = slot;
+}
+
+static void unlink_entry(Onion_Announce *onion_a, uint32_t slot)
+{
+    const Onion_Announce_Entry *const entry = &onion_a->entries[slot];
+
+    if (entry->older != ENTRY_NONE) {
+        onion_a->entries[entry->older].newer = entry->newer;
+    } else {
+        onion_a->oldest = entry->newer;
     }
 
-    if (t1) {
-        return -1;
+    if (entry->newer != ENTRY_NONE) {
+        onion_a->entries[entry->newer].older = entry->older;
+    } else {
+        onion_a->newest = entry->older;
     }
+}
 
-    if (t2) {
-        return 1;
+/* Remove the entry at position pos of the sorted entries and free its slot.
+ */
+static void remove_entry(Onion_Announce *onion_a, uint32_t pos)
+{
+    const uint32_t slot = onion_a->sorted[pos];
+    --onion_a->num_entries;
+    memmove(&onion_a->sorted[pos], &onion_a->sorted[pos + 1], (onion_a->num_entries - pos) * sizeof(uint32_t));
+
+    unlink_entry(onion_a, slot);
+    onion_a->entries[slot].newer = onion_a->free_slot;
+    onion_a->free_slot = slot;
+}
+
+/* Remove the timed out entries, which are the oldest ones.
+ */
+static void remove_timed_out(Onion_Announce *onion_a)
+{
+    while (onion_a->oldest != ENTRY_NONE) {
+        const Onion_Announce_Entry *const entry = &onion_a->entries[onion_a->oldest];
+
+        if (!mono_time_is_timeout(onion_a->mono_time, entry->time, ONION_ANNOUNCE_TIMEOUT)) {
+            break;
+        }
+
+        uint32_t pos;
+
+        if (!find_sorted(onion_a, entry->public_key, &pos)) {
+            // Can't happen: every stored entry is sorted.
+            break;
+        }
+
+        remove_entry(onion_a, pos);
     }
+}
 
-    int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
+/* Sort the entries again if our DHT public key changed since they were sorted.
+ */
+static void update_base_public_key(Onion_Announce *onion_a)
+{
+    const uint8_t *const self_public_key = dht_get_self_public_key(onion_a->dht);
 
-    if (close == 1) {
-        return 1;
+    if (public_key_cmp(onion_a->base_public_key, self_public_key) == 0) {
+        return;
     }
 
-    if (close == 2) {
-        return -1;
+    memcpy(onion_a->base_public_key, self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    onion_a->num_entries = 0;
+
+    for (uint32_t slot = onion_a->oldest; slot != ENTRY_NONE; slot = onion_a->entries[slot].newer) {
+        uint32_t pos;
+        find_sorted(onion_a, onion_a->entries[slot].public_key, &pos);
+        insert_sorted(onion_a, pos, slot);
     }
+}
 
-    return 0;
+/* Make entries and sorted, with room for capacity entries, the empty store.
+ */
+static void init_entries(Onion_Announce *onion_a, Onion_Announce_Entry *entries, uint32_t *sorted, uint32_t capacity)
+{
+    for (uint32_t i = 0; i < capacity; ++i) {
+        entries[i].newer = i + 1 < capacity ? i + 1 : ENTRY_NONE;
+    }
+
+    onion_a->entries = entries;
+    onion_a->sorted = sorted;
+    onion_a->capacity = capacity;
+    onion_a->num_entries = 0;
+    onion_a->oldest = ENTRY_NONE;
+    onion_a->newest = ENTRY_NONE;
+    onion_a->free_slot = 0;
+    memcpy(onion_a->base_public_key, dht_get_self_public_key(onion_a->dht), CRYPTO_PUBLIC_KEY_SIZE);
 }
 
-static void sort_onion_announce_list(Onion_Announce_Entry *list, unsigned int length, const Mono_Time *mono_time,
-                                     const uint8_t *comp_public_key)
+/* check if public key is in entries list
+ *
+ * return -1 if no
+ * return slot of its entry if yes
+ */
+static int in_entries(const Onion_Announce *onion_a, const uint8_t *public_key)
 {
-    // Pass comp_public_key to qsort with each Client_data entry, so the
-    // comparison function can use it as the base of comparison.
-    VLA(Cmp_data, cmp_list, length);
+    uint32_t pos;
 
-    for (uint32_t i = 0; i < length; ++i) {
-        cmp_list[i].mono_time = mono_time;
-        cmp_list[i].base_public_key = comp_public_key;
-        cmp_list[i].entry = list[i];
+    if (!find_sorted(onion_a, public_key, &pos)) {
+        return -1;
     }
 
-    qsort(cmp_list, length, sizeof(Cmp_data), cmp_entry);
+    const uint32_t slot = onion_a->sorted[pos];
+
+    if (mono_time_is_timeout(onion_a->mono_time, onion_a->entries[slot].time, ONION_ANNOUNCE_TIMEOUT)) {
+        return -1;
+    }
+
+    return slot;
+}
+
+/* Store an entry, replacing the one with the same public key. If the store is
+ * full, the farthest entry from our DHT public key is evicted for it, but only
+ * if it is closer than that.
+ *
+ * return -1 if failure
+ * return slot of the entry if stored
+ */
+static int store_entry(Onion_Announce *onion_a, const uint8_t *public_key, IP_Port ret_ip_port, const uint8_t *ret,
+                       const uint8_t *data_public_key, uint64_t time)
+{
+    uint32_t pos;
+    uint32_t slot;
+
+    if (find_sorted(onion_a, public_key, &pos)) {
+        slot = onion_a->sorted[pos];
+        unlink_entry(onion_a, slot);
+    } else {
+        if (onion_a->num_entries == onion_a->capacity) {
+            if (pos == onion_a->num_entries) {
+                return -1;
+            }
 
-    for (uint32_t i = 0; i < length; ++i) {
-        list[i] = cmp_list[i].entry;
+            remove_entry(onion_a, onion_a->num_entries - 1);
+        }
+
+        slot = onion_a->free_slot;
+        onion_a->free_slot = onion_a->entries[slot].newer;
+        insert_sorted(onion_a, pos, slot);
     }
+
+    Onion_Announce_Entry *const entry = &onion_a->entries[slot];
+    memcpy(entry->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    entry->ret_ip_port = ret_ip_port;
+    memcpy(entry->ret, ret, ONION_RETURN_3);
+    memcpy(entry->data_public_key, data_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    entry->time = time;
+    link_newest(onion_a, slot);
+
+    return slot;
 }
 
 /* add entry to entries list
  *
  * return -1 if failure
- * return position if added
+ * return slot of the entry if added
  */
 static int add_to_entries(Onion_Announce *onion_a, IP_Port ret_ip_port, const uint8_t *public_key,
                           const uint8_t *data_public_key, const uint8_t *ret)
 {
+    update_base_public_key(onion_a);
+    remove_timed_out(onion_a);
+    return store_entry(onion_a, public_key, ret_ip_port, ret, data_public_key, mono_time_get(onion_a->mono_time));
+}
 
-    int pos = in_entries(onion_a, public_key);
-
-    if (pos == -1) {
-        for (unsigned i = 0; i < ONION_ANNOUNCE_MAX_ENTRIES; ++i) {
-            if (mono_time_is_timeout(onion_a->mono_time, onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT)) {
-                pos = i;
-            }
-        }
+const uint8_t *onion_announce_entry_public_key(const Onion_Announce *onion_a, uint32_t entry)
+{
+    if (entry >= onion_a->num_entries) {
+        return nullptr;
     }
 
-    if (pos == -1) {
-        if (id_closest(dht_get_self_public_key(onion_a->dht), public_key, onion_a->entries[0].public_key) == 1) {
-            pos = 0;
-        }
+    return onion_a->entries[onion_a->sorted[entry]].public_key;
+}
+
+bool onion_announce_add_entry(Onion_Announce *onion_a, const uint8_t *public_key)
+{
+    IP_Port ret_ip_port = {{{0}}};
+    const uint8_t ret[ONION_RETURN_3] = {0};
+    return add_to_entries(onion_a, ret_ip_port, public_key, public_key, ret) != -1;
+}
+
+bool onion_announce_set_capacity(Onion_Announce *onion_a, uint32_t capacity)
+{
+    if (capacity == 0 || capacity > UINT32_MAX / sizeof(Onion_Announce_Entry)) {
+        return false;
     }
 
-    if (pos == -1) {
-        return -1;
+    Onion_Announce_Entry *const entries = (Onion_Announce_Entry *)calloc(capacity, sizeof(Onion_Announce_Entry));
+    uint32_t *const sorted = (uint32_t *)calloc(capacity, sizeof(uint32_t));
+
+    if (entries == nullptr || sorted == nullptr) {
+        free(sorted);
+        free(entries);
+        return false;
     }
 
-    memcpy(onion_a->entries[pos].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    onion_a->entries[pos].ret_ip_port = ret_ip_port;
-    memcpy(onion_a->entries[pos].ret, ret, ONION_RETURN_3);
-    memcpy(onion_a->entries[pos].data_public_key, data_public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    onion_a->entries[pos].time = mono_time_get(onion_a->mono_time);
+    Onion_Announce_Entry *const old_entries = onion_a->entries;
+    uint32_t *const old_sorted = onion_a->sorted;
+    const uint32_t old_oldest = onion_a->oldest;
 
-    sort_onion_announce_list(onion_a->entries, ONION_ANNOUNCE_MAX_ENTRIES, onion_a->mono_time,
-                             dht_get_self_public_key(onion_a->dht));
-    return in_entries(onion_a, public_key);
+    init_entries(onion_a, entries, sorted, capacity);
+
+    /* Store the entries again in the order they were announced in, so the
+     * farthest ones are evicted if they don't all fit. */
+    for (uint32_t slot = old_oldest; slot != ENTRY_NONE; slot = old_entries[slot].newer) {
+        const Onion_Announce_Entry *const entry = &old_entries[slot];
+
+        if (!mono_time_is_timeout(onion_a->mono_time, entry->time, ONION_ANNOUNCE_TIMEOUT)) {
+            store_entry(onion_a, entry->public_key, entry->ret_ip_port, entry->ret, entry->data_public_key, entry->time);
+        }
+    }
+
+    free(old_sorted);
+    free(old_entries);
+    return true;
 }
 
 static int handle_announce_request(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
@@ -365,8 +540,7 @@ static int handle_announce_request(void *object, IP_Port source, const uint8_t *
 
     const uint8_t *packet_public_key = packet + 1 + CRYPTO_NONCE_SIZE;
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(onion_a->mono_time, &onion_a->shared_keys_recv, shared_key, dht_get_self_secret_key(onion_a->dht),
-                   packet_public_key);
+    get_shared_key(onion_a->shared_keys_recv, shared_key, dht_get_self_secret_key(onion_a->dht), packet_public_key);
 
     uint8_t plain[ONION_PING_ID_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_PUBLIC_KEY_SIZE +
                                      ONION_ANNOUNCE_SENDBACK_DATA_LENGTH];
@@ -502,6 +676,21 @@ Onion_Announce *new_onion_announce(Mono_Time *mono_time, DHT *dht)
     onion_a->net = dht_get_net(dht);
     new_symmetric_key(onion_a->secret_bytes);
 
+    onion_a->shared_keys_recv = shared_keys_new(SHARED_KEYS_DEFAULT_CAPACITY);
+
+    if (onion_a->shared_keys_recv == nullptr) {
+        free(onion_a);
+        return nullptr;
+    }
+
+    init_entries(onion_a, nullptr, nullptr, 0);
+
+    if (!onion_announce_set_capacity(onion_a, ONION_ANNOUNCE_MAX_ENTRIES)) {
+        shared_keys_free(onion_a->shared_keys_recv);
+        free(onion_a);
+        return nullptr;
+    }
+
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, &handle_announce_request, onion_a);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, &handle_data_request, onion_a);
 
@@ -516,5 +705,8 @@ void kill_onion_announce(Onion_Announce *onion_a)
 
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, nullptr, nullptr);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, nullptr, nullptr);
+    shared_keys_free(onion_a->shared_keys_recv);
+    free(onion_a->sorted);
+    free(onion_a->entries);
     free(onion_a);
 }
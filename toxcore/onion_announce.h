@@ -11,6 +11,7 @@
 
 #include "onion.h"
 
+/* Number of announced nodes stored, unless set with onion_announce_set_capacity. */
 #define ONION_ANNOUNCE_MAX_ENTRIES 160
 #define ONION_ANNOUNCE_TIMEOUT 300
 #define ONION_PING_ID_SIZE CRYPTO_SHA256_SIZE
@@ -34,8 +35,15 @@
 typedef struct Onion_Announce Onion_Announce;
 
 /* These two are not public; they are for tests only! */
-uint8_t *onion_announce_entry_public_key(Onion_Announce *onion_a, uint32_t entry);
-void onion_announce_entry_set_time(Onion_Announce *onion_a, uint32_t entry, uint64_t time);
+/* return the public key of the stored node that is the entry-th closest to our
+ * DHT public key, or NULL if fewer nodes are stored. */
+const uint8_t *onion_announce_entry_public_key(const Onion_Announce *onion_a, uint32_t entry);
+/* Store public_key as if it announced itself with a valid ping id.
+ * return true if it was stored. */
+bool onion_announce_add_entry(Onion_Announce *onion_a, const uint8_t *public_key);
+
+/* return the number of announced nodes stored that are not timed out. */
+uint32_t onion_announce_num_entries(const Onion_Announce *onion_a);
 
 /* Create an onion announce request packet in packet of max_packet_length (recommended size ONION_ANNOUNCE_REQUEST_SIZE).
  *
@@ -105,6 +113,20 @@ int send_data_request(Networking_Core *net, const Onion_Path *path, IP_Port dest
                       const uint8_t *encrypt_public_key, const uint8_t *nonce, const uint8_t *data, uint16_t length);
 
 
+/* Set the number of announced nodes that can be stored. When it is full, a node
+ * announcing itself replaces the stored node farthest from our DHT public key
+ * if it is closer than that. Shrinking it keeps the closest nodes.
+ *
+ * Finding a node is a binary search, and storing or evicting one moves at most
+ * a 4 byte index per stored node, so a large capacity costs little besides
+ * memory.
+ *
+ * return true on success.
+ * return false if capacity is 0 or memory allocation failed, in which case the
+ *   stored nodes are kept as they were.
+ */
+bool onion_announce_set_capacity(Onion_Announce *onion_a, uint32_t capacity);
+
 Onion_Announce *new_onion_announce(Mono_Time *mono_time, DHT *dht);
 
 void kill_onion_announce(Onion_Announce *onion_a);
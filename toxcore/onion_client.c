@@ -249,6 +249,26 @@ uint16_t onion_backup_nodes(const Onion_Client *onion_c, Node_format *nodes, uin
     return i;
 }
 
+/* Return the round trip time of our DHT requests to node to order path nodes
+ * by, the fastest first and the ones that were never measured last.
+ */
+static uint32_t path_node_rtt_rank(const Onion_Client *onion_c, const Node_format *node)
+{
+    const uint32_t rtt = dht_node_rtt(onion_c->dht, node->public_key, &node->ip_port);
+    return rtt == 0 ? UINT32_MAX : rtt;
+}
+
+/* Return one of the first num_nodes nodes in path_nodes: the faster of two
+ * random ones, so that paths prefer fast nodes but still use all of them.
+ */
+static Node_format random_path_node(const Onion_Client *onion_c, const Node_format *path_nodes, uint16_t num_nodes)
+{
+    const Node_format *const node1 = &path_nodes[random_u32() % num_nodes];
+    const Node_format *const node2 = &path_nodes[random_u32() % num_nodes];
+
+    return path_node_rtt_rank(onion_c, node2) < path_node_rtt_rank(onion_c, node1) ? *node2 : *node1;
+}
+
 /* Put up to max_num random nodes in nodes.
  *
  * return the number of nodes.
@@ -270,7 +290,7 @@ static uint16_t random_nodes_path_onion(const Onion_Client *onion_c, Node_format
         }
 
         for (i = 0; i < max_num; ++i) {
-            nodes[i] = onion_c->path_nodes[random_u32() % num_nodes];
+            nodes[i] = random_path_node(onion_c, onion_c->path_nodes, num_nodes);
         }
     } else {
         int random_tcp = get_random_tcp_con_number(onion_c->c);
@@ -284,7 +304,7 @@ static uint16_t random_nodes_path_onion(const Onion_Client *onion_c, Node_format
             nodes[0].ip_port.ip.ip.v4.uint32 = random_tcp;
 
             for (i = 1; i < max_num; ++i) {
-                nodes[i] = onion_c->path_nodes[random_u32() % num_nodes];
+                nodes[i] = random_path_node(onion_c, onion_c->path_nodes, num_nodes);
             }
         } else {
             const uint16_t num_nodes_bs = min_u16(onion_c->path_nodes_index_bs, MAX_PATH_NODES);
@@ -297,7 +317,7 @@ static uint16_t random_nodes_path_onion(const Onion_Client *onion_c, Node_format
             nodes[0].ip_port.ip.ip.v4.uint32 = random_tcp;
 
             for (i = 1; i < max_num; ++i) {
-                nodes[i] = onion_c->path_nodes_bs[random_u32() % num_nodes_bs];
+                nodes[i] = random_path_node(onion_c, onion_c->path_nodes_bs, num_nodes_bs);
             }
         }
     }
@@ -43,7 +43,8 @@ struct Ping {
 
 #define PING_PLAIN_SIZE (1 + sizeof(uint64_t))
 #define DHT_PING_SIZE (1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + PING_PLAIN_SIZE + CRYPTO_MAC_SIZE)
-#define PING_DATA_SIZE (CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port))
+/* Public key and address of the pinged node, and the time in milliseconds we pinged it at. */
+#define PING_DATA_SIZE (CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint64_t))
 
 int32_t ping_send_request(Ping *ping, IP_Port ipp, const uint8_t *public_key)
 {
@@ -63,6 +64,8 @@ int32_t ping_send_request(Ping *ping, IP_Port ipp, const uint8_t *public_key)
     uint8_t data[PING_DATA_SIZE];
     id_copy(data, public_key);
     memcpy(data + CRYPTO_PUBLIC_KEY_SIZE, &ipp, sizeof(IP_Port));
+    const uint64_t sent_time = dht_request_time(ping->dht);
+    memcpy(data + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port), &sent_time, sizeof(sent_time));
     ping_id = ping_array_add(ping->ping_array, ping->mono_time, data, sizeof(data));
 
     if (ping_id == 0) {
@@ -219,7 +222,9 @@ static int handle_ping_response(void *object, IP_Port source, const uint8_t *pac
         return 1;
     }
 
-    addto_lists(dht, source, packet + 1);
+    uint64_t sent_time;
+    memcpy(&sent_time, data + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port), sizeof(sent_time));
+    addto_lists_answered(dht, source, packet + 1, sent_time);
     return 0;
 }
 
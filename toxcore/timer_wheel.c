@@ -0,0 +1,223 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/*
+ * Hierarchical timer wheel with one timer per id.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "timer_wheel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ccompat.h"
+
+/* Marks the end of a list and entries that aren't on any. */
+#define TIMER_WHEEL_NONE UINT32_MAX
+#define TIMER_WHEEL_UNSET UINT16_MAX
+
+/* The list of timers that expired and wait for their callback. */
+#define TIMER_WHEEL_EXPIRED (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)
+
+/* Number of ticks the second level covers. Timers further in the future are
+ * parked in the second level slot that comes up last and put back in place
+ * when it does.
+ */
+#define TIMER_WHEEL_SPAN ((uint64_t)TIMER_WHEEL_SLOTS * TIMER_WHEEL_SLOTS)
+
+static void list_push(Timer_Wheel *wheel, uint16_t list, uint32_t id)
+{
+    Timer_Wheel_Entry *const entry = &wheel->entries[id];
+    entry->list = list;
+    entry->prev = TIMER_WHEEL_NONE;
+    entry->next = wheel->heads[list];
+
+    if (entry->next != TIMER_WHEEL_NONE) {
+        wheel->entries[entry->next].prev = id;
+    }
+
+    wheel->heads[list] = id;
+}
+
+static void list_remove(Timer_Wheel *wheel, uint32_t id)
+{
+    Timer_Wheel_Entry *const entry = &wheel->entries[id];
+
+    if (entry->prev != TIMER_WHEEL_NONE) {
+        wheel->entries[entry->prev].next = entry->next;
+    } else {
+        wheel->heads[entry->list] = entry->next;
+    }
+
+    if (entry->next != TIMER_WHEEL_NONE) {
+        wheel->entries[entry->next].prev = entry->prev;
+    }
+
+    entry->list = TIMER_WHEEL_UNSET;
+}
+
+/* Put a timer on the list of the slot its deadline falls into. The deadline
+ * must be after the wheel's time.
+ */
+static void schedule(Timer_Wheel *wheel, uint32_t id)
+{
+    const uint64_t deadline = wheel->entries[id].deadline;
+    const uint64_t delta = deadline - wheel->time;
+
+    if (delta < TIMER_WHEEL_SLOTS) {
+        list_push(wheel, deadline % TIMER_WHEEL_SLOTS, id);
+    } else if (delta < TIMER_WHEEL_SPAN) {
+        list_push(wheel, TIMER_WHEEL_SLOTS + (deadline / TIMER_WHEEL_SLOTS) % TIMER_WHEEL_SLOTS, id);
+    } else {
+        list_push(wheel, TIMER_WHEEL_SLOTS + (wheel->time / TIMER_WHEEL_SLOTS) % TIMER_WHEEL_SLOTS, id);
+    }
+}
+
+void timer_wheel_init(Timer_Wheel *wheel, uint64_t time)
+{
+    memset(wheel, 0, sizeof(Timer_Wheel));
+    wheel->time = time;
+
+    for (uint32_t i = 0; i < sizeof(wheel->heads) / sizeof(wheel->heads[0]); ++i) {
+        wheel->heads[i] = TIMER_WHEEL_NONE;
+    }
+}
+
+void timer_wheel_free(Timer_Wheel *wheel)
+{
+    free(wheel->entries);
+    wheel->entries = nullptr;
+    wheel->capacity = 0;
+    wheel->count = 0;
+}
+
+bool timer_wheel_reserve(Timer_Wheel *wheel, uint32_t capacity)
+{
+    if (capacity <= wheel->capacity) {
+        return true;
+    }
+
+    Timer_Wheel_Entry *entries = (Timer_Wheel_Entry *)realloc(wheel->entries, capacity * sizeof(Timer_Wheel_Entry));
+
+    if (entries == nullptr) {
+        return false;
+    }
+
+    for (uint32_t i = wheel->capacity; i < capacity; ++i) {
+        entries[i].list = TIMER_WHEEL_UNSET;
+    }
+
+    wheel->entries = entries;
+    wheel->capacity = capacity;
+    return true;
+}
+
+bool timer_wheel_set(Timer_Wheel *wheel, uint32_t id, uint64_t deadline)
+{
+    if (id >= wheel->capacity) {
+        return false;
+    }
+
+    timer_wheel_cancel(wheel, id);
+
+    wheel->entries[id].deadline = deadline > wheel->time ? deadline : wheel->time + 1;
+    schedule(wheel, id);
+    ++wheel->count;
+    return true;
+}
+
+void timer_wheel_cancel(Timer_Wheel *wheel, uint32_t id)
+{
+    if (!timer_wheel_is_set(wheel, id)) {
+        return;
+    }
+
+    list_remove(wheel, id);
+    --wheel->count;
+}
+
+bool timer_wheel_is_set(const Timer_Wheel *wheel, uint32_t id)
+{
+    return id < wheel->capacity && wheel->entries[id].list != TIMER_WHEEL_UNSET;
+}
+
+uint64_t timer_wheel_deadline(const Timer_Wheel *wheel, uint32_t id)
+{
+    if (!timer_wheel_is_set(wheel, id)) {
+        return UINT64_MAX;
+    }
+
+    return wheel->entries[id].deadline;
+}
+
+uint64_t timer_wheel_time(const Timer_Wheel *wheel)
+{
+    return wheel->time;
+}
+
+/* Move the wheel one tick forward, putting the timers due at it on the
+ * expired list.
+ */
+static void tick(Timer_Wheel *wheel)
+{
+    ++wheel->time;
+
+    if (wheel->time % TIMER_WHEEL_SLOTS == 0) {
+        /* Spread the second level slot that comes up over the first level. */
+        const uint16_t list = TIMER_WHEEL_SLOTS + (wheel->time / TIMER_WHEEL_SLOTS) % TIMER_WHEEL_SLOTS;
+        uint32_t id = wheel->heads[list];
+        wheel->heads[list] = TIMER_WHEEL_NONE;
+
+        while (id != TIMER_WHEEL_NONE) {
+            const uint32_t next = wheel->entries[id].next;
+
+            if (wheel->entries[id].deadline <= wheel->time) {
+                list_push(wheel, TIMER_WHEEL_EXPIRED, id);
+            } else {
+                schedule(wheel, id);
+            }
+
+            id = next;
+        }
+    }
+
+    const uint16_t list = wheel->time % TIMER_WHEEL_SLOTS;
+    uint32_t id = wheel->heads[list];
+    wheel->heads[list] = TIMER_WHEEL_NONE;
+
+    while (id != TIMER_WHEEL_NONE) {
+        const uint32_t next = wheel->entries[id].next;
+        list_push(wheel, TIMER_WHEEL_EXPIRED, id);
+        id = next;
+    }
+}
+
+uint32_t timer_wheel_advance(Timer_Wheel *wheel, uint64_t time, timer_wheel_expired_cb *expired, void *object)
+{
+    while (wheel->time < time) {
+        if (wheel->count == 0) {
+            wheel->time = time;
+            break;
+        }
+
+        tick(wheel);
+    }
+
+    uint32_t num_expired = 0;
+
+    while (wheel->heads[TIMER_WHEEL_EXPIRED] != TIMER_WHEEL_NONE) {
+        const uint32_t id = wheel->heads[TIMER_WHEEL_EXPIRED];
+        timer_wheel_cancel(wheel, id);
+        ++num_expired;
+
+        if (expired != nullptr) {
+            expired(object, id);
+        }
+    }
+
+    return num_expired;
+}
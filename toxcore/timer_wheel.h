@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/*
+ * Hierarchical timer wheel with one timer per id.
+ * -Setting, cancelling and expiring a timer take constant time, so advancing
+ *  the wheel costs time proportional to the timers that expire rather than to
+ *  the timers that are set
+ * -Time is counted in ticks of whatever unit the user chooses; the first level
+ *  has one slot per tick, the second one slot per TIMER_WHEEL_SLOTS ticks
+ */
+#ifndef C_TOXCORE_TOXCORE_TIMER_WHEEL_H
+#define C_TOXCORE_TOXCORE_TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TIMER_WHEEL_SLOTS 64
+#define TIMER_WHEEL_LEVELS 2
+
+typedef struct Timer_Wheel_Entry {
+    uint64_t deadline;
+    uint32_t next;
+    uint32_t prev;
+    uint16_t list; // list the timer is on, UINT16_MAX if it isn't set
+} Timer_Wheel_Entry;
+
+typedef struct Timer_Wheel {
+    uint64_t time; // every timer with a deadline up to this tick has expired
+    uint32_t count; // number of timers set
+    uint32_t capacity; // number of ids timers can be set for
+    Timer_Wheel_Entry *entries; // one per id
+    uint32_t heads[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS + 1]; // slot lists, then the list of expired timers
+} Timer_Wheel;
+
+/* Initialize a timer wheel starting at the given tick. Timers can only be set
+ * for ids below the capacity, which starts at 0.
+ */
+void timer_wheel_init(Timer_Wheel *wheel, uint64_t time);
+
+/* Free a wheel initiated with timer_wheel_init */
+void timer_wheel_free(Timer_Wheel *wheel);
+
+/* Make room for timers for ids up to (not including) capacity. Never shrinks
+ * the wheel.
+ *
+ * return true on success.
+ * return false if memory allocation failed.
+ */
+bool timer_wheel_reserve(Timer_Wheel *wheel, uint32_t capacity);
+
+/* Set the timer of id to expire at deadline, replacing any timer it had.
+ * Timers set for a deadline that isn't after the wheel's time expire at the
+ * next tick.
+ *
+ * return true on success.
+ * return false if id is not below the capacity.
+ */
+bool timer_wheel_set(Timer_Wheel *wheel, uint32_t id, uint64_t deadline);
+
+/* Cancel the timer of id, if it had one. */
+void timer_wheel_cancel(Timer_Wheel *wheel, uint32_t id);
+
+/* return true if a timer is set for id. */
+bool timer_wheel_is_set(const Timer_Wheel *wheel, uint32_t id);
+
+/* return the tick the timer of id expires at.
+ * return UINT64_MAX if no timer is set for id.
+ */
+uint64_t timer_wheel_deadline(const Timer_Wheel *wheel, uint32_t id);
+
+/* return the tick the wheel was last advanced to. */
+uint64_t timer_wheel_time(const Timer_Wheel *wheel);
+
+typedef void timer_wheel_expired_cb(void *object, uint32_t id);
+
+/* Move the wheel forward to the given tick and call expired for every timer
+ * whose deadline is up to it. A timer is unset before its callback runs, which
+ * may set and cancel timers of any id, including its own.
+ *
+ * Advancing a wheel with no timers set is constant time, so starting it at
+ * tick 0 and advancing it before the first timer is set is fine.
+ *
+ * return the number of timers that expired.
+ */
+uint32_t timer_wheel_advance(Timer_Wheel *wheel, uint64_t time, timer_wheel_expired_cb *expired, void *object);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
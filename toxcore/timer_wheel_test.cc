@@ -0,0 +1,151 @@
+#include "timer_wheel.h"
+
+#include <gtest/gtest.h>
+
+#include <map>
+#include <vector>
+
+namespace {
+
+class TimerWheel : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    timer_wheel_init(&wheel_, 1000);
+    ASSERT_TRUE(timer_wheel_reserve(&wheel_, 100));
+  }
+  void TearDown() override { timer_wheel_free(&wheel_); }
+
+  static void record(void *object, uint32_t id) {
+    TimerWheel *self = static_cast<TimerWheel *>(object);
+    self->expired_.emplace_back(self->wheel_.time, id);
+  }
+
+  uint32_t advance(uint64_t time) { return timer_wheel_advance(&wheel_, time, &record, this); }
+
+  Timer_Wheel wheel_;
+  std::vector<std::pair<uint64_t, uint32_t>> expired_;
+};
+
+TEST_F(TimerWheel, IdsBeyondCapacityAreRejected) {
+  EXPECT_FALSE(timer_wheel_set(&wheel_, 100, 1010));
+  EXPECT_FALSE(timer_wheel_is_set(&wheel_, 100));
+  ASSERT_TRUE(timer_wheel_reserve(&wheel_, 200));
+  EXPECT_TRUE(timer_wheel_set(&wheel_, 100, 1010));
+  EXPECT_TRUE(timer_wheel_is_set(&wheel_, 100));
+}
+
+TEST_F(TimerWheel, DeadlineOfUnsetTimerIsMax) {
+  EXPECT_EQ(timer_wheel_deadline(&wheel_, 1), UINT64_MAX);
+  ASSERT_TRUE(timer_wheel_set(&wheel_, 1, 1010));
+  EXPECT_EQ(timer_wheel_deadline(&wheel_, 1), 1010u);
+  timer_wheel_cancel(&wheel_, 1);
+  EXPECT_EQ(timer_wheel_deadline(&wheel_, 1), UINT64_MAX);
+  EXPECT_EQ(timer_wheel_deadline(&wheel_, 100), UINT64_MAX);
+}
+
+TEST_F(TimerWheel, TimersExpireAtTheirDeadline) {
+  ASSERT_TRUE(timer_wheel_set(&wheel_, 1, 1005));
+  ASSERT_TRUE(timer_wheel_set(&wheel_, 2, 1030));
+
+  EXPECT_EQ(advance(1004), 0u);
+  EXPECT_EQ(advance(1005), 1u);
+  ASSERT_EQ(expired_.size(), 1u);
+  EXPECT_EQ(expired_[0].second, 1u);
+  EXPECT_FALSE(timer_wheel_is_set(&wheel_, 1));
+  EXPECT_TRUE(timer_wheel_is_set(&wheel_, 2));
+
+  EXPECT_EQ(advance(1100), 1u);
+  EXPECT_EQ(expired_[1].second, 2u);
+  EXPECT_EQ(wheel_.count, 0u);
+}
+
+TEST_F(TimerWheel, PastDeadlinesExpireAtTheNextTick) {
+  ASSERT_TRUE(timer_wheel_set(&wheel_, 3, 900));
+  EXPECT_EQ(advance(1000), 0u);
+  EXPECT_EQ(advance(1001), 1u);
+}
+
+TEST_F(TimerWheel, CancelledTimersDontExpire) {
+  ASSERT_TRUE(timer_wheel_set(&wheel_, 1, 1005));
+  ASSERT_TRUE(timer_wheel_set(&wheel_, 2, 1005));
+  timer_wheel_cancel(&wheel_, 1);
+  timer_wheel_cancel(&wheel_, 1);
+
+  EXPECT_EQ(advance(1010), 1u);
+  EXPECT_EQ(expired_[0].second, 2u);
+}
+
+TEST_F(TimerWheel, SettingATimerAgainReplacesIt) {
+  ASSERT_TRUE(timer_wheel_set(&wheel_, 1, 1005));
+  ASSERT_TRUE(timer_wheel_set(&wheel_, 1, 1500));
+  EXPECT_EQ(wheel_.count, 1u);
+
+  EXPECT_EQ(advance(1499), 0u);
+  EXPECT_EQ(advance(1500), 1u);
+}
+
+TEST_F(TimerWheel, EveryDeadlineIsHitExactlyWhenAdvancingTickByTick) {
+  // Deadlines on both levels and beyond the range of the second level.
+  std::map<uint32_t, uint64_t> deadlines;
+
+  for (uint32_t id = 0; id < 100; ++id) {
+    const uint64_t deadline = 1000 + 1 + id * id * 7 % 9000;
+    deadlines[id] = deadline;
+    ASSERT_TRUE(timer_wheel_set(&wheel_, id, deadline));
+  }
+
+  for (uint64_t time = 1001; time <= 11000; ++time) {
+    advance(time);
+  }
+
+  ASSERT_EQ(expired_.size(), 100u);
+
+  for (const auto &e : expired_) {
+    EXPECT_EQ(e.first, deadlines[e.second]) << "id " << e.second;
+  }
+}
+
+TEST_F(TimerWheel, LargeStepsExpireEverythingDue) {
+  for (uint32_t id = 0; id < 100; ++id) {
+    ASSERT_TRUE(timer_wheel_set(&wheel_, id, 1000 + 1 + id * 97));
+  }
+
+  EXPECT_EQ(advance(1000 + 50 * 97), 50u);
+  EXPECT_EQ(advance(1000 + 200 * 97), 50u);
+}
+
+TEST_F(TimerWheel, CallbacksCanRescheduleTimers) {
+  struct Rescheduler {
+    Timer_Wheel *wheel;
+    uint32_t calls;
+  } r{&wheel_, 0};
+
+  ASSERT_TRUE(timer_wheel_set(&wheel_, 5, 1010));
+  ASSERT_TRUE(timer_wheel_set(&wheel_, 6, 1010));
+
+  auto reschedule = [](void *object, uint32_t id) {
+    Rescheduler *r = static_cast<Rescheduler *>(object);
+    ++r->calls;
+    // Cancel the other timer due at the same time and set this one again.
+    timer_wheel_cancel(r->wheel, id == 5 ? 6 : 5);
+    timer_wheel_set(r->wheel, id, r->wheel->time);
+  };
+
+  EXPECT_EQ(timer_wheel_advance(&wheel_, 1010, reschedule, &r), 1u);
+  EXPECT_EQ(r.calls, 1u);
+  EXPECT_EQ(wheel_.count, 1u);
+  EXPECT_EQ(timer_wheel_advance(&wheel_, 1011, reschedule, &r), 1u);
+}
+
+TEST(TimerWheelStart, EmptyWheelJumpsToTheCurrentTime) {
+  Timer_Wheel wheel;
+  timer_wheel_init(&wheel, 0);
+  ASSERT_TRUE(timer_wheel_reserve(&wheel, 1));
+  EXPECT_EQ(timer_wheel_advance(&wheel, 1700000000, nullptr, nullptr), 0u);
+  EXPECT_EQ(wheel.time, 1700000000u);
+  ASSERT_TRUE(timer_wheel_set(&wheel, 0, 1700000030));
+  EXPECT_EQ(timer_wheel_advance(&wheel, 1700000030, nullptr, nullptr), 1u);
+  timer_wheel_free(&wheel);
+}
+
+}  // namespace
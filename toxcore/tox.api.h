@@ -399,6 +399,25 @@ enum class PROXY_TYPE {
   SOCKS5,
 }
 
+/**
+ * Algorithm used to decide how fast data is sent to friends.
+ *
+ * @deprecated All UPPER_CASE enum type names are deprecated. Use the
+ *   Camel_Snake_Case versions, instead.
+ */
+enum class CONGESTION_CONTROL {
+  /**
+   * Adjust the sending rate by how fast the queue of unacknowledged packets
+   * grows.
+   */
+  QUEUE,
+  /**
+   * Keep the queueing delay on the path, measured through round trip times,
+   * close to a small target, and back off gently on packet loss.
+   */
+  DELAY,
+}
+
 /**
  * Type of savedata to create the Tox instance from.
  *
@@ -624,6 +643,14 @@ static class options {
        * Default: false.
        */
       bool thread_safety;
+
+      /**
+       * Congestion control algorithm used for connections to friends. Unknown
+       * values select the default.
+       *
+       * Default: ${CONGESTION_CONTROL.QUEUE}.
+       */
+      CONGESTION_CONTROL congestion_control;
     }
   }
 
@@ -903,6 +930,61 @@ const uint32_t iteration_interval();
 void iterate(any user_data);
 
 
+/**
+ * Functions for running Tox from an event loop (poll, epoll, kqueue, ...)
+ * instead of a fixed timer.
+ *
+ * After each call to $iterate, wait until one of the sockets returned by
+ * ${wait.fds.get} becomes readable or until the time returned by
+ * $deadline is reached, whichever comes first, then call $iterate again.
+ * The set of sockets changes as TCP relay connections come and go, so it must
+ * be fetched again after each $iterate.
+ */
+namespace wait {
+
+  int32_t[size] fds {
+    /**
+     * Return the number of sockets the event loop needs to watch.
+     *
+     * This function can be used to determine how much memory to allocate for
+     * $get.
+     */
+    size();
+
+
+    /**
+     * Copy the file descriptors of the UDP socket, the TCP server (if
+     * enabled) and all active TCP relay connections into an array.
+     *
+     * Call $size to determine the number of elements to allocate.
+     *
+     * @param fds A memory region with enough space to hold the socket list. If
+     *   this parameter is NULL, this function has no effect.
+     */
+    get();
+  }
+
+
+  /**
+   * Return the time in milliseconds at which $iterate() must be called again
+   * if none of the sockets became readable before then.
+   *
+   * The time is on the same monotonic clock as $current_time(). It may
+   * already be in the past, in which case $iterate() should be called right
+   * away.
+   */
+  const uint64_t deadline();
+
+
+  /**
+   * Return the current time in milliseconds on the monotonic clock used by
+   * $deadline(). The starting point of the clock is unspecified.
+   */
+  const uint64_t current_time();
+
+}
+
+
 /*******************************************************************************
  *
  * :: Internal client information (Tox address/id)
@@ -1510,6 +1592,131 @@ namespace friend {
 }
 
 
+/*******************************************************************************
+ *
+ * :: Friend transport statistics
+ *
+ ******************************************************************************/
+
+
+namespace friend {
+
+  /**
+   * Common error codes for friend transport statistics functions.
+   *
+   * The transport statistics describe the state of the connection to a friend,
+   * for diagnosing slow or unreliable friend connections. Each getter is cheap
+   * enough to be called once per second for every friend.
+   *
+   * Counters are totals since the connection to the friend was (re)established.
+   * Poll them periodically and take differences to get rates over the polling
+   * interval, e.g. packets_resent / packets_sent for the loss rate.
+   */
+  error for get_transport_stats {
+    /**
+     * The friend_number did not designate a valid friend.
+     */
+    FRIEND_NOT_FOUND,
+    /**
+     * This client is currently not connected to the friend.
+     */
+    FRIEND_NOT_CONNECTED,
+  }
+
+
+  uint64_t transport_rtt_min {
+    /**
+     * Return the lowest round trip time measured on the connection to a friend
+     * in milliseconds, or 0 if none was measured yet.
+     */
+    get(uint32_t friend_number)
+        with error for get_transport_stats;
+  }
+
+
+  uint64_t transport_rtt_last {
+    /**
+     * Return the most recent round trip time measured on the connection to a
+     * friend in milliseconds, or 0 if none was measured yet.
+     */
+    get(uint32_t friend_number)
+        with error for get_transport_stats;
+  }
+
+
+  uint64_t transport_queue_delay {
+    /**
+     * Return the estimate of the time in milliseconds packets to a friend spend
+     * queued on the path, or 0 if the congestion controller in use doesn't
+     * estimate it.
+     */
+    get(uint32_t friend_number)
+        with error for get_transport_stats;
+  }
+
+
+  double transport_send_rate {
+    /**
+     * Return the number of lossless packets per second the congestion
+     * controller currently allows to be sent to a friend.
+     */
+    get(uint32_t friend_number)
+        with error for get_transport_stats;
+  }
+
+
+  double transport_recv_rate {
+    /**
+     * Return the number of packets per second currently being received from a
+     * friend.
+     */
+    get(uint32_t friend_number)
+        with error for get_transport_stats;
+  }
+
+
+  uint64_t transport_packets_sent {
+    /**
+     * Return the number of lossless packets sent to a friend.
+     */
+    get(uint32_t friend_number)
+        with error for get_transport_stats;
+  }
+
+
+  uint64_t transport_packets_resent {
+    /**
+     * Return the number of lossless packets sent to a friend again because the
+     * friend reported them missing.
+     */
+    get(uint32_t friend_number)
+        with error for get_transport_stats;
+  }
+
+
+  uint32_t transport_send_queue_size {
+    /**
+     * Return the number of lossless packets sent to a friend but not
+     * acknowledged yet.
+     */
+    get(uint32_t friend_number)
+        with error for get_transport_stats;
+  }
+
+
+  uint32_t transport_recv_queue_size {
+    /**
+     * Return the number of lossless packets from the first one missing to the
+     * newest one received from a friend. Non-zero when packets arrive out of
+     * order or get lost.
+     */
+    get(uint32_t friend_number)
+        with error for get_transport_stats;
+  }
+
+}
+
+
 /*******************************************************************************
  *
  * :: Sending private messages
@@ -2827,6 +3034,7 @@ typedef TOX_ERR_FRIEND_BY_PUBLIC_KEY Tox_Err_Friend_By_Public_Key;
 typedef TOX_ERR_FRIEND_GET_PUBLIC_KEY Tox_Err_Friend_Get_Public_Key;
 typedef TOX_ERR_FRIEND_GET_LAST_ONLINE Tox_Err_Friend_Get_Last_Online;
 typedef TOX_ERR_FRIEND_QUERY Tox_Err_Friend_Query;
+typedef TOX_ERR_FRIEND_GET_TRANSPORT_STATS Tox_Err_Friend_Get_Transport_Stats;
 typedef TOX_ERR_SET_TYPING Tox_Err_Set_Typing;
 typedef TOX_ERR_FRIEND_SEND_MESSAGE Tox_Err_Friend_Send_Message;
 typedef TOX_ERR_FILE_CONTROL Tox_Err_File_Control;
@@ -2850,6 +3058,7 @@ typedef TOX_ERR_GET_PORT Tox_Err_Get_Port;
 typedef TOX_USER_STATUS Tox_User_Status;
 typedef TOX_MESSAGE_TYPE Tox_Message_Type;
 typedef TOX_PROXY_TYPE Tox_Proxy_Type;
+typedef TOX_CONGESTION_CONTROL Tox_Congestion_Control;
 typedef TOX_SAVEDATA_TYPE Tox_Savedata_Type;
 typedef TOX_LOG_LEVEL Tox_Log_Level;
 typedef TOX_CONNECTION Tox_Connection;
@@ -467,6 +467,17 @@ Tox *tox_new(const struct Tox_Options *options, Tox_Err_New *error)
     m_options.hole_punching_enabled = tox_options_get_hole_punching_enabled(opts);
     m_options.local_discovery_enabled = tox_options_get_local_discovery_enabled(opts);
 
+    switch (tox_options_get_experimental_congestion_control(opts)) {
+        case TOX_CONGESTION_CONTROL_DELAY:
+            m_options.congestion_control = CONGESTION_CONTROL_DELAY;
+            break;
+
+        case TOX_CONGESTION_CONTROL_QUEUE:
+        default:
+            m_options.congestion_control = CONGESTION_CONTROL_QUEUE;
+            break;
+    }
+
     m_options.log_callback = (logger_cb *)tox_options_get_log_callback(opts);
     m_options.log_context = tox;
     m_options.log_user_data = tox_options_get_log_user_data(opts);
@@ -828,6 +839,54 @@ void tox_iterate(Tox *tox, void *user_data)
     unlock(tox);
 }
 
+size_t tox_wait_get_fds_size(const Tox *tox)
+{
+    assert(tox != nullptr);
+    lock(tox);
+    size_t ret = messenger_copy_wait_sockets(tox->m, nullptr, 0);
+    unlock(tox);
+    return ret;
+}
+
+void tox_wait_get_fds(const Tox *tox, int32_t *fds)
+{
+    assert(tox != nullptr);
+
+    if (fds) {
+        lock(tox);
+        const uint32_t num = messenger_copy_wait_sockets(tox->m, nullptr, 0);
+
+        if (num > 0) {
+            VLA(Socket, socks, num);
+            messenger_copy_wait_sockets(tox->m, socks, num);
+
+            for (uint32_t i = 0; i < num; ++i) {
+                fds[i] = socks[i].socket;
+            }
+        }
+
+        unlock(tox);
+    }
+}
+
+uint64_t tox_wait_deadline(const Tox *tox)
+{
+    assert(tox != nullptr);
+    lock(tox);
+    uint64_t ret = messenger_run_deadline(tox->m);
+    unlock(tox);
+    return ret;
+}
+
+uint64_t tox_wait_current_time(const Tox *tox)
+{
+    assert(tox != nullptr);
+    lock(tox);
+    uint64_t ret = current_time_monotonic(tox->mono_time);
+    unlock(tox);
+    return ret;
+}
+
 void tox_self_get_address(const Tox *tox, uint8_t *address)
 {
     assert(tox != nullptr);
@@ -1332,6 +1391,96 @@ void tox_callback_friend_typing(Tox *tox, tox_friend_typing_cb *callback)
     tox->friend_typing_callback = callback;
 }
 
+/* Take a snapshot of the transport state of the connection to a friend.
+ *
+ * return true on success.
+ * return false on failure, with error set.
+ */
+static bool get_transport_stats(const Tox *tox, uint32_t friend_number, Crypto_Connection_Stats *stats,
+                                Tox_Err_Friend_Get_Transport_Stats *error)
+{
+    assert(tox != nullptr);
+    lock(tox);
+    const int ret = m_get_friend_transport_stats(tox->m, friend_number, stats);
+    unlock(tox);
+
+    if (ret == -1) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_GET_TRANSPORT_STATS_FRIEND_NOT_FOUND);
+        return 0;
+    }
+
+    if (ret == -2) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_GET_TRANSPORT_STATS_FRIEND_NOT_CONNECTED);
+        return 0;
+    }
+
+    SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_GET_TRANSPORT_STATS_OK);
+    return 1;
+}
+
+uint64_t tox_friend_get_transport_rtt_min(const Tox *tox, uint32_t friend_number,
+                                          Tox_Err_Friend_Get_Transport_Stats *error)
+{
+    Crypto_Connection_Stats stats;
+    return get_transport_stats(tox, friend_number, &stats, error) ? stats.rtt_min : 0;
+}
+
+uint64_t tox_friend_get_transport_rtt_last(const Tox *tox, uint32_t friend_number,
+                                           Tox_Err_Friend_Get_Transport_Stats *error)
+{
+    Crypto_Connection_Stats stats;
+    return get_transport_stats(tox, friend_number, &stats, error) ? stats.rtt_last : 0;
+}
+
+uint64_t tox_friend_get_transport_queue_delay(const Tox *tox, uint32_t friend_number,
+                                              Tox_Err_Friend_Get_Transport_Stats *error)
+{
+    Crypto_Connection_Stats stats;
+    return get_transport_stats(tox, friend_number, &stats, error) ? stats.queue_delay : 0;
+}
+
+double tox_friend_get_transport_send_rate(const Tox *tox, uint32_t friend_number,
+                                          Tox_Err_Friend_Get_Transport_Stats *error)
+{
+    Crypto_Connection_Stats stats;
+    return get_transport_stats(tox, friend_number, &stats, error) ? stats.send_rate : 0;
+}
+
+double tox_friend_get_transport_recv_rate(const Tox *tox, uint32_t friend_number,
+                                          Tox_Err_Friend_Get_Transport_Stats *error)
+{
+    Crypto_Connection_Stats stats;
+    return get_transport_stats(tox, friend_number, &stats, error) ? stats.recv_rate : 0;
+}
+
+uint64_t tox_friend_get_transport_packets_sent(const Tox *tox, uint32_t friend_number,
+                                               Tox_Err_Friend_Get_Transport_Stats *error)
+{
+    Crypto_Connection_Stats stats;
+    return get_transport_stats(tox, friend_number, &stats, error) ? stats.packets_sent : 0;
+}
+
+uint64_t tox_friend_get_transport_packets_resent(const Tox *tox, uint32_t friend_number,
+                                                 Tox_Err_Friend_Get_Transport_Stats *error)
+{
+    Crypto_Connection_Stats stats;
+    return get_transport_stats(tox, friend_number, &stats, error) ? stats.packets_resent : 0;
+}
+
+uint32_t tox_friend_get_transport_send_queue_size(const Tox *tox, uint32_t friend_number,
+                                                  Tox_Err_Friend_Get_Transport_Stats *error)
+{
+    Crypto_Connection_Stats stats;
+    return get_transport_stats(tox, friend_number, &stats, error) ? stats.send_queue_size : 0;
+}
+
+uint32_t tox_friend_get_transport_recv_queue_size(const Tox *tox, uint32_t friend_number,
+                                                  Tox_Err_Friend_Get_Transport_Stats *error)
+{
+    Crypto_Connection_Stats stats;
+    return get_transport_stats(tox, friend_number, &stats, error) ? stats.recv_queue_size : 0;
+}
+
 bool tox_self_set_typing(Tox *tox, uint32_t friend_number, bool typing, Tox_Err_Set_Typing *error)
 {
     assert(tox != nullptr);
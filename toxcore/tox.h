@@ -445,6 +445,29 @@ typedef enum TOX_PROXY_TYPE {
 } TOX_PROXY_TYPE;
 
 
+/**
+ * Algorithm used to decide how fast data is sent to friends.
+ *
+ * @deprecated All UPPER_CASE enum type names are deprecated. Use the
+ *   Camel_Snake_Case versions, instead.
+ */
+typedef enum TOX_CONGESTION_CONTROL {
+
+    /**
+     * Adjust the sending rate by how fast the queue of unacknowledged packets
+     * grows.
+     */
+    TOX_CONGESTION_CONTROL_QUEUE,
+
+    /**
+     * Keep the queueing delay on the path, measured through round trip times,
+     * close to a small target, and back off gently on packet loss.
+     */
+    TOX_CONGESTION_CONTROL_DELAY,
+
+} TOX_CONGESTION_CONTROL;
+
+
 /**
  * Type of savedata to create the Tox instance from.
  *
@@ -691,6 +714,15 @@ struct Tox_Options {
      */
     bool experimental_thread_safety;
 
+
+    /**
+     * Congestion control algorithm used for connections to friends. Unknown
+     * values select the default.
+     *
+     * Default: TOX_CONGESTION_CONTROL_QUEUE.
+     */
+    TOX_CONGESTION_CONTROL experimental_congestion_control;
+
 };
 
 
@@ -758,6 +790,11 @@ bool tox_options_get_experimental_thread_safety(const struct Tox_Options *option
 
 void tox_options_set_experimental_thread_safety(struct Tox_Options *options, bool thread_safety);
 
+TOX_CONGESTION_CONTROL tox_options_get_experimental_congestion_control(const struct Tox_Options *options);
+
+void tox_options_set_experimental_congestion_control(struct Tox_Options *options,
+        TOX_CONGESTION_CONTROL congestion_control);
+
 /**
  * Initialises a Tox_Options object with the default options.
  *
@@ -1062,6 +1099,41 @@ uint32_t tox_iteration_interval(const Tox *tox);
  */
 void tox_iterate(Tox *tox, void *user_data);
 
+/**
+ * Return the number of sockets the event loop needs to watch.
+ *
+ * This function can be used to determine how much memory to allocate for
+ * tox_wait_get_fds.
+ */
+size_t tox_wait_get_fds_size(const Tox *tox);
+
+/**
+ * Copy the file descriptors of the UDP socket, the TCP server (if
+ * enabled) and all active TCP relay connections into an array.
+ *
+ * Call tox_wait_get_fds_size to determine the number of elements to allocate.
+ *
+ * @param fds A memory region with enough space to hold the socket list. If
+ *   this parameter is NULL, this function has no effect.
+ */
+void tox_wait_get_fds(const Tox *tox, int32_t *fds);
+
+/**
+ * Return the time in milliseconds at which tox_iterate() must be called again
+ * if none of the sockets became readable before then.
+ *
+ * The time is on the same monotonic clock as tox_wait_current_time(). It may
+ * already be in the past, in which case tox_iterate() should be called right
+ * away.
+ */
+uint64_t tox_wait_deadline(const Tox *tox);
+
+/**
+ * Return the current time in milliseconds on the monotonic clock used by
+ * tox_wait_deadline(). The starting point of the clock is unspecified.
+ */
+uint64_t tox_wait_current_time(const Tox *tox);
+
 
 /*******************************************************************************
  *
@@ -1687,6 +1759,110 @@ typedef void tox_friend_typing_cb(Tox *tox, uint32_t friend_number, bool is_typi
 void tox_callback_friend_typing(Tox *tox, tox_friend_typing_cb *callback);
 
 
+/*******************************************************************************
+ *
+ * :: Friend transport statistics
+ *
+ ******************************************************************************/
+
+
+
+/**
+ * Common error codes for friend transport statistics functions.
+ *
+ * The transport statistics describe the state of the connection to a friend,
+ * for diagnosing slow or unreliable friend connections. Each getter is cheap
+ * enough to be called once per second for every friend.
+ *
+ * Counters are totals since the connection to the friend was (re)established.
+ * Poll them periodically and take differences to get rates over the polling
+ * interval, e.g. packets_resent / packets_sent for the loss rate.
+ */
+typedef enum TOX_ERR_FRIEND_GET_TRANSPORT_STATS {
+
+    /**
+     * The function returned successfully.
+     */
+    TOX_ERR_FRIEND_GET_TRANSPORT_STATS_OK,
+
+    /**
+     * The friend_number did not designate a valid friend.
+     */
+    TOX_ERR_FRIEND_GET_TRANSPORT_STATS_FRIEND_NOT_FOUND,
+
+    /**
+     * This client is currently not connected to the friend.
+     */
+    TOX_ERR_FRIEND_GET_TRANSPORT_STATS_FRIEND_NOT_CONNECTED,
+
+} TOX_ERR_FRIEND_GET_TRANSPORT_STATS;
+
+
+/**
+ * Return the lowest round trip time measured on the connection to a friend
+ * in milliseconds, or 0 if none was measured yet.
+ */
+uint64_t tox_friend_get_transport_rtt_min(const Tox *tox, uint32_t friend_number,
+                                          TOX_ERR_FRIEND_GET_TRANSPORT_STATS *error);
+
+/**
+ * Return the most recent round trip time measured on the connection to a
+ * friend in milliseconds, or 0 if none was measured yet.
+ */
+uint64_t tox_friend_get_transport_rtt_last(const Tox *tox, uint32_t friend_number,
+                                           TOX_ERR_FRIEND_GET_TRANSPORT_STATS *error);
+
+/**
+ * Return the estimate of the time in milliseconds packets to a friend spend
+ * queued on the path, or 0 if the congestion controller in use doesn't
+ * estimate it.
+ */
+uint64_t tox_friend_get_transport_queue_delay(const Tox *tox, uint32_t friend_number,
+                                              TOX_ERR_FRIEND_GET_TRANSPORT_STATS *error);
+
+/**
+ * Return the number of lossless packets per second the congestion
+ * controller currently allows to be sent to a friend.
+ */
+double tox_friend_get_transport_send_rate(const Tox *tox, uint32_t friend_number,
+                                          TOX_ERR_FRIEND_GET_TRANSPORT_STATS *error);
+
+/**
+ * Return the number of packets per second currently being received from a
+ * friend.
+ */
+double tox_friend_get_transport_recv_rate(const Tox *tox, uint32_t friend_number,
+                                          TOX_ERR_FRIEND_GET_TRANSPORT_STATS *error);
+
+/**
+ * Return the number of lossless packets sent to a friend.
+ */
+uint64_t tox_friend_get_transport_packets_sent(const Tox *tox, uint32_t friend_number,
+                                               TOX_ERR_FRIEND_GET_TRANSPORT_STATS *error);
+
+/**
+ * Return the number of lossless packets sent to a friend again because the
+ * friend reported them missing.
+ */
+uint64_t tox_friend_get_transport_packets_resent(const Tox *tox, uint32_t friend_number,
+                                                 TOX_ERR_FRIEND_GET_TRANSPORT_STATS *error);
+
+/**
+ * Return the number of lossless packets sent to a friend but not
+ * acknowledged yet.
+ */
+uint32_t tox_friend_get_transport_send_queue_size(const Tox *tox, uint32_t friend_number,
+                                                  TOX_ERR_FRIEND_GET_TRANSPORT_STATS *error);
+
+/**
+ * Return the number of lossless packets from the first one missing to the
+ * newest one received from a friend. Non-zero when packets arrive out of
+ * order or get lost.
+ */
+uint32_t tox_friend_get_transport_recv_queue_size(const Tox *tox, uint32_t friend_number,
+                                                  TOX_ERR_FRIEND_GET_TRANSPORT_STATS *error);
+
+
 /*******************************************************************************
  *
  * :: Sending private messages
@@ -3224,6 +3400,7 @@ typedef TOX_ERR_FRIEND_BY_PUBLIC_KEY Tox_Err_Friend_By_Public_Key;
 typedef TOX_ERR_FRIEND_GET_PUBLIC_KEY Tox_Err_Friend_Get_Public_Key;
 typedef TOX_ERR_FRIEND_GET_LAST_ONLINE Tox_Err_Friend_Get_Last_Online;
 typedef TOX_ERR_FRIEND_QUERY Tox_Err_Friend_Query;
+typedef TOX_ERR_FRIEND_GET_TRANSPORT_STATS Tox_Err_Friend_Get_Transport_Stats;
 typedef TOX_ERR_SET_TYPING Tox_Err_Set_Typing;
 typedef TOX_ERR_FRIEND_SEND_MESSAGE Tox_Err_Friend_Send_Message;
 typedef TOX_ERR_FILE_CONTROL Tox_Err_File_Control;
@@ -3247,6 +3424,7 @@ typedef TOX_ERR_GET_PORT Tox_Err_Get_Port;
 typedef TOX_USER_STATUS Tox_User_Status;
 typedef TOX_MESSAGE_TYPE Tox_Message_Type;
 typedef TOX_PROXY_TYPE Tox_Proxy_Type;
+typedef TOX_CONGESTION_CONTROL Tox_Congestion_Control;
 typedef TOX_SAVEDATA_TYPE Tox_Savedata_Type;
 typedef TOX_LOG_LEVEL Tox_Log_Level;
 typedef TOX_CONNECTION Tox_Connection;
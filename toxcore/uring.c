@@ -0,0 +1,529 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/*
+ * Minimal io_uring wrapper.
+ */
+
+// For syscall(), MAP_POPULATE and POLLRDHUP on Linux.
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "uring.h"
+
+#include "ccompat.h"
+
+#ifdef TCP_SERVER_USE_IO_URING
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/* Group id of the provided receive buffers. */
+#define URING_BUFFER_GROUP 0
+
+struct Uring {
+    int fd;
+
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    /* Tail of the operations queued, published to the kernel on submit. */
+    uint32_t sq_queued;
+
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    uint16_t buf_mask;
+    uint16_t buf_tail;
+    uint8_t *buffers;
+    uint32_t buffer_size;
+};
+
+static int sys_io_uring_setup(uint32_t entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags, const void *arg,
+                              size_t arg_size)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_io_uring_register(int fd, uint32_t opcode, const void *arg, uint32_t nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uint32_t *ring_field(void *map, uint32_t offset)
+{
+    return (uint32_t *)((uint8_t *)map + offset);
+}
+
+static void unmap_ring(Uring *ring)
+{
+    if (ring->sqes != nullptr) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+
+    if (ring->cq_map != nullptr && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+
+    if (ring->sq_map != nullptr) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+
+    if (ring->buf_ring != nullptr) {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    }
+}
+
+/* return false on failure. */
+static bool map_ring(Uring *ring, const struct io_uring_params *params)
+{
+    ring->sq_map_size = params->sq_off.array + params->sq_entries * sizeof(uint32_t);
+    ring->cq_map_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+
+    if ((params->features & IORING_FEAT_SINGLE_MMAP) != 0 && ring->cq_map_size > ring->sq_map_size) {
+        ring->sq_map_size = ring->cq_map_size;
+    }
+
+    void *sq_map = mmap(nullptr, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+
+    if (sq_map == MAP_FAILED) {
+        return false;
+    }
+
+    ring->sq_map = sq_map;
+
+    if ((params->features & IORING_FEAT_SINGLE_MMAP) != 0) {
+        ring->cq_map = sq_map;
+    } else {
+        void *cq_map = mmap(nullptr, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+
+        if (cq_map == MAP_FAILED) {
+            return false;
+        }
+
+        ring->cq_map = cq_map;
+    }
+
+    ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+
+    ring->sqes = (struct io_uring_sqe *)sqes;
+
+    ring->sq_head = ring_field(ring->sq_map, params->sq_off.head);
+    ring->sq_tail = ring_field(ring->sq_map, params->sq_off.tail);
+    ring->sq_mask = *ring_field(ring->sq_map, params->sq_off.ring_mask);
+    ring->sq_entries = params->sq_entries;
+    ring->sq_queued = *ring->sq_tail;
+
+    /* Submission queue entry i always goes in slot i. */
+    uint32_t *sq_array = ring_field(ring->sq_map, params->sq_off.array);
+
+    for (uint32_t i = 0; i < params->sq_entries; ++i) {
+        sq_array[i] = i;
+    }
+
+    ring->cq_head = ring_field(ring->cq_map, params->cq_off.head);
+    ring->cq_tail = ring_field(ring->cq_map, params->cq_off.tail);
+    ring->cq_mask = *ring_field(ring->cq_map, params->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((uint8_t *)ring->cq_map + params->cq_off.cqes);
+
+    return true;
+}
+
+/* return false on failure. */
+static bool register_buffers(Uring *ring, uint32_t num_buffers, uint32_t buffer_size)
+{
+    ring->buf_ring_size = num_buffers * sizeof(struct io_uring_buf);
+    void *buf_ring = mmap(nullptr, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (buf_ring == MAP_FAILED) {
+        return false;
+    }
+
+    ring->buf_ring = (struct io_uring_buf_ring *)buf_ring;
+    ring->buf_mask = (uint16_t)(num_buffers - 1);
+    ring->buffer_size = buffer_size;
+    ring->buffers = (uint8_t *)malloc((size_t)num_buffers * buffer_size);
+
+    if (ring->buffers == nullptr) {
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = num_buffers;
+    reg.bgid = URING_BUFFER_GROUP;
+
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < num_buffers; ++i) {
+        uring_buffer_return(ring, (uint16_t)i);
+    }
+
+    return true;
+}
+
+/* return nullptr if the submission queue is full and submitting it failed. */
+static struct io_uring_sqe *get_sqe(Uring *ring)
+{
+    if (ring->sq_queued - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if (!uring_submit(ring, 0)
+                || ring->sq_queued - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+            return nullptr;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_queued & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++ring->sq_queued;
+    return sqe;
+}
+
+/* Check that multishot receive into provided buffers works, as it came last
+ * of all the operations used.
+ *
+ * return false if it doesn't.
+ */
+static bool self_test(Uring *ring)
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        return false;
+    }
+
+    bool ok = uring_recv(ring, fds[0], 1) && uring_submit(ring, 0) && write(fds[1], "t", 1) == 1
+              && uring_submit(ring, 1000);
+
+    Uring_Completion completion = {0};
+
+    if (!ok || !uring_completion(ring, &completion)) {
+        ok = false;
+    } else {
+        ok = completion.result == 1 && (completion.flags & URING_COMPLETION_MORE) != 0
+             && (completion.flags & URING_COMPLETION_BUFFER) != 0;
+
+        if ((completion.flags & URING_COMPLETION_BUFFER) != 0) {
+            uring_buffer_return(ring, completion.buffer);
+        }
+    }
+
+    /* Closing the socket doesn't end the receive, only shutting it down does. */
+    shutdown(fds[0], SHUT_RDWR);
+    close(fds[1]);
+    close(fds[0]);
+
+    while ((completion.flags & URING_COMPLETION_MORE) != 0 && uring_submit(ring, 1000)
+            && uring_completion(ring, &completion)) {
+        if ((completion.flags & URING_COMPLETION_BUFFER) != 0) {
+            uring_buffer_return(ring, completion.buffer);
+        }
+    }
+
+    return ok;
+}
+
+Uring *uring_new(uint32_t entries, uint32_t num_buffers, uint32_t buffer_size)
+{
+    if (num_buffers == 0 || num_buffers > 32768 || (num_buffers & (num_buffers - 1)) != 0 || buffer_size == 0) {
+        return nullptr;
+    }
+
+    Uring *ring = (Uring *)calloc(1, sizeof(Uring));
+
+    if (ring == nullptr) {
+        return nullptr;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    /* Multishot operations complete more often than they are submitted. */
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    ring->fd = sys_io_uring_setup(entries, &params);
+
+    if (ring->fd < 0) {
+        free(ring);
+        return nullptr;
+    }
+
+    if ((params.features & IORING_FEAT_EXT_ARG) == 0 || (params.features & IORING_FEAT_NODROP) == 0
+            || !map_ring(ring, &params) || !register_buffers(ring, num_buffers, buffer_size) || !self_test(ring)) {
+        uring_kill(ring);
+        return nullptr;
+    }
+
+    return ring;
+}
+
+void uring_kill(Uring *ring)
+{
+    if (ring == nullptr) {
+        return;
+    }
+
+    /* Closing the ring cancels everything still running before the buffers
+     * are freed.
+     */
+    close(ring->fd);
+    unmap_ring(ring);
+    free(ring->buffers);
+    free(ring);
+}
+
+int uring_fd(const Uring *ring)
+{
+    return ring->fd;
+}
+
+bool uring_accept(Uring *ring, int fd, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    if (sqe == nullptr) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool uring_recv(Uring *ring, int fd, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    if (sqe == nullptr) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool uring_poll(Uring *ring, int fd, bool multishot, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    if (sqe == nullptr) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN | POLLRDHUP;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool uring_send(Uring *ring, int fd, const uint8_t *data, uint32_t length, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    if (sqe == nullptr) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = length;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool uring_cancel(Uring *ring, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    if (sqe == nullptr) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = user_data;
+    /* Completions of cancel operations are never looked at. */
+    sqe->user_data = UINT64_MAX;
+    return true;
+}
+
+const uint8_t *uring_buffer(const Uring *ring, uint16_t buffer)
+{
+    return ring->buffers + (size_t)buffer * ring->buffer_size;
+}
+
+void uring_buffer_return(Uring *ring, uint16_t buffer)
+{
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & ring->buf_mask];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)buffer * ring->buffer_size);
+    buf->len = ring->buffer_size;
+    buf->bid = buffer;
+    ++ring->buf_tail;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+bool uring_submit(Uring *ring, int timeout)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_queued, __ATOMIC_RELEASE);
+
+    const uint32_t to_submit = ring->sq_queued - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    const bool have_completions = *ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    const bool wait = timeout != 0 && !have_completions;
+
+    if (to_submit == 0 && !wait) {
+        return true;
+    }
+
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = 8;
+    arg.ts = timeout < 0 ? 0 : (uint64_t)(uintptr_t)&ts;
+
+    const int ret = sys_io_uring_enter(ring->fd, to_submit, wait ? 1 : 0,
+                                       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+    return ret >= 0 || errno == ETIME || errno == EINTR || errno == EBUSY;
+}
+
+bool uring_completion(Uring *ring, Uring_Completion *completion)
+{
+    const uint32_t head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    completion->user_data = cqe->user_data;
+    completion->result = cqe->res;
+    completion->flags = 0;
+    completion->buffer = 0;
+
+    if ((cqe->flags & IORING_CQE_F_MORE) != 0) {
+        completion->flags |= URING_COMPLETION_MORE;
+    }
+
+    if ((cqe->flags & IORING_CQE_F_BUFFER) != 0) {
+        completion->flags |= URING_COMPLETION_BUFFER;
+        completion->buffer = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#else
+
+#include <stddef.h>
+
+Uring *uring_new(uint32_t entries, uint32_t num_buffers, uint32_t buffer_size)
+{
+    return nullptr;
+}
+
+void uring_kill(Uring *ring)
+{
+}
+
+int uring_fd(const Uring *ring)
+{
+    return -1;
+}
+
+bool uring_accept(Uring *ring, int fd, uint64_t user_data)
+{
+    return false;
+}
+
+bool uring_recv(Uring *ring, int fd, uint64_t user_data)
+{
+    return false;
+}
+
+bool uring_poll(Uring *ring, int fd, bool multishot, uint64_t user_data)
+{
+    return false;
+}
+
+bool uring_send(Uring *ring, int fd, const uint8_t *data, uint32_t length, uint64_t user_data)
+{
+    return false;
+}
+
+bool uring_cancel(Uring *ring, uint64_t user_data)
+{
+    return false;
+}
+
+const uint8_t *uring_buffer(const Uring *ring, uint16_t buffer)
+{
+    return nullptr;
+}
+
+void uring_buffer_return(Uring *ring, uint16_t buffer)
+{
+}
+
+bool uring_submit(Uring *ring, int timeout)
+{
+    return false;
+}
+
+bool uring_completion(Uring *ring, Uring_Completion *completion)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,106 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ * Copyright © 2026 The TokTok team.
+ */
+
+/*
+ * Minimal io_uring wrapper, talking to the kernel through the system calls.
+ * -Only has the operations the TCP relay server needs: multishot accept,
+ *  multishot receive into a ring of buffers provided to the kernel up front,
+ *  poll, send and cancel
+ * -Operations are queued until uring_submit, so a whole batch of them costs a
+ *  single system call
+ * -Only available on Linux 6.0 and later, and only if built with
+ *  TCP_SERVER_USE_IO_URING; uring_new fails everywhere else
+ */
+#ifndef C_TOXCORE_TOXCORE_URING_H
+#define C_TOXCORE_TOXCORE_URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Uring Uring;
+
+/* More completions for the same operation will follow. */
+#define URING_COMPLETION_MORE 1
+/* The data received is in the provided buffer completion.buffer. */
+#define URING_COMPLETION_BUFFER 2
+
+typedef struct Uring_Completion {
+    uint64_t user_data;
+    int32_t result; // bytes received or sent, accepted fd, poll events or -errno
+    uint8_t flags;
+    uint16_t buffer;
+} Uring_Completion;
+
+/* Create a ring with room for entries queued operations and num_buffers
+ * receive buffers of buffer_size bytes. num_buffers must be a power of 2 up
+ * to 32768.
+ *
+ * return nullptr if io_uring or one of the operations isn't supported, or
+ * memory allocation failed.
+ */
+Uring *uring_new(uint32_t entries, uint32_t num_buffers, uint32_t buffer_size);
+
+/* Destroy the ring. Operations still running are cancelled. */
+void uring_kill(Uring *ring);
+
+/* return the file descriptor of the ring, which is readable whenever there
+ * are completions to handle.
+ */
+int uring_fd(const Uring *ring);
+
+/* Queue an accept on listening socket fd that completes once for every
+ * connection accepted, with the socket as result.
+ *
+ * return false if the queue is full and submitting it failed.
+ */
+bool uring_accept(Uring *ring, int fd, uint64_t user_data);
+
+/* Queue a receive on socket fd that completes each time data arrives, with
+ * the data in one of the provided buffers. The buffer must be given back with
+ * uring_buffer_return once the data is handled. Stops with result -ENOBUFS
+ * when no buffer is left, and with 0 at the end of the stream.
+ */
+bool uring_recv(Uring *ring, int fd, uint64_t user_data);
+
+/* Queue a poll for fd becoming readable or being hung up. A multishot poll
+ * completes every time that happens, otherwise it completes once.
+ */
+bool uring_poll(Uring *ring, int fd, bool multishot, uint64_t user_data);
+
+/* Queue sending length bytes of data on socket fd. data must stay valid until
+ * the send completes, with the number of bytes sent.
+ */
+bool uring_send(Uring *ring, int fd, const uint8_t *data, uint32_t length, uint64_t user_data);
+
+/* Queue cancelling the operation with user_data. The operation completes with
+ * -ECANCELED, unless it finished already.
+ */
+bool uring_cancel(Uring *ring, uint64_t user_data);
+
+const uint8_t *uring_buffer(const Uring *ring, uint16_t buffer);
+void uring_buffer_return(Uring *ring, uint16_t buffer);
+
+/* Submit the queued operations and, if there are no completions to handle
+ * yet, wait up to timeout ms for one. timeout 0 doesn't wait, -1 waits
+ * indefinitely.
+ *
+ * return false on failure.
+ */
+bool uring_submit(Uring *ring, int timeout);
+
+/* Take the next completion.
+ *
+ * return false if there is none.
+ */
+bool uring_completion(Uring *ring, Uring_Completion *completion);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,175 @@
+#include "uring.h"
+
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <string>
+
+namespace {
+
+class UringTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ring_ = uring_new(64, 8, 16);
+
+    if (ring_ == nullptr) {
+      GTEST_SKIP() << "io_uring is not available";
+    }
+
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds_), 0);
+  }
+
+  void TearDown() override {
+    if (ring_ != nullptr) {
+      close(fds_[0]);
+      close(fds_[1]);
+      uring_kill(ring_);
+    }
+  }
+
+  Uring_Completion wait() {
+    Uring_Completion completion{};
+    EXPECT_TRUE(uring_submit(ring_, 1000));
+    EXPECT_TRUE(uring_completion(ring_, &completion));
+    return completion;
+  }
+
+  Uring *ring_ = nullptr;
+  int fds_[2] = {-1, -1};
+};
+
+TEST_F(UringTest, RecvFillsProvidedBuffersUntilTheyRunOut) {
+  ASSERT_TRUE(uring_recv(ring_, fds_[0], 42));
+  ASSERT_TRUE(uring_submit(ring_, 0));
+
+  /* More data than the 8 buffers of 16 bytes can hold. */
+  const std::string data(200, 'x');
+  ASSERT_EQ(write(fds_[1], data.data(), data.size()), static_cast<ssize_t>(data.size()));
+
+  std::string received;
+  Uring_Completion completion;
+
+  do {
+    completion = wait();
+    ASSERT_EQ(completion.user_data, 42u);
+
+    if (completion.result > 0) {
+      ASSERT_TRUE(completion.flags & URING_COMPLETION_BUFFER);
+      received.append(reinterpret_cast<const char *>(uring_buffer(ring_, completion.buffer)),
+                      completion.result);
+    }
+  } while (completion.flags & URING_COMPLETION_MORE);
+
+  EXPECT_EQ(completion.result, -ENOBUFS);
+  EXPECT_EQ(received, std::string(8 * 16, 'x'));
+
+  /* Once buffers are returned, a new receive picks up the rest. */
+  for (uint16_t i = 0; i < 8; ++i) {
+    uring_buffer_return(ring_, i);
+  }
+
+  ASSERT_TRUE(uring_recv(ring_, fds_[0], 43));
+
+  while (received.size() < data.size()) {
+    completion = wait();
+    ASSERT_EQ(completion.user_data, 43u);
+    ASSERT_GT(completion.result, 0);
+    received.append(reinterpret_cast<const char *>(uring_buffer(ring_, completion.buffer)),
+                    completion.result);
+    uring_buffer_return(ring_, completion.buffer);
+  }
+
+  EXPECT_EQ(received, data);
+}
+
+TEST_F(UringTest, RecvEndsWithTheStream) {
+  ASSERT_TRUE(uring_recv(ring_, fds_[0], 1));
+  ASSERT_TRUE(uring_submit(ring_, 0));
+  shutdown(fds_[1], SHUT_WR);
+
+  const Uring_Completion completion = wait();
+  EXPECT_EQ(completion.result, 0);
+  EXPECT_FALSE(completion.flags & URING_COMPLETION_MORE);
+}
+
+TEST_F(UringTest, CancelStopsMultishotPoll) {
+  ASSERT_TRUE(uring_poll(ring_, fds_[0], true, 7));
+  ASSERT_TRUE(uring_submit(ring_, 0));
+  ASSERT_EQ(write(fds_[1], "a", 1), 1);
+
+  Uring_Completion completion = wait();
+  EXPECT_EQ(completion.user_data, 7u);
+  EXPECT_TRUE(completion.flags & URING_COMPLETION_MORE);
+
+  ASSERT_TRUE(uring_cancel(ring_, 7));
+
+  /* The cancel operation itself completes too, with user data UINT64_MAX. */
+  bool cancelled = false;
+
+  for (int i = 0; i < 2; ++i) {
+    completion = wait();
+
+    if (completion.user_data == 7) {
+      EXPECT_EQ(completion.result, -ECANCELED);
+      EXPECT_FALSE(completion.flags & URING_COMPLETION_MORE);
+      cancelled = true;
+    }
+  }
+
+  EXPECT_TRUE(cancelled);
+}
+
+TEST_F(UringTest, SendsAreBatched) {
+  const uint8_t data[] = "batched";
+
+  for (uint64_t i = 0; i < 3; ++i) {
+    ASSERT_TRUE(uring_send(ring_, fds_[0], data, sizeof(data), i));
+  }
+
+  /* Nothing is sent before submitting. */
+  char buf[64];
+  EXPECT_EQ(recv(fds_[1], buf, sizeof(buf), MSG_DONTWAIT), -1);
+
+  ASSERT_TRUE(uring_submit(ring_, 1000));
+
+  for (uint64_t i = 0; i < 3; ++i) {
+    const Uring_Completion completion = wait();
+    EXPECT_EQ(completion.result, static_cast<int32_t>(sizeof(data)));
+  }
+
+  EXPECT_EQ(recv(fds_[1], buf, sizeof(buf), MSG_DONTWAIT), static_cast<ssize_t>(3 * sizeof(data)));
+}
+
+TEST_F(UringTest, MultishotAcceptCompletesForEveryConnection) {
+  const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(listener, 0);
+  struct sockaddr addr{};
+  addr.sa_family = AF_UNIX;
+  socklen_t addr_len = sizeof(sa_family_t);
+  /* Autobind to an abstract address. */
+  ASSERT_EQ(bind(listener, &addr, addr_len), 0);
+  addr_len = sizeof(addr);
+  ASSERT_EQ(getsockname(listener, &addr, &addr_len), 0);
+  ASSERT_EQ(listen(listener, 4), 0);
+
+  ASSERT_TRUE(uring_accept(ring_, listener, 5));
+  ASSERT_TRUE(uring_submit(ring_, 0));
+
+  for (int i = 0; i < 3; ++i) {
+    const int client = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(client, &addr, addr_len), 0);
+
+    const Uring_Completion completion = wait();
+    EXPECT_EQ(completion.user_data, 5u);
+    EXPECT_GE(completion.result, 0);
+    EXPECT_TRUE(completion.flags & URING_COMPLETION_MORE);
+    close(completion.result);
+    close(client);
+  }
+
+  close(listener);
+}
+
+}  // namespace
@@ -22,12 +22,13 @@
 #include <time.h>
 
 #include "crypto_core.h" /* for CRYPTO_PUBLIC_KEY_SIZE */
+#include "key_math.h"
 
 
 /* id functions */
 bool id_equal(const uint8_t *dest, const uint8_t *src)
 {
-    return public_key_cmp(dest, src) == 0;
+    return key_equal(dest, src);
 }
 
 uint32_t id_copy(uint8_t *dest, const uint8_t *src)
@@ -111,3 +112,29 @@ uint64_t min_u64(uint64_t a, uint64_t b)
 {
     return a < b ? a : b;
 }
+
+static uint64_t hash_mix(uint64_t hash, uint64_t word)
+{
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    return hash ^ (hash >> 29);
+}
+
+uint64_t hash_bytes(uint64_t key, const uint8_t *data, uint32_t length)
+{
+    uint64_t hash = key;
+    uint32_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = hash_mix(hash, word);
+    }
+
+    if (i < length) {
+        uint64_t word = 0;
+        memcpy(&word, data + i, length - i);
+        hash = hash_mix(hash, word);
+    }
+
+    return hash_mix(hash, length);
+}
@@ -47,6 +47,11 @@ uint16_t min_u16(uint16_t a, uint16_t b);
 uint32_t min_u32(uint32_t a, uint32_t b);
 uint64_t min_u64(uint64_t a, uint64_t b);
 
+/* Hash length bytes of data, seeded with a random key so that peers can't pick
+ * data that all lands in the same place of a hash table.
+ */
+uint64_t hash_bytes(uint64_t key, const uint8_t *data, uint32_t length);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
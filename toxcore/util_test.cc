@@ -29,4 +29,15 @@ TEST(Util, IdCopyMakesKeysEqual) {
   EXPECT_TRUE(id_equal(pk1, pk2));
 }
 
+TEST(Util, HashBytesDependsOnKeyDataAndLength) {
+  const uint8_t data[12] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+  const uint8_t zeros[12] = {0};
+
+  EXPECT_EQ(hash_bytes(1, data, sizeof(data)), hash_bytes(1, data, sizeof(data)));
+  EXPECT_NE(hash_bytes(1, data, sizeof(data)), hash_bytes(2, data, sizeof(data)));
+  EXPECT_NE(hash_bytes(1, data, sizeof(data)), hash_bytes(1, data, sizeof(data) - 1));
+  // A trailing zero byte still changes the hash.
+  EXPECT_NE(hash_bytes(1, zeros, sizeof(zeros)), hash_bytes(1, zeros, sizeof(zeros) - 1));
+}
+
 }  // namespace